@@ -0,0 +1,119 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <iostream>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/* Synthetic initial block download: every block has a coinstake, a few
+ * ordinary transactions and now and then a payout to many addresses. */
+static const int BLOCKS_PER_FLUSH = 100;
+static const int TRANSACTIONS_PER_BLOCK = 5;
+static const int PAYOUT_INTERVAL = 10;
+static const int PAYOUT_OUTPUTS = 100;
+
+/* Counts what the same flushes would have written as one record per transaction */
+class CCoinsViewDBCounting : public CCoinsViewDB
+{
+public:
+    uint64_t nLegacyBytes;
+
+    CCoinsViewDBCounting() : CCoinsViewDB(1 << 23, true, true), nLegacyBytes(0) {}
+
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+    {
+        for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            nLegacyBytes += 33;
+            if (!it->second.coins.IsPruned())
+                nLegacyBytes += ::GetSerializeSize(it->second.coins, SER_DISK, CLIENT_VERSION);
+        }
+        return CCoinsViewDB::BatchWrite(mapCoins, hashBlock);
+    }
+};
+
+static void AddCoins(CCoinsViewCache& cache, std::vector<COutPoint>& vUnspent, int nHeight, unsigned int nOutputs, bool fCoinStake)
+{
+    uint256 txid = GetRandHash();
+    CCoinsModifier coins = cache.ModifyNewCoins(txid, false);
+    coins->nVersion = 1;
+    coins->nHeight = nHeight;
+    coins->fCoinStake = fCoinStake;
+    coins->nTime = 1500000000 + nHeight * 64;
+    coins->vout.resize(nOutputs);
+    for (unsigned int i = fCoinStake ? 1 : 0; i < nOutputs; i++) {
+        coins->vout[i].nValue = 1 + GetRand(1000 * COIN);
+        coins->vout[i].scriptPubKey.assign(25, (unsigned char)i);
+        vUnspent.push_back(COutPoint(txid, i));
+    }
+}
+
+static void SpendRandom(CCoinsViewCache& cache, std::vector<COutPoint>& vUnspent)
+{
+    if (vUnspent.empty())
+        return;
+    size_t nPos = GetRand(vUnspent.size());
+    const COutPoint out = vUnspent[nPos];
+    vUnspent[nPos] = vUnspent.back();
+    vUnspent.pop_back();
+    cache.ModifyCoins(out.hash)->Spend(out.n);
+}
+
+static void CoinsFlush(benchmark::State& state)
+{
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / strprintf("bench_kekcoin_%lu", (unsigned long)GetRand(1 << 30));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    ClearDatadirCache();
+    SelectParams(CBaseChainParams::MAIN);
+
+    {
+        CCoinsViewDBCounting db;
+        CCoinsViewCache cache(&db);
+        std::vector<COutPoint> vUnspent;
+        int nHeight = 0;
+        size_t nCacheUsage = 0, nCacheCoins = 0;
+        while (state.KeepRunning()) {
+            nHeight++;
+            SpendRandom(cache, vUnspent);
+            AddCoins(cache, vUnspent, nHeight, 3, true);
+            for (int i = 0; i < TRANSACTIONS_PER_BLOCK; i++) {
+                SpendRandom(cache, vUnspent);
+                SpendRandom(cache, vUnspent);
+                AddCoins(cache, vUnspent, nHeight, 2, false);
+            }
+            if (nHeight % PAYOUT_INTERVAL == 0)
+                AddCoins(cache, vUnspent, nHeight, PAYOUT_OUTPUTS, false);
+            if (nHeight % BLOCKS_PER_FLUSH == 0) {
+                nCacheUsage += cache.DynamicMemoryUsage();
+                nCacheCoins += cache.GetCacheSize();
+                cache.SetBestBlock(GetRandHash());
+                cache.Flush();
+            }
+        }
+        cache.SetBestBlock(GetRandHash());
+        cache.Flush();
+
+        std::cout << "# CoinsFlush: " << nHeight << " blocks, "
+                  << db.GetBytesWritten() << " bytes flushed as per-output records, "
+                  << db.nLegacyBytes << " as per-transaction records\n";
+        if (nCacheCoins)
+            std::cout << "# CoinsFlush: " << nCacheUsage / nCacheCoins << " bytes of cache per cached coins entry\n";
+    }
+
+    boost::filesystem::remove_all(pathTemp);
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+}
+
+BENCHMARK(CoinsFlush);
@@ -10,6 +10,7 @@
 #include "uint256.h"
 #include "utiltime.h"
 #include "crypto/ripemd160.h"
+#include "crypto/scrypt.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
@@ -69,6 +70,25 @@ static void SipHash_32b(benchmark::State& state)
     }
 }
 
+/* Headers hashed per iteration by the scrypt benchmarks */
+static const size_t SCRYPT_HEADERS = 64;
+
+static void Scrypt_Headers(benchmark::State& state)
+{
+    std::vector<char> in(80 * SCRYPT_HEADERS, 0), out(32 * SCRYPT_HEADERS);
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < SCRYPT_HEADERS; i++)
+            scrypt_1024_1_1_256(&in[80 * i], &out[32 * i]);
+    }
+}
+
+static void Scrypt_HeadersMulti(benchmark::State& state)
+{
+    std::vector<char> in(80 * SCRYPT_HEADERS, 0), out(32 * SCRYPT_HEADERS);
+    while (state.KeepRunning())
+        scrypt_1024_1_1_256_multi(&in[0], &out[0], SCRYPT_HEADERS);
+}
+
 BENCHMARK(RIPEMD160);
 BENCHMARK(SHA1);
 BENCHMARK(SHA256);
@@ -76,3 +96,6 @@ BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
 BENCHMARK(SipHash_32b);
+
+BENCHMARK(Scrypt_Headers);
+BENCHMARK(Scrypt_HeadersMulti);
@@ -0,0 +1,81 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "cuckoocache.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+/* A signature cache sized like the default one, half filled before timing */
+static const size_t CACHE_BYTES = 40 << 20;
+static const size_t PREFILLED = 600000;
+/* Cache operations per thread per iteration, one in 16 of them an insert */
+static const size_t OPS_PER_THREAD = 100000;
+
+struct SigCacheBench
+{
+    CCuckooCache cache;
+    std::vector<uint256> vKeys;
+
+    SigCacheBench()
+    {
+        seed_insecure_rand(true);
+        vKeys.resize(PREFILLED * 2);
+        for (size_t i = 0; i < vKeys.size(); i++) {
+            for (unsigned char* p = vKeys[i].begin(); p < vKeys[i].end(); p += 4) {
+                uint32_t r = insecure_rand();
+                memcpy(p, &r, 4);
+            }
+        }
+        cache.Setup(CACHE_BYTES);
+        for (size_t i = 0; i < PREFILLED; i++)
+            cache.Insert(vKeys[i]);
+    }
+};
+
+static SigCacheBench& GetSigCacheBench()
+{
+    static SigCacheBench bench;
+    return bench;
+}
+
+static void SigCacheWorker(SigCacheBench* bench, size_t nThread)
+{
+    for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+        size_t n = (nThread * 7919 + i * 104729) % bench->vKeys.size();
+        if (i % 16 == 0)
+            bench->cache.Insert(bench->vKeys[n]);
+        else
+            bench->cache.Contains(bench->vKeys[n], false);
+    }
+}
+
+static void SigCacheThreads(benchmark::State& state, size_t nThreads)
+{
+    SigCacheBench& bench = GetSigCacheBench();
+    while (state.KeepRunning()) {
+        boost::thread_group threads;
+        for (size_t i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&SigCacheWorker, &bench, i));
+        threads.join_all();
+    }
+}
+
+static void SigCache_1Thread(benchmark::State& state) { SigCacheThreads(state, 1); }
+static void SigCache_2Threads(benchmark::State& state) { SigCacheThreads(state, 2); }
+static void SigCache_4Threads(benchmark::State& state) { SigCacheThreads(state, 4); }
+static void SigCache_8Threads(benchmark::State& state) { SigCacheThreads(state, 8); }
+static void SigCache_16Threads(benchmark::State& state) { SigCacheThreads(state, 16); }
+
+BENCHMARK(SigCache_1Thread);
+BENCHMARK(SigCache_2Threads);
+BENCHMARK(SigCache_4Threads);
+BENCHMARK(SigCache_8Threads);
+BENCHMARK(SigCache_16Threads);
@@ -0,0 +1,106 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chain.h"
+#include "kernel.h"
+#include "random.h"
+
+#include <limits>
+#include <vector>
+
+/* Synthetic chain: 40 second blocks, a new modifier every 13 minutes */
+static const int CHAIN_LENGTH = 1000000;
+static const int64_t BLOCK_SPACING = 40;
+static const int64_t MODIFIER_INTERVAL = 13 * 60;
+
+static int64_t SelectionInterval()
+{
+    int64_t nSelectionInterval = 0;
+    for (int nSection = 0; nSection < 64; nSection++)
+        nSelectionInterval += MODIFIER_INTERVAL * 63 / (63 + ((63 - nSection) * 2));
+    return nSelectionInterval;
+}
+
+struct SyntheticChain
+{
+    std::vector<CBlockIndex> vBlocks;
+    CChain chain;
+    CStakeModifierTable table;
+
+    SyntheticChain() : vBlocks(CHAIN_LENGTH)
+    {
+        for (int i = 0; i < CHAIN_LENGTH; i++) {
+            CBlockIndex& block = vBlocks[i];
+            block.nHeight = i;
+            block.nTime = 1500000000 + i * BLOCK_SPACING;
+            block.pprev = i ? &vBlocks[i - 1] : NULL;
+            bool fGenerated = i && block.nTime / MODIFIER_INTERVAL != block.pprev->nTime / MODIFIER_INTERVAL;
+            block.SetStakeModifier(fGenerated ? GetRand(std::numeric_limits<uint64_t>::max()) : (i ? block.pprev->nStakeModifier : 0), fGenerated);
+        }
+        chain.SetTip(&vBlocks.back());
+        table.Sync(chain);
+    }
+};
+
+static SyntheticChain& GetSyntheticChain()
+{
+    static SyntheticChain synthetic;
+    return synthetic;
+}
+
+/* The lookups as GetLastStakeModifier() and GetKernelStakeModifier() did them before the table */
+static const CBlockIndex* WalkLastGenerated(const CBlockIndex* pindex)
+{
+    while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier())
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+static const CBlockIndex* WalkNextGenerated(const CChain& chain, const CBlockIndex* pindexFrom, int64_t nSelectionInterval)
+{
+    const CBlockIndex* pindex = pindexFrom;
+    int64_t nStakeModifierTime = pindexFrom->GetBlockTime();
+    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nSelectionInterval) {
+        pindex = chain.Next(pindex);
+        if (!pindex)
+            return NULL;
+        if (pindex->GeneratedStakeModifier())
+            nStakeModifierTime = pindex->GetBlockTime();
+    }
+    return pindex;
+}
+
+// volatile, so the lookups are not optimized away
+static volatile uint64_t nStakeModifierSink = 0;
+
+static void StakeModifierWalk(benchmark::State& state)
+{
+    SyntheticChain& synthetic = GetSyntheticChain();
+    int64_t nSelectionInterval = SelectionInterval();
+    uint64_t nSum = 0;
+    while (state.KeepRunning()) {
+        const CBlockIndex* pindex = synthetic.chain[GetRand(CHAIN_LENGTH - 10000)];
+        nSum += WalkLastGenerated(pindex)->nStakeModifier;
+        nSum += WalkNextGenerated(synthetic.chain, pindex, nSelectionInterval)->nStakeModifier;
+    }
+    nStakeModifierSink = nSum;
+}
+
+static void StakeModifierTable(benchmark::State& state)
+{
+    SyntheticChain& synthetic = GetSyntheticChain();
+    int64_t nSelectionInterval = SelectionInterval();
+    uint64_t nSum = 0;
+    while (state.KeepRunning()) {
+        const CBlockIndex* pindex = synthetic.chain[GetRand(CHAIN_LENGTH - 10000)];
+        const CBlockIndex* pindexLast = synthetic.table.GetLastGenerated(pindex->nHeight);
+        nSum += (pindexLast ? pindexLast : synthetic.chain.Genesis())->nStakeModifier;
+        nSum += synthetic.table.GetNextGenerated(pindex->nHeight, pindex->GetBlockTime() + nSelectionInterval)->nStakeModifier;
+    }
+    nStakeModifierSink = nSum;
+}
+
+BENCHMARK(StakeModifierWalk);
+BENCHMARK(StakeModifierTable);
@@ -0,0 +1,137 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+#include "wallet/wallet.h"
+
+#include <iostream>
+#include <vector>
+
+/* A long-lived wallet: 10,000 payments of 100 outputs each, nine in ten of
+ * those outputs since spent 100 at a time, all confirmed. */
+static const int WALLET_PAYMENTS = 10000;
+static const int OUTPUTS_PER_PAYMENT = 100;
+static const int INPUTS_PER_SPEND = 100;
+static const int SPENT_PER_MILLE = 900;
+static const int CHAIN_LENGTH = 2000;
+
+struct SyntheticWallet
+{
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vBlocks;
+    CWallet wallet;
+    CScript scriptMine;
+    CKeyID keyChange;
+    size_t nUnspent;
+
+    SyntheticWallet() : vHashes(CHAIN_LENGTH), vBlocks(CHAIN_LENGTH), nUnspent(0)
+    {
+        SelectParams(CBaseChainParams::MAIN);
+
+        LOCK2(cs_main, wallet.cs_wallet);
+        for (int i = 0; i < CHAIN_LENGTH; i++) {
+            vHashes[i] = GetRandHash();
+            CBlockIndex& block = vBlocks[i];
+            block.phashBlock = &vHashes[i];
+            block.nHeight = i;
+            block.nTime = 1500000000 + i * 64;
+            block.pprev = i ? &vBlocks[i - 1] : NULL;
+            mapBlockIndex[vHashes[i]] = &block;
+        }
+        chainActive.SetTip(&vBlocks.back());
+
+        CKey key;
+        key.MakeNewKey(true);
+        wallet.AddKeyPubKey(key, key.GetPubKey());
+        keyChange = key.GetPubKey().GetID();
+        scriptMine = GetScriptForDestination(keyChange);
+        CScript scriptOther = CScript() << OP_TRUE;
+
+        std::vector<COutPoint> vToSpend;
+        for (int i = 0; i < WALLET_PAYMENTS; i++) {
+            CMutableTransaction mtx;
+            mtx.nTime = 1500000000 + i;
+            mtx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+            mtx.vout.resize(OUTPUTS_PER_PAYMENT, CTxOut(COIN, scriptMine));
+            uint256 hash = mtx.GetHash();
+            for (int n = 0; n < OUTPUTS_PER_PAYMENT; n++) {
+                if (GetRand(1000) < SPENT_PER_MILLE)
+                    vToSpend.push_back(COutPoint(hash, n));
+                else
+                    nUnspent++;
+            }
+            AddConfirmed(mtx, 1 + i * (CHAIN_LENGTH / 2) / WALLET_PAYMENTS);
+        }
+
+        for (size_t i = 0; i < vToSpend.size(); i += INPUTS_PER_SPEND) {
+            CMutableTransaction mtx;
+            mtx.nTime = 1600000000 + i;
+            for (size_t j = i; j < vToSpend.size() && j < i + INPUTS_PER_SPEND; j++)
+                mtx.vin.push_back(CTxIn(vToSpend[j]));
+            mtx.vout.push_back(CTxOut(COIN, scriptOther));
+            AddConfirmed(mtx, CHAIN_LENGTH / 2 + i * (CHAIN_LENGTH / 2 - 1) / vToSpend.size());
+        }
+
+        // as in a running wallet, whatever the first listing builds is in place
+        std::vector<COutput> vCoins;
+        wallet.AvailableCoins(vCoins, false, NULL, true);
+    }
+
+    ~SyntheticWallet()
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(NULL);
+        for (int i = 0; i < CHAIN_LENGTH; i++)
+            mapBlockIndex.erase(vHashes[i]);
+    }
+
+    void AddConfirmed(const CMutableTransaction& mtx, int nHeight)
+    {
+        CWalletTx wtx(&wallet, CTransaction(mtx));
+        wtx.hashBlock = vHashes[nHeight];
+        wtx.nIndex = 1;
+        wallet.AddToWallet(wtx, true, NULL);
+    }
+};
+
+static SyntheticWallet& GetSyntheticWallet()
+{
+    static SyntheticWallet synthetic;
+    return synthetic;
+}
+
+/* What listunspent does */
+static void WalletAvailableCoins(benchmark::State& state)
+{
+    SyntheticWallet& synthetic = GetSyntheticWallet();
+    std::vector<COutput> vCoins;
+    while (state.KeepRunning()) {
+        synthetic.wallet.AvailableCoins(vCoins, false, NULL, true);
+        assert(vCoins.size() == synthetic.nUnspent);
+    }
+    std::cout << "# WalletAvailableCoins: " << synthetic.nUnspent << " unspent of " << WALLET_PAYMENTS * OUTPUTS_PER_PAYMENT << " outputs\n";
+}
+
+/* What fundrawtransaction does, for a payment any single coin covers */
+static void WalletFundTransaction(benchmark::State& state)
+{
+    SyntheticWallet& synthetic = GetSyntheticWallet();
+    while (state.KeepRunning()) {
+        CMutableTransaction mtx;
+        mtx.vout.push_back(CTxOut(COIN / 2, CScript() << OP_TRUE));
+        CAmount nFee;
+        int nChangePos = -1;
+        std::string strFailReason;
+        bool fFunded = synthetic.wallet.FundTransaction(mtx, nFee, false, CFeeRate(0), nChangePos, strFailReason, false, false, synthetic.keyChange);
+        assert(fFunded);
+    }
+}
+
+BENCHMARK(WalletAvailableCoins);
+BENCHMARK(WalletFundTransaction);
@@ -5,7 +5,15 @@
 #ifndef KEKCOIN_CHECKQUEUE_H
 #define KEKCOIN_CHECKQUEUE_H
 
+#include "tinyformat.h"
+#include "utiltime.h"
+
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -16,22 +24,94 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/** Power-of-two histograms of how long checks queued and ran, in microseconds */
+struct CCheckQueueStats
+{
+    static const unsigned int BUCKETS = 16;
+
+    uint64_t vWait[BUCKETS];
+    uint64_t vExec[BUCKETS];
+
+    CCheckQueueStats() { SetNull(); }
+
+    void SetNull()
+    {
+        std::fill(vWait, vWait + BUCKETS, 0);
+        std::fill(vExec, vExec + BUCKETS, 0);
+    }
+
+    static unsigned int Bucket(int64_t nMicros)
+    {
+        unsigned int nBucket = 0;
+        while (nBucket + 1 < BUCKETS && ((int64_t)1 << nBucket) <= nMicros)
+            nBucket++;
+        return nBucket;
+    }
+
+    void Merge(const CCheckQueueStats& other)
+    {
+        for (unsigned int i = 0; i < BUCKETS; i++) {
+            vWait[i] += other.vWait[i];
+            vExec[i] += other.vExec[i];
+        }
+    }
+
+    /** Non-empty buckets as "<upper bound>us:count", the last bucket open-ended */
+    static std::string HistogramToString(const uint64_t* vCounts)
+    {
+        std::string str;
+        for (unsigned int i = 0; i < BUCKETS; i++) {
+            if (!vCounts[i])
+                continue;
+            if (!str.empty())
+                str += " ";
+            if (i + 1 < BUCKETS)
+                str += strprintf("<%dus:%u", (int64_t)1 << i, vCounts[i]);
+            else
+                str += strprintf(">=%dus:%u", (int64_t)1 << (i - 1), vCounts[i]);
+        }
+        return str.empty() ? "none" : str;
+    }
+};
+
+/**
  * Queue for verifications that have to be performed.
-  * The verifications are represented by a type T, which must provide an
-  * operator(), returning a bool.
-  *
-  * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
-  */
+ * The verifications are represented by a type T, which must provide an
+ * operator(), returning a bool.
+ *
+ * One thread (the master) is assumed to push batches of verifications
+ * onto the queue, where they are processed by N-1 worker threads. When
+ * the master is done adding work, it temporarily joins the worker pool
+ * as an N'th worker, until all jobs are done.
+ *
+ * Every worker, and the master, owns a deque. Added checks are dealt out
+ * over the deques, and each thread takes work from the front of its own;
+ * once that is empty it steals half of another thread's deque from the
+ * back. Priority checks go to a deque that every thread drains first. The
+ * deques have their own locks, so threads only meet on a lock when they
+ * steal or have run out of work.
+ */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
+    typedef std::pair<int64_t, T> Item;
+
+    struct WorkDeque
+    {
+        boost::mutex mutex;
+        //! Checks with the time they were added
+        std::deque<Item> items;
+    };
+
+    //! Index 0 is the master's, then one per worker thread
+    std::vector<std::unique_ptr<WorkDeque> > vDeques;
+
+    //! Checks that every thread looks at first
+    WorkDeque priority;
+
+    //! Protects sleeping and waking up; not taken while there is work
+    boost::mutex mutexSleep;
 
     //! Worker threads block on this when out of work
     boost::condition_variable condWorker;
@@ -39,121 +119,181 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! Number of worker threads that have started, not counting the master
+    std::atomic<unsigned int> nWorkers;
 
-    //! The total number of workers (including the master).
-    int nTotal;
-
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! Checks sitting in a deque
+    std::atomic<unsigned int> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are no longer queued, but still in the
-     * worker's own batches.
+     * This includes elements that are no longer queued, but still in a
+     * thread's own batch.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! The temporary evaluation result.
+    std::atomic<bool> fAllOk;
+
+    //! The deque the next added batch goes to
+    unsigned int nNextDeque;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Timing of the checks run since the last Wait()
+    boost::mutex mutexStats;
+    CCheckQueueStats stats;
+    CCheckQueueStats statsLast;
+
+    unsigned int TakeFront(WorkDeque& deque, std::vector<Item>& vBatch, unsigned int nMax)
+    {
+        boost::unique_lock<boost::mutex> lock(deque.mutex);
+        unsigned int nNow = std::min(nMax, (unsigned int)deque.items.size());
+        vBatch.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            vBatch[i].first = deque.items.front().first;
+            vBatch[i].second.swap(deque.items.front().second);
+            deque.items.pop_front();
+        }
+        return nNow;
+    }
+
+    unsigned int StealBack(WorkDeque& deque, std::vector<Item>& vBatch)
+    {
+        boost::unique_lock<boost::mutex> lock(deque.mutex);
+        unsigned int nNow = std::min(nBatchSize, (unsigned int)(deque.items.size() + 1) / 2);
+        vBatch.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            vBatch[i].first = deque.items.back().first;
+            vBatch[i].second.swap(deque.items.back().second);
+            deque.items.pop_back();
+        }
+        return nNow;
+    }
+
+    /** Fill vBatch from the priority deque, the own deque or a victim, in that order */
+    bool TakeBatch(unsigned int nOwn, std::vector<Item>& vBatch)
+    {
+        if (nQueued.load() == 0)
+            return false;
+        unsigned int nNow = TakeFront(priority, vBatch, nBatchSize);
+        if (!nNow)
+            nNow = TakeFront(*vDeques[nOwn], vBatch, nBatchSize);
+        for (unsigned int i = 1; !nNow && i < vDeques.size(); i++)
+            nNow = StealBack(*vDeques[(nOwn + i) % vDeques.size()], vBatch);
+        nQueued -= nNow;
+        return nNow > 0;
+    }
+
+    /** Run a batch and account for it; returns whether it completed the outstanding work */
+    bool RunBatch(std::vector<Item>& vBatch)
+    {
+        CCheckQueueStats statsBatch;
+        int64_t nTime = GetTimeMicros();
+        BOOST_FOREACH (Item& item, vBatch) {
+            statsBatch.vWait[CCheckQueueStats::Bucket(nTime - item.first)]++;
+            if (fAllOk.load(std::memory_order_relaxed) && !item.second())
+                fAllOk = false;
+            int64_t nTimeDone = GetTimeMicros();
+            statsBatch.vExec[CCheckQueueStats::Bucket(nTimeDone - nTime)]++;
+            nTime = nTimeDone;
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(mutexStats);
+            stats.Merge(statsBatch);
+        }
+        unsigned int nDone = vBatch.size();
+        vBatch.clear();
+        return (nTodo -= nDone) == 0;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nOwn, bool fMaster)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
+        std::vector<Item> vBatch;
+        vBatch.reserve(nBatchSize);
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
+            if (TakeBatch(nOwn, vBatch)) {
+                if (RunBatch(vBatch) && !fMaster) {
+                    // We processed the last element; inform the master it can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutexSleep);
+                    condMaster.notify_one();
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutexSleep);
+            if (fMaster) {
+                while (nQueued.load() == 0 && nTodo.load() > 0)
+                    condMaster.wait(lock);
+                if (nTodo.load() == 0) {
+                    bool fRet = fAllOk;
+                    // reset the status for new work later
+                    fAllOk = true;
+                    boost::unique_lock<boost::mutex> lockStats(mutexStats);
+                    statsLast = stats;
+                    stats.SetNull();
+                    return fRet;
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+            } else {
+                while (nQueued.load() == 0)
+                    condWorker.wait(lock);
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue; nMaxWorkers deques are set aside for worker threads
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkers = 16) :
+        nWorkers(0), nQueued(0), nTodo(0), fAllOk(true), nNextDeque(0), nBatchSize(nBatchSizeIn)
+    {
+        for (unsigned int i = 0; i <= nMaxWorkers; i++)
+            vDeques.push_back(std::unique_ptr<WorkDeque>(new WorkDeque()));
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        unsigned int nWorker = nWorkers++;
+        // Without deques of their own, workers take from the master's
+        Loop(vDeques.size() > 1 ? 1 + nWorker % (vDeques.size() - 1) : 0, false);
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
-    //! Add a batch of checks to the queue
-    void Add(std::vector<T>& vChecks)
+    //! Add a batch of checks to the queue; priority checks are started before all others
+    void Add(std::vector<T>& vChecks, bool fPriority = false)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+
+        // Count the checks before they become visible, so a thread that takes
+        // one early can never bring nTodo to zero while others are still coming
+        {
+            boost::unique_lock<boost::mutex> lock(mutexSleep);
+            nTodo += vChecks.size();
+            nQueued += vChecks.size();
+        }
+
+        int64_t nTime = GetTimeMicros();
+        unsigned int nDeques = std::min((unsigned int)vDeques.size(), nWorkers.load() + 1);
+        unsigned int nChunk = std::max(1U, std::min(nBatchSize, (unsigned int)vChecks.size() / nDeques));
+        for (unsigned int nBegin = 0; nBegin < vChecks.size(); nBegin += nChunk) {
+            WorkDeque& deque = fPriority ? priority : *vDeques[nNextDeque++ % nDeques];
+            boost::unique_lock<boost::mutex> lock(deque.mutex);
+            for (unsigned int i = nBegin; i < std::min(nBegin + nChunk, (unsigned int)vChecks.size()); i++) {
+                deque.items.push_back(Item(nTime, T()));
+                vChecks[i].swap(deque.items.back().second);
+            }
         }
-        nTodo += vChecks.size();
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -163,13 +303,18 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return nTodo.load() == 0 && nQueued.load() == 0 && fAllOk.load();
     }
 
+    //! Timing histograms of the checks completed by the last Wait()
+    CCheckQueueStats GetLastStats()
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStats);
+        return statsLast;
+    }
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
@@ -199,10 +344,10 @@ public:
         return fRet;
     }
 
-    void Add(std::vector<T>& vChecks)
+    void Add(std::vector<T>& vChecks, bool fPriority = false)
     {
         if (pqueue != NULL)
-            pqueue->Add(vChecks);
+            pqueue->Add(vChecks, fPriority);
     }
 
     ~CCheckQueueControl()
@@ -77,6 +77,7 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    ret->second.SetParent(tmp);
     tmp.swap(ret->second.coins);
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
@@ -108,6 +109,8 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
         } else if (ret.first->second.coins.IsPruned()) {
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        } else {
+            ret.first->second.SetParent(ret.first->second.coins);
         }
     } else {
         cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
@@ -125,6 +128,10 @@ CCoinsModifier CCoinsViewCache::ModifyNewCoins(const uint256 &txid, bool coinbas
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
     ret.first->second.coins.Clear();
+    // Whatever the parent has for this txid is replaced wholesale. A new
+    // coinbase entry may be a duplicate of one the parent has.
+    if (ret.second ? coinbase : ret.first->second.nParentOutputs != 0)
+        ret.first->second.SetParentUnknown();
     if (!coinbase) {
         ret.first->second.flags = CCoinsCacheEntry::FRESH;
     }
@@ -185,6 +192,8 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     // and already exist in the grandparent
                     if (it->second.flags & CCoinsCacheEntry::FRESH)
                         entry.flags |= CCoinsCacheEntry::FRESH;
+                    else
+                        entry.SetParentUnknown();
                 }
             } else {
                 // Found the entry in the parent cache
@@ -200,6 +209,10 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    // The child recreated the entry rather than only spending from it
+                    bool fReplaced = (it->second.flags & CCoinsCacheEntry::FRESH) || it->second.nParentOutputs == CCoinsCacheEntry::PARENT_UNKNOWN;
+                    if (fReplaced && itUs->second.nParentOutputs != 0)
+                        itUs->second.SetParentUnknown();
                 }
             }
         }
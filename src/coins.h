@@ -334,13 +334,38 @@ struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    //! Size of vout in the parent view's version, or PARENT_UNKNOWN.
+    uint32_t nParentOutputs;
+    //! Which of the first 64 outputs the parent view has unspent, unchanged
+    //! apart from being spent here since. Meaningless if nParentOutputs is
+    //! PARENT_UNKNOWN. Lets a per-output database write only what changed.
+    uint64_t nParentUnspent;
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    static const uint32_t PARENT_UNKNOWN = 0xffffffff;
+    static const unsigned int PARENT_MASK_OUTPUTS = 64;
+
+    CCoinsCacheEntry() : coins(), flags(0), nParentOutputs(0), nParentUnspent(0) {}
+
+    //! Remember coinsParent as the parent view's version of this entry
+    void SetParent(const CCoins& coinsParent) {
+        nParentOutputs = coinsParent.vout.size();
+        nParentUnspent = 0;
+        for (unsigned int i = 0; i < coinsParent.vout.size() && i < PARENT_MASK_OUTPUTS; i++) {
+            if (!coinsParent.vout[i].IsNull())
+                nParentUnspent |= (uint64_t)1 << i;
+        }
+    }
+
+    //! The parent view's version may differ in any way, not only by spends
+    void SetParentUnknown() {
+        nParentOutputs = PARENT_UNKNOWN;
+        nParentUnspent = 0;
+    }
 };
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
@@ -0,0 +1,280 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <string.h>
+
+namespace {
+
+typedef Num3072::limb_t limb_t;
+typedef Num3072::double_limb_t double_limb_t;
+
+static const int LIMBS = Num3072::LIMBS;
+static const int LIMB_BITS = Num3072::LIMB_BITS;
+static const limb_t MAX_LIMB = (limb_t)-1;
+/** 2^3072 - MAX_PRIME_DIFF is the modulus */
+static const limb_t MAX_PRIME_DIFF = 1103717;
+
+limb_t ReadLimb(const unsigned char* p)
+{
+    return sizeof(limb_t) == 8 ? (limb_t)ReadLE64(p) : (limb_t)ReadLE32(p);
+}
+
+void WriteLimb(unsigned char* p, limb_t n)
+{
+    if (sizeof(limb_t) == 8)
+        WriteLE64(p, n);
+    else
+        WriteLE32(p, n);
+}
+
+/* Helpers for the inversion, on plain numbers below 2^3072 */
+
+bool IsOne(const limb_t* a)
+{
+    if (a[0] != 1)
+        return false;
+    for (int i = 1; i < LIMBS; i++) {
+        if (a[i])
+            return false;
+    }
+    return true;
+}
+
+int Compare(const limb_t* a, const limb_t* b)
+{
+    for (int i = LIMBS - 1; i >= 0; i--) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+/** a += b, returning the carry */
+limb_t Add(limb_t* a, const limb_t* b)
+{
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t t = (double_limb_t)a[i] + b[i] + carry;
+        a[i] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_BITS);
+    }
+    return carry;
+}
+
+/** a -= b, returning the borrow */
+limb_t Sub(limb_t* a, const limb_t* b)
+{
+    limb_t borrow = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        limb_t bi = b[i] + borrow;
+        limb_t borrowNext = (bi < borrow) || (a[i] < bi);
+        a[i] -= bi;
+        borrow = borrowNext;
+    }
+    return borrow;
+}
+
+/** a >>= 1, shifting topBit in at the top */
+void ShiftRight(limb_t* a, limb_t topBit)
+{
+    for (int i = 0; i < LIMBS - 1; i++)
+        a[i] = (a[i] >> 1) | (a[i + 1] << (LIMB_BITS - 1));
+    a[LIMBS - 1] = (a[LIMBS - 1] >> 1) | (topBit << (LIMB_BITS - 1));
+}
+
+} // namespace
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; i++)
+        limbs[i] = ReadLimb(data + i * sizeof(limb_t));
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; i++)
+        limbs[i] = 0;
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= MAX_LIMB - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < LIMBS; i++) {
+        if (limbs[i] != MAX_LIMB)
+            return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting the modulus is adding MAX_PRIME_DIFF and dropping 2^3072
+    limb_t carry = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t t = (double_limb_t)limbs[i] + carry;
+        limbs[i] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_BITS);
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    limb_t tmp[2 * LIMBS];
+    memset(tmp, 0, sizeof(tmp));
+    for (int i = 0; i < LIMBS; i++) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            double_limb_t t = (double_limb_t)limbs[i] * a.limbs[j] + tmp[i + j] + carry;
+            tmp[i + j] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_BITS);
+        }
+        tmp[i + LIMBS] = carry;
+    }
+
+    // 2^3072 is MAX_PRIME_DIFF modulo the prime, so fold the upper half in
+    double_limb_t carry = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        carry += (double_limb_t)tmp[LIMBS + i] * MAX_PRIME_DIFF + tmp[i];
+        limbs[i] = (limb_t)carry;
+        carry >>= LIMB_BITS;
+    }
+    while (carry) {
+        double_limb_t t = carry * MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && t; i++) {
+            t += limbs[i];
+            limbs[i] = (limb_t)t;
+            t >>= LIMB_BITS;
+        }
+        carry = t;
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Binary extended Euclid. Throughout, u = this * x1 and v = this * x2.
+    limb_t p[LIMBS], u[LIMBS], v[LIMBS], x1[LIMBS], x2[LIMBS];
+    for (int i = 0; i < LIMBS; i++) {
+        p[i] = MAX_LIMB;
+        u[i] = limbs[i];
+        x1[i] = 0;
+        x2[i] = 0;
+    }
+    p[0] = MAX_LIMB - MAX_PRIME_DIFF + 1;
+    memcpy(v, p, sizeof(v));
+    x1[0] = 1;
+
+    Num3072 ret;
+    bool fZero = true;
+    for (int i = 0; i < LIMBS; i++)
+        fZero = fZero && !u[i];
+    if (fZero) {
+        ret.limbs[0] = 0;
+        return ret;
+    }
+
+    while (!IsOne(u) && !IsOne(v)) {
+        while (!(u[0] & 1)) {
+            ShiftRight(u, 0);
+            ShiftRight(x1, (x1[0] & 1) ? Add(x1, p) : 0);
+        }
+        while (!(v[0] & 1)) {
+            ShiftRight(v, 0);
+            ShiftRight(x2, (x2[0] & 1) ? Add(x2, p) : 0);
+        }
+        if (Compare(u, v) >= 0) {
+            Sub(u, v);
+            if (Sub(x1, x2))
+                Add(x1, p);
+        } else {
+            Sub(v, u);
+            if (Sub(x2, x1))
+                Add(x2, p);
+        }
+    }
+    memcpy(ret.limbs, IsOne(u) ? x1 : x2, sizeof(ret.limbs));
+    return ret;
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; i++)
+        WriteLimb(out + i * sizeof(limb_t), limbs[i]);
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    // Stretch the element's SHA256 to 3072 bits with SHA512 in counter mode
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(hash);
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    for (unsigned char i = 0; i < Num3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; i++)
+        CSHA512().Write(hash, sizeof(hash)).Write(&i, 1).Finalize(bytes + i * CSHA512::OUTPUT_SIZE);
+    return Num3072(bytes);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& other)
+{
+    numerator.Multiply(other.numerator);
+    denominator.Multiply(other.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& other)
+{
+    numerator.Multiply(other.denominator);
+    denominator.Multiply(other.numerator);
+    return *this;
+}
+
+void MuHash3072::Normalize()
+{
+    numerator.Multiply(denominator.GetInverse());
+    denominator.SetToOne();
+}
+
+void MuHash3072::Finalize(unsigned char (&out)[32])
+{
+    Normalize();
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    numerator.ToBytes(bytes);
+    CSHA256().Write(bytes, sizeof(bytes)).Finalize(out);
+}
+
+void MuHash3072::ToBytes(unsigned char (&out)[2 * Num3072::BYTE_SIZE]) const
+{
+    unsigned char (&num)[Num3072::BYTE_SIZE] = *reinterpret_cast<unsigned char (*)[Num3072::BYTE_SIZE]>(out);
+    unsigned char (&den)[Num3072::BYTE_SIZE] = *reinterpret_cast<unsigned char (*)[Num3072::BYTE_SIZE]>(out + Num3072::BYTE_SIZE);
+    numerator.ToBytes(num);
+    denominator.ToBytes(den);
+}
+
+void MuHash3072::FromBytes(const unsigned char (&in)[2 * Num3072::BYTE_SIZE])
+{
+    numerator = Num3072(*reinterpret_cast<const unsigned char (*)[Num3072::BYTE_SIZE]>(in));
+    denominator = Num3072(*reinterpret_cast<const unsigned char (*)[Num3072::BYTE_SIZE]>(in + Num3072::BYTE_SIZE));
+}
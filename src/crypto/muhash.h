@@ -0,0 +1,82 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef KEKCOIN_CRYPTO_MUHASH_H
+#define KEKCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** An integer modulo 2^3072 - 1103717, the largest 3072-bit safe prime. */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+#endif
+    static const int LIMB_BITS = sizeof(limb_t) * 8;
+    static const int LIMBS = 3072 / LIMB_BITS;
+    static const size_t BYTE_SIZE = 384;
+
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    //! Reduce a 384-byte little-endian number
+    explicit Num3072(const unsigned char (&data)[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    //! The multiplicative inverse; the inverse of zero is zero
+    Num3072 GetInverse() const;
+    void ToBytes(unsigned char (&out)[BYTE_SIZE]) const;
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+};
+
+/**
+ * A hash of a set of byte strings that can be updated as elements are added
+ * and removed, and that does not depend on their order.
+ *
+ * Each element is hashed to a number modulo a 3072-bit prime, and the set
+ * hash is the product of those numbers. Removing an element divides it out
+ * again. Divisions are collected in a separate denominator, so that only
+ * Finalize() has to compute an inverse.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    //! The hash of the empty set
+    MuHash3072() {}
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+
+    //! Combine with the hash of a disjoint set, or take one out that is a subset
+    MuHash3072& operator*=(const MuHash3072& other);
+    MuHash3072& operator/=(const MuHash3072& other);
+
+    //! Fold the denominator into the numerator; does not change the hash
+    void Normalize();
+
+    //! Normalize and write the 32-byte digest of the set
+    void Finalize(unsigned char (&out)[32]);
+
+    //! Serialized form: numerator and denominator, little-endian
+    void ToBytes(unsigned char (&out)[2 * Num3072::BYTE_SIZE]) const;
+    void FromBytes(const unsigned char (&in)[2 * Num3072::BYTE_SIZE]);
+};
+
+#endif // KEKCOIN_CRYPTO_MUHASH_H
@@ -33,6 +33,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <openssl/sha.h>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2_LANES 1
+#include <immintrin.h>
+#endif
 
 #if defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)
 #ifdef _MSC_VER
@@ -324,8 +330,139 @@ std::string scrypt_detect_sse2()
 }
 #endif
 
+#if defined(USE_AVX2_LANES)
+#define SCRYPT_LANES 8
+
+#define ROTL_LANES(a, b) _mm256_or_si256(_mm256_slli_epi32((a), (b)), _mm256_srli_epi32((a), 32 - (b)))
+#define SALSA_STEP(d, a, b, n) d = _mm256_xor_si256(d, ROTL_LANES(_mm256_add_epi32(a, b), n))
+
+/* xor_salsa8() on eight independent states, word k of lane l in B[k][l]. */
+__attribute__((target("avx2")))
+static inline void xor_salsa8_lanes(__m256i B[16], const __m256i Bx[16])
+{
+	__m256i x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = B[i] = _mm256_xor_si256(B[i], Bx[i]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		SALSA_STEP(x[ 4], x[ 0], x[12],  7);  SALSA_STEP(x[ 9], x[ 5], x[ 1],  7);
+		SALSA_STEP(x[14], x[10], x[ 6],  7);  SALSA_STEP(x[ 3], x[15], x[11],  7);
+
+		SALSA_STEP(x[ 8], x[ 4], x[ 0],  9);  SALSA_STEP(x[13], x[ 9], x[ 5],  9);
+		SALSA_STEP(x[ 2], x[14], x[10],  9);  SALSA_STEP(x[ 7], x[ 3], x[15],  9);
+
+		SALSA_STEP(x[12], x[ 8], x[ 4], 13);  SALSA_STEP(x[ 1], x[13], x[ 9], 13);
+		SALSA_STEP(x[ 6], x[ 2], x[14], 13);  SALSA_STEP(x[11], x[ 7], x[ 3], 13);
+
+		SALSA_STEP(x[ 0], x[12], x[ 8], 18);  SALSA_STEP(x[ 5], x[ 1], x[13], 18);
+		SALSA_STEP(x[10], x[ 6], x[ 2], 18);  SALSA_STEP(x[15], x[11], x[ 7], 18);
+
+		/* Operate on rows. */
+		SALSA_STEP(x[ 1], x[ 0], x[ 3],  7);  SALSA_STEP(x[ 6], x[ 5], x[ 4],  7);
+		SALSA_STEP(x[11], x[10], x[ 9],  7);  SALSA_STEP(x[12], x[15], x[14],  7);
+
+		SALSA_STEP(x[ 2], x[ 1], x[ 0],  9);  SALSA_STEP(x[ 7], x[ 6], x[ 5],  9);
+		SALSA_STEP(x[ 8], x[11], x[10],  9);  SALSA_STEP(x[13], x[12], x[15],  9);
+
+		SALSA_STEP(x[ 3], x[ 2], x[ 1], 13);  SALSA_STEP(x[ 4], x[ 7], x[ 6], 13);
+		SALSA_STEP(x[ 9], x[ 8], x[11], 13);  SALSA_STEP(x[14], x[13], x[12], 13);
+
+		SALSA_STEP(x[ 0], x[ 3], x[ 2], 18);  SALSA_STEP(x[ 5], x[ 4], x[ 7], 18);
+		SALSA_STEP(x[10], x[ 9], x[ 8], 18);  SALSA_STEP(x[15], x[14], x[13], 18);
+	}
+	for (i = 0; i < 16; i++)
+		B[i] = _mm256_add_epi32(B[i], x[i]);
+}
+
+/*
+ * Eight hashes at once. The scratchpad holds SCRYPT_LANES * 131072 + 63 bytes,
+ * laid out like X with the lanes interleaved, so the first loop stores whole
+ * vectors and the second gathers each lane's row by its own index.
+ */
+__attribute__((target("avx2")))
+static void scrypt_1024_1_1_256_sp_avx2_lanes(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[128];
+	uint32_t W[32][SCRYPT_LANES] __attribute__((aligned(32)));
+	__m256i X[32];
+	__m256i *V;
+	__m256i j, lane;
+	uint32_t i, k, l;
+
+	V = (__m256i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (l = 0; l < SCRYPT_LANES; l++) {
+		PBKDF2_SHA256((const uint8_t *)&input[80 * l], 80, (const uint8_t *)&input[80 * l], 80, 1, B, 128);
+		for (k = 0; k < 32; k++)
+			W[k][l] = le32dec(&B[4 * k]);
+	}
+	for (k = 0; k < 32; k++)
+		X[k] = _mm256_load_si256((const __m256i *)W[k]);
+
+	for (i = 0; i < 1024; i++) {
+		memcpy(&V[i * 32], X, sizeof(X));
+		xor_salsa8_lanes(&X[0], &X[16]);
+		xor_salsa8_lanes(&X[16], &X[0]);
+	}
+	lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	for (i = 0; i < 1024; i++) {
+		/* word offset of row (X[16] & 1023) for each lane */
+		j = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(X[16], _mm256_set1_epi32(1023)), 8), lane);
+		for (k = 0; k < 32; k++)
+			X[k] = _mm256_xor_si256(X[k], _mm256_i32gather_epi32((const int *)&V[k], j, 4));
+		xor_salsa8_lanes(&X[0], &X[16]);
+		xor_salsa8_lanes(&X[16], &X[0]);
+	}
+
+	for (k = 0; k < 32; k++)
+		_mm256_store_si256((__m256i *)W[k], X[k]);
+	for (l = 0; l < SCRYPT_LANES; l++) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[4 * k], W[k][l]);
+		PBKDF2_SHA256((const uint8_t *)&input[80 * l], 80, B, 128, 1, (uint8_t *)&output[32 * l], 32);
+	}
+}
+#endif // USE_AVX2_LANES
+
+bool scrypt_multi_has_avx2()
+{
+#if defined(USE_AVX2_LANES)
+	static const bool fAvx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+	return fAvx2;
+#else
+	return false;
+#endif
+}
+
+/* Per-thread scratch space, grown on first use and kept for the life of the thread. */
+static char *scrypt_scratch(size_t size)
+{
+	static thread_local std::vector<char> scratch;
+	if (scratch.size() < size)
+		scratch.resize(size);
+	return &scratch[0];
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t count)
+{
+	size_t i = 0;
+#if defined(USE_AVX2_LANES)
+	if (count >= SCRYPT_LANES && scrypt_multi_has_avx2()) {
+		char *scratchpad = scrypt_scratch(SCRYPT_LANES * 131072 + 63);
+		for (; i + SCRYPT_LANES <= count; i += SCRYPT_LANES)
+			scrypt_1024_1_1_256_sp_avx2_lanes(&input[80 * i], &output[32 * i], scratchpad);
+	}
+#endif
+	if (i < count) {
+		char *scratchpad = scrypt_scratch(SCRYPT_SCRATCHPAD_SIZE);
+		for (; i < count; i++)
+			scrypt_1024_1_1_256_sp(&input[80 * i], &output[32 * i], scratchpad);
+	}
+}
+
 void scrypt_1024_1_1_256(const char *input, char *output)
 {
-	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
-    scrypt_1024_1_1_256_sp(input, output, scratchpad);
+	scrypt_1024_1_1_256_sp(input, output, scrypt_scratch(SCRYPT_SCRATCHPAD_SIZE));
 }
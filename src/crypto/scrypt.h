@@ -8,6 +8,14 @@ static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
+/**
+ * Hash count consecutive 80-byte inputs into count consecutive 32-byte outputs.
+ * Runs eight interleaved lanes when the CPU has AVX2 and falls back to one at a
+ * time otherwise. Scratch space is allocated once per thread and reused.
+ */
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t count);
+bool scrypt_multi_has_avx2();
+
 #if defined(USE_SSE2)
 #include <string>
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
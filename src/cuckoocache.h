@@ -0,0 +1,196 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef KEKCOIN_CUCKOOCACHE_H
+#define KEKCOIN_CUCKOOCACHE_H
+
+#include "crypto/common.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <stdint.h>
+
+/**
+ * Fixed-memory set of uint256 keys that are already uniformly random, such as
+ * salted hashes.
+ *
+ * Every key has eight candidate slots, taken from its own 32-bit words. Lookups
+ * and erasure never lock: slots are read word by word through atomics, and
+ * erasing only marks a slot collectable so the next insert may reuse it.
+ * Inserts are serialized among themselves and, when all eight candidates are
+ * taken, displace an occupant to one of its other slots, giving up after a
+ * bounded number of moves.
+ *
+ * A lookup racing an insert into the same slot can see a mix of the old and
+ * the new key. That only matches a key equal to one of the two, as the keys are
+ * random, so the worst case is a lookup missing an entry that is being moved.
+ *
+ * Entries age in generations. Once most slots hold entries of the current
+ * generation, entries of the previous one become collectable and the current
+ * generation becomes the previous one.
+ */
+class CCuckooCache
+{
+private:
+    static const unsigned int CANDIDATES = 8;
+
+    enum : uint8_t {
+        //! An insert may overwrite this slot
+        SLOT_COLLECTABLE = 1,
+        //! The entry dates from the previous generation
+        SLOT_OLD = 2,
+    };
+
+    struct Slot
+    {
+        std::atomic<uint64_t> words[4];
+    };
+
+    std::unique_ptr<Slot[]> table;
+    std::unique_ptr<std::atomic<uint8_t>[]> flags;
+    uint32_t nSize;
+    //! Displacements tried before an insert gives up
+    unsigned int nMaxDepth;
+    //! Inserts until the generation fill level is checked again
+    uint32_t nUntilGenerationCheck;
+    CCriticalSection cs_insert;
+
+    uint32_t Candidate(const uint256& key, unsigned int n) const
+    {
+        return ((uint64_t)ReadLE32(key.begin() + 4 * n) * nSize) >> 32;
+    }
+
+    bool Matches(uint32_t pos, const uint256& key) const
+    {
+        for (int i = 0; i < 4; i++) {
+            if (table[pos].words[i].load(std::memory_order_relaxed) != ReadLE64(key.begin() + 8 * i))
+                return false;
+        }
+        return true;
+    }
+
+    uint256 Read(uint32_t pos) const
+    {
+        uint256 key;
+        for (int i = 0; i < 4; i++)
+            WriteLE64(key.begin() + 8 * i, table[pos].words[i].load(std::memory_order_relaxed));
+        return key;
+    }
+
+    void Write(uint32_t pos, const uint256& key)
+    {
+        for (int i = 0; i < 4; i++)
+            table[pos].words[i].store(ReadLE64(key.begin() + 8 * i), std::memory_order_relaxed);
+    }
+
+    /** Age the table if more than 45% of it holds current-generation entries */
+    void CheckGeneration()
+    {
+        if (nUntilGenerationCheck-- > 0)
+            return;
+        nUntilGenerationCheck = nSize / 16;
+
+        uint32_t nCurrent = 0;
+        for (uint32_t i = 0; i < nSize; i++) {
+            if (!(flags[i].load(std::memory_order_relaxed) & (SLOT_COLLECTABLE | SLOT_OLD)))
+                nCurrent++;
+        }
+        if (nCurrent * 20 < nSize * 9)
+            return;
+        for (uint32_t i = 0; i < nSize; i++) {
+            if (flags[i].load(std::memory_order_relaxed) & SLOT_OLD)
+                flags[i].fetch_or(SLOT_COLLECTABLE, std::memory_order_relaxed);
+            else
+                flags[i].fetch_or(SLOT_OLD, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    CCuckooCache() : nSize(0), nMaxDepth(0), nUntilGenerationCheck(0) {}
+
+    /**
+     * Size the cache to at most nBytes and empty it. Returns the number of
+     * entries it can hold. Not safe to call while the cache is in use.
+     */
+    size_t Setup(size_t nBytes)
+    {
+        nSize = std::min(nBytes / (sizeof(Slot) + sizeof(std::atomic<uint8_t>)), (size_t)std::numeric_limits<uint32_t>::max());
+        table.reset(nSize ? new Slot[nSize] : NULL);
+        flags.reset(nSize ? new std::atomic<uint8_t>[nSize] : NULL);
+        for (uint32_t i = 0; i < nSize; i++) {
+            Write(i, uint256());
+            flags[i].store(SLOT_COLLECTABLE, std::memory_order_relaxed);
+        }
+        nMaxDepth = 1;
+        while (nMaxDepth < 32 && ((uint64_t)1 << nMaxDepth) < nSize)
+            nMaxDepth++;
+        nUntilGenerationCheck = nSize / 16;
+        return nSize;
+    }
+
+    size_t Size() const { return nSize; }
+
+    /** Whether key is present; if fErase, its slot may be reused afterwards */
+    bool Contains(const uint256& key, bool fErase)
+    {
+        if (!nSize || key.IsNull())
+            return false;
+        for (unsigned int n = 0; n < CANDIDATES; n++) {
+            uint32_t pos = Candidate(key, n);
+            if (Matches(pos, key)) {
+                if (fErase)
+                    flags[pos].fetch_or(SLOT_COLLECTABLE, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Insert(uint256 key)
+    {
+        if (!nSize || key.IsNull())
+            return;
+
+        LOCK(cs_insert);
+        CheckGeneration();
+
+        uint8_t nFlags = 0;
+        uint32_t posLast = Candidate(key, 0);
+        for (unsigned int nDepth = 0; nDepth < nMaxDepth; nDepth++) {
+            for (unsigned int n = 0; n < CANDIDATES; n++) {
+                uint32_t pos = Candidate(key, n);
+                if (Matches(pos, key)) {
+                    flags[pos].store(nFlags, std::memory_order_relaxed);
+                    return;
+                }
+                if (flags[pos].load(std::memory_order_relaxed) & SLOT_COLLECTABLE) {
+                    Write(pos, key);
+                    flags[pos].store(nFlags, std::memory_order_relaxed);
+                    return;
+                }
+            }
+
+            // All candidates are taken: move into the one after the slot this
+            // key was displaced from, and carry on with its occupant.
+            unsigned int n = 0;
+            while (n < CANDIDATES - 1 && Candidate(key, n) != posLast)
+                n++;
+            uint32_t pos = Candidate(key, (n + 1) % CANDIDATES);
+            uint256 keyVictim = Read(pos);
+            uint8_t nFlagsVictim = flags[pos].load(std::memory_order_relaxed);
+            Write(pos, key);
+            flags[pos].store(nFlags, std::memory_order_relaxed);
+            key = keyVictim;
+            nFlags = nFlagsVictim & SLOT_OLD;
+            posLast = pos;
+        }
+        // the last displaced entry is dropped
+    }
+};
+
+#endif // KEKCOIN_CUCKOOCACHE_H
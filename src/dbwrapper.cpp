@@ -6,8 +6,17 @@
 
 #include "util.h"
 #include "random.h"
+#include "utilstrencodings.h"
 
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -15,12 +24,186 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize, bool compression, int maxOpenFiles)
+namespace {
+
+/** Block cache that counts lookups; can be a view on a cache shared with other databases */
+class CDBCountingCache : public leveldb::Cache
+{
+private:
+    std::shared_ptr<leveldb::Cache> base;
+    size_t nCapacity;
+    bool fShared;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+
+public:
+    CDBCountingCache(const std::shared_ptr<leveldb::Cache>& baseIn, size_t nCapacityIn, bool fSharedIn) :
+        base(baseIn), nCapacity(nCapacityIn), fShared(fSharedIn), nHits(0), nMisses(0) {}
+
+    Handle* Insert(const leveldb::Slice& key, void* value, size_t charge, void (*deleter)(const leveldb::Slice& key, void* value)) {
+        return base->Insert(key, value, charge, deleter);
+    }
+
+    Handle* Lookup(const leveldb::Slice& key) {
+        Handle* handle = base->Lookup(key);
+        if (handle)
+            nHits++;
+        else
+            nMisses++;
+        return handle;
+    }
+
+    void Release(Handle* handle) { base->Release(handle); }
+    void* Value(Handle* handle) { return base->Value(handle); }
+    void Erase(const leveldb::Slice& key) { base->Erase(key); }
+    uint64_t NewId() { return base->NewId(); }
+
+    size_t GetCapacity() const { return nCapacity; }
+    bool IsShared() const { return fShared; }
+    uint64_t GetHits() const { return nHits; }
+    uint64_t GetMisses() const { return nMisses; }
+};
+
+/** Merges the changes of a batch into the changes held back in bulk mode */
+class CDBBulkMerger : public leveldb::WriteBatch::Handler
+{
+private:
+    std::map<std::string, std::pair<bool, std::string> >& mapBulk;
+    size_t& nBulkSize;
+
+    void Set(const leveldb::Slice& key, bool fValue, const leveldb::Slice& value)
+    {
+        std::string strKey = key.ToString();
+        std::map<std::string, std::pair<bool, std::string> >::iterator it = mapBulk.find(strKey);
+        if (it == mapBulk.end()) {
+            it = mapBulk.insert(std::make_pair(strKey, std::make_pair(false, std::string()))).first;
+            nBulkSize += strKey.size();
+        } else {
+            nBulkSize -= it->second.second.size();
+        }
+        it->second.first = fValue;
+        it->second.second.assign(value.data(), value.size());
+        nBulkSize += value.size();
+    }
+
+public:
+    CDBBulkMerger(std::map<std::string, std::pair<bool, std::string> >& mapBulkIn, size_t& nBulkSizeIn) :
+        mapBulk(mapBulkIn), nBulkSize(nBulkSizeIn) {}
+
+    void Put(const leveldb::Slice& key, const leveldb::Slice& value) { Set(key, true, value); }
+    void Delete(const leveldb::Slice& key) { Set(key, false, leveldb::Slice()); }
+};
+
+//! Largest batch written at once when the changes held back in bulk mode are written out
+const size_t BULK_BATCH_SIZE = 16 << 20;
+
+boost::mutex csDatabases;
+//! Settings from -dbtune by database name
+std::map<std::string, CDBTuning> mapTuning;
+//! Block cache shared by the databases opened while it is set
+std::shared_ptr<leveldb::Cache> pcacheShared;
+size_t nSharedCacheSize = 0;
+//! Open databases, for getdbstats
+std::set<const CDBWrapper*> setDatabases;
+
+bool ParseTuningValue(const std::string& strValue, int64_t nMin, int64_t nMax, int64_t& nRet)
+{
+    return ParseInt64(strValue, &nRet) && nRet >= nMin && nRet <= nMax;
+}
+
+} // anon namespace
+
+bool SetDBTuning(const std::vector<std::string>& vTuning, std::string& strError)
+{
+    std::map<std::string, CDBTuning> mapNew;
+    BOOST_FOREACH(const std::string& strTuning, vTuning) {
+        size_t nColon = strTuning.find(':');
+        if (nColon == 0 || nColon == std::string::npos) {
+            strError = strprintf("Invalid -dbtune value '%s', expected <database>:<option>=<value>", strTuning);
+            return false;
+        }
+        CDBTuning& tuning = mapNew[strTuning.substr(0, nColon)];
+        std::vector<std::string> vOptions;
+        boost::split(vOptions, strTuning.substr(nColon + 1), boost::is_any_of(","));
+        BOOST_FOREACH(const std::string& strOption, vOptions) {
+            size_t nEquals = strOption.find('=');
+            std::string strKey = strOption.substr(0, nEquals);
+            std::string strValue = nEquals == std::string::npos ? "" : strOption.substr(nEquals + 1);
+            int64_t n;
+            bool fValid = true;
+            if (strKey == "cache") {
+                fValid = ParseTuningValue(strValue, 1, 1 << 20, n);
+                tuning.nCacheSize = (size_t)n << 20;
+            } else if (strKey == "readshare") {
+                fValid = ParseTuningValue(strValue, 1, 99, n);
+                tuning.nReadShare = n;
+            } else if (strKey == "blocksize") {
+                fValid = ParseTuningValue(strValue, 1, 1024, n);
+                tuning.nBlockSize = (size_t)n << 10;
+            } else if (strKey == "bloombits") {
+                fValid = ParseTuningValue(strValue, 0, 64, n);
+                tuning.nBloomBits = n;
+            } else if (strKey == "compression") {
+                fValid = ParseTuningValue(strValue, 0, 1, n);
+                tuning.nCompression = n;
+            } else {
+                strError = strprintf("Unknown -dbtune option '%s'", strKey);
+                return false;
+            }
+            if (!fValid) {
+                strError = strprintf("Invalid value for -dbtune option '%s': '%s'", strKey, strValue);
+                return false;
+            }
+        }
+    }
+
+    boost::unique_lock<boost::mutex> lock(csDatabases);
+    mapTuning.swap(mapNew);
+    return true;
+}
+
+CDBTuning GetDBTuning(const std::string& strName)
+{
+    boost::unique_lock<boost::mutex> lock(csDatabases);
+    std::map<std::string, CDBTuning>::const_iterator it = mapTuning.find(strName);
+    return it == mapTuning.end() ? CDBTuning() : it->second;
+}
+
+size_t GetDBBlockCacheSize(const std::string& strName, size_t nCacheSize)
+{
+    CDBTuning tuning = GetDBTuning(strName);
+    return (tuning.nCacheSize ? tuning.nCacheSize : nCacheSize) / 100 * tuning.nReadShare;
+}
+
+void SetSharedDBCache(size_t nSize)
+{
+    boost::unique_lock<boost::mutex> lock(csDatabases);
+    // Databases still open keep the old one alive
+    pcacheShared.reset(nSize ? leveldb::NewLRUCache(nSize) : NULL);
+    nSharedCacheSize = nSize;
+}
+
+std::vector<CDBStats> GetDBStats()
+{
+    boost::unique_lock<boost::mutex> lock(csDatabases);
+    std::vector<CDBStats> vStats(setDatabases.size());
+    std::vector<CDBStats>::iterator itStats = vStats.begin();
+    BOOST_FOREACH(const CDBWrapper* pdb, setDatabases)
+        pdb->GetStats(*itStats++);
+    return vStats;
+}
+
+static leveldb::Options GetOptions(const CDBTuning& tuning, bool compression, int maxOpenFiles)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    size_t nBlockCacheSize = tuning.nCacheSize / 100 * tuning.nReadShare;
+    if (pcacheShared)
+        options.block_cache = new CDBCountingCache(pcacheShared, nSharedCacheSize, true);
+    else
+        options.block_cache = new CDBCountingCache(std::shared_ptr<leveldb::Cache>(leveldb::NewLRUCache(nBlockCacheSize)), nBlockCacheSize, false);
+    options.write_buffer_size = (tuning.nCacheSize - nBlockCacheSize) / 2; // up to two write buffers may be held in memory simultaneously
+    options.block_size = tuning.nBlockSize;
+    options.filter_policy = tuning.nBloomBits ? leveldb::NewBloomFilterPolicy(tuning.nBloomBits) : NULL;
     options.compression = compression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
     options.max_open_files = maxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
@@ -34,11 +217,23 @@ static leveldb::Options GetOptions(size_t nCacheSize, bool compression, int maxO
 CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, bool compression, int maxOpenFiles)
 {
     penv = NULL;
+    fBulk = false;
+    nBulkSize = 0;
+    nBulkLimit = 0;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize, compression, maxOpenFiles);
+    name = path.filename().string();
+    tuning = GetDBTuning(name);
+    if (!tuning.nCacheSize)
+        tuning.nCacheSize = nCacheSize;
+    if (tuning.nCompression >= 0)
+        compression = tuning.nCompression;
+    {
+        boost::unique_lock<boost::mutex> lock(csDatabases);
+        options = GetOptions(tuning, compression, maxOpenFiles);
+    }
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -74,10 +269,25 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     }
 
     LogPrintf("Using obfuscation key for %s: %s\n", path.string(), HexStr(obfuscate_key));
+
+    boost::unique_lock<boost::mutex> lock(csDatabases);
+    setDatabases.insert(this);
 }
 
 CDBWrapper::~CDBWrapper()
 {
+    {
+        boost::unique_lock<boost::mutex> lock(csDatabases);
+        setDatabases.erase(this);
+    }
+    if (fBulk) {
+        try {
+            boost::unique_lock<boost::mutex> lock(csBulk);
+            WriteBulk(true);
+        } catch (const dbwrapper_error& e) {
+            LogPrintf("%s: failed to write out held back changes: %s\n", __func__, e.what());
+        }
+    }
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -88,8 +298,65 @@ CDBWrapper::~CDBWrapper()
     options.env = NULL;
 }
 
+bool CDBWrapper::ReadValue(const leveldb::Slice& slKey, std::string& strValue) const
+{
+    if (fBulk) {
+        boost::unique_lock<boost::mutex> lock(csBulk);
+        std::map<std::string, std::pair<bool, std::string> >::const_iterator it = mapBulk.find(slKey.ToString());
+        if (it != mapBulk.end()) {
+            if (!it->second.first)
+                return false;
+            strValue = it->second.second;
+            return true;
+        }
+    }
+    leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+    if (!status.ok()) {
+        if (status.IsNotFound())
+            return false;
+        LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        dbwrapper_private::HandleError(status);
+    }
+    return true;
+}
+
+void CDBWrapper::WriteBulk(bool fSync)
+{
+    // Keys in order go into the memtable, and from there into the tables, without reshuffling
+    leveldb::WriteBatch batch;
+    size_t nBatchSize = 0;
+    for (std::map<std::string, std::pair<bool, std::string> >::const_iterator it = mapBulk.begin(); it != mapBulk.end(); it++) {
+        if (it->second.first)
+            batch.Put(it->first, it->second.second);
+        else
+            batch.Delete(it->first);
+        nBatchSize += it->first.size() + it->second.second.size();
+        if (nBatchSize >= BULK_BATCH_SIZE) {
+            leveldb::Status status = pdb->Write(writeoptions, &batch);
+            dbwrapper_private::HandleError(status);
+            batch.Clear();
+            nBatchSize = 0;
+        }
+    }
+    leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch);
+    dbwrapper_private::HandleError(status);
+    mapBulk.clear();
+    nBulkSize = 0;
+}
+
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
+    if (fBulk) {
+        boost::unique_lock<boost::mutex> lock(csBulk);
+        if (fBulk) {
+            CDBBulkMerger merger(mapBulk, nBulkSize);
+            leveldb::Status status = batch.batch.Iterate(&merger);
+            dbwrapper_private::HandleError(status);
+            if (fSync || nBulkSize >= nBulkLimit)
+                WriteBulk(fSync);
+            return true;
+        }
+    }
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
     dbwrapper_private::HandleError(status);
     return true;
@@ -115,6 +382,42 @@ std::vector<unsigned char> CDBWrapper::CreateObfuscateKey() const
 
 }
 
+bool CDBWrapper::Flush()
+{
+    if (fBulk) {
+        boost::unique_lock<boost::mutex> lock(csBulk);
+        if (fBulk && !mapBulk.empty())
+            WriteBulk(false);
+    }
+    return true;
+}
+
+CDBIterator* CDBWrapper::NewIterator()
+{
+    Flush();
+    return new CDBIterator(*this, pdb->NewIterator(iteroptions));
+}
+
+void CDBWrapper::SetBulkMode(bool fBulkIn, size_t nBulkLimitIn)
+{
+    boost::unique_lock<boost::mutex> lock(csBulk);
+    if (fBulkIn) {
+        nBulkLimit = nBulkLimitIn ? nBulkLimitIn : tuning.nCacheSize;
+        fBulk = true;
+        return;
+    }
+    if (!fBulk)
+        return;
+    WriteBulk(true);
+    fBulk = false;
+}
+
+void CDBWrapper::Compact()
+{
+    LogPrintf("Compacting LevelDB %s\n", name);
+    pdb->CompactRange(NULL, NULL);
+}
+
 bool CDBWrapper::IsEmpty()
 {
     boost::scoped_ptr<CDBIterator> it(NewIterator());
@@ -122,10 +425,28 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+void CDBWrapper::GetStats(CDBStats& stats) const
+{
+    const CDBCountingCache* pcache = static_cast<const CDBCountingCache*>(options.block_cache);
+    stats.strName = name;
+    stats.nBlockCacheSize = pcache->GetCapacity();
+    stats.nWriteBufferSize = options.write_buffer_size;
+    stats.nBlockSize = options.block_size;
+    stats.nBloomBits = options.filter_policy ? tuning.nBloomBits : 0;
+    stats.fCompression = options.compression != leveldb::kNoCompression;
+    stats.fSharedCache = pcache->IsShared();
+    stats.nCacheHits = pcache->GetHits();
+    stats.nCacheMisses = pcache->GetMisses();
+    if (!pdb->GetProperty("leveldb.stats", &stats.strLevelDBStats))
+        stats.strLevelDBStats.clear();
+}
+
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
+void CDBIterator::SeekToLast() { piter->SeekToLast(); }
 void CDBIterator::Next() { piter->Next(); }
+void CDBIterator::Prev() { piter->Prev(); }
 
 namespace dbwrapper_private {
 
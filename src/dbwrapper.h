@@ -12,7 +12,11 @@
 #include "utilstrencodings.h"
 #include "version.h"
 
+#include <atomic>
+#include <map>
+
 #include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
@@ -25,6 +29,54 @@ public:
 
 class CDBWrapper;
 
+/** LevelDB settings of one database, see -dbtune */
+struct CDBTuning
+{
+    //! Total cache of the database in bytes, 0 for what the caller passes
+    size_t nCacheSize;
+    //! Percentage of the cache used as block cache, the rest goes to the two write buffers
+    int nReadShare;
+    //! Approximate size of the uncompressed data blocks in bytes
+    size_t nBlockSize;
+    //! Bits per key of the bloom filter, 0 for none
+    int nBloomBits;
+    //! 0 or 1 to override the compression the caller asks for, -1 to keep it
+    int nCompression;
+
+    CDBTuning() : nCacheSize(0), nReadShare(50), nBlockSize(4096), nBloomBits(10), nCompression(-1) {}
+};
+
+/** Numbers of an open database, as getdbstats reports them */
+struct CDBStats
+{
+    std::string strName;
+    size_t nBlockCacheSize;
+    size_t nWriteBufferSize;
+    size_t nBlockSize;
+    int nBloomBits;
+    bool fCompression;
+    bool fSharedCache;
+    uint64_t nCacheHits;
+    uint64_t nCacheMisses;
+    //! LevelDB's "leveldb.stats" property: files, sizes and compactions per level
+    std::string strLevelDBStats;
+};
+
+/**
+ * Parse -dbtune values, "<database>:<option>=<value>[,<option>=<value>...]",
+ * for the databases opened from now on. A database is named by the last
+ * component of its path, such as "chainstate" or "index".
+ */
+bool SetDBTuning(const std::vector<std::string>& vTuning, std::string& strError);
+/** The settings of the database with this name */
+CDBTuning GetDBTuning(const std::string& strName);
+/** Block cache the database with this name gets, given the cache size the caller passes */
+size_t GetDBBlockCacheSize(const std::string& strName, size_t nCacheSize);
+/** Let the databases opened from now on share one block cache of nSize bytes, or 0 for a cache each */
+void SetSharedDBCache(size_t nSize);
+/** Numbers of all open databases */
+std::vector<CDBStats> GetDBStats();
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -49,12 +101,13 @@ class CDBBatch
 private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
+    size_t size_estimate;
 
 public:
     /**
      * @param[in] parent    CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &parent) : parent(parent) { };
+    CDBBatch(const CDBWrapper &parent) : parent(parent), size_estimate(0) { };
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -71,6 +124,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        size_estimate += ssKey.size() + ssValue.size();
     }
 
     template <typename K>
@@ -82,7 +136,17 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        size_estimate += ssKey.size();
     }
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
+
+    //! Bytes of keys and values queued, not counting leveldb's own framing
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -104,6 +168,7 @@ public:
     bool Valid();
 
     void SeekToFirst();
+    void SeekToLast();
 
     template<typename K> void Seek(const K& key) {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -114,6 +179,7 @@ public:
     }
 
     void Next();
+    void Prev();
 
     template<typename K> bool GetKey(K& key) {
         leveldb::Slice slKey = piter->key();
@@ -173,6 +239,12 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    //! name of the database's tuning profile, the last component of its path
+    std::string name;
+
+    //! the settings the database was opened with
+    CDBTuning tuning;
+
     //! a key used for optional XOR-obfuscation of the database
     std::vector<unsigned char> obfuscate_key;
 
@@ -184,10 +256,30 @@ private:
 
     std::vector<unsigned char> CreateObfuscateKey() const;
 
+    //! whether writes are held back in mapBulk, see SetBulkMode
+    std::atomic<bool> fBulk;
+
+    //! the writes held back in bulk mode, by key; erased keys map to no value
+    std::map<std::string, std::pair<bool, std::string> > mapBulk;
+
+    //! bytes of keys and values in mapBulk
+    size_t nBulkSize;
+
+    //! size at which mapBulk is written out
+    size_t nBulkLimit;
+
+    mutable boost::mutex csBulk;
+
+    //! look the raw value of a key up, in mapBulk first when in bulk mode
+    bool ReadValue(const leveldb::Slice& slKey, std::string& strValue) const;
+
+    //! write mapBulk to the database in key order; csBulk must be held
+    void WriteBulk(bool fSync);
+
 public:
     /**
      * @param[in] path          Location in the filesystem where leveldb data will be stored.
-     * @param[in] nCacheSize    Configures various leveldb cache settings.
+     * @param[in] nCacheSize    Configures various leveldb cache settings, unless -dbtune sets the cache of the database.
      * @param[in] fMemory       If true, use leveldb's memory environment.
      * @param[in] fWipe         If true, remove all existing data.
      * @param[in] obfuscate     If true, store data obfuscated via simple XOR. If false, XOR
@@ -207,13 +299,8 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
-        if (!status.ok()) {
-            if (status.IsNotFound())
-                return false;
-            LogPrintf("LevelDB read failure: %s\n", status.ToString());
-            dbwrapper_private::HandleError(status);
-        }
+        if (!ReadValue(slKey, strValue))
+            return false;
         try {
             CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue.Xor(obfuscate_key);
@@ -241,14 +328,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
-        if (!status.ok()) {
-            if (status.IsNotFound())
-                return false;
-            LogPrintf("LevelDB read failure: %s\n", status.ToString());
-            dbwrapper_private::HandleError(status);
-        }
-        return true;
+        return ReadValue(slKey, strValue);
     }
 
     template <typename K>
@@ -261,27 +341,41 @@ public:
 
     bool WriteBatch(CDBBatch& batch, bool fSync = false);
 
-    // not available for LevelDB; provide for compatibility with BDB
-    bool Flush()
-    {
-        return true;
-    }
+    //! Write out the changes held back in bulk mode; nothing to do otherwise
+    bool Flush();
 
+    //! Make all writes so far durable, including those held back in bulk mode
     bool Sync()
     {
         CDBBatch batch(*this);
         return WriteBatch(batch, true);
     }
 
-    CDBIterator *NewIterator()
-    {
-        return new CDBIterator(*this, pdb->NewIterator(iteroptions));
-    }
+    /**
+     * Iterate over the database. Changes held back in bulk mode are written
+     * out first, so the iterator sees them.
+     */
+    CDBIterator *NewIterator();
+
+    /**
+     * In bulk mode batches are merged in memory, and written to the database
+     * in key order and without syncing each time nBulkLimitIn bytes pile up,
+     * or as much as the cache of the database if 0.
+     * Reads see the held back changes. Leaving bulk mode writes out the rest
+     * with a sync; callers compact the database afterwards, see Compact.
+     */
+    void SetBulkMode(bool fBulkIn, size_t nBulkLimitIn = 0);
+    bool IsBulkMode() const { return fBulk; }
+
+    //! Compact the whole database, which can take minutes after bulk writes
+    void Compact();
 
     /**
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    void GetStats(CDBStats& stats) const;
 };
 
 #endif // KEKCOIN_DBWRAPPER_H
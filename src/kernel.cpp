@@ -6,6 +6,380 @@
 #include <boost/assign/list_of.hpp>
 
 #include "kernel.h"
+#include "chainparams.h"
+#include "checkqueue.h"
 #include "timedata.h"
 #include "txdb.h"
 #include "main.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <limits>
+
+using namespace std;
+
+CStakeKernelCache stakeKernelCache;
+CStakeKernelSearch stakeKernelSearch;
+CStakeModifierTable stakeModifierTable;
+
+static CCheckQueue<CStakeKernelCheck> stakekernelqueue(1);
+
+CStakeKernelCache::CStakeKernelCache(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn), nGeneration(0)
+{
+}
+
+void CStakeKernelCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    LOCK(cs_stakecache);
+    nMaxSize = nMaxSizeIn;
+    while (mapEntries.size() > nMaxSize) {
+        mapEntries.erase(listEntries.back().first);
+        listEntries.pop_back();
+    }
+}
+
+void CStakeKernelCache::Touch(const COutPoint& outpoint, const CStakeIndexValue& value)
+{
+    AssertLockHeld(cs_stakecache);
+    if (nMaxSize == 0)
+        return;
+
+    map<COutPoint, list_type::iterator>::iterator it = mapEntries.find(outpoint);
+    if (it != mapEntries.end()) {
+        it->second->second = value;
+        listEntries.splice(listEntries.begin(), listEntries, it->second);
+        return;
+    }
+
+    listEntries.push_front(make_pair(outpoint, value));
+    mapEntries.insert(make_pair(outpoint, listEntries.begin()));
+    if (mapEntries.size() > nMaxSize) {
+        mapEntries.erase(listEntries.back().first);
+        listEntries.pop_back();
+    }
+}
+
+bool CStakeKernelCache::Get(const COutPoint& outpoint, CStakeIndexValue& value)
+{
+    uint64_t nGenerationRead;
+    {
+        LOCK(cs_stakecache);
+        map<COutPoint, list_type::iterator>::iterator it = mapEntries.find(outpoint);
+        if (it != mapEntries.end()) {
+            value = it->second->second;
+            listEntries.splice(listEntries.begin(), listEntries, it->second);
+            return true;
+        }
+        nGenerationRead = nGeneration;
+    }
+
+    if (!pblocktree || !pblocktree->ReadStakeIndex(outpoint, value))
+        return false;
+
+    // An Update() during the read may have erased or replaced this record
+    LOCK(cs_stakecache);
+    if (nGeneration == nGenerationRead)
+        Touch(outpoint, value);
+    return true;
+}
+
+void CStakeKernelCache::Update(const vector<pair<COutPoint, CStakeIndexValue> >& vect)
+{
+    LOCK(cs_stakecache);
+    nGeneration++;
+    for (vector<pair<COutPoint, CStakeIndexValue> >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        if (it->second.IsNull()) {
+            map<COutPoint, list_type::iterator>::iterator mi = mapEntries.find(it->first);
+            if (mi != mapEntries.end()) {
+                listEntries.erase(mi->second);
+                mapEntries.erase(mi);
+            }
+        } else {
+            Touch(it->first, it->second);
+        }
+    }
+}
+
+void CStakeKernelCache::Clear()
+{
+    LOCK(cs_stakecache);
+    nGeneration++;
+    mapEntries.clear();
+    listEntries.clear();
+}
+
+size_t CStakeKernelCache::Size() const
+{
+    LOCK(cs_stakecache);
+    return mapEntries.size();
+}
+
+bool GetStakeKernelInput(const CBlockIndex* pindexPrev, const COutPoint& prevout, CStakeIndexValue& kernelInput, const CBlockIndex** ppindexFrom)
+{
+    // A record written by a block on another branch describes a different block
+    if (pindexPrev && stakeKernelCache.Get(prevout, kernelInput)) {
+        const CBlockIndex* pindexFrom = pindexPrev->GetAncestor(kernelInput.nHeight);
+        if (pindexFrom && pindexFrom->GetBlockHash() == kernelInput.hashBlock) {
+            if (ppindexFrom)
+                *ppindexFrom = pindexFrom;
+            return true;
+        }
+    }
+
+    LOCK(cs_main);
+
+    CTransaction txPrev;
+    uint256 hashBlock = uint256();
+    if (!GetTransaction(prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
+        return false;
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end() || prevout.n >= txPrev.vout.size())
+        return false;
+    const CBlockIndex* pindexFrom = mi->second;
+
+    unsigned int nTxOffset = 0;
+    CDiskTxPos postx;
+    if (fTxIndex && pblocktree->ReadTxIndex(prevout.hash, postx))
+        nTxOffset = postx.nTxOffset;
+
+    kernelInput = CStakeIndexValue(pindexFrom->nTime, txPrev.nTime, nTxOffset, txPrev.vout[prevout.n].nValue, pindexFrom->nHeight, pindexFrom->GetBlockHash());
+    if (ppindexFrom)
+        *ppindexFrom = pindexFrom;
+
+    // Only unspent outputs are recorded: the record of a spent one would never be erased
+    const CCoins* coins = pcoinsTip->AccessCoins(prevout.hash);
+    if (!coins || !coins->IsAvailable(prevout.n))
+        return true;
+
+    vector<pair<COutPoint, CStakeIndexValue> > vStakeIndex(1, make_pair(prevout, kernelInput));
+    if (!pblocktree->UpdateStakeIndex(vStakeIndex))
+        LogPrintf("%s: failed to write stake index entry for %s\n", __func__, prevout.ToString());
+    stakeKernelCache.Update(vStakeIndex);
+    return true;
+}
+
+void CStakeModifierTable::Connect(const CBlockIndex* pindex)
+{
+    if (pindex->pprev != pindexTip || (int)vGeneratedCount.size() != pindex->nHeight)
+        return;
+
+    int nGenerated = pindex->pprev ? vGeneratedCount.back() : 0;
+    if (pindex->GeneratedStakeModifier()) {
+        vGenerated.push_back(pindex);
+        nGenerated++;
+    }
+    vGeneratedCount.push_back(nGenerated);
+    pindexTip = pindex;
+}
+
+void CStakeModifierTable::Disconnect(const CBlockIndex* pindex)
+{
+    if (pindex != pindexTip)
+        return;
+
+    if (pindex->GeneratedStakeModifier())
+        vGenerated.pop_back();
+    vGeneratedCount.pop_back();
+    pindexTip = pindex->pprev;
+}
+
+void CStakeModifierTable::Sync(const CChain& chain)
+{
+    if (pindexTip == chain.Tip())
+        return;
+
+    while (pindexTip && !chain.Contains(pindexTip))
+        Disconnect(pindexTip);
+    while ((int)vGeneratedCount.size() <= chain.Height()) {
+        const CBlockIndex* pindex = chain[vGeneratedCount.size()];
+        Connect(pindex);
+        assert(pindexTip == pindex);
+    }
+}
+
+void CStakeModifierTable::Clear()
+{
+    vGeneratedCount.clear();
+    vGenerated.clear();
+    pindexTip = NULL;
+}
+
+const CBlockIndex* CStakeModifierTable::GetLastGenerated(int nHeight) const
+{
+    if (nHeight < 0 || nHeight >= (int)vGeneratedCount.size() || vGeneratedCount[nHeight] == 0)
+        return NULL;
+    return vGenerated[vGeneratedCount[nHeight] - 1];
+}
+
+const CBlockIndex* CStakeModifierTable::GetNextGenerated(int nHeight, int64_t nTime) const
+{
+    if (nHeight < 0 || nHeight >= (int)vGeneratedCount.size())
+        return NULL;
+
+    // Only modifier-generating blocks are visited, a handful per selection interval
+    for (size_t i = vGeneratedCount[nHeight]; i < vGenerated.size(); i++) {
+        if (vGenerated[i]->GetBlockTime() >= nTime)
+            return vGenerated[i];
+    }
+    return NULL;
+}
+
+CStakeSearchResult::CStakeSearchResult() : nCandidate(numeric_limits<size_t>::max()), nOffset(0), nEvaluated(0)
+{
+}
+
+bool CStakeKernelCheck::operator()()
+{
+    uint64_t nEvaluated = 0;
+    arith_uint256 hashProofOfStake, targetProofOfStake;
+    for (size_t i = nBegin; i < nEnd && i < pResult->nCandidate; i++) {
+        const CStakeCandidate& candidate = (*pvCandidates)[i];
+        for (unsigned int n = 0; n < nInterval; n++) {
+            nEvaluated++;
+            if (!CheckStakeKernel(candidate.nBitsFrom, candidate.kernelInput, nTimeTx - n, hashProofOfStake, targetProofOfStake))
+                continue;
+
+            // Keep the earliest candidate, like a sequential scan would
+            {
+                boost::lock_guard<boost::mutex> lock(pResult->mutex);
+                if (i < pResult->nCandidate) {
+                    pResult->nCandidate = i;
+                    pResult->nOffset = n;
+                }
+            }
+            pResult->nEvaluated += nEvaluated;
+            return true;
+        }
+    }
+    pResult->nEvaluated += nEvaluated;
+    return true;
+}
+
+void CStakeKernelCheck::swap(CStakeKernelCheck& check)
+{
+    std::swap(pvCandidates, check.pvCandidates);
+    std::swap(nBegin, check.nBegin);
+    std::swap(nEnd, check.nEnd);
+    std::swap(nTimeTx, check.nTimeTx);
+    std::swap(nInterval, check.nInterval);
+    std::swap(pResult, check.pResult);
+}
+
+CStakeKernelSearch::CStakeKernelSearch() : nThreads(1), nKernelsEvaluated(0), dKernelsPerSecond(0)
+{
+}
+
+void CStakeKernelSearch::SetThreads(int nThreadsIn)
+{
+    LOCK(cs_search);
+    nThreads = std::max(nThreadsIn, 1);
+}
+
+void CStakeKernelSearch::Prepare(const CBlockIndex* pindexPrev, const vector<COutPoint>& vPrevouts, vector<CStakeCandidate>& vCandidatesRet)
+{
+    vCandidatesRet.clear();
+    if (!pindexPrev)
+        return;
+
+    LOCK2(cs_main, cs_search);
+    if (hashPrepared != pindexPrev->GetBlockHash()) {
+        mapCandidates.clear();
+        setIneligible.clear();
+        hashPrepared = pindexPrev->GetBlockHash();
+    }
+
+    const int nSpendHeight = pindexPrev->nHeight + 1;
+    vCandidatesRet.reserve(vPrevouts.size());
+    BOOST_FOREACH(const COutPoint& prevout, vPrevouts) {
+        map<COutPoint, CStakeCandidate>::const_iterator it = mapCandidates.find(prevout);
+        if (it != mapCandidates.end()) {
+            vCandidatesRet.push_back(it->second);
+            continue;
+        }
+        if (setIneligible.count(prevout))
+            continue;
+
+        // Same depth and modifier rules as CheckProofOfStake()
+        CStakeCandidate candidate;
+        candidate.prevout = prevout;
+        const CBlockIndex* pindexFrom = NULL;
+        int64_t nStakeModifierTime = 0;
+        int nStakeModifierHeight = 0;
+        if (!GetStakeKernelInput(pindexPrev, prevout, candidate.kernelInput, &pindexFrom) ||
+            (nSpendHeight - candidate.kernelInput.nHeight < Params().GetConsensus().nCoinbaseMaturityV1 - 1 && nSpendHeight - candidate.kernelInput.nHeight > 0) ||
+            !GetKernelStakeModifier(pindexFrom->GetBlockHash(), candidate.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false)) {
+            setIneligible.insert(prevout);
+            continue;
+        }
+        candidate.nBitsFrom = pindexFrom->nBits;
+        mapCandidates.insert(make_pair(prevout, candidate));
+        vCandidatesRet.push_back(candidate);
+    }
+}
+
+bool CStakeKernelSearch::Search(const vector<CStakeCandidate>& vCandidates, size_t nStart, unsigned int nTimeTx, unsigned int nInterval, size_t& nCandidateRet, unsigned int& nTimeTxRet)
+{
+    if (nStart >= vCandidates.size() || nInterval == 0)
+        return false;
+
+    int nSearchThreads;
+    {
+        LOCK(cs_search);
+        nSearchThreads = nThreads;
+    }
+
+    int64_t nTimeStart = GetTimeMicros();
+    CStakeSearchResult result;
+    {
+        // A few slices per thread so an early kernel lets the rest finish quickly
+        size_t nCount = vCandidates.size() - nStart;
+        size_t nSlices = std::min(nCount, (size_t)nSearchThreads * 4);
+        size_t nSliceSize = (nCount + nSlices - 1) / nSlices;
+
+        CCheckQueueControl<CStakeKernelCheck> control(nSearchThreads > 1 ? &stakekernelqueue : NULL);
+        vector<CStakeKernelCheck> vChecks;
+        for (size_t nBegin = nStart; nBegin < vCandidates.size(); nBegin += nSliceSize)
+            vChecks.push_back(CStakeKernelCheck(&vCandidates, nBegin, std::min(nBegin + nSliceSize, vCandidates.size()), nTimeTx, nInterval, &result));
+        if (nSearchThreads > 1) {
+            control.Add(vChecks);
+            control.Wait();
+        } else {
+            BOOST_FOREACH(CStakeKernelCheck& check, vChecks)
+                check();
+        }
+    }
+    int64_t nTimeElapsed = GetTimeMicros() - nTimeStart;
+
+    {
+        LOCK(cs_search);
+        nKernelsEvaluated += result.nEvaluated;
+        dKernelsPerSecond = result.nEvaluated * 1000000.0 / std::max(nTimeElapsed, (int64_t)1);
+        LogPrint("coinstake", "%s: evaluated %u kernels over %u candidates in %.2fms (%.0f kernels/s)\n", __func__,
+            (uint64_t)result.nEvaluated, vCandidates.size() - nStart, nTimeElapsed * 0.001, dKernelsPerSecond);
+    }
+
+    if (result.nCandidate == numeric_limits<size_t>::max())
+        return false;
+
+    nCandidateRet = result.nCandidate;
+    nTimeTxRet = nTimeTx - result.nOffset;
+    return true;
+}
+
+double CStakeKernelSearch::GetKernelsPerSecond() const
+{
+    LOCK(cs_search);
+    return dKernelsPerSecond;
+}
+
+uint64_t CStakeKernelSearch::GetKernelsEvaluated() const
+{
+    LOCK(cs_search);
+    return nKernelsEvaluated;
+}
+
+void ThreadStakeKernelCheck() {
+    RenameThread("kekcoin-stakechk");
+    stakekernelqueue.Thread();
+}
@@ -0,0 +1,197 @@
+// Copyright (c) 2012-2013 The PPCoin developers
+// Copyright (c) 2014 The KekCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef KEKCOIN_KERNEL_H
+#define KEKCOIN_KERNEL_H
+
+#include "primitives/transaction.h"
+#include "stakeindex.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+class CBlockIndex;
+class CChain;
+
+/** Default for -maxstakecachesize, number of kernel inputs kept in memory */
+static const unsigned int DEFAULT_MAX_STAKE_CACHE_SIZE = 100000;
+/** -stakethreads default, number of kernel search threads (0 = one per core) */
+static const int DEFAULT_STAKE_THREADS = 0;
+/** Maximum number of kernel search threads */
+static const int MAX_STAKE_THREADS = 16;
+
+/**
+ * In-memory LRU front-end for the stake index in the block tree database.
+ * Holds the kernel inputs (block time, tx time, tx offset, value, height) of
+ * recently created or recently staked outputs so that kernel checks neither
+ * read the previous transaction nor deserialize the block that contains it.
+ */
+class CStakeKernelCache
+{
+private:
+    typedef std::list<std::pair<COutPoint, CStakeIndexValue> > list_type;
+
+    mutable CCriticalSection cs_stakecache;
+    list_type listEntries; //! most recently used first
+    std::map<COutPoint, list_type::iterator> mapEntries;
+    size_t nMaxSize;
+    uint64_t nGeneration; //! bumped by every Update(), so Get() can tell its read went stale
+
+    void Touch(const COutPoint& outpoint, const CStakeIndexValue& value);
+
+public:
+    CStakeKernelCache(size_t nMaxSizeIn = DEFAULT_MAX_STAKE_CACHE_SIZE);
+
+    void SetMaxSize(size_t nMaxSizeIn);
+
+    //! Look up a kernel input, consulting the block tree database on a miss
+    bool Get(const COutPoint& outpoint, CStakeIndexValue& value);
+
+    //! Mirror a stake index batch; null values erase their outpoint
+    void Update(const std::vector<std::pair<COutPoint, CStakeIndexValue> >& vect);
+
+    void Clear();
+    size_t Size() const;
+};
+
+extern CStakeKernelCache stakeKernelCache;
+
+/**
+ * Fetch the kernel input for prevout as seen from pindexPrev, and optionally
+ * the block that contains it. A cached record is only used if its block is
+ * an ancestor of pindexPrev. Otherwise, and for outputs that predate the
+ * stake index, falls back to the transaction index and block files and
+ * records those still unspent so the next lookup is served from the cache.
+ */
+bool GetStakeKernelInput(const CBlockIndex* pindexPrev, const COutPoint& prevout, CStakeIndexValue& kernelInput, const CBlockIndex** ppindexFrom = NULL);
+
+/**
+ * Height-indexed view of the stake modifiers along the active chain. For
+ * every height it records how many blocks at or below it generated a new
+ * modifier, and it lists those generating blocks in order, so finding the
+ * modifier in force at a height or the next one generated after it needs no
+ * walk through pprev or chainActive.Next(). Protected by cs_main.
+ */
+class CStakeModifierTable
+{
+private:
+    std::vector<int> vGeneratedCount; //! per height: generating blocks at or below it
+    std::vector<const CBlockIndex*> vGenerated;
+    const CBlockIndex* pindexTip;
+
+public:
+    CStakeModifierTable() : pindexTip(NULL) {}
+
+    //! Append pindex if it extends the table tip; Sync() catches up otherwise
+    void Connect(const CBlockIndex* pindex);
+    //! Drop pindex if it is the table tip
+    void Disconnect(const CBlockIndex* pindex);
+    //! Rewind and extend the table until its tip matches chain's
+    void Sync(const CChain& chain);
+    void Clear();
+
+    const CBlockIndex* Tip() const { return pindexTip; }
+
+    //! Last block at or below nHeight that generated a modifier, NULL if none
+    const CBlockIndex* GetLastGenerated(int nHeight) const;
+    //! First block above nHeight that generated a modifier no earlier than nTime, NULL if not yet on the chain
+    const CBlockIndex* GetNextGenerated(int nHeight, int64_t nTime) const;
+};
+
+extern CStakeModifierTable stakeModifierTable;
+
+/** A staking output with everything its kernel check needs, resolved against one chain tip */
+struct CStakeCandidate
+{
+    COutPoint prevout;
+    CStakeIndexValue kernelInput;
+    unsigned int nBitsFrom; //! nBits of the block containing the output
+    uint64_t nStakeModifier;
+
+    CStakeCandidate() : nBitsFrom(0), nStakeModifier(0) {}
+};
+
+/** Position of the first kernel found in a search grid, shared by all slices */
+struct CStakeSearchResult
+{
+    boost::mutex mutex;
+    std::atomic<size_t> nCandidate; //! index into the candidate vector, max() while none found
+    unsigned int nOffset; //! seconds back from nTimeTx, guarded by mutex
+    std::atomic<uint64_t> nEvaluated;
+
+    CStakeSearchResult();
+};
+
+/**
+ * Closure scanning one contiguous slice of the (coin x timestamp) grid. Each
+ * candidate is tried from nTimeTx back through the search interval; the first
+ * kernel of the slice is recorded unless an earlier slice already found one.
+ */
+class CStakeKernelCheck
+{
+private:
+    const std::vector<CStakeCandidate>* pvCandidates;
+    size_t nBegin;
+    size_t nEnd;
+    unsigned int nTimeTx;
+    unsigned int nInterval;
+    CStakeSearchResult* pResult;
+
+public:
+    CStakeKernelCheck() : pvCandidates(NULL), nBegin(0), nEnd(0), nTimeTx(0), nInterval(0), pResult(NULL) {}
+    CStakeKernelCheck(const std::vector<CStakeCandidate>* pvCandidatesIn, size_t nBeginIn, size_t nEndIn, unsigned int nTimeTxIn, unsigned int nIntervalIn, CStakeSearchResult* pResultIn) :
+        pvCandidates(pvCandidatesIn), nBegin(nBeginIn), nEnd(nEndIn), nTimeTx(nTimeTxIn), nInterval(nIntervalIn), pResult(pResultIn) {}
+
+    bool operator()();
+
+    void swap(CStakeKernelCheck& check);
+};
+
+/**
+ * Kernel search engine for the staker. Kernel inputs, depth and stake
+ * modifiers are resolved once per chain tip; afterwards every grid point is a
+ * pure CheckStakeKernel() evaluation, spread over the -stakethreads pool.
+ */
+class CStakeKernelSearch
+{
+private:
+    mutable CCriticalSection cs_search;
+    uint256 hashPrepared; //! tip the cached candidates were resolved against
+    std::map<COutPoint, CStakeCandidate> mapCandidates;
+    std::set<COutPoint> setIneligible;
+    int nThreads;
+    uint64_t nKernelsEvaluated;
+    double dKernelsPerSecond;
+
+public:
+    CStakeKernelSearch();
+
+    void SetThreads(int nThreadsIn);
+
+    //! Resolve vPrevouts against pindexPrev, keeping the order and dropping outputs that cannot stake on it
+    void Prepare(const CBlockIndex* pindexPrev, const std::vector<COutPoint>& vPrevouts, std::vector<CStakeCandidate>& vCandidatesRet);
+
+    //! Find the first kernel in vCandidates[nStart..] x [nTimeTx - nInterval + 1, nTimeTx], candidate-major
+    bool Search(const std::vector<CStakeCandidate>& vCandidates, size_t nStart, unsigned int nTimeTx, unsigned int nInterval, size_t& nCandidateRet, unsigned int& nTimeTxRet);
+
+    //! Kernel evaluation rate of the last search
+    double GetKernelsPerSecond() const;
+    uint64_t GetKernelsEvaluated() const;
+};
+
+extern CStakeKernelSearch stakeKernelSearch;
+
+/** Run an instance of the kernel search thread */
+void ThreadStakeKernelCheck();
+
+#endif // KEKCOIN_KERNEL_H
@@ -8,7 +8,6 @@
 
 #include "addrman.h"
 #include "arith_uint256.h"
-#include "bignum.h"
 #include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -18,10 +17,12 @@
 #include "consensus/validation.h"
 #include "hash.h"
 #include "init.h"
+#include "kernel.h"
 #include "merkleblock.h"
 #include "net.h"
 #include "policy/fees.h"
 #include "policy/policy.h"
+#include "pos.h"
 #include "pow.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
@@ -36,12 +37,14 @@
 #include "undo.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "utxostats.h"
 #include "utilstrencodings.h"
 #include "validationinterface.h"
 #include "versionbits.h"
 #include "wallet/wallet.h"
 
 #include <atomic>
+#include <list>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -75,6 +78,7 @@ bool fReindex = false;
 bool fTxIndex = false;
 bool fAddressIndex = false;
 bool fTimestampIndex = false;
+bool fUTXOStatsIndex = false;
 bool fSpentIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
@@ -83,6 +87,7 @@ bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
+unsigned int nRawBlockCacheSize = DEFAULT_RAW_BLOCK_CACHE;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
@@ -252,6 +257,14 @@ namespace {
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
 
+    /** Whether blocks/index.snapshot matches the block index database. */
+    bool fBlockIndexSnapshotCurrent = false;
+
+    /** UTXO set statistics as of utxoStats.hashBlock, kept with -utxostatsindex; null when unknown. */
+    CUTXOStats utxoStats;
+    /** Where utxoStats is stored along with the chainstate. */
+    CCoinsViewDB* pcoinsdbviewStats = NULL;
+
     /** Number of peers from which we're downloading blocks. */
     int nPeersWithValidatedDownloads = 0;
 
@@ -701,8 +714,10 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
     return chain.Genesis();
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CIndexDB *pindexdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1609,7 +1624,7 @@ bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const
     if (!fTimestampIndex)
         return error("Timestamp index not enabled");
 
-    if (!pblocktree->ReadTimestampIndex(high, low, fActiveOnly, hashes))
+    if (!pindexdb->ReadTimestampIndex(high, low, fActiveOnly, hashes))
         return error("Unable to get hashes for timestamps");
 
     return true;
@@ -1623,7 +1638,7 @@ bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
     if (mempool.getSpentIndex(key, value))
         return true;
 
-    if (!pblocktree->ReadSpentIndex(key, value))
+    if (!pindexdb->ReadSpentIndex(key, value))
         return false;
 
     return true;
@@ -1646,24 +1661,119 @@ bool GetAddressIndex(uint160 addressHash, int type,
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
+    if (!pindexdb->ReadAddressIndex(addressHash, type, addressIndex, start, end))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool GetAddressIndexPage(uint160 addressHash, int type, int start, int end,
+                         const CAddressIndexKey *pkeyAfter, bool fReverse, size_t nLimit,
+                         std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pindexdb->ReadAddressIndexPage(addressHash, type, start, end, pkeyAfter, fReverse, nLimit, addressIndex))
         return error("unable to get txids for address");
 
     return true;
 }
 
+bool GetAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pindexdb->ReadAddressBalanceIndex(addressHash, type, value))
+        value.SetNull();
+
+    return true;
+}
+
 bool GetAddressUnspent(uint160 addressHash, int type,
                        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs)
 {
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+    if (!pindexdb->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+static bool ReadAddressUnspent(const std::vector<std::pair<uint160, int> > &addresses, int minConf, CAmount minValue, bool includeMempool,
+                               std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > &unspentOutputs)
+{
+    int maxHeight = minConf > 0 ? chainActive.Height() - minConf + 1 : std::numeric_limits<int>::max();
+    if (!pindexdb->ReadAddressUnspentIndex(addresses, maxHeight, minValue, unspentOutputs))
         return error("unable to get txids for address");
 
+    if (!includeMempool)
+        return true;
+
+    std::map<std::pair<int, uint160>, size_t> mapFirst;
+    std::vector<std::pair<uint160, int> > mempoolAddresses;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        if (mapFirst.insert(std::make_pair(std::make_pair(addresses[i].second, addresses[i].first), i)).second)
+            mempoolAddresses.push_back(addresses[i]);
+    }
+
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > deltas;
+    mempool.getAddressIndex(mempoolAddresses, deltas);
+
+    std::set<COutPoint> spent;
+    for (std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >::const_iterator it = deltas.begin(); it != deltas.end(); it++) {
+        if (it->first.spending)
+            spent.insert(COutPoint(it->second.prevhash, it->second.prevout));
+    }
+
+    // Drop outputs spent in the mempool and, unless confirmations are required,
+    // add the unspent mempool outputs with a height of -1
+    for (size_t i = 0; i < addresses.size(); i++) {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &outputs = unspentOutputs[i];
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::iterator end = outputs.begin();
+        for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::iterator it = outputs.begin(); it != outputs.end(); it++) {
+            if (!spent.count(COutPoint(it->first.txhash, it->first.index)))
+                *end++ = *it;
+        }
+        outputs.erase(end, outputs.end());
+    }
+
+    if (minConf > 0)
+        return true;
+
+    for (std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >::const_iterator it = deltas.begin(); it != deltas.end(); it++) {
+        const CMempoolAddressDeltaKey &key = it->first;
+        if (key.spending || it->second.amount < minValue || spent.count(COutPoint(key.txhash, key.index)))
+            continue;
+        size_t first = mapFirst[std::make_pair(key.type, key.addressBytes)];
+        CScript script = key.type == 2 ? GetScriptForDestination(CScriptID(key.addressBytes)) : GetScriptForDestination(CKeyID(key.addressBytes));
+        CAddressUnspentKey unspentKey(key.type, key.addressBytes, key.txhash, key.index);
+        for (size_t i = first; i < addresses.size(); i++) {
+            if (addresses[i].second == key.type && addresses[i].first == key.addressBytes)
+                unspentOutputs[i].push_back(std::make_pair(unspentKey, CAddressUnspentValue(it->second.amount, script, -1)));
+        }
+    }
+
     return true;
 }
 
+bool GetAddressUnspent(const std::vector<std::pair<uint160, int> > &addresses, int minConf, CAmount minValue, bool includeMempool,
+                       std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > &unspentOutputs)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    // Hold the chain still while heights are compared or the mempool is merged in
+    if (minConf > 0 || includeMempool) {
+        LOCK(cs_main);
+        return ReadAddressUnspent(addresses, minConf, minValue, includeMempool, unspentOutputs);
+    }
+    return ReadAddressUnspent(addresses, minConf, minValue, includeMempool, unspentOutputs);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1789,6 +1899,70 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+namespace {
+
+/** Most recently served raw blocks, newest first */
+CCriticalSection cs_rawBlockCache;
+std::list<std::pair<uint256, CRawBlockRef> > listRawBlockCache;
+std::map<uint256, std::list<std::pair<uint256, CRawBlockRef> >::iterator> mapRawBlockCache;
+
+} // anon namespace
+
+bool ReadRawBlockFromDisk(CRawBlockRef& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    const uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_rawBlockCache);
+        std::map<uint256, std::list<std::pair<uint256, CRawBlockRef> >::iterator>::iterator it = mapRawBlockCache.find(hash);
+        if (it != mapRawBlockCache.end()) {
+            listRawBlockCache.splice(listRawBlockCache.begin(), listRawBlockCache, it->second);
+            block = it->second->second;
+            return true;
+        }
+    }
+
+    // The block is preceded by the message start and its size, see WriteBlockToDisk
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s: no block header at %s", __func__, pos.ToString());
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - MESSAGE_START_SIZE - sizeof(unsigned int)), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    std::vector<unsigned char> vchBlock;
+    try {
+        unsigned char pchMessageStart[MESSAGE_START_SIZE];
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, messageStart, MESSAGE_START_SIZE))
+            return error("%s: bad message start at %s", __func__, pos.ToString());
+        if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+            return error("%s: bad block size %u at %s", __func__, nSize, pos.ToString());
+        vchBlock.resize(nSize);
+        filein.read((char*)begin_ptr(vchBlock), nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    // The header is the first 80 bytes, so checking the hash needs no deserialization
+    if (Hash(vchBlock.begin(), vchBlock.begin() + 80) != hash)
+        return error("%s: hash doesn't match index for %s at %s", __func__, pindex->ToString(), pos.ToString());
+
+    block = std::make_shared<const std::vector<unsigned char> >(std::move(vchBlock));
+
+    LOCK(cs_rawBlockCache);
+    if (nRawBlockCacheSize > 0 && !mapRawBlockCache.count(hash)) {
+        listRawBlockCache.push_front(std::make_pair(hash, block));
+        mapRawBlockCache[hash] = listRawBlockCache.begin();
+        while (listRawBlockCache.size() > nRawBlockCacheSize) {
+            mapRawBlockCache.erase(listRawBlockCache.back().first);
+            listRawBlockCache.pop_back();
+        }
+    }
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 420 * COIN;
@@ -2225,8 +2399,10 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
+} // anon namespace
+
 /** Abort with a message */
-bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
+bool AbortNode(const std::string& strMessage, const std::string& userMessage)
 {
     strMiscWarning = strMessage;
     LogPrintf("*** %s\n", strMessage);
@@ -2237,12 +2413,45 @@ bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
     return false;
 }
 
+namespace {
+
 bool AbortNode(CValidationState& state, const std::string& strMessage, const std::string& userMessage="")
 {
-    AbortNode(strMessage, userMessage);
+    ::AbortNode(strMessage, userMessage);
     return state.Error(strMessage);
 }
 
+/** Copy the coins of every transaction block creates or spends from, as view has them now */
+void SnapshotBlockCoins(const CBlock& block, CCoinsViewCache& view, std::map<uint256, CCoins>& mapCoins)
+{
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        mapCoins[tx.GetHash()];
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapCoins[txin.prevout.hash];
+    }
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        const CCoins* coins = view.AccessCoins(it->first);
+        if (coins)
+            it->second = *coins;
+    }
+}
+
+/** Move utxoStats to pindexNew by diffing the coins in mapCoinsBefore against view */
+bool UpdateUTXOStats(CValidationState& state, const std::map<uint256, CCoins>& mapCoinsBefore, CCoinsViewCache& view, const CBlockIndex* pindexNew)
+{
+    const CCoins coinsEmpty;
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoinsBefore.begin(); it != mapCoinsBefore.end(); it++) {
+        const CCoins* coins = view.AccessCoins(it->first);
+        utxoStats.UpdateCoins(it->first, it->second, coins ? *coins : coinsEmpty);
+    }
+    utxoStats.hashBlock = pindexNew->GetBlockHash();
+    if (!pblocktree->WriteUTXOStats(utxoStats.hashBlock, utxoStats.GetValue(pindexNew->nHeight)))
+        return AbortNode(state, "Failed to write UTXO set statistics");
+    return true;
+}
+
 } // anon namespace
 
 /**
@@ -2298,15 +2507,27 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
 
+    // VerifyDB disconnects on a scratch view and must leave the statistics alone
+    bool fUpdateUTXOStats = !pfClean && fUTXOStatsIndex && utxoStats.hashBlock == pindex->GetBlockHash();
+    std::map<uint256, CCoins> mapCoinsBefore;
+    if (fUpdateUTXOStats)
+        SnapshotBlockCoins(block, view, mapCoinsBefore);
+
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    std::vector<std::pair<COutPoint, CStakeIndexValue> > stakeIndex;
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
         uint256 hash = tx.GetHash();
 
+        // forget the kernel inputs of the outputs this block created; inputs
+        // restored below are looked up again on demand
+        for (unsigned int k = 0; k < tx.vout.size(); k++)
+            stakeIndex.push_back(make_pair(COutPoint(hash, k), CStakeIndexValue()));
+
 	if (block.IsProofOfStake() && tx.IsCoinStake()) {
 	    continue;
 	}
@@ -2425,14 +2646,18 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     }
 
     if (fAddressIndex) {
-        if (!pblocktree->EraseAddressIndex(addressIndex)) {
+        if (!pindexdb->DisconnectAddressIndex(addressIndex, addressUnspentIndex)) {
             return AbortNode(state, "Failed to delete address index");
         }
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
-        }
     }
 
+    if (!pblocktree->UpdateStakeIndex(stakeIndex))
+        return AbortNode(state, "Failed to delete stake index");
+    stakeKernelCache.Update(stakeIndex);
+
+    if (fUpdateUTXOStats && !UpdateUTXOStats(state, mapCoinsBefore, view, pindex->pprev))
+        return false;
+
     return fClean;
 }
 
@@ -2461,7 +2686,7 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("kekcoin-scriptch");
@@ -2557,8 +2782,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // (its coinbase is unspendable)
 
     if (block.GetHash() == chainparams.GetConsensus().hashGenesisBlock) {
-        if (!fJustCheck)
+        if (!fJustCheck) {
             view.SetBestBlock(pindex->GetBlockHash());
+            if (fUTXOStatsIndex && utxoStats.hashBlock.IsNull() && !UpdateUTXOStats(state, std::map<uint256, CCoins>(), view, pindex))
+                return false;
+        }
         return true;
     }
 
@@ -2707,6 +2935,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    std::vector<std::pair<COutPoint, CStakeIndexValue> > stakeIndex;
+
+    // VerifyDB reconnects on a scratch view, after the statistics have moved on
+    bool fUpdateUTXOStats = !fJustCheck && fUTXOStatsIndex && utxoStats.hashBlock == hashPrevBlock;
+    std::map<uint256, CCoins> mapCoinsBefore;
+    if (fUpdateUTXOStats)
+        SnapshotBlockCoins(block, view, mapCoinsBefore);
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
@@ -2807,7 +3042,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, nScriptCheckThreads ? &vChecks : NULL, nStakeReward))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
-            control.Add(vChecks);
+            // the coinstake decides the block's validity first, so its checks jump the queue
+            control.Add(vChecks, tx.IsCoinStake());
         }
 
         if (fAddressIndex) {
@@ -2839,6 +3075,18 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             }
         }
 
+        // record the kernel inputs of new outputs and drop those being spent
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                stakeIndex.push_back(make_pair(txin.prevout, CStakeIndexValue()));
+        }
+        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+            const CTxOut &out = tx.vout[k];
+            if (out.IsEmpty() || out.scriptPubKey.IsUnspendable())
+                continue;
+            stakeIndex.push_back(make_pair(COutPoint(txhash, k), CStakeIndexValue(pindex->nTime, tx.nTime, pos.nTxOffset, out.nValue, pindex->nHeight, pindex->GetBlockHash())));
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
@@ -2880,6 +3128,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     //     return state.DoS(100, false);
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
+    if (fScriptChecks && nScriptCheckThreads && LogAcceptCategory("bench")) {
+        CCheckQueueStats stats = scriptcheckqueue.GetLastStats();
+        LogPrint("bench", "      - Script checks queued: %s\n", CCheckQueueStats::HistogramToString(stats.vWait));
+        LogPrint("bench", "      - Script checks ran: %s\n", CCheckQueueStats::HistogramToString(stats.vExec));
+    }
 
     if (fJustCheck)
         return true;
@@ -2908,26 +3161,26 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             return AbortNode(state, "Failed to write transaction index");
 
     if (fAddressIndex) {
-        if (!pblocktree->WriteAddressIndex(addressIndex)) {
+        if (!pindexdb->ConnectAddressIndex(addressIndex, addressUnspentIndex)) {
             return AbortNode(state, "Failed to write address index");
         }
-
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
-        }
     }
 
     if (fSpentIndex)
-        if (!pblocktree->UpdateSpentIndex(spentIndex))
+        if (!pindexdb->UpdateSpentIndex(spentIndex))
             return AbortNode(state, "Failed to write transaction index");
 
+    if (!pblocktree->UpdateStakeIndex(stakeIndex))
+        return AbortNode(state, "Failed to write stake index");
+    stakeKernelCache.Update(stakeIndex);
+
     if (fTimestampIndex) {
         unsigned int logicalTS = pindex->nTime;
         unsigned int prevLogicalTS = 0;
 
         // retrieve logical timestamp of the previous block
         if (pindex->pprev)
-            if (!pblocktree->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS))
+            if (!pindexdb->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS))
                 LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
 
         if (logicalTS <= prevLogicalTS) {
@@ -2935,13 +3188,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, pindex->nTime, prevLogicalTS, logicalTS);
         }
 
-        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())))
+        if (!pindexdb->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())))
             return AbortNode(state, "Failed to write timestamp index");
 
-        if (!pblocktree->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
+        if (!pindexdb->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
             return AbortNode(state, "Failed to write blockhash index");
     }
 
+    if (fUpdateUTXOStats && !UpdateUTXOStats(state, mapCoinsBefore, view, pindex))
+        return false;
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2969,6 +3225,26 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 }
 
 
+/** Write the whole block index, in height order, to blocks/index.snapshot */
+static bool WriteBlockIndexSnapshot()
+{
+    int64_t nStart = GetTimeMicros();
+    vector<pair<int, const CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    vector<const CBlockIndex*> vIndex;
+    vIndex.reserve(vSortedByHeight.size());
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+        vIndex.push_back(vSortedByHeight[i].second);
+    if (!pblocktree->WriteBlockIndexSnapshot(vIndex))
+        return false;
+    LogPrint("bench", "    - Block index snapshot of %u entries: %.2fms\n", vIndex.size(), 0.001 * (GetTimeMicros() - nStart));
+    return true;
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
@@ -2982,6 +3258,7 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     static int64_t nLastWrite = 0;
     static int64_t nLastFlush = 0;
     static int64_t nLastSetChain = 0;
+    static int64_t nLastSnapshot = 0;
     std::set<int> setFilesToPrune;
     bool fFlushForPrune = false;
     try {
@@ -3007,9 +3284,17 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     if (nLastSetChain == 0) {
         nLastSetChain = nNow;
     }
+    if (nLastSnapshot == 0) {
+        nLastSnapshot = nNow;
+    }
+
+    // A failed background write of the coin database is reported here
+    if (pcoinsdbview && pcoinsdbview->HasWriteError())
+        return AbortNode(state, "Failed to write to coin database");
 
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
-    int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() * DB_PEAK_USAGE_FACTOR;
+    // Dirty coins still being written in the background count against the limit too
+    int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() * DB_PEAK_USAGE_FACTOR + (pcoinsdbview ? pcoinsdbview->DynamicMemoryUsage() : 0);
     int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
     // The cache is large and we're within 10% and 200 MiB or 50% and 50MiB of the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize > std::min(std::max(nTotalSpace / 2, nTotalSpace - MIN_BLOCK_COINSDB_USAGE * 1024 * 1024),
@@ -3046,6 +3331,14 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
             if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                 return AbortNode(state, "Files to write to block index database");
             }
+            if (!vBlocks.empty())
+                fBlockIndexSnapshotCurrent = false;
+        }
+        // Refresh the block index snapshot on shutdown and now and then. A
+        // failure only costs the next startup its speed.
+        if (!fBlockIndexSnapshotCurrent && (mode == FLUSH_STATE_ALWAYS || nNow > nLastSnapshot + (int64_t)BLOCK_INDEX_SNAPSHOT_INTERVAL * 1000000)) {
+            fBlockIndexSnapshotCurrent = WriteBlockIndexSnapshot();
+            nLastSnapshot = nNow;
         }
         // Finally remove any pruned files
         if (fFlushForPrune)
@@ -3061,9 +3354,18 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
+        // Index records, including those held back by a bulk build, go to disk
+        // first, the chainstate must not get ahead of them
+        if (pindexdb && !pindexdb->Sync())
+            return AbortNode(state, "Failed to write to index database");
         // Flush the chainstate (which may refer to block index entries).
+        if (fUTXOStatsIndex && pcoinsdbviewStats)
+            pcoinsdbviewStats->SetUTXOStats(utxoStats);
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // Explicit flushes are done when they return, whatever the mode
+        if (mode == FLUSH_STATE_ALWAYS && pcoinsdbview && !pcoinsdbview->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -3203,6 +3505,7 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
 
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev, chainparams);
+    stakeModifierTable.Disconnect(pindexDelete);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
@@ -3264,6 +3567,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
     // Update chainActive & related variables.
     UpdateTip(pindexNew, chainparams);
+    stakeModifierTable.Connect(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH(const CTransaction &tx, txConflicted) {
@@ -3611,12 +3915,9 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex) {
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256& hash)
 {
-
-
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
@@ -3650,6 +3951,11 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     return pindexNew;
 }
 
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+{
+    return AddToBlockIndex(block, block.GetHash());
+}
+
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
@@ -4120,11 +4426,11 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+/** hash must be block.GetHash(); callers that hashed the header outside cs_main pass it in */
+static bool AcceptBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -4161,7 +4467,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
     }
 
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -4169,6 +4475,11 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
     return true;
 }
 
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+{
+    return AcceptBlockHeader(block, block.GetHash(), state, chainparams, ppindex);
+}
+
 /** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
 static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
 {
@@ -4495,23 +4806,40 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
-        return false;
+    int64_t nTimeStart = GetTimeMicros();
+
+    // The snapshot comes in height order with parents resolved; the database
+    // needs a lookup per parent and a sort afterwards.
+    vector<CBlockIndex*> vSortedByHeight;
+    fBlockIndexSnapshotCurrent = pblocktree->LoadBlockIndexSnapshot(InsertBlockIndex, vSortedByHeight);
+    if (!fBlockIndexSnapshotCurrent) {
+        // drop whatever a damaged snapshot had inserted already
+        BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex)
+            delete entry.second;
+        mapBlockIndex.clear();
+
+        if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+            return false;
+
+        vector<pair<int, CBlockIndex*> > vHeights;
+        vHeights.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            vHeights.push_back(make_pair(item.second->nHeight, item.second));
+        sort(vHeights.begin(), vHeights.end());
+        vSortedByHeight.clear();
+        vSortedByHeight.reserve(vHeights.size());
+        for (unsigned int i = 0; i < vHeights.size(); i++)
+            vSortedByHeight.push_back(vHeights[i].second);
+    }
+    int64_t nTimeRead = GetTimeMicros();
+    LogPrintf("%s: read %u block index entries from the %s in %.2fms\n", __func__, vSortedByHeight.size(),
+        fBlockIndexSnapshotCurrent ? "snapshot" : "database", 0.001 * (nTimeRead - nTimeStart));
 
     boost::this_thread::interruption_point();
 
     // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
@@ -4536,6 +4864,8 @@ bool static LoadBlockIndexDB()
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    int64_t nTimeLink = GetTimeMicros();
+    LogPrintf("%s: linked the block index in %.2fms\n", __func__, 0.001 * (nTimeLink - nTimeRead));
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -4571,6 +4901,7 @@ bool static LoadBlockIndexDB()
             return false;
         }
     }
+    LogPrintf("%s: loaded block file info in %.2fms\n", __func__, 0.001 * (GetTimeMicros() - nTimeLink));
 
     // Check whether we have ever pruned block & undo files
     pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
@@ -4590,6 +4921,18 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("addressindex", fAddressIndex);
     LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
 
+    // Build the address balances of an address index that predates them
+    if (fAddressIndex && !fReindex) {
+        bool fAddressBalanceIndex = false;
+        pblocktree->ReadFlag("addressbalanceindex", fAddressBalanceIndex);
+        if (!fAddressBalanceIndex) {
+            LogPrintf("%s: building address balance index...\n", __func__);
+            if (!pindexdb->RebuildAddressBalanceIndex())
+                return error("%s: failed to build address balance index", __func__);
+            pblocktree->WriteFlag("addressbalanceindex", true);
+        }
+    }
+
     // Check whether we have a timestamp index
     pblocktree->ReadFlag("timestampindex", fTimestampIndex);
     LogPrintf("%s: timestamp index %s\n", __func__, fTimestampIndex ? "enabled" : "disabled");
@@ -4823,6 +5166,8 @@ void UnloadBlockIndex()
     setDirtyFileInfo.clear();
     mapNodeState.clear();
     recentRejects.reset(NULL);
+    stakeKernelCache.Clear();
+    stakeModifierTable.Clear();
     versionbitscache.Clear();
     for (int b = 0; b < VERSIONBITS_NUM_BITS; b++) {
         warningcache[b].clear();
@@ -4833,6 +5178,8 @@ void UnloadBlockIndex()
     }
     mapBlockIndex.clear();
     fHavePruned = false;
+    utxoStats.SetNull();
+    pcoinsdbviewStats = NULL;
 }
 
 bool LoadBlockIndex()
@@ -4843,6 +5190,44 @@ bool LoadBlockIndex()
     return true;
 }
 
+bool LoadUTXOStats(CCoinsViewDB* pcoinsdbviewIn)
+{
+    LOCK(cs_main);
+    pcoinsdbviewStats = pcoinsdbviewIn;
+    LogPrintf("%s: UTXO set statistics index %s\n", __func__, fUTXOStatsIndex ? "enabled" : "disabled");
+    if (!fUTXOStatsIndex || chainActive.Tip() == NULL)
+        return true;
+
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (utxoStats.hashBlock == pindexTip->GetBlockHash())
+        return true;
+    if (pcoinsdbviewStats->GetUTXOStats(utxoStats) && utxoStats.hashBlock == pindexTip->GetBlockHash()) {
+        LogPrintf("%s: UTXO set statistics at height %d\n", __func__, pindexTip->nHeight);
+        return true;
+    }
+
+    // Missing or left behind while the index was off: start over from the coin database
+    int64_t nStart = GetTimeMillis();
+    uiInterface.InitMessage(_("Computing UTXO set statistics..."));
+    CValidationState state;
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+        return false;
+    if (!ScanUTXOStats(pcoinsdbviewStats, utxoStats))
+        return false;
+    if (utxoStats.hashBlock != pindexTip->GetBlockHash())
+        return error("%s: coin database is not at the active tip", __func__);
+    if (!pblocktree->WriteUTXOStats(utxoStats.hashBlock, utxoStats.GetValue(pindexTip->nHeight)))
+        return error("%s: failed to write UTXO set statistics", __func__);
+    pcoinsdbviewStats->SetUTXOStats(utxoStats);
+    LogPrintf("%s: computed UTXO set statistics at height %d in %dms\n", __func__, pindexTip->nHeight, GetTimeMillis() - nStart);
+    return FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+}
+
+bool GetUTXOStatsForBlock(const CBlockIndex* pindex, CUTXOStatsValue& value)
+{
+    return fUTXOStatsIndex && pblocktree->ReadUTXOStats(pindex->GetBlockHash(), value) && value.nHeight == pindex->nHeight;
+}
+
 bool InitBlockIndex(const CChainParams& chainparams)
 {
     LOCK(cs_main);
@@ -4862,6 +5247,7 @@ bool InitBlockIndex(const CChainParams& chainparams)
     // Use the provided setting for -addressindex in the new database
     fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
     pblocktree->WriteFlag("addressindex", fAddressIndex);
+    pblocktree->WriteFlag("addressbalanceindex", fAddressIndex);
     LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
 
     // Use the provided setting for -timestampindex in the new database
@@ -4903,6 +5289,217 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
+bool DropIndexes()
+{
+    LOCK(cs_main);
+
+    // The flag goes first, records left by an interrupted drop are erased before the index is built again
+    if (fAddressIndex && !GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) {
+        LogPrintf("%s: dropping address index\n", __func__);
+        if (!pblocktree->WriteFlag("addressindex", false) || !pblocktree->WriteFlag("addressbalanceindex", false))
+            return false;
+        fAddressIndex = false;
+        if (!pindexdb->DropAddressIndex())
+            return false;
+    }
+
+    if (fSpentIndex && !GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) {
+        LogPrintf("%s: dropping spent index\n", __func__);
+        if (!pblocktree->WriteFlag("spentindex", false))
+            return false;
+        fSpentIndex = false;
+        if (!pindexdb->DropSpentIndex())
+            return false;
+    }
+
+    if (fTimestampIndex && !GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX)) {
+        LogPrintf("%s: dropping timestamp index\n", __func__);
+        if (!pblocktree->WriteFlag("timestampindex", false))
+            return false;
+        fTimestampIndex = false;
+        if (!pindexdb->DropTimestampIndex())
+            return false;
+    }
+
+    return true;
+}
+
+/** Address type and hash the address index files an output script under, or 0 if it has none */
+static int GetAddressIndexType(const CScript& script, uint160& hashBytes)
+{
+    if (script.IsPayToScriptHash()) {
+        hashBytes = uint160(vector<unsigned char>(script.begin()+2, script.begin()+22));
+        return 2;
+    }
+    if (script.IsPayToPublicKeyHash()) {
+        hashBytes = uint160(vector<unsigned char>(script.begin()+3, script.begin()+23));
+        return 1;
+    }
+    hashBytes.SetNull();
+    return 0;
+}
+
+/** Write the records of the indexes being built for one block of the active chain */
+static bool BuildIndexesForBlock(const CChainParams& chainparams, const CBlockIndex* pindex, bool fBuildAddressIndex,
+                                 bool fBuildSpentIndex, bool fBuildTimestampIndex, unsigned int& prevLogicalTS)
+{
+    if (fBuildTimestampIndex) {
+        unsigned int logicalTS = std::max(pindex->nTime, prevLogicalTS + 1);
+        if (!pindexdb->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())) ||
+            !pindexdb->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
+            return error("%s: failed to write timestamp index", __func__);
+        prevLogicalTS = logicalTS;
+    }
+    if (!fBuildAddressIndex && !fBuildSpentIndex)
+        return true;
+
+    // The outputs a block spends are in its undo data
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+        return error("%s: failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+    CBlockUndo blockUndo;
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    if (pos.IsNull() || !UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
+        return error("%s: failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+    if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
+        return error("%s: block and undo data of %s inconsistent", __func__, pindex->GetBlockHash().ToString());
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+
+    // The same records ConnectBlock writes, in the same order
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = block.vtx[i];
+        const uint256 txhash = tx.GetHash();
+        uint160 hashBytes;
+
+        if (!tx.IsCoinBase()) {
+            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return error("%s: transaction and undo data of %s inconsistent", __func__, txhash.ToString());
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CTxIn &input = tx.vin[j];
+                const CTxOut &prevout = txundo.vprevout[j].txout;
+                int addressType = GetAddressIndexType(prevout.scriptPubKey, hashBytes);
+                if (fBuildAddressIndex && addressType > 0) {
+                    addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), prevout.nValue * -1));
+                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
+                }
+                if (fBuildSpentIndex)
+                    spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevout.nValue, addressType, hashBytes)));
+            }
+        }
+
+        if (fBuildAddressIndex) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut &out = tx.vout[k];
+                int addressType = GetAddressIndexType(out.scriptPubKey, hashBytes);
+                if (addressType == 0)
+                    continue;
+                addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, k, false), out.nValue));
+                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
+    }
+
+    if (fBuildAddressIndex && !pindexdb->ConnectAddressIndex(addressIndex, addressUnspentIndex))
+        return error("%s: failed to write address index", __func__);
+    if (fBuildSpentIndex && !pindexdb->UpdateSpentIndex(spentIndex))
+        return error("%s: failed to write spent index", __func__);
+    return true;
+}
+
+bool BuildIndexes(const CChainParams& chainparams)
+{
+    bool fBuildAddressIndex = !fAddressIndex && GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
+    bool fBuildSpentIndex = !fSpentIndex && GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    bool fBuildTimestampIndex = !fTimestampIndex && GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
+    if (!fBuildAddressIndex && !fBuildSpentIndex && !fBuildTimestampIndex)
+        return true;
+
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = chainActive.Height();
+    }
+    LogPrintf("%s: building%s%s%s from %d blocks\n", __func__, fBuildAddressIndex ? " address index" : "",
+        fBuildSpentIndex ? " spent index" : "", fBuildTimestampIndex ? " timestamp index" : "", nHeight);
+    int64_t nStart = GetTimeMillis();
+
+    // cs_main is only held for a chunk of blocks at a time. Blocks connected in between are
+    // built by a later chunk, and the indexes are switched on once the build has caught up.
+    // A reorg below the blocks built so far starts the build over.
+    const CBlockIndex* pindexLast = NULL;
+    unsigned int prevLogicalTS = 0;
+    bool fRestart = true;
+    while (true) {
+        if (fRestart) {
+            // Start over from whatever an interrupted build left behind
+            pindexdb->SetBulkMode(false);
+            if ((fBuildAddressIndex && !pindexdb->DropAddressIndex()) ||
+                (fBuildSpentIndex && !pindexdb->DropSpentIndex()) ||
+                (fBuildTimestampIndex && !pindexdb->DropTimestampIndex()))
+                return error("%s: failed to clear indexes", __func__);
+            pindexdb->SetBulkMode(true);
+            pindexLast = NULL;
+            prevLogicalTS = 0;
+            fRestart = false;
+        }
+        if (ShutdownRequested()) {
+            pindexdb->SetBulkMode(false);
+            LogPrintf("%s: interrupted at height %d, the indexes are built again on the next start\n", __func__,
+                pindexLast ? pindexLast->nHeight : 0);
+            return true;
+        }
+
+        LOCK(cs_main);
+        if (pindexLast && !chainActive.Contains(pindexLast)) {
+            LogPrintf("%s: block %s was disconnected, starting over\n", __func__, pindexLast->GetBlockHash().ToString());
+            fRestart = true;
+            continue;
+        }
+
+        // The genesis block is never connected, so it has no index records
+        const CBlockIndex* pindex = pindexLast ? chainActive.Next(pindexLast) : chainActive[1];
+        if (!pindex) {
+            // Caught up with the tip: the indexes are switched on before cs_main is released,
+            // so ConnectBlock and DisconnectBlock keep them from the next block on
+            pindexdb->SetBulkMode(false);
+            if (fBuildAddressIndex) {
+                if (!pblocktree->WriteFlag("addressindex", true) || !pblocktree->WriteFlag("addressbalanceindex", true))
+                    return false;
+                fAddressIndex = true;
+            }
+            if (fBuildSpentIndex) {
+                if (!pblocktree->WriteFlag("spentindex", true))
+                    return false;
+                fSpentIndex = true;
+            }
+            if (fBuildTimestampIndex) {
+                if (!pblocktree->WriteFlag("timestampindex", true))
+                    return false;
+                fTimestampIndex = true;
+            }
+            break;
+        }
+        for (int n = 0; pindex && n < BUILD_INDEXES_CHUNK_SIZE; pindex = chainActive.Next(pindex), n++) {
+            if (pindex->nHeight % 10000 == 0)
+                LogPrintf("%s: at height %d\n", __func__, pindex->nHeight);
+            if (!BuildIndexesForBlock(chainparams, pindex, fBuildAddressIndex, fBuildSpentIndex, fBuildTimestampIndex, prevLogicalTS))
+                return false;
+            pindexLast = pindex;
+        }
+    }
+
+    LogPrintf("%s: built indexes in %dms\n", __func__, GetTimeMillis() - nStart);
+
+    // Compacting takes a while, so it is done without cs_main
+    if (!ShutdownRequested())
+        pindexdb->Compact();
+    return true;
+}
+
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
@@ -5348,45 +5945,58 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_FILTERED_BLOCK)
+                    // Full blocks go out as stored on disk when that is already the
+                    // wire format: always with witnesses, and without them for
+                    // blocks that cannot carry any.
+                    bool fPlainBlock = inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK;
+                    CRawBlockRef rawBlock;
+                    if ((inv.type == MSG_WITNESS_BLOCK || (fPlainBlock && !(mi->second->nStatus & BLOCK_OPT_WITNESS))) &&
+                        ReadRawBlockFromDisk(rawBlock, mi->second, Params().MessageStart()))
                     {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
-                        {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
-                        }
-                        // else
-                            // no response
+                        pfrom->PushMessage(NetMsgType::BLOCK, CFlatData((void*)begin_ptr(*rawBlock), (void*)end_ptr(*rawBlock)));
                     }
-                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    else
                     {
-                        // If a peer is asking for old blocks, we're almost guaranteed
-                        // they wont have a useful mempool to match against a compact block,
-                        // and we dont feel like constructing the object for them, so
-                        // instead we respond with the full, non-compact block.
-//                        if (mi->second->nHeight >= chainActive.Height() - 10) {
-//                            CBlockHeaderAndShortTxIDs cmpctblock(block);
-//                            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
-//                        } else
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                            assert(!"cannot load block from disk");
+                        if (inv.type == MSG_BLOCK)
                             pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+                        else if (inv.type == MSG_WITNESS_BLOCK)
+                            pfrom->PushMessage(NetMsgType::BLOCK, block);
+                        else if (inv.type == MSG_FILTERED_BLOCK)
+                        {
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter)
+                            {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                                    pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                            }
+                            // else
+                                // no response
+                        }
+                        else if (inv.type == MSG_CMPCT_BLOCK)
+                        {
+                            // If a peer is asking for old blocks, we're almost guaranteed
+                            // they wont have a useful mempool to match against a compact block,
+                            // and we dont feel like constructing the object for them, so
+                            // instead we respond with the full, non-compact block.
+    //                        if (mi->second->nHeight >= chainActive.Height() - 10) {
+    //                            CBlockHeaderAndShortTxIDs cmpctblock(block);
+    //                            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
+    //                        } else
+                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+                        }
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
@@ -6340,6 +6950,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Hash the whole batch before taking cs_main, so the lock is only
+        // held for the index lookups and insertions.
+        int64_t nTimeStart = GetTimeMicros();
+        std::vector<uint256> vHashes(nCount);
+        for (unsigned int n = 0; n < nCount; n++)
+            vHashes[n] = headers[n].GetHash();
+        int64_t nTimeHashed = GetTimeMicros();
+
         {
         LOCK(cs_main);
 
@@ -6362,14 +6980,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             nodestate->nUnconnectingHeaders++;
             pfrom->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(pindexBestHeader), uint256());
             LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
-                    headers[0].GetHash().ToString(),
+                    vHashes[0].ToString(),
                     headers[0].hashPrevBlock.ToString(),
                     pindexBestHeader->nHeight,
                     pfrom->id, nodestate->nUnconnectingHeaders);
             // Set hashLastUnknownBlock for this peer, so that if we
             // eventually get the headers - even from a different peer -
             // we can use this peer to download.
-            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            UpdateBlockAvailability(pfrom->GetId(), vHashes.back());
 
             if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
                 Misbehaving(pfrom->GetId(), 20);
@@ -6378,15 +6996,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        int64_t nTimeLocked = GetTimeMicros();
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlock& header, headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlock& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            CBlockHeader pblockheader = CBlockHeader(header);
-            if (!AcceptBlockHeader(pblockheader, state, chainparams, &pindexLast)) {
+            if (!AcceptBlockHeader(header, vHashes[n], state, chainparams, &pindexLast)) {
 
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
@@ -6404,6 +7023,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         assert(pindexLast);
         UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+        int64_t nTimeAccepted = GetTimeMicros();
+        LogPrint("bench", "  - %u headers from peer=%d: hash %.2fms, wait for cs_main %.2fms, accept %.2fms\n", nCount, pfrom->id,
+            0.001 * (nTimeHashed - nTimeStart), 0.001 * (nTimeLocked - nTimeHashed), 0.001 * (nTimeAccepted - nTimeLocked));
 
         if (nCount == MAX_HEADERS_RESULTS) {
             // Headers message had its maximum size; the peer may have more headers.
@@ -7406,7 +8028,7 @@ unsigned int ComputedMinStake(unsigned int nBase, int64_t nTime, unsigned int nB
 
 bool TransactionGetCoinAge(CTransaction& transaction, uint64_t& nCoinAge)
 {
-    CBigNum bnCentSecond = 0;  // coin age in the unit of cent-seconds
+    arith_uint256 bnCentSecond = 0;  // coin age in the unit of cent-seconds
     nCoinAge = 0;
 
     if (transaction.IsCoinBase())
@@ -7414,36 +8036,27 @@ bool TransactionGetCoinAge(CTransaction& transaction, uint64_t& nCoinAge)
 
     BOOST_FOREACH(const CTxIn& txin, transaction.vin)
     {
-        // First try finding the previous transaction in database
-        CTransaction txPrev;
-        uint256 hashBlock = uint256();
-
-        if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
+        // Look up the previous output's block and transaction times
+        CStakeIndexValue kernelInput;
+        if (!GetStakeKernelInput(chainActive.Tip(), txin.prevout, kernelInput))
             continue;  // previous transaction not in main chain
 
-        // Read block header
-        CBlock block;
-        if (!mapBlockIndex.count(hashBlock))
-            return false; // unable to read block of previous transaction
-	if (!ReadBlockFromDisk(block, mapBlockIndex[hashBlock], Params().GetConsensus()))
-            return false; // unable to read block of previous transaction
-        if (block.nTime + Params().GetConsensus().nStakeMinAge > transaction.nTime)
+        if (kernelInput.nBlockTime + Params().GetConsensus().nStakeMinAge > transaction.nTime)
             continue; // only count coins meeting min age requirement
 
-        if (transaction.nTime != 0 && transaction.nTime < txPrev.nTime)
+        if (transaction.nTime != 0 && transaction.nTime < kernelInput.nTxTime)
             return false;  // Transaction timestamp violation
 
-        int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-        int64_t nTimeWeight = GetCoinAgeWeight(txPrev.nTime, transaction.nTime);
-        bnCentSecond += CBigNum(nValueIn) * nTimeWeight / CENT;
+        int64_t nValueIn = kernelInput.nValue;
+        int64_t nTimeWeight = GetCoinAgeWeight(kernelInput.nTxTime, transaction.nTime);
+        bnCentSecond += GetCoinAgeCentSeconds(nValueIn, nTimeWeight);
 
-        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, transaction.nTime - txPrev.nTime, bnCentSecond.ToString());
+        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, transaction.nTime - kernelInput.nTxTime, bnCentSecond.ToString());
     }
 
 
-    CBigNum bnCoinDay = ((bnCentSecond * CENT) / COIN) / (24 * 60 * 60);
-    LogPrint("coinage", "coin age bnCoinDay=%s\n", bnCoinDay.ToString());
-    nCoinAge = bnCoinDay.getuint64();
+    nCoinAge = GetCoinAgeCoinDays(bnCentSecond);
+    LogPrint("coinage", "coin age bnCoinDay=%d\n", nCoinAge);
 
     return true;
 }
@@ -7465,6 +8078,11 @@ static bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModi
 {
     if (!pindex)
         return error("GetLastStakeModifier: null pindex");
+    stakeModifierTable.Sync(chainActive);
+    if (chainActive.Contains(pindex)) {
+        const CBlockIndex* pindexGenerated = stakeModifierTable.GetLastGenerated(pindex->nHeight);
+        pindex = pindexGenerated ? pindexGenerated : chainActive.Genesis();
+    }
     while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier())
         pindex = pindex->pprev;
     if (!pindex->GeneratedStakeModifier()){
@@ -7493,51 +8111,60 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
-// select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
+// compute the selection hash of a candidate block by hashing its proof-hash
+// and the previous proof-of-stake modifier
+static uint256 GetStakeModifierSelectionHash(const CBlockIndex* pindex, uint64_t nStakeModifierPrev)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << ArithToUint256(pindex->hashProof) << nStakeModifierPrev;
+    uint256 hashSelection = ss.GetHash();
+
+    // the selection hash is divided by 2**32 so that proof-of-stake block
+    // is always favored over proof-of-work block. this is to preserve
+    // the energy efficiency property
+    if (pindex->IsProofOfStake())
+        hashSelection = ArithToUint256(UintToArith256(hashSelection) >> 32);
+    return hashSelection;
+}
+
+// a candidate block for the stake modifier, ordered by timestamp and then hash
+struct CStakeModifierCandidate
+{
+    int64_t nTime;
+    uint256 hash;
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+
+    CStakeModifierCandidate(const CBlockIndex* pindexIn) : nTime(pindexIn->GetBlockTime()), hash(pindexIn->GetBlockHash()), pindex(pindexIn) {}
+
+    bool operator<(const CStakeModifierCandidate& other) const
+    {
+        return nTime < other.nTime || (nTime == other.nTime && hash < other.hash);
+    }
+};
+
+// select a block from the candidate blocks in vCandidates, excluding
+// already selected blocks in vSelected, and with timestamp up to
 // nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+static bool SelectBlockFromCandidates(const vector<CStakeModifierCandidate>& vCandidates, const vector<bool>& vSelected,
+    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, size_t& nSelected)
 {
     bool fSelected = false;
-    uint256 hashBest = uint256();
-    *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    for (size_t i = 0; i < vCandidates.size(); i++)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop){
-            LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s index=%d proofhash=%s nStakeModifierPrev=%08x\n", hashBest.ToString(), pindex->nHeight, pindex->hashProof.ToString(), nStakeModifierPrev);
+        const CStakeModifierCandidate& candidate = vCandidates[i];
+        if (fSelected && candidate.nTime > nSelectionIntervalStop) {
+            LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s index=%d proofhash=%s nStakeModifierPrev=%08x\n", vCandidates[nSelected].hashSelection.ToString(), candidate.pindex->nHeight, candidate.pindex->hashProof.ToString(), nStakeModifierPrev);
             break;
-
         }
 
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (vSelected[i])
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        CDataStream ss(SER_GETHASH, 0);
-        ss << ArithToUint256(pindex->hashProof) << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-
-
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection = ArithToUint256(UintToArith256(hashSelection) >> 32);
 
-        if (fSelected && hashSelection < hashBest)
-        {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
-        else if (!fSelected)
+        if (!fSelected || candidate.hashSelection < vCandidates[nSelected].hashSelection)
         {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            nSelected = i;
         }
     }
     return fSelected;
@@ -7576,8 +8203,8 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
-    vSortedByTimestamp.reserve(64 * nModifierInterval / Params().GetConsensus().nBitcoinTargetSpacing);
+    vector<CStakeModifierCandidate> vCandidates;
+    vCandidates.reserve(64 * nModifierInterval / Params().GetConsensus().nBitcoinTargetSpacing);
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     LogPrint("stakemodifier", "nSelectionInterval = %d nSelectionIntervalStart = %d\n",nSelectionInterval,nSelectionIntervalStart);
@@ -7585,28 +8212,35 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        vCandidates.push_back(CStakeModifierCandidate(pindex));
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
-    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+    reverse(vCandidates.begin(), vCandidates.end());
+    sort(vCandidates.begin(), vCandidates.end());
+
+    // The selection hashes only depend on the previous modifier, so every
+    // round compares the same ones
+    for (size_t i = 0; i < vCandidates.size(); i++)
+        vCandidates[i].hashSelection = GetStakeModifierSelectionHash(vCandidates[i].pindex, nStakeModifier);
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
-    for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
+    vector<bool> vSelected(vCandidates.size(), false);
+    for (int nRound=0; nRound<min(64, (int)vCandidates.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        size_t nSelected = 0;
+        if (!SelectBlockFromCandidates(vCandidates, vSelected, nSelectionIntervalStop, nStakeModifier, nSelected))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
+        pindex = vCandidates[nSelected].pindex;
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
         // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        vSelected[nSelected] = true;
         LogPrint("stakemodifier", "ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nSelectionIntervalStop), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
 
@@ -7624,11 +8258,14 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        for (size_t i = 0; i < vCandidates.size(); i++)
         {
+            if (!vSelected[i])
+                continue;
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            const CBlockIndex* pindexSelected = vCandidates[i].pindex;
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake()? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap);
     }
@@ -7649,26 +8286,39 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
     return Hash(ss.begin(), ss.end());
 }
 
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernel(unsigned int nBits, const CStakeIndexValue& kernelInput, unsigned int nTimeTx, const arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake)
 {
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
-    unsigned int nTimeTxPrev = txPrev.nTime;
+    unsigned int nTimeBlockFrom = kernelInput.nBlockTime;
+    unsigned int nTimeTxPrev = kernelInput.nTxTime;
 
     if (nTimeTxPrev == 0)
 	nTimeTxPrev = nTimeBlockFrom;
 
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < kernelInput.nTxTime)  // Transaction timestamp violation
+        return false;
+
+    if (nTimeBlockFrom + Params().GetConsensus().nStakeMinAge > nTimeTx)
+        return false;
+
+    // Now check if proof-of-stake hash meets target protocol
+    return CheckStakeTarget(nBits, kernelInput.nValue, GetCoinAgeWeight((int64_t)nTimeTxPrev, (int64_t)nTimeTx), hashProofOfStake, targetProofOfStake);
+}
+
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, const CStakeIndexValue& kernelInput, unsigned int nTxPrevOffset, const COutPoint& prevout, unsigned int nTimeTx, arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    unsigned int nTimeBlockFrom = kernelInput.nBlockTime;
+    unsigned int nTimeTxPrev = kernelInput.nTxTime;
+
+    if (nTimeTxPrev == 0)
+	nTimeTxPrev = nTimeBlockFrom;
+
+    if (nTimeTx < kernelInput.nTxTime)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     if (nTimeBlockFrom + Params().GetConsensus().nStakeMinAge > nTimeTx)
 	return error("CheckStakeKernelHash() : min age violation");
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    uint256 hashBlockFrom = blockFrom.GetHash();
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetCoinAgeWeight((int64_t)nTimeTxPrev, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
-    targetProofOfStake = UintToArith256((bnCoinDayWeight * bnTargetPerCoinDay).getuint256());
+    uint256 hashBlockFrom = pindexFrom->GetBlockHash();
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
@@ -7686,7 +8336,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << prevout.n << nTimeTx;
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(ArithToUint256(hashProofOfStake)) > bnCoinDayWeight * bnTargetPerCoinDay) {
+    if (!CheckStakeKernel(nBits, kernelInput, nTimeTx, hashProofOfStake, targetProofOfStake)) {
       LogPrintf("Proof-Of-Stake hash doesnt meet target protocol");
       return false;
     }
@@ -7699,7 +8349,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
             DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nTimeBlockFrom));
         LogPrint("stakemodifier","CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, kernelInput.nTxTime, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -7715,9 +8365,9 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    CTransaction txPrev;
-    uint256 hashBlock = uint256();
-    if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
+    CStakeIndexValue kernelInput;
+    const CBlockIndex* pindexFrom = NULL;
+    if (!GetStakeKernelInput(pindexPrev, txin.prevout, kernelInput, &pindexFrom))
         return error("CheckProofOfStake() : INFO: read txPrev failed %s",txin.prevout.hash.GetHex());  // previous transaction not in main chain, may occur during initial download
 
     if (pvChecks)
@@ -7751,21 +8401,7 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned
     if (nSpendHeight - coins->nHeight < Params().GetConsensus().nCoinbaseMaturityV1 - 1  && nSpendHeight - coins->nHeight > 0)
 	return error("CheckProofOfStake(): tried to stake at depth %d", nSpendHeight - coins->nHeight);
 
-    if (mapBlockIndex.count(hashBlock) == 0)
-        return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
-
-    CBlockIndex* pblockindex = mapBlockIndex[hashBlock];
-
-    if (txin.prevout.hash != txPrev.GetHash())
-        return error("CheckProofOfStake(): Coinstake input does not match previous output %s",txin.prevout.hash.GetHex());
-
-    // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-	return error("CheckProofOfStake() : Failed to read block from disk");
-
-
-    if (!CheckStakeKernelHash(block.nBits, block, txin.prevout.n, txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(pindexFrom->nBits, pindexFrom, kernelInput, txin.prevout.n, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
         return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s", tx.GetHash().ToString(), hashProofOfStake.ToString()); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -7781,20 +8417,12 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 {
     arith_uint256 hashProofOfStake, targetProofOfStake;
 
-    CTransaction txPrev;
-    uint256 hashBlock = uint256();
-    if (!GetTransaction(prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true)){
+    CStakeIndexValue kernelInput;
+    if (!GetStakeKernelInput(pindexPrev, prevout, kernelInput)){
         LogPrintf("CheckKernel : Could not find previous transaction %s\n",prevout.hash.ToString());
         return false;
     }
 
-    if (mapBlockIndex.count(hashBlock) == 0){
-        LogPrintf("CheckKernel : Could not find block of previous transaction %s\n",hashBlock.ToString());
-        return false;
-    }
-
-    CBlockIndex* pblockindex = mapBlockIndex[hashBlock];
-
     // if (pblockindex->GetBlockTime() + nStakeMinAge > nTime){
     //   LogPrintf("CheckKernel : CreateCoinStake selected coins which do not meet min age requirement.\n");
     //     return false;
@@ -7814,16 +8442,11 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     }
    
     if (pBlockTime)
-        *pBlockTime = pblockindex->GetBlockTime();
+        *pBlockTime = kernelInput.nBlockTime;
 
     if (!pwalletMain->mapWallet.count(prevout.hash))
         return("CheckProofOfStake(): Couldn't get Tx Index");
 
-    // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-	return("CheckProofOfStake() : Failed to read block from disk");
-
     //return CheckStakeKernelHash(nBits, block, txin.prevout.n, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake, false);
     //return CheckStakeKernelHash(pindexPrev, nBits, block, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
     return true;
@@ -7920,6 +8543,18 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
     const CBlockIndex* pindex = pindexFrom;
+    // jump straight to the first modifier generated a selection interval later
+    stakeModifierTable.Sync(chainActive);
+    if (chainActive.Contains(pindexFrom)) {
+        const CBlockIndex* pindexGenerated = stakeModifierTable.GetNextGenerated(pindexFrom->nHeight, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+        if (pindexGenerated) {
+            nStakeModifierHeight = pindexGenerated->nHeight;
+            nStakeModifierTime = pindexGenerated->GetBlockTime();
+            nStakeModifier = pindexGenerated->nStakeModifier;
+            return true;
+        }
+        pindex = chainActive.Tip();
+    }
     // loop to find the stake modifier later by a selection interval
     while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
     {
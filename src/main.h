@@ -19,6 +19,7 @@
 #include "sync.h"
 #include "versionbits.h"
 #include "spentindex.h"
+#include "stakeindex.h"
 #include "addressindex.h"
 #include "timestampindex.h"
 #include "wallet/walletdb.h"
@@ -29,6 +30,7 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -43,6 +45,8 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewDB;
+class CIndexDB;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
@@ -50,6 +54,7 @@ class CValidationInterface;
 class CValidationState;
 
 struct CNodeStateStats;
+struct CUTXOStatsValue;
 struct LockPoints;
 
 /** Default for DEFAULT_WHITELISTRELAY. */
@@ -107,6 +112,10 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Time to wait (in seconds) between rewriting the block index snapshot while running; it is also written on shutdown. */
+static const unsigned int BLOCK_INDEX_SNAPSHOT_INTERVAL = 6 * 60 * 60;
+/** Number of blocks BuildIndexes handles per hold of cs_main. */
+static const int BUILD_INDEXES_CHUNK_SIZE = 1000;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -139,9 +148,13 @@ static const bool DEFAULT_TXINDEX = false;
 static const bool DEFAULT_ADDRESSINDEX = false;
 static const bool DEFAULT_TIMESTAMPINDEX = false;
 static const bool DEFAULT_SPENTINDEX = false;
+static const bool DEFAULT_UTXOSTATSINDEX = false;
 static const unsigned int DEFAULT_DB_MAX_OPEN_FILES = 1000;
 static const bool DEFAULT_DB_COMPRESSION = true;
+static const bool DEFAULT_DB_SHARE_CACHE = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
+/** Default for -rawblockcache, the number of recently served serialized blocks kept in memory */
+static const unsigned int DEFAULT_RAW_BLOCK_CACHE = 16;
 
 static const bool DEFAULT_TESTSAFEMODE = false;
 /** Default for -mempoolreplacement */
@@ -180,11 +193,13 @@ extern bool fTxIndex;
 extern bool fAddressIndex;
 extern bool fSpentIndex;
 extern bool fTimestampIndex;
+extern bool fUTXOStatsIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
+extern unsigned int nRawBlockCacheSize;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
 /** Absolute maximum transaction fee (in satoshis) used by wallet and mempool (rejects high fee in sendrawtransaction) */
@@ -242,6 +257,8 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, CNode* pfrom, const CBlock* pblock, bool fForceProcessing, const CDiskBlockPos* dbp);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
+/** Log a fatal error, show it to the user and start shutting down; returns false */
+bool AbortNode(const std::string& strMessage, const std::string& userMessage = "");
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
@@ -256,6 +273,17 @@ bool InitBlockIndex(const CChainParams& chainparams);
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/** Drop the address, spent and timestamp indexes switched off since the last start */
+bool DropIndexes();
+/**
+ * Build the address, spent and timestamp indexes switched on since the last
+ * start from the blocks of the active chain and their undo data.
+ */
+bool BuildIndexes(const CChainParams& chainparams);
+/** Bring the UTXO set statistics up to the active tip, scanning the chainstate if they are not */
+bool LoadUTXOStats(CCoinsViewDB* pcoinsdbviewIn);
+/** The UTXO set statistics recorded when pindex was connected, if -utxostatsindex was on then */
+bool GetUTXOStatsForBlock(const CBlockIndex* pindex, CUTXOStatsValue& value);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /**
@@ -456,11 +484,25 @@ bool GetAddressIndex(uint160 addressHash, int type,
                      int start = 0, int end = 0);
 bool GetAddressUnspent(uint160 addressHash, int type,
                        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs);
+bool GetAddressIndexPage(uint160 addressHash, int type, int start, int end,
+                         const CAddressIndexKey *pkeyAfter, bool fReverse, size_t nLimit,
+                         std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex);
+/** Unspent outputs of many addresses in one index sweep, grouped per address in request order */
+bool GetAddressUnspent(const std::vector<std::pair<uint160, int> > &addresses, int minConf, CAmount minValue, bool includeMempool,
+                       std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > &unspentOutputs);
+bool GetAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value);
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** A block's serialization exactly as stored in blk*.dat, shared between everyone sending it */
+typedef std::shared_ptr<const std::vector<unsigned char> > CRawBlockRef;
+/**
+ * Read a block without deserializing it. The stored bytes are the witness
+ * serialization, and only match the plain one for blocks without witness data.
+ */
+bool ReadRawBlockFromDisk(CRawBlockRef& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -531,11 +573,17 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 /** The currently-connected chain of blocks (protected by cs_main). */
 extern CChain chainActive;
 
+/** Global variable that points to the coin database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
+
+/** Global variable that points to the address, spent and timestamp indexes (protected by cs_main) */
+extern CIndexDB *pindexdb;
 extern uint256 hashBestChain;
 
 /**
@@ -578,9 +626,13 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& kernel);
 
+// Check a kernel whose inputs are already resolved against the stake target
+// Touches neither the chain nor the disk, so it is safe to call concurrently
+bool CheckStakeKernel(unsigned int nBits, const CStakeIndexValue& kernelInput, unsigned int nTimeTx, const arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake, bool fPrintProofOfStake);
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, const CStakeIndexValue& kernelInput, unsigned int nTxPrevOffset, const COutPoint& prevout, unsigned int nTimeTx, arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake, bool fPrintProofOfStake);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
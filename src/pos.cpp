@@ -4,6 +4,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "chain.h"
 #include "main.h"
 #include "pos.h"
@@ -79,3 +80,44 @@ double GetPoSKernelPS()
 
     return result;
 }
+
+arith_uint256 GetCoinAgeCentSeconds(int64_t nValue, int64_t nTimeWeight)
+{
+    assert(nValue >= 0 && nTimeWeight >= 0);
+    return arith_uint256(nValue) * arith_uint256(nTimeWeight) / CENT;
+}
+
+uint64_t GetCoinAgeCoinDays(const arith_uint256& bnCentSecond)
+{
+    return (((bnCentSecond * CENT) / COIN) / (24 * 60 * 60)).GetLow64();
+}
+
+bool CheckStakeTarget(unsigned int nBits, int64_t nValue, int64_t nTimeWeight, const arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake)
+{
+    assert(nValue >= 0 && nTimeWeight >= 0);
+    arith_uint256 bnCoinDayWeight = arith_uint256(nValue) * arith_uint256(nTimeWeight) / COIN / (24 * 60 * 60);
+
+    // Decode nBits as CBigNum::SetCompact() does, but keep mantissa and exponent
+    // apart: the weight (< 2^126) times the mantissa (< 2^23) always fits, and
+    // only the byte shift can carry the product past 256 bits.
+    unsigned int nSize = nBits >> 24;
+    uint32_t nWord = nBits & 0x007fffff;
+    bool fNegative = (nBits & 0x00800000) != 0;
+    unsigned int nShift = 0;
+    if (nSize <= 3)
+        nWord >>= 8 * (3 - nSize);
+    else
+        nShift = 8 * (nSize - 3);
+
+    arith_uint256 bnProduct = bnCoinDayWeight * nWord;
+    if (bnProduct == 0) {
+        targetProofOfStake = 0;
+        return hashProofOfStake == 0;
+    }
+    bool fOverflow = bnProduct.bits() + nShift > 256;
+    targetProofOfStake = bnProduct << nShift;
+
+    if (fNegative)
+        return false;
+    return fOverflow || hashProofOfStake <= targetProofOfStake;
+}
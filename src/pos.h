@@ -5,6 +5,8 @@
 #ifndef KEKCOIN_POS_H
 #define KEKCOIN_POS_H
 
+class arith_uint256;
+
 static const int STAKE_TIMESTAMP_MASK = 15;
 
 double GetDifficulty(const CBlockIndex* blockindex);
@@ -15,4 +17,23 @@ double GetPoSKernelPS();
 
 extern uint64_t nLastCoinStakeSearchInterval;
 
+/**
+ * Fixed-width replacements for the CBigNum proof-of-stake arithmetic. Results
+ * are bit-for-bit what the OpenSSL code produced; values and time weights are
+ * never negative.
+ */
+
+/** Coin age in cent-seconds of nValue satoshis held for nTimeWeight seconds */
+arith_uint256 GetCoinAgeCentSeconds(int64_t nValue, int64_t nTimeWeight);
+
+/** Whole coin-days in bnCentSecond, truncated to 64 bits */
+uint64_t GetCoinAgeCoinDays(const arith_uint256& bnCentSecond);
+
+/**
+ * Check hashProofOfStake against the coin-day weight of the kernel input times
+ * the compact per-coin-day target nBits. targetProofOfStake is set to the
+ * magnitude of that product modulo 2^256.
+ */
+bool CheckStakeTarget(unsigned int nBits, int64_t nValue, int64_t nTimeWeight, const arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake);
+
 #endif // KEKCOIN_POS_H
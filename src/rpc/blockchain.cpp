@@ -10,6 +10,7 @@
 #include "checkpoints.h"
 #include "coins.h"
 #include "consensus/validation.h"
+#include "dbwrapper.h"
 #include "main.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
@@ -20,9 +21,11 @@
 #include "script/standard.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utxostats.h"
 #include "hash.h"
 #include "pos.h"
 
@@ -859,11 +862,14 @@ static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( hash_or_height )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "With -utxostatsindex the statistics are kept per block and returned at once, for the tip\n"
+            "or for the given block. Otherwise the whole set is scanned, which may take some time.\n"
+            "\nArguments:\n"
+            "1. hash_or_height    (string or numeric, optional) The block hash or height to report on; requires -utxostatsindex\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -871,16 +877,52 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash, without -utxostatsindex\n"
+            "  \"muhash\": \"hash\",            (string) The rolling set hash of the outputs, with -utxostatsindex\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "1000")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
     UniValue ret(UniValue::VOBJ);
 
+    if (fUTXOStatsIndex) {
+        LOCK(cs_main);
+        const CBlockIndex* pindex = chainActive.Tip();
+        if (params.size() > 0) {
+            int nHeight;
+            if (params[0].isNum() || (params[0].isStr() && ParseInt32(params[0].get_str(), &nHeight))) {
+                nHeight = params[0].isNum() ? params[0].get_int() : nHeight;
+                if (nHeight < 0 || nHeight > chainActive.Height())
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+                pindex = chainActive[nHeight];
+            } else {
+                uint256 hash = ParseHashV(params[0], "hash_or_height");
+                BlockMap::const_iterator it = mapBlockIndex.find(hash);
+                if (it == mapBlockIndex.end())
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+                pindex = it->second;
+            }
+        }
+        CUTXOStatsValue value;
+        if (pindex == NULL || !GetUTXOStatsForBlock(pindex, value))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "No UTXO set statistics for this block");
+        ret.push_back(Pair("height", (int64_t)value.nHeight));
+        ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
+        ret.push_back(Pair("transactions", (int64_t)value.nTransactions));
+        ret.push_back(Pair("txouts", (int64_t)value.nTransactionOutputs));
+        ret.push_back(Pair("bytes_serialized", (int64_t)value.nSerializedSize));
+        ret.push_back(Pair("muhash", value.hashMuHash.GetHex()));
+        ret.push_back(Pair("total_amount", ValueFromAmount(value.nTotalAmount)));
+        return ret;
+    }
+
+    if (params.size() > 0)
+        throw JSONRPCError(RPC_MISC_ERROR, "Statistics for a given block require -utxostatsindex");
+
     CCoinsStats stats;
     FlushStateToDisk();
     if (GetUTXOStats(pcoinsTip, stats)) {
@@ -975,6 +1017,54 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns the settings and statistics of the LevelDB databases.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\": \"xxxx\",          (string) the database, as named by -dbtune\n"
+            "    \"blockcache\": xxxxx,       (numeric) size of the cache of recently read blocks, in bytes\n"
+            "    \"sharedcache\": true|false, (boolean) if the block cache is shared with other databases\n"
+            "    \"writebuffer\": xxxxx,      (numeric) size of each of the two write buffers, in bytes\n"
+            "    \"blocksize\": xxxxx,        (numeric) approximate size of the data blocks, in bytes\n"
+            "    \"bloombits\": xx,           (numeric) bits per key of the bloom filter\n"
+            "    \"compression\": true|false, (boolean) if data blocks are compressed\n"
+            "    \"cache_hits\": xxxxx,       (numeric) block reads found in the block cache\n"
+            "    \"cache_misses\": xxxxx,     (numeric) block reads that had to go to disk\n"
+            "    \"cache_hitrate\": x.xxx,    (numeric) share of the block reads found in the cache\n"
+            "    \"leveldb_stats\": \"xxxx\"   (string) LevelDB's files, sizes and compactions per level\n"
+            "  }, ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    std::vector<CDBStats> vStats = GetDBStats();
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH(const CDBStats& stats, vStats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("name", stats.strName));
+        obj.push_back(Pair("blockcache", (uint64_t)stats.nBlockCacheSize));
+        obj.push_back(Pair("sharedcache", stats.fSharedCache));
+        obj.push_back(Pair("writebuffer", (uint64_t)stats.nWriteBufferSize));
+        obj.push_back(Pair("blocksize", (uint64_t)stats.nBlockSize));
+        obj.push_back(Pair("bloombits", stats.nBloomBits));
+        obj.push_back(Pair("compression", stats.fCompression));
+        obj.push_back(Pair("cache_hits", stats.nCacheHits));
+        obj.push_back(Pair("cache_misses", stats.nCacheMisses));
+        uint64_t nReads = stats.nCacheHits + stats.nCacheMisses;
+        obj.push_back(Pair("cache_hitrate", nReads ? (double)stats.nCacheHits / nReads : 0.0));
+        obj.push_back(Pair("leveldb_stats", stats.strLevelDBStats));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 UniValue verifychain(const UniValue& params, bool fHelp)
 {
     int nCheckLevel = GetArg("-checklevel", DEFAULT_CHECKLEVEL);
@@ -1085,6 +1175,16 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
             "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
             "  \"pruneheight\": xxxxxx,    (numeric) heighest block available\n"
+            "  \"coinsflush\": {           (object) writes of the UTXO cache to the chainstate database\n"
+            "     \"async\": xx,            (boolean) if the writes are done in the background\n"
+            "     \"pending_usage\": xx,    (numeric) memory held by the write in progress, in bytes\n"
+            "     \"flushes\": xx,          (numeric) number of writes since startup\n"
+            "     \"bytes\": xx,            (numeric) bytes of records written since startup\n"
+            "     \"last_ms\": xx,          (numeric) duration of the last write\n"
+            "     \"max_ms\": xx,           (numeric) duration of the slowest write\n"
+            "     \"total_ms\": xx,         (numeric) duration of all writes\n"
+            "     \"wait_ms\": xx,          (numeric) time block processing waited for background writes\n"
+            "  },\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -1124,6 +1224,19 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("verificationprogress",  Checkpoints::GuessVerificationProgress(Params().Checkpoints(), chainActive.Tip())));
     obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
     obj.push_back(Pair("pruned",                fPruneMode));
+    if (pcoinsdbview) {
+        CCoinsFlushStats flushStats = pcoinsdbview->GetFlushStats();
+        UniValue coinsflush(UniValue::VOBJ);
+        coinsflush.push_back(Pair("async",         pcoinsdbview->IsAsyncFlush()));
+        coinsflush.push_back(Pair("pending_usage", (uint64_t)pcoinsdbview->DynamicMemoryUsage()));
+        coinsflush.push_back(Pair("flushes",       flushStats.nFlushes));
+        coinsflush.push_back(Pair("bytes",         flushStats.nBytesWritten));
+        coinsflush.push_back(Pair("last_ms",       flushStats.nLastMicros * 0.001));
+        coinsflush.push_back(Pair("max_ms",        flushStats.nMaxMicros * 0.001));
+        coinsflush.push_back(Pair("total_ms",      flushStats.nTotalMicros * 0.001));
+        coinsflush.push_back(Pair("wait_ms",       flushStats.nWaitMicros * 0.001));
+        obj.push_back(Pair("coinsflush",            coinsflush));
+    }
 
     const Consensus::Params& consensusParams = Params().GetConsensus();
     CBlockIndex* tip = chainActive.Tip();
@@ -1390,6 +1503,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
+    { "blockchain",         "getdbstats",             &getdbstats,             true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true  },
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true  },
@@ -36,6 +36,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "sendtoaddress", 1 },
     { "sendtoaddress", 5 },
     { "settxfee", 0 },
+    { "getstakeseries", 0 },
+    { "getstakeseries", 1 },
     { "getreceivedbyaddress", 1 },
     { "getreceivedbyaccount", 1 },
     { "listreceivedbyaddress", 0 },
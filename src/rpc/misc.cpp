@@ -544,6 +544,127 @@ bool timestampSort(std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> a,
     return a.second.time < b.second.time;
 }
 
+struct AddressIndexPaging {
+    size_t limit;
+    bool reverse;
+    bool haveCursor;
+    CAddressIndexKey cursor;
+
+    AddressIndexPaging() : limit(0), reverse(false), haveCursor(false) {}
+};
+
+/** The opaque continuation cursor is the serialized index key of the last entry returned */
+std::string encodeAddressIndexCursor(const CAddressIndexKey &key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key;
+    return HexStr(ss.begin(), ss.end());
+}
+
+bool getAddressIndexPaging(const UniValue& params, AddressIndexPaging &paging)
+{
+    if (!params[0].isObject()) {
+        return false;
+    }
+
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+    UniValue directionValue = find_value(params[0].get_obj(), "direction");
+
+    if (limitValue.isNull()) {
+        if (!cursorValue.isNull() || !directionValue.isNull()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cursor and direction require a limit");
+        }
+        return false;
+    }
+
+    int limit = limitValue.get_int();
+    if (limit <= 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be greater than zero");
+    }
+    paging.limit = limit;
+
+    if (!directionValue.isNull()) {
+        std::string direction = directionValue.get_str();
+        if (direction == "desc") {
+            paging.reverse = true;
+        } else if (direction != "asc") {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Direction is expected to be \"asc\" or \"desc\"");
+        }
+    }
+
+    if (!cursorValue.isNull()) {
+        std::string cursor = cursorValue.get_str();
+        if (!IsHex(cursor)) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        }
+        std::vector<unsigned char> data(ParseHex(cursor));
+        CDataStream ss(data, SER_DISK, CLIENT_VERSION);
+        try {
+            ss >> paging.cursor;
+        } catch (const std::exception&) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        }
+        if (!ss.empty()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        }
+        paging.haveCursor = true;
+    }
+
+    return true;
+}
+
+/**
+ * Read up to limit address index entries following pkeyAfter (or from the
+ * beginning), address by address in request order, reversed for a descending
+ * page. Returns whether more entries follow the ones read.
+ */
+bool getAddressIndexPage(const std::vector<std::pair<uint160, int> > &addresses, int start, int end, bool reverse,
+                         const CAddressIndexKey *pkeyAfter, size_t limit,
+                         std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex)
+{
+    std::vector<std::pair<uint160, int> > ordered(addresses);
+    if (reverse) {
+        std::reverse(ordered.begin(), ordered.end());
+    }
+
+    std::vector<std::pair<uint160, int> >::const_iterator it = ordered.begin();
+    if (pkeyAfter) {
+        it = std::find(ordered.begin(), ordered.end(), std::make_pair(pkeyAfter->hashBytes, (int)pkeyAfter->type));
+        if (it == ordered.end()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cursor does not belong to the requested addresses");
+        }
+    }
+
+    // Ask for one entry more than the page holds to learn whether another page follows
+    size_t size = addressIndex.size();
+    for (; it != ordered.end() && addressIndex.size() - size <= limit; it++) {
+        if (!GetAddressIndexPage((*it).first, (*it).second, start, end, pkeyAfter, reverse,
+                                 limit + 1 - (addressIndex.size() - size), addressIndex)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
+        pkeyAfter = NULL;
+    }
+
+    if (addressIndex.size() - size > limit) {
+        addressIndex.pop_back();
+        return true;
+    }
+    return false;
+}
+
+UniValue unspentOutputToJSON(const std::string &address, const std::pair<CAddressUnspentKey, CAddressUnspentValue> &unspent)
+{
+    UniValue output(UniValue::VOBJ);
+    output.push_back(Pair("address", address));
+    output.push_back(Pair("txid", unspent.first.txhash.GetHex()));
+    output.push_back(Pair("outputIndex", (int)unspent.first.index));
+    output.push_back(Pair("script", HexStr(unspent.second.script.begin(), unspent.second.script.end())));
+    output.push_back(Pair("satoshis", unspent.second.satoshis));
+    output.push_back(Pair("height", unspent.second.blockHeight));
+    return output;
+}
+
 UniValue getaddressmempool(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -629,6 +750,11 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "      ,...\n"
             "    ],\n"
             "  \"chainInfo\"  (boolean) Include chain info with results\n"
+            "  \"minconf\"  (number, optional, default=0) Only outputs with at least this many confirmations\n"
+            "  \"minvalue\"  (number, optional, default=0) Only outputs of at least this many satoshis\n"
+            "  \"mempool\"  (boolean, optional, default=false) Leave out outputs spent in the mempool and, with\n"
+            "              minconf 0, add unconfirmed outputs with height -1\n"
+            "  \"grouped\"  (boolean, optional, default=false) Return the outputs grouped per address\n"
             "}\n"
             "\nResult\n"
             "[\n"
@@ -641,17 +767,45 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "    \"satoshis\"  (number) The number of satoshis of the output\n"
             "  }\n"
             "]\n"
+            "\nResult (grouped)\n"
+            "[\n"
+            "  {\n"
+            "    \"address\"  (string) The address base58check encoded, in request order\n"
+            "    \"utxos\"  (array) The outputs of the address as above, by height\n"
+            "  }\n"
+            "]\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"], \"minconf\": 6, \"grouped\": true}'")
             + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
             );
 
     bool includeChainInfo = false;
+    int minConf = 0;
+    CAmount minValue = 0;
+    bool includeMempool = false;
+    bool grouped = false;
     if (params[0].isObject()) {
         UniValue chainInfo = find_value(params[0].get_obj(), "chainInfo");
         if (chainInfo.isBool()) {
             includeChainInfo = chainInfo.get_bool();
         }
+        UniValue minConfValue = find_value(params[0].get_obj(), "minconf");
+        if (minConfValue.isNum()) {
+            minConf = minConfValue.get_int();
+        }
+        UniValue minValueValue = find_value(params[0].get_obj(), "minvalue");
+        if (minValueValue.isNum()) {
+            minValue = minValueValue.get_int64();
+        }
+        UniValue mempoolValue = find_value(params[0].get_obj(), "mempool");
+        if (mempoolValue.isBool()) {
+            includeMempool = mempoolValue.get_bool();
+        }
+        UniValue groupedValue = find_value(params[0].get_obj(), "grouped");
+        if (groupedValue.isBool()) {
+            grouped = groupedValue.get_bool();
+        }
     }
 
     std::vector<std::pair<uint160, int> > addresses;
@@ -660,32 +814,48 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+    std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > addressOutputs;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-        }
+    if (!GetAddressUnspent(addresses, minConf, minValue, includeMempool, addressOutputs)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
     }
 
-    std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
-
     UniValue utxos(UniValue::VARR);
 
-    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=unspentOutputs.begin(); it!=unspentOutputs.end(); it++) {
-        UniValue output(UniValue::VOBJ);
-        std::string address;
-        if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+    if (grouped) {
+        for (size_t i = 0; i < addresses.size(); i++) {
+            std::string address;
+            if (!getAddressFromIndex(addresses[i].second, addresses[i].first, address)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+            }
+            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs = addressOutputs[i];
+            std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+
+            UniValue outputs(UniValue::VARR);
+            for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=unspentOutputs.begin(); it!=unspentOutputs.end(); it++) {
+                outputs.push_back(unspentOutputToJSON(address, *it));
+            }
+
+            UniValue group(UniValue::VOBJ);
+            group.push_back(Pair("address", address));
+            group.push_back(Pair("utxos", outputs));
+            utxos.push_back(group);
         }
+    } else {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+        for (size_t i = 0; i < addressOutputs.size(); i++) {
+            unspentOutputs.insert(unspentOutputs.end(), addressOutputs[i].begin(), addressOutputs[i].end());
+        }
+
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
 
-        output.push_back(Pair("address", address));
-        output.push_back(Pair("txid", it->first.txhash.GetHex()));
-        output.push_back(Pair("outputIndex", (int)it->first.index));
-        output.push_back(Pair("script", HexStr(it->second.script.begin(), it->second.script.end())));
-        output.push_back(Pair("satoshis", it->second.satoshis));
-        output.push_back(Pair("height", it->second.blockHeight));
-        utxos.push_back(output);
+        for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=unspentOutputs.begin(); it!=unspentOutputs.end(); it++) {
+            std::string address;
+            if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+            }
+            utxos.push_back(unspentOutputToJSON(address, *it));
+        }
     }
 
     if (includeChainInfo) {
@@ -717,6 +887,9 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
             "  \"chainInfo\" (boolean) Include chain info in results, only applies if start and end specified\n"
+            "  \"limit\" (number, optional) Return at most this many deltas, as a page with a cursor\n"
+            "  \"cursor\" (string, optional) The cursor of the previous page, to continue after it\n"
+            "  \"direction\" (string, optional, default=\"asc\") \"asc\" or \"desc\", the order of a paged result\n"
             "}\n"
             "\nResult:\n"
             "[\n"
@@ -728,8 +901,14 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "    \"address\"  (string) The base58check encoded address\n"
             "  }\n"
             "]\n"
+            "\nResult (with limit):\n"
+            "{\n"
+            "  \"deltas\"  (array) The deltas as above\n"
+            "  \"cursor\"  (string) Pass as \"cursor\" to get the next page, absent on the last page\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
         );
 
@@ -763,16 +942,25 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
+    AddressIndexPaging paging;
+    bool paged = getAddressIndexPaging(params, paging);
+    bool more = false;
+
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    if (paged) {
+        more = getAddressIndexPage(addresses, start, end, paging.reverse, paging.haveCursor ? &paging.cursor : NULL,
+                                   paging.limit, addressIndex);
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (start > 0 && end > 0) {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            } else {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
             }
         }
     }
@@ -819,6 +1007,16 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         result.push_back(Pair("deltas", deltas));
         result.push_back(Pair("start", startInfo));
         result.push_back(Pair("end", endInfo));
+        if (more) {
+            result.push_back(Pair("cursor", encodeAddressIndexCursor(addressIndex.back().first)));
+        }
+
+        return result;
+    } else if (paged) {
+        result.push_back(Pair("deltas", deltas));
+        if (more) {
+            result.push_back(Pair("cursor", encodeAddressIndexCursor(addressIndex.back().first)));
+        }
 
         return result;
     } else {
@@ -844,6 +1042,9 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
             "{\n"
             "  \"balance\"  (string) The current balance in satoshis\n"
             "  \"received\"  (string) The total number of satoshis received (including change)\n"
+            "  \"txcount\"  (number) The number of transactions involving the address(es), counted per address\n"
+            "  \"firstheight\"  (number) The height of the first block involving the address(es), -1 if none\n"
+            "  \"lastheight\"  (number) The height of the last block involving the address(es), -1 if none\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
@@ -856,27 +1057,35 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    CAmount balance = 0;
+    CAmount received = 0;
+    int64_t txCount = 0;
+    int firstHeight = -1;
+    int lastHeight = -1;
 
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+        CAddressBalanceValue value;
+        if (!GetAddressBalance((*it).first, (*it).second, value)) {
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
-    }
-
-    CAmount balance = 0;
-    CAmount received = 0;
-
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        if (it->second > 0) {
-            received += it->second;
+        if (value.IsNull()) {
+            continue;
+        }
+        balance += value.balance;
+        received += value.received;
+        txCount += value.txCount;
+        if (firstHeight == -1 || value.firstHeight < firstHeight) {
+            firstHeight = value.firstHeight;
         }
-        balance += it->second;
+        lastHeight = std::max(lastHeight, value.lastHeight);
     }
 
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("balance", balance));
     result.push_back(Pair("received", received));
+    result.push_back(Pair("txcount", txCount));
+    result.push_back(Pair("firstheight", firstHeight));
+    result.push_back(Pair("lastheight", lastHeight));
 
     return result;
 
@@ -897,14 +1106,24 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Return at most this many txids, as a page with a cursor. Paged txids\n"
+            "            are listed address by address, once for each requested address they involve\n"
+            "  \"cursor\" (string, optional) The cursor of the previous page, to continue after it\n"
+            "  \"direction\" (string, optional, default=\"asc\") \"asc\" or \"desc\", the order of a paged result\n"
             "}\n"
             "\nResult:\n"
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
             "]\n"
+            "\nResult (with limit):\n"
+            "{\n"
+            "  \"txids\"  (array) The txids as above\n"
+            "  \"cursor\"  (string) Pass as \"cursor\" to get the next page, absent on the last page\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
         );
 
@@ -925,6 +1144,42 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         }
     }
 
+    AddressIndexPaging paging;
+    if (getAddressIndexPaging(params, paging)) {
+        // An address's deltas of one transaction are adjacent in the index, so
+        // a txid is new whenever the address or txid differs from the last delta
+        UniValue txids(UniValue::VARR);
+        bool haveLast = paging.haveCursor;
+        CAddressIndexKey last = paging.cursor;
+        bool more = false;
+        while (true) {
+            std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+            bool pending = getAddressIndexPage(addresses, start, end, paging.reverse, haveLast ? &last : NULL,
+                                               paging.limit, addressIndex);
+            for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
+                if (!haveLast || it->first.txhash != last.txhash || it->first.hashBytes != last.hashBytes || it->first.type != last.type) {
+                    if (txids.size() == paging.limit) {
+                        more = true;
+                        break;
+                    }
+                    txids.push_back(it->first.txhash.GetHex());
+                }
+                haveLast = true;
+                last = it->first;
+            }
+            if (more || !pending) {
+                break;
+            }
+        }
+
+        UniValue result(UniValue::VOBJ);
+        result.push_back(Pair("txids", txids));
+        if (more) {
+            result.push_back(Pair("cursor", encodeAddressIndexCursor(last)));
+        }
+        return result;
+    }
+
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
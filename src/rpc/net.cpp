@@ -6,6 +6,7 @@
 
 #include "chainparams.h"
 #include "clientversion.h"
+#include "kernel.h"
 #include "main.h"
 #include "net.h"
 #include "netbase.h"
@@ -580,8 +581,11 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
             "Returns an object containing staking-related information.");
 
     uint64_t nWeight = 0;
-    if (pwalletMain)
+    uint64_t nStakeableCoins = 0;
+    if (pwalletMain) {
         nWeight = pwalletMain->GetStakeWeight();
+        nStakeableCoins = pwalletMain->GetStakeableCoinCount();
+    }
 
     uint64_t nNetworkWeight = GetPoSKernelPS();
     bool staking = nLastCoinStakeSearchInterval && nWeight;
@@ -598,8 +602,10 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
 
     obj.push_back(Pair("difficulty", GetDifficulty(GetLastBlockIndex(pindexBestHeader, true))));
     obj.push_back(Pair("search-interval", (int)nLastCoinStakeSearchInterval));
+    obj.push_back(Pair("kernelspersecond", stakeKernelSearch.GetKernelsPerSecond()));
 
     obj.push_back(Pair("weight", (uint64_t)nWeight));
+    obj.push_back(Pair("stakeablecoins", nStakeableCoins));
     obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
 
     obj.push_back(Pair("expectedtime", nExpectedTime));
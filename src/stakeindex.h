@@ -0,0 +1,65 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef KEKCOIN_STAKEINDEX_H
+#define KEKCOIN_STAKEINDEX_H
+
+#include "amount.h"
+#include "serialize.h"
+#include "uint256.h"
+
+/**
+ * The subset of an output's history that the stake kernel hash depends on.
+ * Records are keyed by COutPoint so a kernel check never has to load the
+ * transaction or the block that created the output.
+ */
+struct CStakeIndexValue {
+    unsigned int nBlockTime;
+    unsigned int nTxTime;
+    unsigned int nTxOffset;
+    CAmount nValue;
+    int nHeight;
+    uint256 hashBlock; //! block that contains the output, to tell branches apart
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nBlockTime);
+        READWRITE(nTxTime);
+        READWRITE(VARINT(nTxOffset));
+        READWRITE(nValue);
+        READWRITE(nHeight);
+        READWRITE(hashBlock);
+    }
+
+    CStakeIndexValue(unsigned int blockTime, unsigned int txTime, unsigned int txOffset, CAmount value, int height, const uint256& hashBlockIn) {
+        nBlockTime = blockTime;
+        nTxTime = txTime;
+        nTxOffset = txOffset;
+        nValue = value;
+        nHeight = height;
+        hashBlock = hashBlockIn;
+    }
+
+    CStakeIndexValue() {
+        SetNull();
+    }
+
+    void SetNull() {
+        nBlockTime = 0;
+        nTxTime = 0;
+        nTxOffset = 0;
+        nValue = 0;
+        nHeight = -1;
+        hashBlock.SetNull();
+    }
+
+    bool IsNull() const {
+        return nHeight == -1;
+    }
+};
+
+#endif // KEKCOIN_STAKEINDEX_H
@@ -0,0 +1,327 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "miner.h"
+#include "pow.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include "test/test_kekcoin.h"
+
+#include <limits>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(addressindex_tests, TestingSetup)
+
+typedef std::vector<std::pair<CAddressIndexKey, CAmount> > AddressIndexVector;
+
+static void ConnectDeltas(const AddressIndexVector& vect)
+{
+    BOOST_CHECK(pindexdb->ConnectAddressIndex(vect, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >()));
+}
+
+static void DisconnectDeltas(const AddressIndexVector& vect)
+{
+    BOOST_CHECK(pindexdb->DisconnectAddressIndex(vect, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >()));
+}
+
+static void CheckBalance(const uint160& address, CAmount balance, CAmount received, int64_t txCount, int firstHeight, int lastHeight)
+{
+    CAddressBalanceValue value;
+    BOOST_CHECK(pindexdb->ReadAddressBalanceIndex(address, 1, value));
+    BOOST_CHECK_EQUAL(value.balance, balance);
+    BOOST_CHECK_EQUAL(value.received, received);
+    BOOST_CHECK_EQUAL(value.txCount, txCount);
+    BOOST_CHECK_EQUAL(value.firstHeight, firstHeight);
+    BOOST_CHECK_EQUAL(value.lastHeight, lastHeight);
+}
+
+BOOST_AUTO_TEST_CASE(address_balance_connect_disconnect)
+{
+    uint160 address(ParseHex("1111111111111111111111111111111111111111"));
+    uint160 other(ParseHex("2222222222222222222222222222222222222222"));
+    uint256 txA = uint256S("0xa"), txB = uint256S("0xb"), txC = uint256S("0xc");
+
+    // block 10: two outputs to the address in one transaction, one to another address
+    AddressIndexVector block10;
+    block10.push_back(std::make_pair(CAddressIndexKey(1, address, 10, 1, txA, 0, false), 5 * COIN));
+    block10.push_back(std::make_pair(CAddressIndexKey(1, address, 10, 1, txA, 1, false), 3 * COIN));
+    block10.push_back(std::make_pair(CAddressIndexKey(1, other, 10, 1, txA, 2, false), 1 * COIN));
+
+    // block 12: spends one output and receives change in the same transaction, plus another payment
+    AddressIndexVector block12;
+    block12.push_back(std::make_pair(CAddressIndexKey(1, address, 12, 1, txB, 0, true), -5 * COIN));
+    block12.push_back(std::make_pair(CAddressIndexKey(1, address, 12, 1, txB, 1, false), 2 * COIN));
+    block12.push_back(std::make_pair(CAddressIndexKey(1, address, 12, 2, txC, 0, false), 4 * COIN));
+
+    ConnectDeltas(block10);
+    CheckBalance(address, 8 * COIN, 8 * COIN, 1, 10, 10);
+    CheckBalance(other, 1 * COIN, 1 * COIN, 1, 10, 10);
+
+    ConnectDeltas(block12);
+    CheckBalance(address, 9 * COIN, 14 * COIN, 3, 10, 12);
+
+    // connecting the same block again is a no-op
+    ConnectDeltas(block12);
+    CheckBalance(address, 9 * COIN, 14 * COIN, 3, 10, 12);
+
+    // the rebuild from the address index agrees with the incremental records
+    BOOST_CHECK(pindexdb->RebuildAddressBalanceIndex());
+    CheckBalance(address, 9 * COIN, 14 * COIN, 3, 10, 12);
+    CheckBalance(other, 1 * COIN, 1 * COIN, 1, 10, 10);
+
+    DisconnectDeltas(block12);
+    CheckBalance(address, 8 * COIN, 8 * COIN, 1, 10, 10);
+
+    // disconnecting twice is a no-op as well
+    DisconnectDeltas(block12);
+    CheckBalance(address, 8 * COIN, 8 * COIN, 1, 10, 10);
+
+    DisconnectDeltas(block10);
+    CAddressBalanceValue value;
+    BOOST_CHECK(!pindexdb->ReadAddressBalanceIndex(address, 1, value));
+    BOOST_CHECK(!pindexdb->ReadAddressBalanceIndex(other, 1, value));
+}
+
+BOOST_AUTO_TEST_CASE(address_index_pages)
+{
+    uint160 address(ParseHex("3333333333333333333333333333333333333333"));
+    uint160 after(ParseHex("3333333333333333333333333333333333333334"));
+
+    AddressIndexVector vect;
+    for (int height = 1; height <= 10; height++)
+        vect.push_back(std::make_pair(CAddressIndexKey(1, address, height, 1, uint256S("0x1"), height, false), height * COIN));
+    vect.push_back(std::make_pair(CAddressIndexKey(1, after, 5, 1, uint256S("0x1"), 0, false), COIN));
+    BOOST_CHECK(pindexdb->WriteAddressIndex(vect));
+
+    // walk forward three at a time, each page continuing after the last key of the previous one
+    std::vector<int> heights;
+    AddressIndexVector page;
+    const CAddressIndexKey* pkeyAfter = NULL;
+    do {
+        page.clear();
+        BOOST_CHECK(pindexdb->ReadAddressIndexPage(address, 1, 0, 0, pkeyAfter, false, 3, page));
+        BOOST_CHECK(page.size() <= 3);
+        for (unsigned int i = 0; i < page.size(); i++)
+            heights.push_back(page[i].first.blockHeight);
+        if (!page.empty())
+            pkeyAfter = &page.back().first;
+    } while (!page.empty());
+    BOOST_CHECK_EQUAL(heights.size(), 10U);
+    for (unsigned int i = 0; i < heights.size(); i++)
+        BOOST_CHECK_EQUAL(heights[i], (int)i + 1);
+
+    // backwards within a height range, and from a cursor
+    page.clear();
+    BOOST_CHECK(pindexdb->ReadAddressIndexPage(address, 1, 3, 6, NULL, true, 10, page));
+    BOOST_CHECK_EQUAL(page.size(), 4U);
+    BOOST_CHECK_EQUAL(page.front().first.blockHeight, 6);
+    BOOST_CHECK_EQUAL(page.back().first.blockHeight, 3);
+
+    CAddressIndexKey cursor = vect[4].first;
+    page.clear();
+    BOOST_CHECK(pindexdb->ReadAddressIndexPage(address, 1, 0, 0, &cursor, true, 10, page));
+    BOOST_CHECK_EQUAL(page.size(), 4U);
+    BOOST_CHECK_EQUAL(page.front().first.blockHeight, 4);
+    BOOST_CHECK_EQUAL(page.back().first.blockHeight, 1);
+
+    // the newest entries of the last address sit right before the end of the database
+    page.clear();
+    BOOST_CHECK(pindexdb->ReadAddressIndexPage(after, 1, 0, 0, NULL, true, 10, page));
+    BOOST_CHECK_EQUAL(page.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(address_unspent_batch)
+{
+    uint160 a(ParseHex("4444444444444444444444444444444444444444"));
+    uint160 b(ParseHex("5555555555555555555555555555555555555555"));
+    uint160 missing(ParseHex("4545454545454545454545454545454545454545"));
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vect;
+    for (int n = 0; n < 3; n++) {
+        vect.push_back(std::make_pair(CAddressUnspentKey(1, a, uint256S("0xa"), n), CAddressUnspentValue((n + 1) * COIN, CScript(), 10 + n)));
+        vect.push_back(std::make_pair(CAddressUnspentKey(2, b, uint256S("0xb"), n), CAddressUnspentValue((n + 1) * COIN, CScript(), 20 + n)));
+    }
+    BOOST_CHECK(pindexdb->UpdateAddressUnspentIndex(vect));
+
+    // results come back in request order, whatever the key order
+    std::vector<std::pair<uint160, int> > addresses;
+    addresses.push_back(std::make_pair(b, 2));
+    addresses.push_back(std::make_pair(missing, 1));
+    addresses.push_back(std::make_pair(a, 1));
+    addresses.push_back(std::make_pair(b, 1));
+    addresses.push_back(std::make_pair(b, 2));
+
+    std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > results;
+    BOOST_CHECK(pindexdb->ReadAddressUnspentIndex(addresses, std::numeric_limits<int>::max(), 0, results));
+    BOOST_CHECK_EQUAL(results.size(), 5U);
+    BOOST_CHECK_EQUAL(results[0].size(), 3U);
+    BOOST_CHECK(results[1].empty());
+    BOOST_CHECK_EQUAL(results[2].size(), 3U);
+    BOOST_CHECK(results[3].empty());
+    BOOST_CHECK_EQUAL(results[4].size(), 3U);
+    BOOST_CHECK(results[0][0].first.hashBytes == b);
+    BOOST_CHECK(results[2][0].first.hashBytes == a);
+
+    // height and value filters
+    BOOST_CHECK(pindexdb->ReadAddressUnspentIndex(addresses, 21, 2 * COIN, results));
+    BOOST_CHECK_EQUAL(results[0].size(), 1U);
+    BOOST_CHECK_EQUAL(results[0][0].second.blockHeight, 21);
+    BOOST_CHECK_EQUAL(results[2].size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(indexes_move_from_block_tree)
+{
+    uint160 address(ParseHex("5555555555555555555555555555555555555555"));
+    uint256 txid = uint256S("0x55");
+    uint256 hashBlock = uint256S("0x56");
+
+    // records as older versions wrote them, next to the block index
+    CAddressIndexKey addressKey(1, address, 30, 1, txid, 0, false);
+    CSpentIndexKey spentKey(txid, 0);
+    CSpentIndexValue spentValue(uint256S("0x57"), 0, 31, 5 * COIN, 1, address);
+    BOOST_CHECK(pblocktree->Write(std::make_pair('a', addressKey), 5 * COIN));
+    BOOST_CHECK(pblocktree->Write(std::make_pair('p', spentKey), spentValue));
+    BOOST_CHECK(pblocktree->Write(std::make_pair('s', CTimestampIndexKey(1500000000, hashBlock)), 0));
+    BOOST_CHECK(pblocktree->Write(std::make_pair('z', CTimestampBlockIndexKey(hashBlock)), CTimestampBlockIndexValue(1500000000)));
+    BOOST_CHECK(pblocktree->WriteFlag("addressindex", true));
+
+    BOOST_CHECK(pblocktree->MoveIndexes(pindexdb));
+    BOOST_CHECK(!pblocktree->Exists(std::make_pair('a', addressKey)));
+    BOOST_CHECK(!pblocktree->Exists(std::make_pair('p', spentKey)));
+    bool fValue = false;
+    BOOST_CHECK(pblocktree->ReadFlag("addressindex", fValue) && fValue);
+
+    AddressIndexVector addressIndex;
+    BOOST_CHECK(pindexdb->ReadAddressIndex(address, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+    BOOST_CHECK_EQUAL(addressIndex[0].second, 5 * COIN);
+    CSpentIndexValue value;
+    BOOST_CHECK(pindexdb->ReadSpentIndex(spentKey, value));
+    BOOST_CHECK(value.txid == spentValue.txid);
+    unsigned int logicalTS = 0;
+    BOOST_CHECK(pindexdb->ReadTimestampBlockIndex(hashBlock, logicalTS));
+    BOOST_CHECK_EQUAL(logicalTS, 1500000000U);
+
+    // nothing is left to move, and dropping an index leaves the others
+    BOOST_CHECK(pblocktree->MoveIndexes(pindexdb));
+    BOOST_CHECK(pindexdb->DropAddressIndex());
+    addressIndex.clear();
+    BOOST_CHECK(pindexdb->ReadAddressIndex(address, 1, addressIndex));
+    BOOST_CHECK(addressIndex.empty());
+    BOOST_CHECK(pindexdb->ReadSpentIndex(spentKey, value));
+    BOOST_CHECK(pindexdb->DropSpentIndex());
+    BOOST_CHECK(!pindexdb->ReadSpentIndex(spentKey, value));
+}
+
+/** All records the indexes hold for one script hash, its spent output and the blocks */
+static std::string IndexRecords(const uint160& hashBytes, const COutPoint& spent)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(pindexdb->ReadAddressIndex(hashBytes, 2, addressIndex));
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspent;
+    BOOST_CHECK(pindexdb->ReadAddressUnspentIndex(hashBytes, 2, addressUnspent));
+    CAddressBalanceValue balance;
+    BOOST_CHECK(pindexdb->ReadAddressBalanceIndex(hashBytes, 2, balance));
+    CSpentIndexKey spentKey(spent.hash, spent.n);
+    CSpentIndexValue spentValue;
+    BOOST_CHECK(pindexdb->ReadSpentIndex(spentKey, spentValue));
+    std::vector<std::pair<uint256, unsigned int> > timestamps;
+    BOOST_CHECK(pindexdb->ReadTimestampIndex(std::numeric_limits<unsigned int>::max(), 0, false, timestamps));
+    BOOST_CHECK_EQUAL(timestamps.size(), (size_t)chainActive.Height());
+    ss << addressIndex << addressUnspent << balance << spentValue << timestamps;
+    return ss.str();
+}
+
+/** Mine a block whose coinbase pays nValue to a script, the coinbases of the fixture pay nothing */
+static CBlock CreateAndProcessPayment(const CScript& scriptPubKey, CAmount nValue)
+{
+    const CChainParams& chainparams = Params();
+    boost::scoped_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(chainparams).CreateNewBlock(CScript(), false, 0));
+    CBlock block = pblocktemplate->block;
+    CMutableTransaction txCoinbase(block.vtx[0]);
+    txCoinbase.vout[0] = CTxOut(nValue, scriptPubKey);
+    block.vtx[0] = txCoinbase;
+    unsigned int extraNonce = 0;
+    IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
+    while (!CheckProofOfWork(block.GetHash(), block.nBits, chainparams.GetConsensus())) ++block.nNonce;
+
+    CValidationState state;
+    BOOST_CHECK(ProcessNewBlock(state, chainparams, NULL, &block, true, NULL));
+    return block;
+}
+
+BOOST_FIXTURE_TEST_CASE(build_indexes_match_connected_blocks, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    mapArgs["-addressindex"] = mapArgs["-spentindex"] = mapArgs["-timestampindex"] = "1";
+
+    // Built over the blocks of the fixture, the indexes are switched on
+    BOOST_CHECK(BuildIndexes(chainparams));
+    BOOST_CHECK(fAddressIndex && fSpentIndex && fTimestampIndex);
+    bool fValue;
+    BOOST_CHECK(pblocktree->ReadFlag("addressindex", fValue) && fValue);
+    BOOST_CHECK(pblocktree->ReadFlag("spentindex", fValue) && fValue);
+    BOOST_CHECK(pblocktree->ReadFlag("timestampindex", fValue) && fValue);
+
+    // ConnectBlock keeps them from there: a coinbase paying a script hash, spent once mature
+    CScript redeemScript = CScript() << OP_TRUE;
+    CScriptID scriptID(redeemScript);
+    CScript scriptPay = GetScriptForDestination(scriptID);
+    CBlock blockPay = CreateAndProcessPayment(scriptPay, 10 * COIN);
+    std::vector<CMutableTransaction> noTxns;
+    for (int i = 0; i < chainparams.GetConsensus().nCoinbaseMaturityV1; i++)
+        CreateAndProcessBlock(noTxns, CScript());
+
+    CMutableTransaction spend;
+    spend.nTime = chainActive.Tip()->nTime;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(blockPay.vtx[0].GetHash(), 0);
+    spend.vin[0].scriptSig = CScript() << ToByteVector(redeemScript);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = blockPay.vtx[0].vout[0].nValue;
+    spend.vout[0].scriptPubKey = scriptPay;
+    std::vector<CMutableTransaction> spendTxns(1, spend);
+    CreateAndProcessBlock(spendTxns, CScript());
+    BOOST_CHECK(chainActive.Tip()->nTx == 2);
+
+    std::string records = IndexRecords(scriptID, spend.vin[0].prevout);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(pindexdb->ReadAddressIndex(scriptID, 2, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 3U);
+
+    // Dropped with their options, the records and flags are gone
+    mapArgs.erase("-addressindex");
+    mapArgs.erase("-spentindex");
+    mapArgs.erase("-timestampindex");
+    BOOST_CHECK(DropIndexes());
+    BOOST_CHECK(!fAddressIndex && !fSpentIndex && !fTimestampIndex);
+    BOOST_CHECK(pblocktree->ReadFlag("addressindex", fValue) && !fValue);
+    addressIndex.clear();
+    BOOST_CHECK(pindexdb->ReadAddressIndex(scriptID, 2, addressIndex));
+    BOOST_CHECK(addressIndex.empty());
+
+    // Built again from the blocks on disk, they hold what ConnectBlock wrote
+    mapArgs["-addressindex"] = mapArgs["-spentindex"] = mapArgs["-timestampindex"] = "1";
+    BOOST_CHECK(BuildIndexes(chainparams));
+    BOOST_CHECK(fAddressIndex && fSpentIndex && fTimestampIndex);
+    BOOST_CHECK(IndexRecords(scriptID, spend.vin[0].prevout) == records);
+
+    mapArgs.erase("-addressindex");
+    mapArgs.erase("-spentindex");
+    mapArgs.erase("-timestampindex");
+    BOOST_CHECK(DropIndexes());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,139 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include "test/test_kekcoin.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+/** Counts its runs, fails if told to, and records the order it ran in */
+struct CountingCheck
+{
+    std::atomic<unsigned int>* pnRuns;
+    std::vector<int>* pvOrder;
+    int nId;
+    bool fOk;
+
+    CountingCheck() : pnRuns(NULL), pvOrder(NULL), nId(0), fOk(true) {}
+    CountingCheck(std::atomic<unsigned int>* pnRunsIn, int nIdIn, bool fOkIn = true, std::vector<int>* pvOrderIn = NULL) :
+        pnRuns(pnRunsIn), pvOrder(pvOrderIn), nId(nIdIn), fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        ++*pnRuns;
+        if (pvOrder)
+            pvOrder->push_back(nId);
+        return fOk;
+    }
+
+    void swap(CountingCheck& check)
+    {
+        std::swap(pnRuns, check.pnRuns);
+        std::swap(pvOrder, check.pvOrder);
+        std::swap(nId, check.nId);
+        std::swap(fOk, check.fOk);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_checks_run)
+{
+    CCheckQueue<CountingCheck> queue(16, 4);
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, &queue));
+
+    // uneven batches, as transactions with different input counts produce
+    for (int nRound = 0; nRound < 50; nRound++) {
+        std::atomic<unsigned int> nRuns(0);
+        unsigned int nTotal = 0;
+        {
+            CCheckQueueControl<CountingCheck> control(&queue);
+            for (int nTx = 0; nTx < 40; nTx++) {
+                std::vector<CountingCheck> vChecks(1 + (nTx * 7 + nRound) % 23, CountingCheck(&nRuns, nTx));
+                nTotal += vChecks.size();
+                control.Add(vChecks, nTx == 1);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        BOOST_CHECK_EQUAL(nRuns.load(), nTotal);
+        BOOST_CHECK(queue.IsIdle());
+    }
+
+    // a failure is reported once, and the queue is clean for the next block
+    std::atomic<unsigned int> nRuns(0);
+    {
+        CCheckQueueControl<CountingCheck> control(&queue);
+        std::vector<CountingCheck> vChecks(100, CountingCheck(&nRuns, 0));
+        vChecks[50] = CountingCheck(&nRuns, 0, false);
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+    BOOST_CHECK(queue.IsIdle());
+    {
+        CCheckQueueControl<CountingCheck> control(&queue);
+        std::vector<CountingCheck> vChecks(10, CountingCheck(&nRuns, 0));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    CCheckQueueStats stats = queue.GetLastStats();
+    uint64_t nExec = 0;
+    for (unsigned int i = 0; i < CCheckQueueStats::BUCKETS; i++)
+        nExec += stats.vExec[i];
+    BOOST_CHECK_EQUAL(nExec, 10U);
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_priority_first)
+{
+    // without workers the master runs everything, priority checks first
+    CCheckQueue<CountingCheck> queue(4, 0);
+    std::atomic<unsigned int> nRuns(0);
+    std::vector<int> vOrder;
+    {
+        CCheckQueueControl<CountingCheck> control(&queue);
+        std::vector<CountingCheck> vChecks(6, CountingCheck(&nRuns, 0, true, &vOrder));
+        control.Add(vChecks);
+        std::vector<CountingCheck> vStake(2, CountingCheck(&nRuns, 1, true, &vOrder));
+        control.Add(vStake, true);
+        BOOST_CHECK(control.Wait());
+    }
+    BOOST_REQUIRE_EQUAL(vOrder.size(), 8U);
+    BOOST_CHECK_EQUAL(vOrder[0], 1);
+    BOOST_CHECK_EQUAL(vOrder[1], 1);
+    BOOST_CHECK_EQUAL(vOrder[2], 0);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_workers_without_deques)
+{
+    // workers of a queue with no deques set aside share the master's
+    CCheckQueue<CountingCheck> queue(4, 0);
+    boost::thread_group threads;
+    for (int i = 0; i < 2; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, &queue));
+
+    std::atomic<unsigned int> nRuns(0);
+    {
+        CCheckQueueControl<CountingCheck> control(&queue);
+        std::vector<CountingCheck> vChecks(100, CountingCheck(&nRuns, 0));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+    BOOST_CHECK_EQUAL(nRuns.load(), 100U);
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
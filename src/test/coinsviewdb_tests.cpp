@@ -0,0 +1,230 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "random.h"
+#include "txdb.h"
+#include "uint256.h"
+#include "test/test_kekcoin.h"
+
+#include <map>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+/** Gives the tests access to the database, to write records in the old layout */
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest(bool fAsyncFlush = false) : CCoinsViewDB(1 << 20, true, true, fAsyncFlush) {}
+
+    void WriteLegacyCoins(const uint256& txid, const CCoins& coins)
+    {
+        db.Write(std::make_pair('c', txid), coins);
+    }
+
+    int ReadVersion()
+    {
+        int nVersion = 0;
+        db.Read('V', nVersion);
+        return nVersion;
+    }
+
+    void WriteVersion(int nVersion)
+    {
+        db.Write('V', nVersion);
+    }
+};
+
+unsigned int RandomOutputCount()
+{
+    // Mostly small transactions, some past the sizes that change how they are read and written
+    switch (insecure_rand() % 8) {
+    case 0: return 17 + insecure_rand() % 40;
+    case 1: return 60 + insecure_rand() % 60;
+    default: return 1 + insecure_rand() % 4;
+    }
+}
+
+void CheckCoins(CCoinsView& view, const std::map<uint256, CCoins>& mapCoins)
+{
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        CCoins coins;
+        // Caches may return pruned entries, the database does not have them
+        bool fFound = view.GetCoins(it->first, coins) && !coins.IsPruned();
+        BOOST_CHECK_EQUAL(fFound, !it->second.IsPruned());
+        BOOST_CHECK_EQUAL(view.HaveCoins(it->first), !it->second.IsPruned());
+        if (fFound)
+            BOOST_CHECK(coins == it->second);
+    }
+}
+
+void CheckDB(CCoinsViewDB& db, const std::map<uint256, CCoins>& mapCoins)
+{
+    CheckCoins(db, mapCoins);
+
+    size_t nFound = 0;
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    while (pcursor->Valid()) {
+        uint256 txid;
+        CCoins coins;
+        BOOST_CHECK(pcursor->GetKey(txid));
+        BOOST_CHECK(pcursor->GetValue(coins));
+        BOOST_CHECK_EQUAL(pcursor->GetValueSize(), ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION));
+        std::map<uint256, CCoins>::const_iterator it = mapCoins.find(txid);
+        BOOST_CHECK(it != mapCoins.end() && it->second == coins);
+        nFound++;
+        pcursor->Next();
+    }
+    size_t nUnspent = 0;
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+        nUnspent += !it->second.IsPruned();
+    BOOST_CHECK_EQUAL(nFound, nUnspent);
+}
+
+void SimulateFlushes(bool fAsyncFlush)
+{
+    seed_insecure_rand(true);
+    CCoinsViewDBTest db(fAsyncFlush);
+    CCoinsViewCache base(&db);
+    std::map<uint256, CCoins> mapCoins;
+    std::vector<uint256> vTxids;
+
+    for (int nRound = 0; nRound < 60; nRound++) {
+        // Changes go through a child cache most of the time, as blocks are connected
+        boost::scoped_ptr<CCoinsViewCache> pchild(insecure_rand() % 4 ? new CCoinsViewCache(&base) : NULL);
+        CCoinsViewCache& cache = pchild ? *pchild : base;
+
+        for (int i = 0; i < 4; i++) {
+            uint256 txid = GetRandHash();
+            CCoins coins = RandomCoins(nRound, RandomOutputCount());
+            *cache.ModifyNewCoins(txid, coins.fCoinBase) = coins;
+            coins.Cleanup();
+            mapCoins[txid] = coins;
+            vTxids.push_back(txid);
+        }
+        for (int i = 0; i < 12; i++) {
+            const uint256& txid = vTxids[insecure_rand() % vTxids.size()];
+            CCoins& coins = mapCoins[txid];
+            if (coins.IsPruned())
+                continue;
+            unsigned int n = insecure_rand() % coins.vout.size();
+            cache.ModifyCoins(txid)->Spend(n);
+            coins.Spend(n);
+        }
+        if (insecure_rand() % 10 == 0) {
+            // A spent transaction id that is used again, as duplicate coinbases were
+            const uint256& txid = vTxids[insecure_rand() % vTxids.size()];
+            if (mapCoins[txid].IsPruned()) {
+                CCoins coins = RandomCoins(nRound, RandomOutputCount());
+                *cache.ModifyNewCoins(txid, true) = coins;
+                coins.Cleanup();
+                mapCoins[txid] = coins;
+            }
+        }
+
+        if (pchild)
+            BOOST_CHECK(pchild->Flush());
+        if (insecure_rand() % 3 == 0) {
+            uint256 hashBlock = GetRandHash();
+            base.SetBestBlock(hashBlock);
+            BOOST_CHECK(base.Flush());
+            // An asynchronous flush may still be writing, reads see its result anyway
+            BOOST_CHECK(db.GetBestBlock() == hashBlock);
+            CheckCoins(db, mapCoins);
+            if (insecure_rand() % 2 == 0) {
+                BOOST_CHECK(db.Sync());
+                CheckDB(db, mapCoins);
+            }
+        }
+        CheckCoins(base, mapCoins);
+    }
+    base.SetBestBlock(GetRandHash());
+    BOOST_CHECK(base.Flush());
+    CheckDB(db, mapCoins);
+    BOOST_CHECK_EQUAL(db.DynamicMemoryUsage(), 0U);
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(coinsviewdb_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(coinsviewdb_per_output_simulation)
+{
+    SimulateFlushes(false);
+}
+
+BOOST_AUTO_TEST_CASE(coinsviewdb_async_flush_simulation)
+{
+    SimulateFlushes(true);
+}
+
+BOOST_AUTO_TEST_CASE(coinsviewdb_spend_writes_one_output)
+{
+    seed_insecure_rand(true);
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coins = RandomCoins(1, 200);
+    coins.fCoinBase = false;
+
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyNewCoins(txid, false) = coins;
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    uint64_t nBytesCreated = db.GetBytesWritten();
+
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txid)->Spend(150);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    coins.Spend(150);
+    uint64_t nBytesSpent = db.GetBytesWritten() - nBytesCreated;
+    // The erased output and the best block, not the other 199 outputs
+    BOOST_CHECK(nBytesSpent < 100);
+    BOOST_CHECK(nBytesCreated > 200 * 30);
+
+    CCoins coinsRead;
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+}
+
+BOOST_AUTO_TEST_CASE(coinsviewdb_upgrade)
+{
+    seed_insecure_rand(true);
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> mapCoins;
+    for (int i = 0; i < 100; i++) {
+        uint256 txid = GetRandHash();
+        CCoins coins = RandomCoins(i, RandomOutputCount());
+        for (unsigned int n = 0; n < coins.vout.size(); n++) {
+            if (insecure_rand() % 3 == 0)
+                coins.Spend(n);
+        }
+        if (coins.IsPruned())
+            continue;
+        db.WriteLegacyCoins(txid, coins);
+        mapCoins[txid] = coins;
+    }
+    BOOST_CHECK(!db.HaveCoins(mapCoins.begin()->first));
+
+    BOOST_CHECK(db.Upgrade());
+    CheckDB(db, mapCoins);
+    BOOST_CHECK_EQUAL(db.ReadVersion(), CHAINSTATE_VERSION);
+    // Nothing is left to convert
+    BOOST_CHECK(db.Upgrade());
+    CheckDB(db, mapCoins);
+
+    // A layout from a later version is not touched
+    db.WriteVersion(CHAINSTATE_VERSION + 1);
+    BOOST_CHECK(db.IsNewerVersion());
+    BOOST_CHECK(!db.Upgrade());
+    BOOST_CHECK_EQUAL(db.ReadVersion(), CHAINSTATE_VERSION + 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/muhash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_kekcoin.h"
@@ -439,4 +440,84 @@ BOOST_AUTO_TEST_CASE(aes_cbc_testvectors) {
                   "b2eb05e2c39be9fcda6c19078c6a9d1b3f461796d6b0d6b2e0c2a72b4d80e644");
 }
 
+static uint256 MuHashDigest(MuHash3072 muhash)
+{
+    uint256 hash;
+    muhash.Finalize(*reinterpret_cast<unsigned char (*)[32]>(hash.begin()));
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(muhash_set_properties) {
+    unsigned char elems[4][4] = {{0, 0, 0, 0}, {1, 0, 0, 0}, {0, 0, 0, 1}, {255, 255, 255, 255}};
+
+    // Insertion order does not matter
+    MuHash3072 a, b;
+    for (int i = 0; i < 4; i++)
+        a.Insert(elems[i], 4);
+    for (int i = 3; i >= 0; i--)
+        b.Insert(elems[i], 4);
+    BOOST_CHECK(MuHashDigest(a) == MuHashDigest(b));
+
+    // Removing what was inserted gives back the empty set, in any order
+    MuHash3072 empty;
+    MuHash3072 c;
+    c.Insert(elems[0], 4).Insert(elems[1], 4).Remove(elems[0], 4).Remove(elems[1], 4);
+    BOOST_CHECK(MuHashDigest(c) == MuHashDigest(empty));
+    MuHash3072 d;
+    d.Remove(elems[2], 4).Insert(elems[2], 4);
+    BOOST_CHECK(MuHashDigest(d) == MuHashDigest(empty));
+
+    // Distinct sets hash differently, including multisets
+    MuHash3072 e, f;
+    e.Insert(elems[0], 4).Insert(elems[1], 4);
+    f.Insert(elems[0], 4).Insert(elems[2], 4);
+    BOOST_CHECK(MuHashDigest(e) != MuHashDigest(f));
+    BOOST_CHECK(MuHashDigest(e) != MuHashDigest(empty));
+    MuHash3072 g;
+    g.Insert(elems[0], 4).Insert(elems[0], 4).Insert(elems[1], 4);
+    BOOST_CHECK(MuHashDigest(e) != MuHashDigest(g));
+
+    // Combining set hashes matches inserting into one
+    MuHash3072 h, i;
+    h.Insert(elems[0], 4).Insert(elems[1], 4);
+    i.Insert(elems[2], 4).Insert(elems[3], 4);
+    h *= i;
+    BOOST_CHECK(MuHashDigest(h) == MuHashDigest(a));
+    h /= i;
+    BOOST_CHECK(MuHashDigest(h) == MuHashDigest(e));
+
+    // Serialization keeps the pending denominator
+    MuHash3072 j;
+    j.Insert(elems[0], 4).Insert(elems[1], 4).Insert(elems[3], 4).Remove(elems[3], 4);
+    unsigned char bytes[2 * Num3072::BYTE_SIZE];
+    j.ToBytes(bytes);
+    MuHash3072 k;
+    k.FromBytes(bytes);
+    BOOST_CHECK(MuHashDigest(k) == MuHashDigest(e));
+    k.Normalize();
+    BOOST_CHECK(MuHashDigest(k) == MuHashDigest(e));
+}
+
+BOOST_AUTO_TEST_CASE(muhash_vectors) {
+    unsigned char elems[4][4] = {{0, 0, 0, 0}, {1, 0, 0, 0}, {0, 0, 0, 1}, {255, 255, 255, 255}};
+
+    // Digests as stored in the 'U' records, from an independent bignum implementation
+    MuHash3072 empty;
+    BOOST_CHECK_EQUAL(HexStr(MuHashDigest(empty)), "c85525462fdcf30a2c18d6f4b92923000974355c2477f59594d2c205a1d25add");
+    MuHash3072 a;
+    a.Insert(elems[0], 4);
+    BOOST_CHECK_EQUAL(HexStr(MuHashDigest(a)), "863947176dd01e035894629983e0992420f3905d834800b63535ce41841b8edc");
+    MuHash3072 b;
+    b.Insert(elems[0], 4).Insert(elems[1], 4);
+    BOOST_CHECK_EQUAL(HexStr(MuHashDigest(b)), "b2e7d916f86c0f427e08c1c82b88abaa8e4f1093e8ec47fa491df02f9f8e48bf");
+
+    // Removals take the inverse of the element
+    MuHash3072 c;
+    c.Insert(elems[0], 4).Insert(elems[1], 4).Insert(elems[3], 4).Remove(elems[2], 4);
+    BOOST_CHECK_EQUAL(HexStr(MuHashDigest(c)), "5ccdbe1405537cac9948db022be74a8eedbec57726ea67055c73265a0a5081d9");
+    MuHash3072 d;
+    d.Remove(elems[2], 4);
+    BOOST_CHECK_EQUAL(HexStr(MuHashDigest(d)), "6a727a1e4b09ccc26bb6b7ba2c842572f5ce57c67c31e1de77510fa6f2d9d983");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
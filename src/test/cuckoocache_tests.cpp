@@ -0,0 +1,109 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "uint256.h"
+
+#include "test/test_kekcoin.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+static std::vector<uint256> RandomKeys(size_t nCount)
+{
+    std::vector<uint256> vKeys(nCount);
+    for (size_t i = 0; i < nCount; i++)
+        vKeys[i] = GetRandHash();
+    return vKeys;
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_insert_contains)
+{
+    CCuckooCache cache;
+    BOOST_CHECK(!cache.Contains(GetRandHash(), false));
+
+    size_t nSize = cache.Setup(1 << 16);
+    BOOST_CHECK_EQUAL(nSize, (size_t)(1 << 16) / 33);
+
+    // at half load everything inserted is found
+    std::vector<uint256> vKeys = RandomKeys(nSize / 2);
+    for (size_t i = 0; i < vKeys.size(); i++)
+        cache.Insert(vKeys[i]);
+    for (size_t i = 0; i < vKeys.size(); i++)
+        BOOST_CHECK(cache.Contains(vKeys[i], false));
+
+    std::vector<uint256> vOther = RandomKeys(100);
+    for (size_t i = 0; i < vOther.size(); i++)
+        BOOST_CHECK(!cache.Contains(vOther[i], false));
+    BOOST_CHECK(!cache.Contains(uint256(), false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase_and_generations)
+{
+    CCuckooCache cache;
+    size_t nSize = cache.Setup(1 << 16);
+
+    // erasing makes room without disturbing the other entries
+    std::vector<uint256> vKeys = RandomKeys(nSize * 4 / 10);
+    for (size_t i = 0; i < vKeys.size(); i++)
+        cache.Insert(vKeys[i]);
+    for (size_t i = 0; i < vKeys.size() / 2; i++)
+        BOOST_CHECK(cache.Contains(vKeys[i], true));
+    std::vector<uint256> vNew = RandomKeys(vKeys.size() / 2);
+    for (size_t i = 0; i < vNew.size(); i++)
+        cache.Insert(vNew[i]);
+    size_t nFound = 0;
+    for (size_t i = 0; i < vNew.size(); i++)
+        nFound += cache.Contains(vNew[i], false);
+    BOOST_CHECK(nFound * 100 >= vNew.size() * 99);
+    nFound = 0;
+    for (size_t i = vKeys.size() / 2; i < vKeys.size(); i++)
+        nFound += cache.Contains(vKeys[i], false);
+    BOOST_CHECK(nFound * 100 >= (vKeys.size() - vKeys.size() / 2) * 99);
+
+    // inserting far more than fits keeps the newest entries
+    std::vector<uint256> vMany = RandomKeys(nSize * 4);
+    for (size_t i = 0; i < vMany.size(); i++)
+        cache.Insert(vMany[i]);
+    nFound = 0;
+    for (size_t i = vMany.size() - nSize / 4; i < vMany.size(); i++)
+        nFound += cache.Contains(vMany[i], false);
+    BOOST_CHECK(nFound * 100 >= (nSize / 4) * 95);
+}
+
+static void LookupAll(CCuckooCache* cache, const std::vector<uint256>* vKeys, size_t* nFound)
+{
+    for (size_t i = 0; i < vKeys->size(); i++)
+        *nFound += cache->Contains((*vKeys)[i], false);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_concurrent_lookups)
+{
+    CCuckooCache cache;
+    size_t nSize = cache.Setup(1 << 18);
+    std::vector<uint256> vKeys = RandomKeys(nSize / 4);
+    for (size_t i = 0; i < vKeys.size(); i++)
+        cache.Insert(vKeys[i]);
+
+    // readers never block on, nor lose entries to, a writer filling other slots
+    std::vector<size_t> vFound(4, 0);
+    boost::thread_group threads;
+    for (size_t i = 0; i < vFound.size(); i++)
+        threads.create_thread(boost::bind(&LookupAll, &cache, &vKeys, &vFound[i]));
+    std::vector<uint256> vNew = RandomKeys(nSize / 8);
+    for (size_t i = 0; i < vNew.size(); i++)
+        cache.Insert(vNew[i]);
+    threads.join_all();
+
+    for (size_t i = 0; i < vFound.size(); i++)
+        BOOST_CHECK(vFound[i] * 100 >= vKeys.size() * 99);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -90,6 +90,64 @@ BOOST_AUTO_TEST_CASE(dbwrapper_maxopenfiles_1000)
     BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_tuning)
+{
+    std::string strError;
+    BOOST_CHECK(!SetDBTuning(vector<string>(1, "tunedb"), strError));
+    BOOST_CHECK(!SetDBTuning(vector<string>(1, "tunedb:cache=0"), strError));
+    BOOST_CHECK(!SetDBTuning(vector<string>(1, "tunedb:readshare=100"), strError));
+    BOOST_CHECK(!SetDBTuning(vector<string>(1, "tunedb:unknown=1"), strError));
+    BOOST_CHECK(SetDBTuning(vector<string>(1, "tunedb:cache=2,readshare=75,bloombits=0,compression=1,blocksize=16"), strError));
+
+    size_t nBlockCache = (2 << 20) / 100 * 75;
+    BOOST_CHECK_EQUAL(GetDBBlockCacheSize("tunedb", 1 << 20), nBlockCache);
+    BOOST_CHECK_EQUAL(GetDBBlockCacheSize("other", 1 << 20), (1 << 20) / 100 * 50);
+    {
+        CDBWrapper dbw(temp_directory_path() / unique_path() / "tunedb", 1 << 20, true);
+        CDBStats stats;
+        dbw.GetStats(stats);
+        BOOST_CHECK_EQUAL(stats.strName, "tunedb");
+        BOOST_CHECK_EQUAL(stats.nBlockCacheSize, nBlockCache);
+        BOOST_CHECK_EQUAL(stats.nWriteBufferSize, ((2 << 20) - nBlockCache) / 2);
+        BOOST_CHECK_EQUAL(stats.nBlockSize, 16384U);
+        BOOST_CHECK_EQUAL(stats.nBloomBits, 0);
+        BOOST_CHECK(stats.fCompression);
+        BOOST_CHECK(!stats.fSharedCache);
+
+        // Fill the write buffer a few times, so that reads go to the tables
+        vector<unsigned char> value(512, 'v');
+        for (int i = 0; i < 4000; i++)
+            BOOST_CHECK(dbw.Write(make_pair('k', i), value));
+        for (int i = 0; i < 4000; i++)
+            BOOST_CHECK(dbw.Read(make_pair('k', i), value));
+        dbw.GetStats(stats);
+        BOOST_CHECK(stats.nCacheHits > 0);
+        BOOST_CHECK(stats.nCacheMisses > 0);
+        BOOST_CHECK(!stats.strLevelDBStats.empty());
+
+        vector<CDBStats> vStats = GetDBStats();
+        bool fFound = false;
+        for (unsigned int i = 0; i < vStats.size(); i++)
+            fFound |= vStats[i].strName == "tunedb";
+        BOOST_CHECK(fFound);
+    }
+    BOOST_CHECK(SetDBTuning(vector<string>(), strError));
+
+    SetSharedDBCache(1 << 20);
+    {
+        CDBWrapper dbw1(temp_directory_path() / unique_path(), 1 << 20, true);
+        CDBWrapper dbw2(temp_directory_path() / unique_path(), 1 << 20, true);
+        CDBStats stats1, stats2;
+        dbw1.GetStats(stats1);
+        dbw2.GetStats(stats2);
+        BOOST_CHECK(stats1.fSharedCache && stats2.fSharedCache);
+        BOOST_CHECK_EQUAL(stats1.nBlockCacheSize, 1U << 20);
+        // Leaving the shared cache to the databases that use it
+        SetSharedDBCache(0);
+        BOOST_CHECK(dbw1.Write('k', GetRandHash()));
+    }
+}
+
 // Test batch operations
 BOOST_AUTO_TEST_CASE(dbwrapper_batch)
 {
@@ -128,6 +186,59 @@ BOOST_AUTO_TEST_CASE(dbwrapper_batch)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_bulk)
+{
+    path ph = temp_directory_path() / unique_path();
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, false, true);
+        dbw.Write(std::make_pair('b', 0), 100);
+        dbw.Write(std::make_pair('b', 1), 101);
+
+        // held back writes are visible to reads, in memory or written out when the limit is passed
+        dbw.SetBulkMode(true, 16 << 10);
+        BOOST_CHECK(dbw.IsBulkMode());
+        for (int i = 2; i < 2000; i++) {
+            CDBBatch batch(dbw);
+            batch.Write(std::make_pair('b', i), 100 + i);
+            batch.Erase(std::make_pair('b', i - 2));
+            dbw.WriteBatch(batch);
+            int n = 0;
+            BOOST_CHECK(dbw.Read(std::make_pair('b', i), n) && n == 100 + i);
+            BOOST_CHECK(!dbw.Exists(std::make_pair('b', i - 2)));
+            BOOST_CHECK(dbw.Exists(std::make_pair('b', i - 1)));
+        }
+
+        // iterators see everything
+        boost::scoped_ptr<CDBIterator> it(dbw.NewIterator());
+        it->Seek(std::make_pair('b', 0));
+        std::pair<char, int> key;
+        int n = 0;
+        BOOST_CHECK(it->Valid() && it->GetKey(key) && key.second == 1998);
+        BOOST_CHECK(it->GetValue(n) && n == 2098);
+        it->Next();
+        BOOST_CHECK(it->Valid() && it->GetKey(key) && key.second == 1999);
+        it->Next();
+        BOOST_CHECK(!it->Valid());
+
+        // writes after the iterator was made are held back again
+        dbw.Write(std::make_pair('b', 2000), 2100);
+        dbw.SetBulkMode(false);
+        BOOST_CHECK(!dbw.IsBulkMode());
+        BOOST_CHECK(dbw.Read(std::make_pair('b', 2000), n) && n == 2100);
+
+        // closing the database in bulk mode writes out what is held back
+        dbw.SetBulkMode(true);
+        dbw.Erase(std::make_pair('b', 1998));
+    }
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, false, true);
+        int n = 0;
+        BOOST_CHECK(!dbw.Read(std::make_pair('b', 1998), n));
+        BOOST_CHECK(dbw.Read(std::make_pair('b', 1999), n) && n == 2099);
+        BOOST_CHECK(dbw.Read(std::make_pair('b', 2000), n) && n == 2100);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
 {
     // Perform tests both obfuscated and non-obfuscated.
@@ -0,0 +1,188 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "kernel.h"
+#include "main.h"
+#include "txdb.h"
+
+#include "test/test_kekcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(kernel_tests, TestingSetup)
+
+static COutPoint TestOutPoint(uint32_t n)
+{
+    return COutPoint(uint256S("0xbeef"), n);
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_cache_lru)
+{
+    CStakeKernelCache cache(2);
+    std::vector<std::pair<COutPoint, CStakeIndexValue> > vect;
+    for (uint32_t n = 0; n < 3; n++)
+        vect.push_back(std::make_pair(TestOutPoint(n), CStakeIndexValue(1000 + n, 900 + n, 81 + n, COIN * (n + 1), 10 + n, uint256S("0xb10c"))));
+
+    // only the two most recently added entries stay in memory
+    cache.Update(vect);
+    BOOST_CHECK_EQUAL(cache.Size(), 2U);
+
+    CStakeIndexValue value;
+    BOOST_CHECK(!cache.Get(TestOutPoint(0), value));
+    BOOST_CHECK(cache.Get(TestOutPoint(1), value));
+    BOOST_CHECK_EQUAL(value.nBlockTime, 1001U);
+    BOOST_CHECK_EQUAL(value.nTxTime, 901U);
+    BOOST_CHECK_EQUAL(value.nTxOffset, 82U);
+    BOOST_CHECK_EQUAL(value.nValue, 2 * COIN);
+    BOOST_CHECK_EQUAL(value.nHeight, 11);
+
+    // entry 1 was just used, so adding entry 0 again evicts entry 2
+    cache.Update(std::vector<std::pair<COutPoint, CStakeIndexValue> >(1, vect[0]));
+    BOOST_CHECK(cache.Get(TestOutPoint(1), value));
+    BOOST_CHECK(!cache.Get(TestOutPoint(2), value));
+
+    // null values erase
+    cache.Update(std::vector<std::pair<COutPoint, CStakeIndexValue> >(1, std::make_pair(TestOutPoint(1), CStakeIndexValue())));
+    BOOST_CHECK(!cache.Get(TestOutPoint(1), value));
+    BOOST_CHECK_EQUAL(cache.Size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_cache_db_fallback)
+{
+    CStakeKernelCache cache(1);
+    std::vector<std::pair<COutPoint, CStakeIndexValue> > vect;
+    vect.push_back(std::make_pair(TestOutPoint(7), CStakeIndexValue(2000, 1999, 81, 5 * COIN, 42, uint256S("0xb10c"))));
+    BOOST_CHECK(pblocktree->UpdateStakeIndex(vect));
+
+    // a memory miss is served from the block tree database and then cached
+    CStakeIndexValue value;
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+    BOOST_CHECK(cache.Get(TestOutPoint(7), value));
+    BOOST_CHECK_EQUAL(value.nHeight, 42);
+    BOOST_CHECK_EQUAL(value.nValue, 5 * COIN);
+    BOOST_CHECK_EQUAL(cache.Size(), 1U);
+
+    vect[0].second.SetNull();
+    BOOST_CHECK(pblocktree->UpdateStakeIndex(vect));
+    cache.Update(vect);
+    BOOST_CHECK(!cache.Get(TestOutPoint(7), value));
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_input_branch)
+{
+    // Two branches forking at height 1, each with a block at height 2
+    std::vector<CBlockIndex> vMain(4), vFork(4);
+    std::vector<uint256> vMainHash(4), vForkHash(4);
+    for (int i = 0; i < 4; i++) {
+        vMainHash[i] = ArithToUint256(arith_uint256(100 + i));
+        vMain[i].phashBlock = &vMainHash[i];
+        vMain[i].nHeight = i;
+        vMain[i].pprev = i ? &vMain[i - 1] : NULL;
+    }
+    for (int i = 2; i < 4; i++) {
+        vForkHash[i] = ArithToUint256(arith_uint256(200 + i));
+        vFork[i].phashBlock = &vForkHash[i];
+        vFork[i].nHeight = i;
+        vFork[i].pprev = i == 2 ? &vMain[1] : &vFork[i - 1];
+    }
+
+    std::vector<std::pair<COutPoint, CStakeIndexValue> > vect;
+    vect.push_back(std::make_pair(TestOutPoint(9), CStakeIndexValue(2000, 1999, 81, 5 * COIN, 2, vMainHash[2])));
+    stakeKernelCache.Update(vect);
+
+    // the record is used below the block that created the output
+    CStakeIndexValue value;
+    const CBlockIndex* pindexFrom = NULL;
+    BOOST_CHECK(GetStakeKernelInput(&vMain[3], TestOutPoint(9), value, &pindexFrom));
+    BOOST_CHECK(pindexFrom == &vMain[2]);
+
+    // but not on the other branch, where the output has no transaction to fall back to
+    BOOST_CHECK(!GetStakeKernelInput(&vFork[3], TestOutPoint(9), value, &pindexFrom));
+
+    vect[0].second.SetNull();
+    stakeKernelCache.Update(vect);
+}
+
+static CStakeCandidate TestCandidate(uint32_t n, unsigned int nBlockTime)
+{
+    CStakeCandidate candidate;
+    candidate.prevout = TestOutPoint(n);
+    candidate.kernelInput = CStakeIndexValue(nBlockTime, nBlockTime, 81, 10 * COIN, 10, uint256S("0xb10c"));
+    return candidate;
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_search_order)
+{
+    const unsigned int nTimeTx = 1500000000;
+    const unsigned int nOld = nTimeTx - Params().GetConsensus().nStakeMinAge - 1000;
+    const unsigned int nYoung = nTimeTx - Params().GetConsensus().nStakeMinAge + 1000;
+
+    std::vector<CStakeCandidate> vCandidates;
+    for (uint32_t n = 0; n < 40; n++)
+        vCandidates.push_back(TestCandidate(n, (n == 23 || n == 31) ? nOld : nYoung));
+
+    // single threaded and sliced searches agree on the first kernel
+    for (int nThreads = 1; nThreads <= 4; nThreads += 3) {
+        CStakeKernelSearch search;
+        search.SetThreads(nThreads);
+
+        size_t nCandidate = 0;
+        unsigned int nTimeKernel = 0;
+        BOOST_CHECK(search.Search(vCandidates, 0, nTimeTx, 16, nCandidate, nTimeKernel));
+        BOOST_CHECK_EQUAL(nCandidate, 23U);
+        BOOST_CHECK_EQUAL(nTimeKernel, nTimeTx);
+
+        BOOST_CHECK(search.Search(vCandidates, nCandidate + 1, nTimeTx, 16, nCandidate, nTimeKernel));
+        BOOST_CHECK_EQUAL(nCandidate, 31U);
+
+        BOOST_CHECK(!search.Search(vCandidates, nCandidate + 1, nTimeTx, 16, nCandidate, nTimeKernel));
+        BOOST_CHECK(search.GetKernelsEvaluated() > 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_table)
+{
+    // Two branches sharing the first 50 blocks, with modifiers every 7th block on the first and every 5th on the second
+    std::vector<CBlockIndex> vMain(100), vFork(100);
+    for (int i = 0; i < 100; i++) {
+        vMain[i].nHeight = i;
+        vMain[i].nTime = 1000 + i * 10;
+        vMain[i].pprev = i ? &vMain[i - 1] : NULL;
+        vMain[i].SetStakeModifier(i, i && i % 7 == 0);
+    }
+    for (int i = 50; i < 100; i++) {
+        vFork[i].nHeight = i;
+        vFork[i].nTime = 1000 + i * 10;
+        vFork[i].pprev = i == 50 ? &vMain[49] : &vFork[i - 1];
+        vFork[i].SetStakeModifier(1000 + i, i % 5 == 0);
+    }
+
+    CChain chain;
+    chain.SetTip(&vMain[99]);
+    CStakeModifierTable table;
+    table.Sync(chain);
+    BOOST_CHECK(table.Tip() == &vMain[99]);
+
+    BOOST_CHECK(table.GetLastGenerated(6) == NULL);
+    BOOST_CHECK(table.GetLastGenerated(7) == &vMain[7]);
+    BOOST_CHECK(table.GetLastGenerated(55) == &vMain[49]);
+    BOOST_CHECK(table.GetNextGenerated(7, vMain[7].nTime) == &vMain[14]);
+    BOOST_CHECK(table.GetNextGenerated(10, vMain[10].nTime + 200) == &vMain[35]);
+    BOOST_CHECK(table.GetNextGenerated(90, vMain[90].nTime + 100) == NULL);
+
+    // disconnecting the tip and reorganizing onto the fork keeps the table in step
+    table.Disconnect(&vMain[99]);
+    BOOST_CHECK(table.Tip() == &vMain[98]);
+    table.Connect(&vMain[99]);
+    chain.SetTip(&vFork[99]);
+    table.Sync(chain);
+    BOOST_CHECK(table.Tip() == &vFork[99]);
+    BOOST_CHECK(table.GetLastGenerated(49) == &vMain[49]);
+    BOOST_CHECK(table.GetLastGenerated(54) == &vFork[50]);
+    BOOST_CHECK(table.GetLastGenerated(57) == &vFork[55]);
+    BOOST_CHECK(table.GetNextGenerated(50, vMain[50].nTime) == &vFork[55]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "txdb.h"
 
 #include "test/test_kekcoin.h"
 
@@ -41,4 +42,109 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_AUTO_TEST_CASE(raw_block_read)
+{
+    const CChainParams& chainparams = Params();
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex);
+
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()));
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+
+    CRawBlockRef rawBlock;
+    BOOST_CHECK(ReadRawBlockFromDisk(rawBlock, pindex, chainparams.MessageStart()));
+    BOOST_REQUIRE(rawBlock);
+    BOOST_CHECK(std::string(rawBlock->begin(), rawBlock->end()) == ssBlock.str());
+
+    // a second read is served from the cache; a block under another hash is
+    // read from disk again, and fails on the wrong message start
+    CRawBlockRef rawBlockAgain;
+    BOOST_CHECK(ReadRawBlockFromDisk(rawBlockAgain, pindex, chainparams.MessageStart()));
+    BOOST_CHECK(rawBlockAgain == rawBlock);
+
+    const CChainParams& otherparams = Params(CBaseChainParams::REGTEST);
+    if (memcmp(otherparams.MessageStart(), chainparams.MessageStart(), MESSAGE_START_SIZE)) {
+        CRawBlockRef rawBlockOther;
+        CBlockIndex index(*pindex);
+        uint256 hashOther = uint256S("0x1");
+        index.phashBlock = &hashOther;
+        BOOST_CHECK(!ReadRawBlockFromDisk(rawBlockOther, &index, otherparams.MessageStart()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_index_snapshot)
+{
+    const CBlockIndex* pindexGenesis = chainActive.Genesis();
+    BOOST_REQUIRE(pindexGenesis);
+
+    // a proof-of-work and a proof-of-stake block on top of genesis
+    uint256 hashA = uint256S("0xa"), hashB = uint256S("0xb");
+    CBlockIndex indexA, indexB;
+    indexA.phashBlock = &hashA;
+    indexA.pprev = const_cast<CBlockIndex*>(pindexGenesis);
+    indexA.nHeight = 1;
+    indexA.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA;
+    indexA.nTx = 2;
+    indexA.nDataPos = 1234;
+    indexA.nTime = pindexGenesis->nTime + 60;
+    indexA.nMint = 50 * COIN;
+    indexA.nMoneySupply = 100 * COIN;
+    indexA.hashProof = UintToArith256(uint256S("0x1234"));
+    indexB.phashBlock = &hashB;
+    indexB.pprev = &indexA;
+    indexB.nHeight = 2;
+    indexB.nStatus = BLOCK_VALID_TREE;
+    indexB.SetProofOfStake();
+    indexB.nStakeModifier = 0x0123456789abcdefULL;
+    indexB.prevoutStake = COutPoint(uint256S("0xc"), 3);
+    indexB.nStakeTime = indexA.nTime + 30;
+
+    std::vector<const CBlockIndex*> vIndex;
+    vIndex.push_back(pindexGenesis);
+    vIndex.push_back(&indexA);
+    vIndex.push_back(&indexB);
+    BOOST_CHECK(pblocktree->WriteBlockIndexSnapshot(vIndex));
+
+    std::map<uint256, CBlockIndex> mapLoaded;
+    boost::function<CBlockIndex*(const uint256&)> insert = [&mapLoaded](const uint256& hash) {
+        CBlockIndex* pindex = &mapLoaded[hash];
+        pindex->phashBlock = &mapLoaded.find(hash)->first;
+        return pindex;
+    };
+    std::vector<CBlockIndex*> vLoaded;
+    BOOST_CHECK(pblocktree->LoadBlockIndexSnapshot(insert, vLoaded));
+    BOOST_REQUIRE_EQUAL(vLoaded.size(), 3U);
+    for (unsigned int i = 0; i < vLoaded.size(); i++) {
+        BOOST_CHECK(vLoaded[i]->GetBlockHash() == vIndex[i]->GetBlockHash());
+        BOOST_CHECK(vLoaded[i]->pprev == (i ? vLoaded[i - 1] : NULL));
+        BOOST_CHECK_EQUAL(vLoaded[i]->nHeight, vIndex[i]->nHeight);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nStatus, vIndex[i]->nStatus);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nTx, vIndex[i]->nTx);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nDataPos, vIndex[i]->nDataPos);
+        BOOST_CHECK(vLoaded[i]->hashMerkleRoot == vIndex[i]->hashMerkleRoot);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nTime, vIndex[i]->nTime);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nBits, vIndex[i]->nBits);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nMint, vIndex[i]->nMint);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nMoneySupply, vIndex[i]->nMoneySupply);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nFlags, vIndex[i]->nFlags);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nStakeModifier, vIndex[i]->nStakeModifier);
+        BOOST_CHECK(vLoaded[i]->hashProof == vIndex[i]->hashProof);
+        BOOST_CHECK(vLoaded[i]->prevoutStake == vIndex[i]->prevoutStake);
+        BOOST_CHECK_EQUAL(vLoaded[i]->nStakeTime, vIndex[i]->nStakeTime);
+    }
+
+    // writing a block index entry makes the snapshot stale
+    std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
+    std::vector<const CBlockIndex*> vDirty(1, &indexB);
+    BOOST_CHECK(pblocktree->WriteBatchSync(vFiles, 0, vDirty));
+    BOOST_CHECK(!pblocktree->LoadBlockIndexSnapshot(insert, vLoaded));
+
+    // parents have to come first
+    std::swap(vIndex[1], vIndex[2]);
+    BOOST_CHECK(!pblocktree->WriteBlockIndexSnapshot(vIndex));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,214 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "pos.h"
+
+#include "amount.h"
+#include "arith_uint256.h"
+#include "bignum.h"
+#include "chainparams.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include "test/test_kekcoin.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(pos_tests, BasicTestingSetup)
+
+/* The OpenSSL versions the fixed-width code replaced, kept here as the reference */
+static bool BigNumCheckStakeTarget(unsigned int nBits, int64_t nValue, int64_t nTimeWeight, const arith_uint256& hashProofOfStake, arith_uint256& targetProofOfStake)
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    CBigNum bnCoinDayWeight = CBigNum(nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+    targetProofOfStake = UintToArith256((bnCoinDayWeight * bnTargetPerCoinDay).getuint256());
+    return CBigNum(ArithToUint256(hashProofOfStake)) <= bnCoinDayWeight * bnTargetPerCoinDay;
+}
+
+static uint64_t BigNumCoinAge(const std::vector<std::pair<int64_t, int64_t> >& vInputs)
+{
+    CBigNum bnCentSecond = 0;
+    for (unsigned int i = 0; i < vInputs.size(); i++)
+        bnCentSecond += CBigNum(vInputs[i].first) * vInputs[i].second / CENT;
+    CBigNum bnCoinDay = ((bnCentSecond * CENT) / COIN) / (24 * 60 * 60);
+    return bnCoinDay.getuint64();
+}
+
+static int64_t RandValue()
+{
+    switch (GetRand(8)) {
+    case 0: return 0;
+    case 1: return std::numeric_limits<int64_t>::max();
+    case 2: return GetRand(COIN);
+    default: return GetRand(MAX_MONEY + 1);
+    }
+}
+
+static int64_t RandTimeWeight()
+{
+    switch (GetRand(8)) {
+    case 0: return 0;
+    case 1: return std::numeric_limits<int64_t>::max();
+    case 2: return GetRand(24 * 60 * 60);
+    default: return GetRand(90 * 24 * 60 * 60);
+    }
+}
+
+static unsigned int RandCompact()
+{
+    // mostly realistic targets, but also every exponent and the sign bit
+    unsigned int nSize = GetRand(4) ? GetRand(36) : GetRand(256);
+    unsigned int nCompact = (nSize << 24) | GetRand(0x00800000);
+    if (!GetRand(8))
+        nCompact |= 0x00800000;
+    return nCompact;
+}
+
+BOOST_AUTO_TEST_CASE(stake_target_matches_bignum)
+{
+    for (int i = 0; i < 20000; i++) {
+        unsigned int nBits = RandCompact();
+        int64_t nValue = RandValue();
+        int64_t nTimeWeight = RandTimeWeight();
+
+        arith_uint256 targetBigNum;
+        BigNumCheckStakeTarget(nBits, nValue, nTimeWeight, arith_uint256(), targetBigNum);
+
+        // random hashes plus the ones right at the edge of the target
+        arith_uint256 vHash[] = {UintToArith256(GetRandHash()), arith_uint256(), targetBigNum, targetBigNum - 1, targetBigNum + 1};
+        for (unsigned int j = 0; j < sizeof(vHash) / sizeof(vHash[0]); j++) {
+            arith_uint256 targetBigNumHash, target;
+            bool fBigNum = BigNumCheckStakeTarget(nBits, nValue, nTimeWeight, vHash[j], targetBigNumHash);
+            bool fCheck = CheckStakeTarget(nBits, nValue, nTimeWeight, vHash[j], target);
+            BOOST_CHECK_MESSAGE(fCheck == fBigNum && target == targetBigNumHash,
+                strprintf("nBits=%08x nValue=%d nTimeWeight=%d hash=%s", nBits, nValue, nTimeWeight, vHash[j].GetHex()));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coin_age_matches_bignum)
+{
+    for (int i = 0; i < 5000; i++) {
+        std::vector<std::pair<int64_t, int64_t> > vInputs(GetRand(10));
+        arith_uint256 bnCentSecond = 0;
+        for (unsigned int j = 0; j < vInputs.size(); j++) {
+            vInputs[j] = std::make_pair(RandValue(), RandTimeWeight());
+            bnCentSecond += GetCoinAgeCentSeconds(vInputs[j].first, vInputs[j].second);
+        }
+        BOOST_CHECK_EQUAL(GetCoinAgeCoinDays(bnCentSecond), BigNumCoinAge(vInputs));
+    }
+}
+
+/* The stake modifier computation before the selection hashes were cached, kept here as the reference */
+static bool ReferenceNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier)
+{
+    const int64_t nModifierInterval = Params().GetConsensus().nStakeModifierInterval;
+    nStakeModifier = 0;
+    fGeneratedStakeModifier = false;
+
+    const CBlockIndex* pindexLast = pindexPrev;
+    while (pindexLast->pprev && !pindexLast->GeneratedStakeModifier())
+        pindexLast = pindexLast->pprev;
+    nStakeModifier = pindexLast->GeneratedStakeModifier() ? pindexLast->nStakeModifier : 1;
+    if (pindexLast->GetBlockTime() / nModifierInterval >= pindexPrev->GetBlockTime() / nModifierInterval)
+        return true;
+
+    int64_t vSection[64];
+    int64_t nSelectionInterval = 0;
+    for (int nSection = 0; nSection < 64; nSection++) {
+        vSection[nSection] = nModifierInterval * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1)));
+        nSelectionInterval += vSection[nSection];
+    }
+    int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
+
+    std::vector<std::pair<int64_t, uint256> > vSortedByTimestamp;
+    std::map<uint256, const CBlockIndex*> mapCandidates;
+    for (const CBlockIndex* pindex = pindexPrev; pindex && pindex->GetBlockTime() >= nSelectionIntervalStart; pindex = pindex->pprev) {
+        vSortedByTimestamp.push_back(std::make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        mapCandidates[pindex->GetBlockHash()] = pindex;
+    }
+    std::sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+
+    uint64_t nStakeModifierNew = 0;
+    int64_t nSelectionIntervalStop = nSelectionIntervalStart;
+    std::map<uint256, const CBlockIndex*> mapSelectedBlocks;
+    for (int nRound = 0; nRound < std::min(64, (int)vSortedByTimestamp.size()); nRound++) {
+        nSelectionIntervalStop += vSection[nRound];
+        bool fSelected = false;
+        uint256 hashBest;
+        const CBlockIndex* pindexSelected = NULL;
+        for (unsigned int i = 0; i < vSortedByTimestamp.size(); i++) {
+            const CBlockIndex* pindex = mapCandidates[vSortedByTimestamp[i].second];
+            if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+                break;
+            if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+                continue;
+            CDataStream ss(SER_GETHASH, 0);
+            ss << ArithToUint256(pindex->hashProof) << nStakeModifier;
+            uint256 hashSelection = Hash(ss.begin(), ss.end());
+            if (pindex->IsProofOfStake())
+                hashSelection = ArithToUint256(UintToArith256(hashSelection) >> 32);
+            if (!fSelected || hashSelection < hashBest) {
+                fSelected = true;
+                hashBest = hashSelection;
+                pindexSelected = pindex;
+            }
+        }
+        if (!fSelected)
+            return false;
+        nStakeModifierNew |= ((uint64_t)pindexSelected->GetStakeEntropyBit()) << nRound;
+        mapSelectedBlocks[pindexSelected->GetBlockHash()] = pindexSelected;
+    }
+
+    nStakeModifier = nStakeModifierNew;
+    fGeneratedStakeModifier = true;
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_matches_reference)
+{
+    // A chain of mixed proof-of-work and proof-of-stake blocks, with some
+    // blocks sharing a timestamp, replayed the way ContextualCheckBlock does
+    static const int CHAIN_LENGTH = 2000;
+    std::vector<uint256> vHashes(CHAIN_LENGTH);
+    std::vector<CBlockIndex> vIndex(CHAIN_LENGTH);
+    int64_t nTime = 1500000000;
+    for (int i = 0; i < CHAIN_LENGTH; i++) {
+        CBlockIndex& index = vIndex[i];
+        vHashes[i] = GetRandHash();
+        index.phashBlock = &vHashes[i];
+        index.pprev = i ? &vIndex[i - 1] : NULL;
+        index.nHeight = i;
+        index.nTime = nTime;
+        nTime += GetRand(4) ? GetRand(120) + 1 : 0;
+        index.hashProof = UintToArith256(GetRandHash());
+        if (i && GetRand(4))
+            index.SetProofOfStake();
+        BOOST_CHECK(index.SetStakeEntropyBit(GetRand(2)));
+    }
+    vIndex[0].SetStakeModifier(0, true);
+
+    int nGenerated = 0;
+    for (int i = 1; i < CHAIN_LENGTH; i++) {
+        uint64_t nStakeModifier, nStakeModifierReference;
+        bool fGenerated, fGeneratedReference;
+        BOOST_REQUIRE(ComputeNextStakeModifier(&vIndex[i - 1], nStakeModifier, fGenerated));
+        BOOST_REQUIRE(ReferenceNextStakeModifier(&vIndex[i - 1], nStakeModifierReference, fGeneratedReference));
+        BOOST_REQUIRE_MESSAGE(nStakeModifier == nStakeModifierReference && fGenerated == fGeneratedReference,
+            strprintf("height=%d modifier=%016x reference=%016x", i, nStakeModifier, nStakeModifierReference));
+        vIndex[i].SetStakeModifier(nStakeModifier, fGenerated);
+        nGenerated += fGenerated;
+    }
+    BOOST_CHECK(nGenerated > 100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -32,4 +32,23 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(scrypt_multi)
+{
+    // The batched hash must agree with the single one whether a hash lands in a full set of lanes or in the tail
+    std::vector<char> input(80 * 21), output(32 * 21);
+    for (unsigned int i = 0; i < input.size(); i++)
+        input[i] = (char)(i * 131 + 7);
+    for (size_t count = 0; count <= 21; count += 7) {
+        std::fill(output.begin(), output.end(), 0);
+        scrypt_1024_1_1_256_multi(&input[0], &output[0], count);
+        for (size_t i = 0; i < 21; i++) {
+            uint256 expected, hash;
+            if (i < count)
+                scrypt_1024_1_1_256(&input[80 * i], BEGIN(expected));
+            memcpy(hash.begin(), &output[32 * i], 32);
+            BOOST_CHECK_EQUAL(hash.ToString(), expected.ToString());
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 #include "test_kekcoin.h"
 
 #include "chainparams.h"
+#include "coins.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
 #include "key.h"
@@ -19,6 +20,7 @@
 #include "ui_interface.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
+#include "script/sigcache.h"
 
 #include "test/testutil.h"
 
@@ -38,6 +40,7 @@ BasicTestingSetup::BasicTestingSetup(const std::string& chainName)
         fCheckBlockIndex = true;
         SelectParams(chainName);
         noui_connect();
+        InitSignatureCache();
 }
 
 BasicTestingSetup::~BasicTestingSetup()
@@ -57,6 +60,7 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         mapArgs["-datadir"] = pathTemp.string();
         mempool.setSanityCheck(1.0);
         pblocktree = new CBlockTreeDB(1 << 20, true);
+        pindexdb = new CIndexDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
         pcoinsTip = new CCoinsViewCache(pcoinsdbview);
         InitBlockIndex(chainparams);
@@ -74,6 +78,7 @@ TestingSetup::~TestingSetup()
         UnloadBlockIndex();
         delete pcoinsTip;
         delete pcoinsdbview;
+        delete pindexdb;
         delete pblocktree;
         boost::filesystem::remove_all(pathTemp);
 }
@@ -140,6 +145,22 @@ CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(CTransaction &txn, CTxMemPool *po
                            hasNoDependencies, inChainValue, spendsCoinbase, sigOpCost, lp);
 }
 
+CCoins RandomCoins(int nHeight, unsigned int nOutputs)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = nHeight;
+    coins.fCoinBase = insecure_rand() % 8 == 0;
+    coins.fCoinStake = !coins.fCoinBase && insecure_rand() % 4 == 0;
+    coins.nTime = 1500000000 + nHeight * 64;
+    coins.vout.resize(nOutputs);
+    for (unsigned int i = coins.fCoinStake ? 1 : 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = 1 + insecure_rand() % 100000;
+        coins.vout[i].scriptPubKey.assign(1 + insecure_rand() % 30, (unsigned char)i);
+    }
+    return coins;
+}
+
 void Shutdown(void* parg)
 {
   exit(0);
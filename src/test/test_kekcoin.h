@@ -28,7 +28,6 @@ struct BasicTestingSetup {
  * Included are data directory, coins database, script check threads setup.
  */
 struct TestingSetup: public BasicTestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
 
@@ -89,4 +88,10 @@ struct TestMemPoolEntryHelper
     TestMemPoolEntryHelper &SpendsCoinbase(bool _flag) { spendsCoinbase = _flag; return *this; }
     TestMemPoolEntryHelper &SigOpsCost(unsigned int _sigopsCost) { sigOpCost = _sigopsCost; return *this; }
 };
+
+class CCoins;
+
+// Unspent outputs of a made-up transaction at nHeight, with random flags,
+// values and scripts; the first output of a coinstake is empty
+CCoins RandomCoins(int nHeight, unsigned int nOutputs);
 #endif
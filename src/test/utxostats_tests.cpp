@@ -0,0 +1,124 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxostats.h"
+
+#include "coins.h"
+#include "random.h"
+#include "txdb.h"
+#include "uint256.h"
+#include "test/test_kekcoin.h"
+
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CUTXOStatsValue StatsFromScratch(const std::map<uint256, CCoins>& mapCoins, int nHeight)
+{
+    CUTXOStats stats;
+    const CCoins coinsEmpty;
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+        stats.UpdateCoins(it->first, coinsEmpty, it->second);
+    return stats.GetValue(nHeight);
+}
+
+void CheckEqual(const CUTXOStatsValue& a, const CUTXOStatsValue& b)
+{
+    BOOST_CHECK_EQUAL(a.nHeight, b.nHeight);
+    BOOST_CHECK_EQUAL(a.nTransactions, b.nTransactions);
+    BOOST_CHECK_EQUAL(a.nTransactionOutputs, b.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(a.nSerializedSize, b.nSerializedSize);
+    BOOST_CHECK_EQUAL(a.nTotalAmount, b.nTotalAmount);
+    BOOST_CHECK(a.hashMuHash == b.hashMuHash);
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(utxostats_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(utxostats_incremental_matches_scratch)
+{
+    seed_insecure_rand(true);
+    std::map<uint256, CCoins> mapCoins;
+    CUTXOStats stats;
+    std::vector<CUTXOStatsValue> vHistory;
+    std::vector<std::map<uint256, CCoins> > vSets;
+
+    for (int nHeight = 0; nHeight < 40; nHeight++) {
+        // Create a few transactions and spend outputs of older ones
+        for (int i = 0; i < 3; i++) {
+            uint256 txid = GetRandHash();
+            CCoins coins = RandomCoins(nHeight, 1 + insecure_rand() % 4);
+            stats.UpdateCoins(txid, mapCoins[txid], coins);
+            mapCoins[txid] = coins;
+        }
+        for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (it->second.IsPruned() || insecure_rand() % 5)
+                continue;
+            CCoins coinsOld = it->second;
+            it->second.Spend(insecure_rand() % it->second.vout.size());
+            stats.UpdateCoins(it->first, coinsOld, it->second);
+        }
+        vHistory.push_back(stats.GetValue(nHeight));
+        vSets.push_back(mapCoins);
+        CheckEqual(vHistory.back(), StatsFromScratch(mapCoins, nHeight));
+    }
+
+    // Undo back to an earlier set, as a reorganization would
+    std::map<uint256, CCoins> mapTarget = vSets[19];
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        std::map<uint256, CCoins>::const_iterator itTarget = mapTarget.find(it->first);
+        stats.UpdateCoins(it->first, it->second, itTarget == mapTarget.end() ? CCoins() : itTarget->second);
+    }
+    CheckEqual(stats.GetValue(19), vHistory[19]);
+
+    // An output set does not hash like the same outputs created at another height
+    std::map<uint256, CCoins> mapMoved = mapTarget;
+    std::map<uint256, CCoins>::iterator itMoved = mapMoved.begin();
+    while (itMoved->second.IsPruned())
+        itMoved++;
+    itMoved->second.nHeight++;
+    BOOST_CHECK(StatsFromScratch(mapMoved, 19).hashMuHash != vHistory[19].hashMuHash);
+}
+
+BOOST_AUTO_TEST_CASE(utxostats_scan_and_persist)
+{
+    seed_insecure_rand(true);
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsViewCache cache(&db);
+
+    CUTXOStats stats;
+    const CCoins coinsEmpty;
+    for (int i = 0; i < 50; i++) {
+        uint256 txid = GetRandHash();
+        CCoins coins = RandomCoins(i, 1 + insecure_rand() % 4);
+        *cache.ModifyNewCoins(txid, coins.fCoinBase) = coins;
+        stats.UpdateCoins(txid, coinsEmpty, coins);
+    }
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    stats.hashBlock = hashBlock;
+
+    // Statistics for another block are not stored with this flush
+    CUTXOStats statsOther = stats;
+    statsOther.hashBlock = GetRandHash();
+    db.SetUTXOStats(statsOther);
+    BOOST_CHECK(cache.Flush());
+    CUTXOStats statsRead;
+    BOOST_CHECK(!db.GetUTXOStats(statsRead));
+
+    db.SetUTXOStats(stats);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetUTXOStats(statsRead));
+    BOOST_CHECK(statsRead.hashBlock == hashBlock);
+    CheckEqual(statsRead.GetValue(49), stats.GetValue(49));
+
+    CUTXOStats statsScan;
+    BOOST_CHECK(ScanUTXOStats(&db, statsScan));
+    BOOST_CHECK(statsScan.hashBlock == hashBlock);
+    CheckEqual(statsScan.GetValue(49), stats.GetValue(49));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,85 +6,486 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "compressor.h"
+#include "crypto/common.h"
 #include "hash.h"
+#include "init.h"
+#include "main.h"
+#include "memusage.h"
 #include "pow.h"
+#include "random.h"
 #include "uint256.h"
+#include "util.h"
 
+#include <algorithm>
+#include <limits>
+#include <set>
 #include <stdint.h>
+#include <string.h>
 
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 using namespace std;
 
-static const char DB_COINS = 'c';
+static const char DB_COINS = 'c'; // One record per transaction, before Upgrade()
+static const char DB_COIN = 'C';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_ADDRESSINDEX = 'a';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
+static const char DB_ADDRESSBALANCEINDEX = 'A';
 static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_BLOCKHASHINDEX = 'z';
 static const char DB_SPENTINDEX = 'p';
+static const char DB_STAKEINDEX = 'k';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_UTXOSTATS = 'U';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
+static const char DB_VERSION = 'V';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_BLOCK_INDEX_SNAPSHOT = 'S';
 
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, false, 64)
+namespace {
+
+/**
+ * Key of one unspent output: ('C', txid, VARINT(n)). The transaction's
+ * header is at ('C', txid), which sorts right before its outputs.
+ */
+struct CCoinsOutputKey
+{
+    uint256 txid;
+    uint32_t n;
+
+    CCoinsOutputKey() : n(0) {}
+    CCoinsOutputKey(const uint256 &txidIn, uint32_t nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/** What the unspent outputs of one transaction have in common */
+struct CCoinsHeader
+{
+    int nVersion;
+    int nHeight;
+    bool fCoinBase;
+    bool fCoinStake;
+    int64_t nTime;
+    //! Upper bound on the output indexes stored for the transaction
+    uint32_t nOutputs;
+
+    CCoinsHeader() : nVersion(0), nHeight(0), fCoinBase(false), fCoinStake(false), nTime(0), nOutputs(0) {}
+
+    explicit CCoinsHeader(const CCoins &coins) : nVersion(coins.nVersion), nHeight(coins.nHeight),
+        fCoinBase(coins.fCoinBase), fCoinStake(coins.fCoinStake), nTime(coins.nTime), nOutputs(coins.vout.size()) {}
+
+    //! Set the metadata of coins and size vout, with every output spent
+    void ApplyTo(CCoins &coins) const {
+        coins.nVersion = nVersion;
+        coins.nHeight = nHeight;
+        coins.fCoinBase = fCoinBase;
+        coins.fCoinStake = fCoinStake;
+        coins.nTime = nTime;
+        coins.vout.assign(nOutputs, CTxOut());
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        uint32_t nCode = 0;
+        if (!ser_action.ForRead())
+            nCode = nHeight * 4 + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0);
+        READWRITE(VARINT(this->nVersion));
+        READWRITE(VARINT(nCode));
+        READWRITE(VARINT(nTime));
+        READWRITE(VARINT(nOutputs));
+        if (ser_action.ForRead()) {
+            nHeight = nCode / 4;
+            fCoinBase = nCode & 2;
+            fCoinStake = nCode & 1;
+        }
+    }
+};
+
+//! Transactions with up to this many outputs are read with point lookups, larger ones with an iterator
+static const uint32_t COINS_POINT_READ_OUTPUTS = 16;
+//! Flush batches that rewrite many records, to upgrade or move them, when they get this large
+static const size_t REWRITE_BATCH_SIZE = 16 << 20;
+
+/** Read outputs of txid from the iterator, which must be past its header, up to the next transaction */
+void ReadCoinsOutputs(CDBIterator *pcursor, const uint256 &txid, CCoins &coins)
+{
+    std::pair<char, CCoinsOutputKey> key;
+    while (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COIN && key.second.txid == txid) {
+        if (key.second.n < coins.vout.size()) {
+            CTxOutCompressor txout(coins.vout[key.second.n]);
+            if (!pcursor->GetValue(txout))
+                coins.vout[key.second.n].SetNull();
+        }
+        pcursor->Next();
+    }
+}
+
+/** Read the unspent outputs of txid; false if it has none */
+bool ReadCoins(const CDBWrapper &db, const uint256 &txid, CCoins &coins)
+{
+    CCoinsHeader header;
+    if (!db.Read(make_pair(DB_COIN, txid), header))
+        return false;
+    header.ApplyTo(coins);
+    if (header.nOutputs <= COINS_POINT_READ_OUTPUTS) {
+        for (uint32_t i = 0; i < header.nOutputs; i++) {
+            CTxOutCompressor txout(coins.vout[i]);
+            db.Read(make_pair(DB_COIN, CCoinsOutputKey(txid, i)), txout);
+        }
+    } else {
+        boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper&>(db).NewIterator());
+        pcursor->Seek(make_pair(DB_COIN, CCoinsOutputKey(txid, 0)));
+        ReadCoinsOutputs(pcursor.get(), txid, coins);
+    }
+    coins.Cleanup();
+    return true;
+}
+
+/** Queue the header and every unspent output of coins, for a transaction the database has nothing of */
+size_t WriteNewCoins(CDBBatch &batch, const uint256 &txid, const CCoins &coins)
 {
+    size_t nOutputs = 0;
+    batch.Write(make_pair(DB_COIN, txid), CCoinsHeader(coins));
+    for (uint32_t i = 0; i < coins.vout.size(); i++) {
+        if (coins.vout[i].IsNull())
+            continue;
+        batch.Write(make_pair(DB_COIN, CCoinsOutputKey(txid, i)), CTxOutCompressor(REF(coins.vout[i])));
+        nOutputs++;
+    }
+    return nOutputs;
+}
+
+} // anon namespace
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, bool fAsyncFlush) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, false, 64),
+    fPending(false), nPendingUsage(0), fWriteError(false), fStopWriter(false)
+{
+    if (fAsyncFlush)
+        threadWriter = boost::thread(&CCoinsViewDB::ThreadWrite, this);
+}
+
+CCoinsViewDB::~CCoinsViewDB()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        fStopWriter = true;
+        condFlush.notify_all();
+    }
+    if (threadWriter.joinable())
+        threadWriter.join();
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        CCoinsMap::const_iterator it = mapPending.find(txid);
+        if (it != mapPending.end()) {
+            if (it->second.coins.IsPruned())
+                return false;
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return ReadCoins(db, txid, coins);
 }
 
-void static BatchWriteCoins(CDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+void CCoinsViewDB::BatchWriteCoins(CDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry, size_t &nOutputsChanged) const {
+    const CCoins &coins = entry.coins;
+
+    // Which outputs the database has, and whether it has the entry's version
+    // of them. Cache entries know this for small transactions.
+    std::vector<bool> vStored;
+    bool fSameVersion = entry.nParentOutputs != CCoinsCacheEntry::PARENT_UNKNOWN;
+    if (fSameVersion && entry.nParentOutputs <= CCoinsCacheEntry::PARENT_MASK_OUTPUTS) {
+        vStored.resize(entry.nParentOutputs);
+        for (unsigned int i = 0; i < vStored.size(); i++)
+            vStored[i] = (entry.nParentUnspent >> i) & 1;
+    } else {
+        CCoins coinsStored;
+        if (ReadCoins(db, txid, coinsStored)) {
+            vStored.resize(coinsStored.vout.size());
+            for (unsigned int i = 0; i < vStored.size(); i++)
+                vStored[i] = !coinsStored.vout[i].IsNull();
+        }
+    }
+    bool fStoredAny = std::find(vStored.begin(), vStored.end(), true) != vStored.end();
+
+    for (uint32_t i = 0; i < std::max(coins.vout.size(), vStored.size()); i++) {
+        bool fUnspent = coins.IsAvailable(i);
+        bool fStored = i < vStored.size() && vStored[i];
+        if (fUnspent && !(fStored && fSameVersion)) {
+            batch.Write(make_pair(DB_COIN, CCoinsOutputKey(txid, i)), CTxOutCompressor(REF(coins.vout[i])));
+            nOutputsChanged++;
+        } else if (!fUnspent && fStored) {
+            batch.Erase(make_pair(DB_COIN, CCoinsOutputKey(txid, i)));
+            nOutputsChanged++;
+        }
+    }
+
+    if (coins.IsPruned()) {
+        if (fStoredAny)
+            batch.Erase(make_pair(DB_COIN, txid));
+    } else if (!fSameVersion || !fStoredAny || coins.vout.size() > entry.nParentOutputs) {
+        batch.Write(make_pair(DB_COIN, txid), CCoinsHeader(coins));
+    }
 }
 
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
+    if (!Sync())
+        return false;
     CDBBatch batch(db);
-    BatchWriteCoins(batch, txid, coins);
+    CCoinsCacheEntry entry;
+    entry.coins = coins;
+    entry.SetParentUnknown();
+    size_t nOutputsChanged = 0;
+    BatchWriteCoins(batch, txid, entry, nOutputsChanged);
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        flushStats.nBytesWritten += batch.SizeEstimate();
+    }
     return db.WriteBatch(batch);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        CCoinsMap::const_iterator it = mapPending.find(txid);
+        if (it != mapPending.end())
+            return !it->second.coins.IsPruned();
+    }
+    return db.Exists(make_pair(DB_COIN, txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        if (!hashBlockPending.IsNull())
+            return hashBlockPending;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) {
+    int64_t nStart = GetTimeMicros();
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
+    size_t nOutputsChanged = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
-            else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+            BatchWriteCoins(batch, it->first, it->second, nOutputsChanged);
             changed++;
         }
         count++;
         CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase)
+            mapCoins.erase(itOld);
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
+    {
+        boost::unique_lock<boost::mutex> lock(csFlush);
+        if (!statsPending.hashBlock.IsNull() && statsPending.hashBlock == hashBlock) {
+            batch.Write(DB_UTXOSTATS, statsPending);
+            statsPending.SetNull();
+        }
+    }
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transactions (out of %u), %u outputs, %u bytes to coin database...\n",
+        (unsigned int)changed, (unsigned int)count, (unsigned int)nOutputsChanged, (unsigned int)batch.SizeEstimate());
+    bool ret = db.WriteBatch(batch);
+
+    int64_t nTime = GetTimeMicros() - nStart;
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    flushStats.nFlushes++;
+    flushStats.nBytesWritten += batch.SizeEstimate();
+    flushStats.nLastMicros = nTime;
+    flushStats.nMaxMicros = std::max(flushStats.nMaxMicros, nTime);
+    flushStats.nTotalMicros += nTime;
+    LogPrint("bench", "    - Coin database flush: %.2fms, %u bytes\n", nTime * 0.001, (unsigned int)batch.SizeEstimate());
+    return ret;
+}
+
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    if (!threadWriter.joinable())
+        return WriteCoins(mapCoins, hashBlock, true);
+
+    int64_t nStart = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (fPending)
+        condFlush.wait(lock);
+    flushStats.nWaitMicros += GetTimeMicros() - nStart;
+    if (fWriteError)
+        return false;
+
+    // Take over the dirty entries; the others are what the database has already
+    nPendingUsage = 0;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            nPendingUsage += it->second.coins.DynamicMemoryUsage();
+            it++;
+        } else {
+            mapCoins.erase(it++);
+        }
+    }
+    mapPending.swap(mapCoins);
+    nPendingUsage += memusage::DynamicUsage(mapPending);
+    mapCoins.clear();
+    hashBlockPending = hashBlock;
+    fPending = true;
+    condFlush.notify_all();
+    return true;
+}
+
+void CCoinsViewDB::ThreadWrite() {
+    RenameThread("kekcoin-coinsflush");
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    while (true) {
+        while (!fPending && !fStopWriter)
+            condFlush.wait(lock);
+        if (!fPending)
+            return;
+
+        // Nothing changes mapPending while it is being written, so reads
+        // can keep using it without waiting for the write.
+        lock.unlock();
+        bool fSuccess = false;
+        try {
+            fSuccess = WriteCoins(mapPending, hashBlockPending, false);
+        } catch (const std::exception& e) {
+            LogPrintf("Error writing to coin database: %s\n", e.what());
+        }
+        lock.lock();
+
+        if (!fSuccess) {
+            // The cache gave these entries up, so reads keep being served from
+            // them; nothing is written after a failure
+            fWriteError = true;
+            fPending = false;
+            condFlush.notify_all();
+            lock.unlock();
+            AbortNode("Failed to write to coin database");
+            lock.lock();
+            continue;
+        }
+        mapPending.clear();
+        hashBlockPending.SetNull();
+        nPendingUsage = 0;
+        fPending = false;
+        condFlush.notify_all();
+    }
+}
+
+bool CCoinsViewDB::Sync() const {
+    int64_t nStart = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    if (fPending) {
+        while (fPending)
+            condFlush.wait(lock);
+        flushStats.nWaitMicros += GetTimeMicros() - nStart;
+    }
+    return !fWriteError;
+}
+
+bool CCoinsViewDB::HasWriteError() const {
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    return fWriteError;
+}
+
+size_t CCoinsViewDB::DynamicMemoryUsage() const {
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    return nPendingUsage;
+}
+
+CCoinsFlushStats CCoinsViewDB::GetFlushStats() const {
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    return flushStats;
+}
+
+bool CCoinsViewDB::IsNewerVersion() const {
+    int nVersion = 0;
+    return db.Read(DB_VERSION, nVersion) && nVersion > CHAINSTATE_VERSION;
+}
+
+bool CCoinsViewDB::Upgrade() {
+    if (IsNewerVersion())
+        return error("%s: the coin database has a newer layout than this version can read", __func__);
+
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    std::pair<char, uint256> key;
+    if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_COINS) {
+        // New and fully converted databases are in the current layout
+        if (!db.Exists(DB_VERSION))
+            return db.Write(DB_VERSION, CHAINSTATE_VERSION);
+        return true;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    LogPrintf("Upgrading coin database to one record per unspent output...\n");
+    LogPrintf("Versions before this one cannot read the upgraded database, they need -reindex-chainstate\n");
+    size_t nTransactions = 0;
+    size_t nOutputs = 0;
+    CDBBatch batch(db);
+    while (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COINS) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        CCoins coins;
+        if (!pcursor->GetValue(coins))
+            return error("%s: unable to read coins of %s", __func__, key.second.ToString());
+        batch.Erase(key);
+        if (!coins.IsPruned())
+            nOutputs += WriteNewCoins(batch, key.second, coins);
+        nTransactions++;
+        if (batch.SizeEstimate() > REWRITE_BATCH_SIZE) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+            LogPrintf("Upgrading coin database: %u transactions, %u outputs so far\n", nTransactions, nOutputs);
+        }
+        pcursor->Next();
+    }
+    if (!ShutdownRequested())
+        batch.Write(DB_VERSION, CHAINSTATE_VERSION);
+    if (!db.WriteBatch(batch))
+        return false;
+    LogPrintf("Upgraded %u transactions, %u outputs of the coin database in %dms%s\n", nTransactions, nOutputs,
+        GetTimeMillis() - nStart, ShutdownRequested() ? " (interrupted)" : "");
+    return !ShutdownRequested();
+}
+
+bool CCoinsViewDB::GetUTXOStats(CUTXOStats &stats) const {
+    Sync();
+    return db.Read(DB_UTXOSTATS, stats);
+}
+
+void CCoinsViewDB::SetUTXOStats(const CUTXOStats &stats) {
+    boost::unique_lock<boost::mutex> lock(csFlush);
+    statsPending = stats;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, compression, maxOpenFiles) {
@@ -112,21 +513,47 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
+    // Iterate over the database once it has everything
+    Sync();
     CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
-    // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    i->pcursor->Seek(DB_COIN);
+    // Assemble the first transaction
+    i->Load();
     return i;
 }
 
+void CCoinsViewDBCursor::Load()
+{
+    fValid = false;
+    std::pair<char, uint256> key;
+    while (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COIN) {
+        // Outputs without a header before them are not part of the set
+        if (pcursor->GetKeySize() != ::GetSerializeSize(key, SER_DISK, CLIENT_VERSION)) {
+            pcursor->Next();
+            continue;
+        }
+        CCoinsHeader header;
+        if (!pcursor->GetValue(header))
+            return;
+        txidTmp = key.second;
+        header.ApplyTo(coinsTmp);
+        pcursor->Next();
+        ReadCoinsOutputs(pcursor.get(), txidTmp, coinsTmp);
+        coinsTmp.Cleanup();
+        nValueSize = ::GetSerializeSize(coinsTmp, SER_DISK, CLIENT_VERSION);
+        fValid = true;
+        return;
+    }
+}
+
 bool CCoinsViewDBCursor::GetKey(uint256 &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
-        key = keyTmp.second;
+    if (fValid) {
+        key = txidTmp;
         return true;
     }
     return false;
@@ -134,24 +561,26 @@ bool CCoinsViewDBCursor::GetKey(uint256 &key) const
 
 bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
 {
-    return pcursor->GetValue(coins);
+    if (!fValid)
+        return false;
+    coins = coinsTmp;
+    return true;
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
 {
-    return pcursor->GetValueSize();
+    return nValueSize;
 }
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return fValid;
 }
 
 void CCoinsViewDBCursor::Next()
 {
-    pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
-        keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    // The iterator already points past the outputs of the current transaction
+    Load();
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -163,6 +592,9 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
+    // The block index snapshot no longer matches once an entry changes
+    if (!blockinfo.empty())
+        batch.Erase(DB_BLOCK_INDEX_SNAPSHOT);
     return WriteBatch(batch, true);
 }
 
@@ -177,11 +609,90 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
+CIndexDB::CIndexDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles) : CDBWrapper(GetDataDir() / "indexes", nCacheSize, fMemory, fWipe, false, compression, maxOpenFiles) {
+}
+
+namespace {
+
+/** Copy the records of one type to pdest, or only erase them if it is NULL */
+template <typename K, typename V>
+bool MoveRecords(CDBWrapper &source, CDBWrapper *pdest, char chType)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(source.NewIterator());
+    CDBBatch batchErase(source);
+    boost::scoped_ptr<CDBBatch> pbatchWrite(pdest ? new CDBBatch(*pdest) : NULL);
+    size_t nMoved = 0;
+    pcursor->Seek(chType);
+    while (true) {
+        boost::this_thread::interruption_point();
+        std::pair<char, K> key;
+        bool fValid = pcursor->Valid() && pcursor->GetKey(key) && key.first == chType;
+        if (!fValid || batchErase.SizeEstimate() + (pbatchWrite ? pbatchWrite->SizeEstimate() : 0) > REWRITE_BATCH_SIZE) {
+            // The copies are safe on disk before the originals go
+            if (pbatchWrite) {
+                pdest->WriteBatch(*pbatchWrite, true);
+                pbatchWrite->Clear();
+            }
+            source.WriteBatch(batchErase);
+            batchErase.Clear();
+        }
+        if (!fValid)
+            break;
+        if (pbatchWrite) {
+            V value;
+            if (!pcursor->GetValue(value))
+                return error("%s: failed to read record of type '%c'", __func__, chType);
+            pbatchWrite->Write(key, value);
+        }
+        batchErase.Erase(key);
+        nMoved++;
+        pcursor->Next();
+    }
+    if (nMoved)
+        LogPrintf("%s: %s %u records of type '%c'\n", __func__, pdest ? "moved" : "erased", nMoved, chType);
+    return true;
+}
+
+}
+
+bool CIndexDB::EraseRecords(char chType) {
+    switch (chType) {
+    case DB_ADDRESSINDEX: return MoveRecords<CAddressIndexKey, CAmount>(*this, NULL, chType);
+    case DB_ADDRESSUNSPENTINDEX: return MoveRecords<CAddressUnspentKey, CAddressUnspentValue>(*this, NULL, chType);
+    case DB_ADDRESSBALANCEINDEX: return MoveRecords<CAddressIndexIteratorKey, CAddressBalanceValue>(*this, NULL, chType);
+    case DB_TIMESTAMPINDEX: return MoveRecords<CTimestampIndexKey, int>(*this, NULL, chType);
+    case DB_BLOCKHASHINDEX: return MoveRecords<CTimestampBlockIndexKey, CTimestampBlockIndexValue>(*this, NULL, chType);
+    case DB_SPENTINDEX: return MoveRecords<CSpentIndexKey, CSpentIndexValue>(*this, NULL, chType);
+    }
+    return false;
+}
+
+bool CIndexDB::DropAddressIndex() {
+    if (!EraseRecords(DB_ADDRESSINDEX) || !EraseRecords(DB_ADDRESSUNSPENTINDEX) || !EraseRecords(DB_ADDRESSBALANCEINDEX))
+        return false;
+    Compact();
+    return true;
+}
+
+bool CIndexDB::DropSpentIndex() {
+    if (!EraseRecords(DB_SPENTINDEX))
+        return false;
+    Compact();
+    return true;
+}
+
+bool CIndexDB::DropTimestampIndex() {
+    if (!EraseRecords(DB_TIMESTAMPINDEX) || !EraseRecords(DB_BLOCKHASHINDEX))
+        return false;
+    Compact();
+    return true;
+}
+
+bool CIndexDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
     return Read(make_pair(DB_SPENTINDEX, key), value);
 }
 
-bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
+bool CIndexDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
@@ -193,8 +704,7 @@ bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey,
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
-    CDBBatch batch(*this);
+void CIndexDB::BatchAddressUnspentIndex(CDBBatch &batch, const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
     for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
             batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
@@ -202,10 +712,15 @@ bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddres
             batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
         }
     }
+}
+
+bool CIndexDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
+    CDBBatch batch(*this);
+    BatchAddressUnspentIndex(batch, vect);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
+bool CIndexDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
                                            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
 
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
@@ -231,21 +746,72 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
     return true;
 }
 
-bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
+bool CIndexDB::ReadAddressUnspentIndex(const std::vector<std::pair<uint160, int> > &addresses, int maxHeight, CAmount minValue,
+                                           std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > &unspentOutputs) {
+
+    // Visit the addresses in key order, so a single iterator sweeps the index
+    // front to back and only seeks forward over gaps between them
+    std::vector<std::pair<std::pair<unsigned int, uint160>, size_t> > order;
+    order.reserve(addresses.size());
+    for (size_t i = 0; i < addresses.size(); i++)
+        order.push_back(make_pair(make_pair((unsigned int)addresses[i].second, addresses[i].first), i));
+    std::sort(order.begin(), order.end());
+
+    unspentOutputs.assign(addresses.size(), std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >());
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    bool fPositioned = false;
+
+    for (size_t i = 0; i < order.size(); i++) {
+        unsigned int type = order[i].first.first;
+        const uint160 &addressHash = order[i].first.second;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &outputs = unspentOutputs[order[i].second];
+
+        if (i > 0 && order[i].first == order[i - 1].first) {
+            outputs = unspentOutputs[order[i - 1].second];
+            continue;
+        }
+
+        std::pair<char,CAddressUnspentKey> key;
+        bool fSeek = !fPositioned;
+        if (fPositioned && pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX)
+            fSeek = key.second.type < type || (key.second.type == type && key.second.hashBytes < addressHash);
+        if (fSeek) {
+            pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
+            fPositioned = true;
+        }
+
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            if (!pcursor->GetKey(key) || key.first != DB_ADDRESSUNSPENTINDEX || key.second.type != type || key.second.hashBytes != addressHash)
+                break;
+            CAddressUnspentValue value;
+            if (!pcursor->GetValue(value))
+                return error("failed to get address unspent value");
+            if (value.blockHeight <= maxHeight && value.satoshis >= minValue)
+                outputs.push_back(make_pair(key.second, value));
+            pcursor->Next();
+        }
+    }
+
+    return true;
+}
+
+bool CIndexDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
+bool CIndexDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
+bool CIndexDB::ReadAddressIndex(uint160 addressHash, int type,
                                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                                     int start, int end) {
 
@@ -279,13 +845,247 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
+static bool IsSameAddressIndexKey(const CAddressIndexKey &a, const CAddressIndexKey &b)
+{
+    return a.type == b.type && a.hashBytes == b.hashBytes && a.blockHeight == b.blockHeight &&
+           a.txindex == b.txindex && a.txhash == b.txhash && a.index == b.index && a.spending == b.spending;
+}
+
+bool CIndexDB::ReadAddressIndexPage(uint160 addressHash, int type, int start, int end,
+                                        const CAddressIndexKey *pkeyAfter, bool fReverse, size_t nLimit,
+                                        std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex) {
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    if (pkeyAfter) {
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, *pkeyAfter));
+    } else if (fReverse) {
+        int height = end > 0 ? end + 1 : std::numeric_limits<int>::max();
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, height)));
+    } else if (start > 0) {
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
+    } else {
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash)));
+    }
+
+    // Seek() lands on the first key not below the target, which in reverse is
+    // one past the first entry wanted and going forward may be the cursor itself
+    if (fReverse) {
+        if (pcursor->Valid())
+            pcursor->Prev();
+        else
+            pcursor->SeekToLast();
+    } else if (pkeyAfter && pcursor->Valid()) {
+        std::pair<char,CAddressIndexKey> key;
+        if (pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX && IsSameAddressIndexKey(key.second, *pkeyAfter))
+            pcursor->Next();
+    }
+
+    size_t nRead = 0;
+    while (nRead < nLimit && pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX || key.second.type != (unsigned int)type || key.second.hashBytes != addressHash)
+            break;
+        if (fReverse ? (start > 0 && key.second.blockHeight < start) : (end > 0 && key.second.blockHeight > end))
+            break;
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("failed to get address index value");
+        addressIndex.push_back(make_pair(key.second, nValue));
+        nRead++;
+        if (fReverse)
+            pcursor->Prev();
+        else
+            pcursor->Next();
+    }
+
+    return true;
+}
+
+bool CIndexDB::ReadAddressBalanceIndex(uint160 addressHash, int type, CAddressBalanceValue &value) {
+    return Read(make_pair(DB_ADDRESSBALANCEINDEX, CAddressIndexIteratorKey(type, addressHash)), value);
+}
+
+namespace {
+
+/** The change a single block makes to one address */
+struct CAddressBalanceDelta {
+    CAmount balance;
+    CAmount received;
+    std::set<uint256> txids;
+    int height;
+
+    CAddressBalanceDelta() : balance(0), received(0), height(0) {}
+};
+
+typedef std::map<std::pair<unsigned int, uint160>, CAddressBalanceDelta> AddressBalanceDeltaMap;
+
+void GroupAddressBalanceDeltas(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect, AddressBalanceDeltaMap &mapDeltas)
+{
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        CAddressBalanceDelta &delta = mapDeltas[make_pair(it->first.type, it->first.hashBytes)];
+        delta.balance += it->second;
+        if (it->second > 0)
+            delta.received += it->second;
+        delta.txids.insert(it->first.txhash);
+        delta.height = it->first.blockHeight;
+    }
+}
+
+}
+
+bool CIndexDB::WriteAddressBalances(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
+    AddressBalanceDeltaMap mapDeltas;
+    GroupAddressBalanceDeltas(vect, mapDeltas);
+
+    for (AddressBalanceDeltaMap::const_iterator it=mapDeltas.begin(); it!=mapDeltas.end(); it++) {
+        const CAddressBalanceDelta &delta = it->second;
+        CAddressIndexIteratorKey key(it->first.first, it->first.second);
+        CAddressBalanceValue value;
+        if (!Read(make_pair(DB_ADDRESSBALANCEINDEX, key), value))
+            value.SetNull();
+        // Already counted, e.g. a block connected again by -checklevel=4 or after an unclean shutdown
+        if (!value.IsNull() && value.lastHeight >= delta.height)
+            continue;
+        if (value.IsNull())
+            value.firstHeight = delta.height;
+        value.balance += delta.balance;
+        value.received += delta.received;
+        value.txCount += delta.txids.size();
+        value.lastHeight = delta.height;
+        batch.Write(make_pair(DB_ADDRESSBALANCEINDEX, key), value);
+    }
+    return true;
+}
+
+bool CIndexDB::EraseAddressBalances(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
+    AddressBalanceDeltaMap mapDeltas;
+    GroupAddressBalanceDeltas(vect, mapDeltas);
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    for (AddressBalanceDeltaMap::const_iterator it=mapDeltas.begin(); it!=mapDeltas.end(); it++) {
+        const CAddressBalanceDelta &delta = it->second;
+        CAddressIndexIteratorKey key(it->first.first, it->first.second);
+        CAddressBalanceValue value;
+        if (!Read(make_pair(DB_ADDRESSBALANCEINDEX, key), value) || value.lastHeight < delta.height)
+            continue;
+        value.balance -= delta.balance;
+        value.received -= delta.received;
+        value.txCount -= delta.txids.size();
+        if (value.txCount <= 0) {
+            batch.Erase(make_pair(DB_ADDRESSBALANCEINDEX, key));
+            continue;
+        }
+
+        // The entry just before the block's height is the address's previous
+        // activity, whether or not the block's own entries are erased yet
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(key.type, key.hashBytes, delta.height)));
+        if (pcursor->Valid())
+            pcursor->Prev();
+        else
+            pcursor->SeekToLast();
+        std::pair<char,CAddressIndexKey> prevKey;
+        if (!pcursor->Valid() || !pcursor->GetKey(prevKey) || prevKey.first != DB_ADDRESSINDEX ||
+            prevKey.second.type != key.type || prevKey.second.hashBytes != key.hashBytes)
+            return error("failed to find previous address index entry");
+        value.lastHeight = prevKey.second.blockHeight;
+        batch.Write(make_pair(DB_ADDRESSBALANCEINDEX, key), value);
+    }
+    return true;
+}
+
+bool CIndexDB::ConnectAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&addressIndex,
+                                   const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&addressUnspentIndex) {
+    CDBBatch batch(*this);
+    if (!WriteAddressBalances(batch, addressIndex))
+        return false;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++)
+        batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+    BatchAddressUnspentIndex(batch, addressUnspentIndex);
+    return WriteBatch(batch);
+}
+
+bool CIndexDB::DisconnectAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&addressIndex,
+                                      const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&addressUnspentIndex) {
+    CDBBatch batch(*this);
+    if (!EraseAddressBalances(batch, addressIndex))
+        return false;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++)
+        batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
+    BatchAddressUnspentIndex(batch, addressUnspentIndex);
+    return WriteBatch(batch);
+}
+
+bool CIndexDB::RebuildAddressBalanceIndex() {
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    // Drop whatever an interrupted rebuild left behind
+    CDBBatch batch(*this);
+    pcursor->Seek(DB_ADDRESSBALANCEINDEX);
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexIteratorKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSBALANCEINDEX)
+            break;
+        batch.Erase(key);
+        pcursor->Next();
+    }
+    if (!WriteBatch(batch))
+        return false;
+
+    // Address index keys sort by address, then height and position in block,
+    // so each address and each of its transactions is one contiguous run
+    batch.Clear();
+    size_t nWritten = 0;
+    CAddressIndexIteratorKey addressKey;
+    CAddressBalanceValue value;
+    uint256 lastTxHash;
+    pcursor->Seek(DB_ADDRESSINDEX);
+    while (true) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexKey> key;
+        bool fValid = pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX;
+        if (!value.IsNull() && (!fValid || key.second.type != addressKey.type || key.second.hashBytes != addressKey.hashBytes)) {
+            batch.Write(make_pair(DB_ADDRESSBALANCEINDEX, addressKey), value);
+            value.SetNull();
+            if (++nWritten % 10000 == 0) {
+                if (!WriteBatch(batch))
+                    return false;
+                batch.Clear();
+            }
+        }
+        if (!fValid)
+            break;
+
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("failed to get address index value");
+        if (value.IsNull()) {
+            addressKey = CAddressIndexIteratorKey(key.second.type, key.second.hashBytes);
+            value.firstHeight = key.second.blockHeight;
+            lastTxHash.SetNull();
+        }
+        value.balance += nValue;
+        if (nValue > 0)
+            value.received += nValue;
+        if (key.second.txhash != lastTxHash)
+            value.txCount++;
+        lastTxHash = key.second.txhash;
+        value.lastHeight = key.second.blockHeight;
+        pcursor->Next();
+    }
+    LogPrintf("%s: %u address balances\n", __func__, nWritten);
+    return WriteBatch(batch);
+}
+
+bool CIndexDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
     CDBBatch batch(*this);
     batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes) {
+bool CIndexDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes) {
 
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
@@ -312,13 +1112,13 @@ bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned i
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
+bool CIndexDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
     CDBBatch batch(*this);
     batch.Write(make_pair(DB_BLOCKHASHINDEX, blockhashIndex), logicalts);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
+bool CIndexDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
 
     CTimestampBlockIndexValue(lts);
     if (!Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
@@ -328,6 +1128,30 @@ bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &lt
     return true;
 }
 
+bool CBlockTreeDB::ReadStakeIndex(const COutPoint &outpoint, CStakeIndexValue &value) {
+    return Read(make_pair(DB_STAKEINDEX, outpoint), value);
+}
+
+bool CBlockTreeDB::UpdateStakeIndex(const std::vector<std::pair<COutPoint, CStakeIndexValue> >&vect) {
+    CDBBatch batch(*this);
+    for (std::vector<std::pair<COutPoint, CStakeIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull()) {
+            batch.Erase(make_pair(DB_STAKEINDEX, it->first));
+        } else {
+            batch.Write(make_pair(DB_STAKEINDEX, it->first), it->second);
+        }
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadUTXOStats(const uint256 &hash, CUTXOStatsValue &value) {
+    return Read(make_pair(DB_UTXOSTATS, hash), value);
+}
+
+bool CBlockTreeDB::WriteUTXOStats(const uint256 &hash, const CUTXOStatsValue &value) {
+    return Write(make_pair(DB_UTXOSTATS, hash), value);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -387,3 +1211,181 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
 
     return true;
 }
+
+/**
+ * The block index snapshot (blocks/index.snapshot) is a header followed by one
+ * fixed-size record per block index entry, in height order. A record refers to
+ * its predecessor by record number, so loading needs no hash lookups for it.
+ * The header carries a random nonce which the database stores as well; the
+ * snapshot is only used while both agree.
+ */
+static const uint32_t SNAPSHOT_MAGIC = 0x5844494b; // "KIDX"
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const uint32_t SNAPSHOT_NO_PARENT = std::numeric_limits<uint32_t>::max();
+//! magic, version, nonce, record count, record size
+static const size_t SNAPSHOT_HEADER_SIZE = 24;
+static const size_t SNAPSHOT_RECORD_SIZE = 208;
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
+
+static unsigned char* SnapshotPut32(unsigned char* p, uint32_t n) { WriteLE32(p, n); return p + 4; }
+static unsigned char* SnapshotPut64(unsigned char* p, uint64_t n) { WriteLE64(p, n); return p + 8; }
+static unsigned char* SnapshotPutHash(unsigned char* p, const uint256& hash) { memcpy(p, hash.begin(), 32); return p + 32; }
+
+static uint32_t SnapshotGet32(const unsigned char*& p) { uint32_t n = ReadLE32(p); p += 4; return n; }
+static uint64_t SnapshotGet64(const unsigned char*& p) { uint64_t n = ReadLE64(p); p += 8; return n; }
+static uint256 SnapshotGetHash(const unsigned char*& p) { uint256 hash; memcpy(hash.begin(), p, 32); p += 32; return hash; }
+
+static void SnapshotPutRecord(unsigned char* p, const CBlockIndex* pindex, uint32_t nParent)
+{
+    p = SnapshotPutHash(p, pindex->GetBlockHash());
+    p = SnapshotPut32(p, nParent);
+    p = SnapshotPut32(p, pindex->nHeight);
+    p = SnapshotPut32(p, pindex->nStatus);
+    p = SnapshotPut32(p, pindex->nTx);
+    p = SnapshotPut32(p, pindex->nFile);
+    p = SnapshotPut32(p, pindex->nDataPos);
+    p = SnapshotPut32(p, pindex->nUndoPos);
+    p = SnapshotPut32(p, pindex->nVersion);
+    p = SnapshotPutHash(p, pindex->hashMerkleRoot);
+    p = SnapshotPut32(p, pindex->nTime);
+    p = SnapshotPut32(p, pindex->nBits);
+    p = SnapshotPut32(p, pindex->nNonce);
+    p = SnapshotPut64(p, pindex->nMint);
+    p = SnapshotPut64(p, pindex->nMoneySupply);
+    p = SnapshotPut32(p, pindex->nFlags);
+    p = SnapshotPut64(p, pindex->nStakeModifier);
+    p = SnapshotPutHash(p, ArithToUint256(pindex->hashProof));
+    p = SnapshotPutHash(p, pindex->prevoutStake.hash);
+    p = SnapshotPut32(p, pindex->prevoutStake.n);
+    SnapshotPut32(p, pindex->nStakeTime);
+}
+
+bool CBlockTreeDB::WriteBlockIndexSnapshot(const std::vector<const CBlockIndex*>& vSortedByHeight)
+{
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = path.string() + ".new";
+    uint64_t nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("%s: failed to open %s", __func__, pathTmp.string());
+
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    unsigned char* p = SnapshotPut32(header, SNAPSHOT_MAGIC);
+    p = SnapshotPut32(p, SNAPSHOT_VERSION);
+    p = SnapshotPut64(p, nNonce);
+    p = SnapshotPut32(p, vSortedByHeight.size());
+    SnapshotPut32(p, SNAPSHOT_RECORD_SIZE);
+    bool fOk = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+    // Records are written in chunks rather than building the whole file in memory
+    static const size_t CHUNK_RECORDS = 4096;
+    std::vector<unsigned char> vChunk;
+    vChunk.reserve(CHUNK_RECORDS * SNAPSHOT_RECORD_SIZE);
+    boost::unordered_map<const CBlockIndex*, uint32_t> mapPosition;
+    for (uint32_t i = 0; fOk && i < vSortedByHeight.size(); i++) {
+        const CBlockIndex* pindex = vSortedByHeight[i];
+        uint32_t nParent = SNAPSHOT_NO_PARENT;
+        if (pindex->pprev) {
+            boost::unordered_map<const CBlockIndex*, uint32_t>::const_iterator it = mapPosition.find(pindex->pprev);
+            if (it == mapPosition.end()) {
+                fclose(file);
+                boost::filesystem::remove(pathTmp);
+                return error("%s: block %s precedes its parent", __func__, pindex->GetBlockHash().ToString());
+            }
+            nParent = it->second;
+        }
+        mapPosition[pindex] = i;
+
+        vChunk.resize(vChunk.size() + SNAPSHOT_RECORD_SIZE);
+        SnapshotPutRecord(&vChunk[vChunk.size() - SNAPSHOT_RECORD_SIZE], pindex, nParent);
+        if (vChunk.size() == CHUNK_RECORDS * SNAPSHOT_RECORD_SIZE || i + 1 == vSortedByHeight.size()) {
+            fOk = fwrite(&vChunk[0], 1, vChunk.size(), file) == vChunk.size();
+            vChunk.clear();
+        }
+    }
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s: failed to write %s", __func__, path.string());
+    }
+    return Write(DB_BLOCK_INDEX_SNAPSHOT, std::make_pair(nNonce, (uint32_t)vSortedByHeight.size()), true);
+}
+
+bool CBlockTreeDB::LoadBlockIndexSnapshot(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, std::vector<CBlockIndex*>& vSortedByHeight)
+{
+    std::pair<uint64_t, uint32_t> stamp;
+    if (!Read(DB_BLOCK_INDEX_SNAPSHOT, stamp))
+        return false;
+
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    try {
+        if (!boost::filesystem::exists(path) || boost::filesystem::file_size(path) != SNAPSHOT_HEADER_SIZE + (uint64_t)stamp.second * SNAPSHOT_RECORD_SIZE)
+            return error("%s: %s is missing or has the wrong size", __func__, path.string());
+
+        boost::interprocess::file_mapping mapping(path.string().c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+        const unsigned char* p = static_cast<const unsigned char*>(region.get_address());
+
+        if (SnapshotGet32(p) != SNAPSHOT_MAGIC || SnapshotGet32(p) != SNAPSHOT_VERSION || SnapshotGet64(p) != stamp.first ||
+            SnapshotGet32(p) != stamp.second || SnapshotGet32(p) != SNAPSHOT_RECORD_SIZE)
+            return error("%s: %s does not match the block index database", __func__, path.string());
+
+        vSortedByHeight.clear();
+        vSortedByHeight.reserve(stamp.second);
+        for (uint32_t i = 0; i < stamp.second; i++) {
+            if (i % 65536 == 0)
+                boost::this_thread::interruption_point();
+
+            CBlockIndex* pindexNew = insertBlockIndex(SnapshotGetHash(p));
+            uint32_t nParent = SnapshotGet32(p);
+            if (nParent != SNAPSHOT_NO_PARENT && nParent >= i)
+                return error("%s: record %u refers to a later parent", __func__, i);
+            pindexNew->pprev          = nParent == SNAPSHOT_NO_PARENT ? NULL : vSortedByHeight[nParent];
+            pindexNew->nHeight        = SnapshotGet32(p);
+            pindexNew->nStatus        = SnapshotGet32(p);
+            pindexNew->nTx            = SnapshotGet32(p);
+            pindexNew->nFile          = SnapshotGet32(p);
+            pindexNew->nDataPos       = SnapshotGet32(p);
+            pindexNew->nUndoPos       = SnapshotGet32(p);
+            pindexNew->nVersion       = SnapshotGet32(p);
+            pindexNew->hashMerkleRoot = SnapshotGetHash(p);
+            pindexNew->nTime          = SnapshotGet32(p);
+            pindexNew->nBits          = SnapshotGet32(p);
+            pindexNew->nNonce         = SnapshotGet32(p);
+            pindexNew->nMint          = SnapshotGet64(p);
+            pindexNew->nMoneySupply   = SnapshotGet64(p);
+            pindexNew->nFlags         = SnapshotGet32(p);
+            pindexNew->nStakeModifier = SnapshotGet64(p);
+            pindexNew->hashProof      = UintToArith256(SnapshotGetHash(p));
+            pindexNew->prevoutStake.hash = SnapshotGetHash(p);
+            pindexNew->prevoutStake.n = SnapshotGet32(p);
+            pindexNew->nStakeTime     = SnapshotGet32(p);
+            if (pindexNew->pprev && pindexNew->nHeight != pindexNew->pprev->nHeight + 1)
+                return error("%s: record %u has a height that does not follow its parent", __func__, i);
+            vSortedByHeight.push_back(pindexNew);
+        }
+    } catch (const boost::interprocess::interprocess_exception& e) {
+        return error("%s: failed to map %s: %s", __func__, path.string(), e.what());
+    } catch (const boost::filesystem::filesystem_error& e) {
+        return error("%s: failed to read %s: %s", __func__, path.string(), e.what());
+    }
+    return true;
+}
+
+bool CBlockTreeDB::MoveIndexes(CIndexDB* pindexdb)
+{
+    return MoveRecords<CAddressIndexKey, CAmount>(*this, pindexdb, DB_ADDRESSINDEX) &&
+           MoveRecords<CAddressUnspentKey, CAddressUnspentValue>(*this, pindexdb, DB_ADDRESSUNSPENTINDEX) &&
+           MoveRecords<CAddressIndexIteratorKey, CAddressBalanceValue>(*this, pindexdb, DB_ADDRESSBALANCEINDEX) &&
+           MoveRecords<CTimestampIndexKey, int>(*this, pindexdb, DB_TIMESTAMPINDEX) &&
+           MoveRecords<CTimestampBlockIndexKey, CTimestampBlockIndexValue>(*this, pindexdb, DB_BLOCKHASHINDEX) &&
+           MoveRecords<CSpentIndexKey, CSpentIndexValue>(*this, pindexdb, DB_SPENTINDEX);
+}
@@ -13,6 +13,8 @@
 #include "addressindex.h"
 #include "spentindex.h"
 #include "timestampindex.h"
+#include "stakeindex.h"
+#include "utxostats.h"
 
 #include <map>
 #include <string>
@@ -20,8 +22,12 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
+class CIndexDB;
 class CCoinsViewDBCursor;
 class uint256;
 
@@ -31,6 +37,8 @@ static constexpr int DB_PEAK_USAGE_FACTOR = 2;
 static constexpr int MAX_BLOCK_COINSDB_USAGE = 200 * DB_PEAK_USAGE_FACTOR;
 //! Always periodic flush if less than this much space still available.
 static constexpr int MIN_BLOCK_COINSDB_USAGE = 50 * DB_PEAK_USAGE_FACTOR;
+//! Layout of the chainstate records, 1 is one record per unspent output
+static const int CHAINSTATE_VERSION = 1;
 //! -dbcache default (MiB)		  //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 450;
 //! max. -dbcache (MiB)
@@ -45,6 +53,10 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Memory allocated to the index DB specific cache while -addressindex and -spentindex are off (MiB)
+static const int64_t nMinIndexDBCache = 1;
+//! -asyncflush default
+static const bool DEFAULT_COINS_ASYNC_FLUSH = true;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -71,13 +83,63 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/** Timing and size of the writes to the coin database */
+struct CCoinsFlushStats
+{
+    //! Flushes committed
+    uint64_t nFlushes;
+    //! Bytes of records committed
+    uint64_t nBytesWritten;
+    //! Time the last and the slowest flush took to write, from snapshot to commit
+    int64_t nLastMicros;
+    int64_t nMaxMicros;
+    int64_t nTotalMicros;
+    //! Time callers of BatchWrite and Sync spent waiting for a flush to finish
+    int64_t nWaitMicros;
+
+    CCoinsFlushStats() : nFlushes(0), nBytesWritten(0), nLastMicros(0), nMaxMicros(0), nTotalMicros(0), nWaitMicros(0) {}
+};
+
+/**
+ * CCoinsView backed by the coin database (chainstate/).
+ *
+ * Every unspent output is a record of its own, so spending one output of a
+ * transaction deletes one small record instead of rewriting all the others.
+ * A per-transaction header record holds what the outputs have in common.
+ *
+ * With asynchronous flushing, BatchWrite only takes over the dirty entries
+ * and returns; a writer thread commits them while reads are answered from
+ * them. Another BatchWrite waits until that write has finished.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    //! Protects everything below
+    mutable boost::mutex csFlush;
+    mutable boost::condition_variable condFlush;
+    //! Statistics to store with the next batch that moves the best block to theirs
+    CUTXOStats statsPending;
+    mutable CCoinsFlushStats flushStats;
+
+    //! The dirty entries and best block the writer thread is committing; kept
+    //! after a failed write, as the cache no longer has them
+    CCoinsMap mapPending;
+    uint256 hashBlockPending;
+    bool fPending;
+    size_t nPendingUsage;
+    bool fWriteError;
+    bool fStopWriter;
+    boost::thread threadWriter;
+
+    void BatchWriteCoins(CDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry, size_t &nOutputsChanged) const;
+    //! Commit the dirty entries of mapCoins, erasing them as they are queued if fErase
+    bool WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase);
+    void ThreadWrite();
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool fAsyncFlush = false);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool SetCoins(const uint256 &txid, const CCoins &coins);
@@ -86,6 +148,30 @@ public:
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
 
+    bool IsAsyncFlush() const { return threadWriter.joinable(); }
+    //! Wait for the flush in progress, if any; false if an asynchronous flush failed
+    bool Sync() const;
+    //! Whether an asynchronous flush failed
+    bool HasWriteError() const;
+    //! Memory held by the flush in progress
+    size_t DynamicMemoryUsage() const;
+    CCoinsFlushStats GetFlushStats() const;
+
+    /**
+     * Convert records from the one-record-per-transaction layout; can be
+     * interrupted and resumed. Marks the database with CHAINSTATE_VERSION
+     * when done. The conversion cannot be undone, older versions need
+     * -reindex-chainstate.
+     */
+    bool Upgrade();
+    //! Whether the database was written in a layout newer than this version knows
+    bool IsNewerVersion() const;
+    uint64_t GetBytesWritten() const { return GetFlushStats().nBytesWritten; }
+
+    //! Read the UTXO set statistics stored with the best block, if any
+    bool GetUTXOStats(CUTXOStats &stats) const;
+    //! Store stats atomically with the flush that writes stats.hashBlock as the best block
+    void SetUTXOStats(const CUTXOStats &stats);
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -103,46 +189,107 @@ public:
 
 private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn), fValid(false), nValueSize(0) {}
+    //! Assemble the transaction whose header is at or after the iterator
+    void Load();
+
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    bool fValid;
+    uint256 txidTmp;
+    CCoins coinsTmp;
+    unsigned int nValueSize;
 
     friend class CCoinsViewDB;
 };
 
-/** Access to the block database (blocks/index/) */
-class CBlockTreeDB : public CDBWrapper
+/** Access to the optional address, spent and timestamp indexes (indexes/) */
+class CIndexDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool compression = true, int maxOpenFiles = 1000);
+    CIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool compression = true, int maxOpenFiles = 1000);
 private:
-    CBlockTreeDB(const CBlockTreeDB&);
-    void operator=(const CBlockTreeDB&);
+    CIndexDB(const CIndexDB&);
+    void operator=(const CIndexDB&);
+    bool EraseRecords(char chType);
+    void BatchAddressUnspentIndex(CDBBatch &batch, const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
+    //! Add the balance changes of a block's address index entries to batch, or take them out
+    bool WriteAddressBalances(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
+    bool EraseAddressBalances(CDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
 public:
-    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
-    bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
-    bool ReadLastBlockFile(int &nFile);
-    bool WriteReindexing(bool fReindex);
-    bool ReadReindexing(bool &fReindex);
-    bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
     bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect);
     bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
                                  std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    bool ReadAddressUnspentIndex(const std::vector<std::pair<uint160, int> > &addresses, int maxHeight, CAmount minValue,
+                                 std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > &unspentOutputs);
     bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                           int start = 0, int end = 0);
+    bool ReadAddressIndexPage(uint160 addressHash, int type, int start, int end,
+                              const CAddressIndexKey *pkeyAfter, bool fReverse, size_t nLimit,
+                              std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex);
+    bool ReadAddressBalanceIndex(uint160 addressHash, int type, CAddressBalanceValue &value);
+    //! Write a block's address index entries, unspent outputs and balance changes in one batch
+    bool ConnectAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                             const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &addressUnspentIndex);
+    //! Undo ConnectAddressIndex, in one batch as well
+    bool DisconnectAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                                const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &addressUnspentIndex);
+    bool RebuildAddressBalanceIndex();
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
     bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &vect);
     bool WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts);
     bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);
+    //! Erase the address index, with its unspent outputs and balances
+    bool DropAddressIndex();
+    bool DropSpentIndex();
+    bool DropTimestampIndex();
+};
+
+/** Access to the block database (blocks/index/) */
+class CBlockTreeDB : public CDBWrapper
+{
+public:
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool compression = true, int maxOpenFiles = 1000);
+private:
+    CBlockTreeDB(const CBlockTreeDB&);
+    void operator=(const CBlockTreeDB&);
+public:
+    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
+    bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
+    bool ReadLastBlockFile(int &nFile);
+    bool WriteReindexing(bool fReindex);
+    bool ReadReindexing(bool &fReindex);
+    bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
+    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool ReadStakeIndex(const COutPoint &outpoint, CStakeIndexValue &value);
+    bool UpdateStakeIndex(const std::vector<std::pair<COutPoint, CStakeIndexValue> > &vect);
+    bool ReadUTXOStats(const uint256 &hash, CUTXOStatsValue &value);
+    bool WriteUTXOStats(const uint256 &hash, const CUTXOStatsValue &value);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    /**
+     * Write a flat copy of the given block index entries, which must be in
+     * height order and include every entry's predecessor, and mark it as
+     * matching the database. Writing block index entries unmarks it again.
+     */
+    bool WriteBlockIndexSnapshot(const std::vector<const CBlockIndex*>& vSortedByHeight);
+    /**
+     * Load the block index from the snapshot, in height order, if it matches
+     * the database. Returns false if it is missing, stale or damaged; entries
+     * inserted before damage was found are left to the caller.
+     */
+    bool LoadBlockIndexSnapshot(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, std::vector<CBlockIndex*>& vSortedByHeight);
+    /**
+     * Move the address, spent and timestamp index records that older versions
+     * kept here to pindexdb, or drop them if it is NULL. An interrupted move
+     * picks up where it stopped.
+     */
+    bool MoveIndexes(CIndexDB* pindexdb);
 };
 
 #endif // KEKCOIN_TXDB_H
@@ -0,0 +1,103 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxostats.h"
+
+#include "clientversion.h"
+#include "coins.h"
+#include "streams.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+static void UpdateOutput(MuHash3072& muhash, const uint256& txid, unsigned int n, const CCoins& coins, bool fAdd)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << COutPoint(txid, n) << (uint32_t)(coins.nHeight * 2 + coins.fCoinBase) << coins.fCoinStake << coins.nTime << coins.vout[n];
+    if (fAdd)
+        muhash.Insert((const unsigned char*)&ss[0], ss.size());
+    else
+        muhash.Remove((const unsigned char*)&ss[0], ss.size());
+}
+
+void CUTXOStats::SetNull()
+{
+    hashBlock.SetNull();
+    nTransactions = 0;
+    nTransactionOutputs = 0;
+    nSerializedSize = 0;
+    nTotalAmount = 0;
+    muhash = MuHash3072();
+}
+
+void CUTXOStats::UpdateCoins(const uint256& txid, const CCoins& coinsOld, const CCoins& coinsNew)
+{
+    bool fOld = !coinsOld.IsPruned();
+    bool fNew = !coinsNew.IsPruned();
+    if (fOld) {
+        nTransactions--;
+        nSerializedSize -= 32 + ::GetSerializeSize(coinsOld, SER_DISK, CLIENT_VERSION);
+    }
+    if (fNew) {
+        nTransactions++;
+        nSerializedSize += 32 + ::GetSerializeSize(coinsNew, SER_DISK, CLIENT_VERSION);
+    }
+
+    // Outputs that are unspent on both sides and created by the same
+    // transaction are left alone
+    bool fSameTx = fOld && fNew && coinsOld.nHeight == coinsNew.nHeight && coinsOld.fCoinBase == coinsNew.fCoinBase &&
+                   coinsOld.fCoinStake == coinsNew.fCoinStake && coinsOld.nTime == coinsNew.nTime;
+    size_t nOutputs = std::max(fOld ? coinsOld.vout.size() : 0, fNew ? coinsNew.vout.size() : 0);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        const CTxOut* poutOld = fOld && i < coinsOld.vout.size() && !coinsOld.vout[i].IsNull() ? &coinsOld.vout[i] : NULL;
+        const CTxOut* poutNew = fNew && i < coinsNew.vout.size() && !coinsNew.vout[i].IsNull() ? &coinsNew.vout[i] : NULL;
+        if (fSameTx && poutOld && poutNew && *poutOld == *poutNew)
+            continue;
+        if (poutOld) {
+            nTransactionOutputs--;
+            nTotalAmount -= poutOld->nValue;
+            UpdateOutput(muhash, txid, i, coinsOld, false);
+        }
+        if (poutNew) {
+            nTransactionOutputs++;
+            nTotalAmount += poutNew->nValue;
+            UpdateOutput(muhash, txid, i, coinsNew, true);
+        }
+    }
+}
+
+CUTXOStatsValue CUTXOStats::GetValue(int nHeight)
+{
+    CUTXOStatsValue value;
+    value.nHeight = nHeight;
+    value.nTransactions = nTransactions;
+    value.nTransactionOutputs = nTransactionOutputs;
+    value.nSerializedSize = nSerializedSize;
+    value.nTotalAmount = nTotalAmount;
+    muhash.Finalize(*reinterpret_cast<unsigned char (*)[32]>(value.hashMuHash.begin()));
+    return value;
+}
+
+bool ScanUTXOStats(CCoinsView* view, CUTXOStats& stats)
+{
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(view->Cursor());
+
+    stats.SetNull();
+    stats.hashBlock = pcursor->GetBestBlock();
+    const CCoins coinsEmpty;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        uint256 key;
+        CCoins coins;
+        if (!pcursor->GetKey(key) || !pcursor->GetValue(coins))
+            return error("%s: unable to read value", __func__);
+        stats.UpdateCoins(key, coinsEmpty, coins);
+        pcursor->Next();
+    }
+    stats.muhash.Normalize();
+    return true;
+}
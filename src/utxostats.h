@@ -0,0 +1,107 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef KEKCOIN_UTXOSTATS_H
+#define KEKCOIN_UTXOSTATS_H
+
+#include "amount.h"
+#include "crypto/muhash.h"
+#include "serialize.h"
+#include "uint256.h"
+
+class CCoins;
+class CCoinsView;
+
+/** Statistics of the unspent output set as of one block */
+struct CUTXOStatsValue {
+    int nHeight;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+    uint256 hashMuHash;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nHeight);
+        READWRITE(VARINT(nTransactions));
+        READWRITE(VARINT(nTransactionOutputs));
+        READWRITE(VARINT(nSerializedSize));
+        READWRITE(nTotalAmount);
+        READWRITE(hashMuHash);
+    }
+
+    CUTXOStatsValue() {
+        SetNull();
+    }
+
+    void SetNull() {
+        nHeight = -1;
+        nTransactions = 0;
+        nTransactionOutputs = 0;
+        nSerializedSize = 0;
+        nTotalAmount = 0;
+        hashMuHash.SetNull();
+    }
+
+    bool IsNull() const {
+        return nHeight == -1;
+    }
+};
+
+/**
+ * Statistics of the unspent output set that are kept up to date as blocks
+ * are connected and disconnected, rather than computed by scanning the set.
+ * The set hash covers every unspent output together with its outpoint and
+ * the height, time and kind of the transaction that created it, so it does
+ * not depend on how outputs are grouped per transaction.
+ */
+class CUTXOStats
+{
+public:
+    //! The block the statistics are as of
+    uint256 hashBlock;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    //! Size of the coin database records, counting 32 bytes per key
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+    MuHash3072 muhash;
+
+    CUTXOStats() {
+        SetNull();
+    }
+
+    void SetNull();
+
+    /** Account for the coins of txid changing from coinsOld to coinsNew; either may be pruned */
+    void UpdateCoins(const uint256& txid, const CCoins& coinsOld, const CCoins& coinsNew);
+
+    /** The statistics with the finalized set hash, for the block at nHeight */
+    CUTXOStatsValue GetValue(int nHeight);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashBlock);
+        READWRITE(VARINT(nTransactions));
+        READWRITE(VARINT(nTransactionOutputs));
+        READWRITE(VARINT(nSerializedSize));
+        READWRITE(nTotalAmount);
+        unsigned char vchMuHash[2 * Num3072::BYTE_SIZE];
+        if (!ser_action.ForRead())
+            muhash.ToBytes(vchMuHash);
+        READWRITE(FLATDATA(vchMuHash));
+        if (ser_action.ForRead())
+            muhash.FromBytes(vchMuHash);
+    }
+};
+
+/** Compute the statistics of the whole set behind view from scratch */
+bool ScanUTXOStats(CCoinsView* view, CUTXOStats& stats);
+
+#endif // KEKCOIN_UTXOSTATS_H
@@ -1692,12 +1692,13 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
 
     UniValue transactions(UniValue::VARR);
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    // only what came after the block, and what is in no block of the main chain
+    std::vector<const CWalletTx*> vwtx;
+    pwalletMain->GetWalletTxsSince(pindex ? pindex->nHeight : -1, vwtx);
+    BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        if (depth == -1 || pwtx->GetDepthInMainChain() < depth)
+            ListTransactions(*pwtx, "*", 0, true, transactions, filter);
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -2591,70 +2592,36 @@ struct StakePeriodRange_T {
 typedef std::vector<StakePeriodRange_T> vStakePeriodRange_T;
 
 // **em52: Get total coins staked on given period
-// inspired from CWallet::GetStake()
 // Parameter aRange = Vector with given limit date, and result
-// return int =  Number of Wallet's elements analyzed
+// return int =  Number of stakes in the wallet's stake ledger
 int GetsStakeSubTotal(vStakePeriodRange_T& aRange)
 {
-    int nElement = 0;
-    int64_t nAmount = 0;
-
-    const CWalletTx* pcoin;
+    // only mature stakes count
+    int nMaxHeight = pwalletMain->GetMatureStakeHeight();
 
-    vStakePeriodRange_T::iterator vIt;
+    LOCK(pwalletMain->cs_wallet);
+    const CStakeLedger& ledger = pwalletMain->GetStakeLedger();
 
-    // scan the entire wallet transactions
-    for (map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin();
-         it != pwalletMain->mapWallet.end();
-         ++it)
+    for (vStakePeriodRange_T::iterator vIt = aRange.begin(); vIt != aRange.end(); vIt++)
     {
-        pcoin = &(*it).second;
-
-        // skip orphan block or immature
-        if  ((!pcoin->GetDepthInMainChain()) || (pcoin->GetBlocksToMaturity()>0))
-            continue;
-
-        // skip abandoned transactions
-        if(pcoin->isAbandoned())
-            continue;
-
-        // skip transaction other than POS block
-        if (!(pcoin->IsCoinStake()))
-            continue;
-
-        if(pcoin->isAbandoned())
-            continue;
-
-        nElement++;
-
-        // use the cached amount if available
-        if (pcoin->fCreditCached && pcoin->fDebitCached)
-            nAmount = pcoin->nCreditCached - pcoin->nDebitCached;
-        else
-            nAmount = pcoin->GetCredit(ISMINE_SPENDABLE) - pcoin->GetDebit(ISMINE_SPENDABLE);
-
-
-        // scan the range
-        for(vIt=aRange.begin(); vIt != aRange.end(); vIt++)
-        {
-            if (pcoin->nTime >= vIt->Start)
+        if (! vIt->End)
+        {   // Manage Special case
+            CStakeLedgerEntry latest;
+            if (ledger.GetLatest(nMaxHeight, latest))
             {
-                if (! vIt->End)
-                {   // Manage Special case
-                    vIt->Start = pcoin->nTime;
-                    vIt->Total = nAmount;
-                }
-                else if (pcoin->nTime <= vIt->End)
-                {
-                    vIt->Count++;
-                    vIt->Total += nAmount;
-                }
+                vIt->Start = latest.nTime;
+                vIt->Total = latest.nAmount;
             }
         }
-
+        else
+        {
+            int nCount = 0;
+            vIt->Total += ledger.GetTotal(vIt->Start, vIt->End, nMaxHeight, nCount);
+            vIt->Count += nCount;
+        }
     }
 
-    return nElement;
+    return ledger.size();
 }
 
 
@@ -2724,6 +2691,9 @@ return aRange;
 // getstakereport: return SubTotal of the staked coin in last 24H, 7 days, etc.. of all owns address
 UniValue getstakereport(const UniValue& params, bool fHelp)
 {
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
     if ((params.size()>0) || (fHelp))
         throw runtime_error(
             "getstakereport\n"
@@ -2759,6 +2729,63 @@ UniValue getstakereport(const UniValue& params, bool fHelp)
     return  result;
 }
 
+// getstakeseries: stake rewards of each day of a period, read from the wallet's stake ledger
+UniValue getstakeseries(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "getstakeseries ( from to )\n"
+            "\nReturns the rewards of the wallet's mature stakes for each UTC day of a period.\n"
+            "\nArguments:\n"
+            "1. from    (numeric, optional, default=29 days before to) Unix time within the first day\n"
+            "2. to      (numeric, optional, default=now) Unix time within the last day\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"time\": n,              (numeric) Unix time of the start of the day\n"
+            "    \"date\": \"yyyy-mm-dd\",  (string) The day\n"
+            "    \"amount\": x.xxx,        (numeric) The rewards staked on the day in " + CURRENCY_UNIT + "\n"
+            "    \"count\": n              (numeric) The number of stakes on the day\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getstakeseries", "")
+            + HelpExampleCli("getstakeseries", "1483228800 1514764799")
+            + HelpExampleRpc("getstakeseries", "1483228800, 1514764799")
+        );
+
+    int64_t nTo = params.size() > 1 ? params[1].get_int64() : GetTime();
+    int64_t nFrom = params.size() > 0 ? params[0].get_int64() : nTo - 29 * STAKE_LEDGER_DAY;
+    if (nFrom < 0 || nTo < nFrom)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid period");
+
+    int nMaxHeight = pwalletMain->GetMatureStakeHeight();
+
+    LOCK(pwalletMain->cs_wallet);
+    const CStakeLedger& ledger = pwalletMain->GetStakeLedger();
+
+    UniValue result(UniValue::VARR);
+    for (int64_t nDay = CStakeLedger::GetDay(nFrom); nDay <= CStakeLedger::GetDay(nTo); nDay++)
+    {
+        int64_t nStart = nDay * STAKE_LEDGER_DAY;
+        int nCount = 0;
+        CAmount nAmount = ledger.GetDayRecord(nDay) ? ledger.GetTotal(nStart, nStart + STAKE_LEDGER_DAY - 1, nMaxHeight, nCount) : 0;
+
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("time", nStart));
+        entry.push_back(Pair("date", DateTimeStrFormat("%Y-%m-%d", nStart)));
+        entry.push_back(Pair("amount", ValueFromAmount(nAmount)));
+        entry.push_back(Pair("count", nCount));
+        result.push_back(entry);
+    }
+
+    return result;
+}
+
 extern UniValue dumpprivkey(const UniValue& params, bool fHelp); // in rpcdump.cpp
 extern UniValue dumpmasterprivkey(const UniValue& params, bool fHelp);
 extern UniValue importprivkey(const UniValue& params, bool fHelp);
@@ -2791,6 +2818,7 @@ static const CRPCCommand commands[] =
     { "wallet",             "getreceivedbyaccount",     &getreceivedbyaccount,     false },
     { "wallet",             "getreceivedbyaddress",     &getreceivedbyaddress,     false },
     { "wallet",             "getstakereport",           &getstakereport,           false },
+    { "wallet",             "getstakeseries",           &getstakeseries,           false },
     { "wallet",             "gettransaction",           &gettransaction,           false },
     { "wallet",             "getunconfirmedbalance",    &getunconfirmedbalance,    false },
     { "wallet",             "getwalletinfo",            &getwalletinfo,            false },
@@ -0,0 +1,134 @@
+// Copyright (c) 2016 The KekCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/stakeledger.h"
+
+#include <algorithm>
+
+void CStakeDay::UpdateTotals()
+{
+    nTotal = 0;
+    nMaxHeight = 0;
+    for (std::vector<CStakeLedgerEntry>::const_iterator it = vEntries.begin(); it != vEntries.end(); ++it) {
+        nTotal += it->nAmount;
+        nMaxHeight = std::max(nMaxHeight, it->nHeight);
+    }
+}
+
+void CStakeLedger::Add(const CStakeLedgerEntry& entry, std::set<int64_t>& setDaysChanged)
+{
+    const CStakeLedgerEntry* pentry = Find(entry.hash);
+    if (pentry && *pentry == entry)
+        return;
+    Remove(entry.hash, setDaysChanged);
+
+    int64_t nDay = GetDay(entry.nTime);
+    CStakeDay& day = mapDays[nDay];
+    day.vEntries.push_back(entry);
+    day.nTotal += entry.nAmount;
+    day.nMaxHeight = std::max(day.nMaxHeight, entry.nHeight);
+    mapDayByTx[entry.hash] = nDay;
+    setDaysChanged.insert(nDay);
+}
+
+void CStakeLedger::Remove(const uint256& hash, std::set<int64_t>& setDaysChanged)
+{
+    std::map<uint256, int64_t>::iterator mi = mapDayByTx.find(hash);
+    if (mi == mapDayByTx.end())
+        return;
+    int64_t nDay = mi->second;
+    mapDayByTx.erase(mi);
+    setDaysChanged.insert(nDay);
+
+    std::map<int64_t, CStakeDay>::iterator it = mapDays.find(nDay);
+    if (it == mapDays.end())
+        return;
+    std::vector<CStakeLedgerEntry>& vEntries = it->second.vEntries;
+    for (std::vector<CStakeLedgerEntry>::iterator ei = vEntries.begin(); ei != vEntries.end(); ++ei) {
+        if (ei->hash == hash) {
+            vEntries.erase(ei);
+            break;
+        }
+    }
+    if (vEntries.empty())
+        mapDays.erase(it);
+    else
+        it->second.UpdateTotals();
+}
+
+void CStakeLedger::LoadDay(int64_t nDay, const CStakeDay& day)
+{
+    mapDays[nDay] = day;
+    for (std::vector<CStakeLedgerEntry>::const_iterator it = day.vEntries.begin(); it != day.vEntries.end(); ++it)
+        mapDayByTx[it->hash] = nDay;
+}
+
+void CStakeLedger::Clear()
+{
+    mapDays.clear();
+    mapDayByTx.clear();
+}
+
+const CStakeLedgerEntry* CStakeLedger::Find(const uint256& hash) const
+{
+    std::map<uint256, int64_t>::const_iterator mi = mapDayByTx.find(hash);
+    if (mi == mapDayByTx.end())
+        return NULL;
+    const CStakeDay* pday = GetDayRecord(mi->second);
+    if (!pday)
+        return NULL;
+    for (std::vector<CStakeLedgerEntry>::const_iterator it = pday->vEntries.begin(); it != pday->vEntries.end(); ++it)
+        if (it->hash == hash)
+            return &*it;
+    return NULL;
+}
+
+const CStakeDay* CStakeLedger::GetDayRecord(int64_t nDay) const
+{
+    std::map<int64_t, CStakeDay>::const_iterator it = mapDays.find(nDay);
+    return it == mapDays.end() ? NULL : &it->second;
+}
+
+CAmount CStakeLedger::GetTotal(int64_t nStart, int64_t nEnd, int nMaxHeight, int& nCountRet) const
+{
+    CAmount nTotal = 0;
+    nCountRet = 0;
+    if (nEnd < nStart)
+        return 0;
+
+    int64_t nLastDay = GetDay(nEnd);
+    for (std::map<int64_t, CStakeDay>::const_iterator it = mapDays.lower_bound(GetDay(nStart)); it != mapDays.end() && it->first <= nLastDay; ++it)
+    {
+        const CStakeDay& day = it->second;
+        int64_t nDayStart = it->first * STAKE_LEDGER_DAY;
+        if (nDayStart >= nStart && nDayStart + STAKE_LEDGER_DAY - 1 <= nEnd && day.nMaxHeight <= nMaxHeight) {
+            nTotal += day.nTotal;
+            nCountRet += day.vEntries.size();
+            continue;
+        }
+        for (std::vector<CStakeLedgerEntry>::const_iterator ei = day.vEntries.begin(); ei != day.vEntries.end(); ++ei) {
+            if (ei->nTime >= nStart && ei->nTime <= nEnd && ei->nHeight <= nMaxHeight) {
+                nTotal += ei->nAmount;
+                nCountRet++;
+            }
+        }
+    }
+    return nTotal;
+}
+
+bool CStakeLedger::GetLatest(int nMaxHeight, CStakeLedgerEntry& entryRet) const
+{
+    for (std::map<int64_t, CStakeDay>::const_reverse_iterator it = mapDays.rbegin(); it != mapDays.rend(); ++it)
+    {
+        const CStakeLedgerEntry* platest = NULL;
+        for (std::vector<CStakeLedgerEntry>::const_iterator ei = it->second.vEntries.begin(); ei != it->second.vEntries.end(); ++ei)
+            if (ei->nHeight <= nMaxHeight && (!platest || ei->nTime > platest->nTime))
+                platest = &*ei;
+        if (platest) {
+            entryRet = *platest;
+            return true;
+        }
+    }
+    return false;
+}
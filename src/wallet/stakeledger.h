@@ -0,0 +1,114 @@
+// Copyright (c) 2016 The KekCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef KEKCOIN_WALLET_STAKELEDGER_H
+#define KEKCOIN_WALLET_STAKELEDGER_H
+
+#include "amount.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+static const int64_t STAKE_LEDGER_DAY = 24 * 60 * 60;
+
+/** A confirmed coinstake of the wallet and what it earned */
+struct CStakeLedgerEntry
+{
+    uint256 hash;
+    int64_t nTime;
+    int nHeight; //! height of the block containing the coinstake
+    CAmount nAmount; //! credit minus debit of the coinstake
+
+    CStakeLedgerEntry() : nTime(0), nHeight(0), nAmount(0) {}
+    CStakeLedgerEntry(const uint256& hashIn, int64_t nTimeIn, int nHeightIn, CAmount nAmountIn) :
+        hash(hashIn), nTime(nTimeIn), nHeight(nHeightIn), nAmount(nAmountIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hash);
+        READWRITE(nTime);
+        READWRITE(nHeight);
+        READWRITE(nAmount);
+    }
+
+    friend bool operator==(const CStakeLedgerEntry& a, const CStakeLedgerEntry& b)
+    {
+        return a.hash == b.hash && a.nTime == b.nTime && a.nHeight == b.nHeight && a.nAmount == b.nAmount;
+    }
+};
+
+/** The stakes of one UTC day, stored in the wallet as ("stakeday", day) */
+class CStakeDay
+{
+public:
+    std::vector<CStakeLedgerEntry> vEntries;
+
+    //! sum and highest block of vEntries, not stored
+    CAmount nTotal;
+    int nMaxHeight;
+
+    CStakeDay() : nTotal(0), nMaxHeight(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(vEntries);
+        if (ser_action.ForRead())
+            UpdateTotals();
+    }
+
+    void UpdateTotals();
+};
+
+/**
+ * Stake rewards of the wallet in buckets of one UTC day, so that the total
+ * of any period takes a look at each day in it rather than at every
+ * transaction of the wallet. Stakes that are not mature yet are recorded
+ * too and left out of totals by height.
+ */
+class CStakeLedger
+{
+private:
+    std::map<int64_t, CStakeDay> mapDays;
+    std::map<uint256, int64_t> mapDayByTx;
+
+public:
+    static int64_t GetDay(int64_t nTime) { return nTime / STAKE_LEDGER_DAY; }
+
+    //! Record a stake, or move it if it is already there; days whose records changed are added to setDaysChanged
+    void Add(const CStakeLedgerEntry& entry, std::set<int64_t>& setDaysChanged);
+    //! Forget a stake, if it is recorded
+    void Remove(const uint256& hash, std::set<int64_t>& setDaysChanged);
+    //! Take the records of a day as read from the wallet
+    void LoadDay(int64_t nDay, const CStakeDay& day);
+    void Clear();
+
+    bool Contains(const uint256& hash) const { return mapDayByTx.count(hash) > 0; }
+    //! The recorded stake with this hash, or NULL
+    const CStakeLedgerEntry* Find(const uint256& hash) const;
+    //! The records of a day, or NULL if it has no stakes
+    const CStakeDay* GetDayRecord(int64_t nDay) const;
+    size_t size() const { return mapDayByTx.size(); }
+    const std::map<uint256, int64_t>& GetStakes() const { return mapDayByTx; }
+
+    /**
+     * Total of the stakes with nStart <= time <= nEnd in blocks up to
+     * nMaxHeight. Whole days are summed from their totals; only the days at
+     * either end of the period and days holding stakes above nMaxHeight
+     * are looked at stake by stake.
+     */
+    CAmount GetTotal(int64_t nStart, int64_t nEnd, int nMaxHeight, int& nCountRet) const;
+
+    //! The latest stake in blocks up to nMaxHeight
+    bool GetLatest(int nMaxHeight, CStakeLedgerEntry& entryRet) const;
+};
+
+#endif // KEKCOIN_WALLET_STAKELEDGER_H
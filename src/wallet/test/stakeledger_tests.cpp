@@ -0,0 +1,96 @@
+// Copyright (c) 2016 The KekCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/stakeledger.h"
+
+#include "clientversion.h"
+#include "streams.h"
+
+#include "test/test_kekcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(stakeledger_tests, BasicTestingSetup)
+
+static const int64_t DAY = STAKE_LEDGER_DAY;
+static const int64_t T0 = 17000 * DAY;
+
+static CAmount Total(const CStakeLedger& ledger, int64_t nStart, int64_t nEnd, int nMaxHeight, int nExpectedCount)
+{
+    int nCount = -1;
+    CAmount nTotal = ledger.GetTotal(nStart, nEnd, nMaxHeight, nCount);
+    BOOST_CHECK_EQUAL(nCount, nExpectedCount);
+    return nTotal;
+}
+
+BOOST_AUTO_TEST_CASE(stakeledger_totals)
+{
+    CStakeLedger ledger;
+    std::set<int64_t> setDays;
+
+    ledger.Add(CStakeLedgerEntry(uint256S("0x1"), T0 + 100, 10, 1 * COIN), setDays);
+    ledger.Add(CStakeLedgerEntry(uint256S("0x2"), T0 + DAY - 1, 11, 2 * COIN), setDays);
+    ledger.Add(CStakeLedgerEntry(uint256S("0x3"), T0 + DAY, 12, 4 * COIN), setDays);
+    ledger.Add(CStakeLedgerEntry(uint256S("0x4"), T0 + 3 * DAY + 50, 20, 8 * COIN), setDays);
+    BOOST_CHECK_EQUAL(ledger.size(), 4U);
+    BOOST_CHECK_EQUAL(setDays.size(), 3U);
+    BOOST_CHECK_EQUAL(ledger.GetDayRecord(CStakeLedger::GetDay(T0))->nTotal, 3 * COIN);
+
+    // whole days, parts of days and nothing at all
+    BOOST_CHECK_EQUAL(Total(ledger, T0, T0 + 4 * DAY, 100, 4), 15 * COIN);
+    BOOST_CHECK_EQUAL(Total(ledger, T0 + 101, T0 + DAY, 100, 2), 6 * COIN);
+    BOOST_CHECK_EQUAL(Total(ledger, T0 + DAY + 1, T0 + 3 * DAY, 100, 0), 0);
+    BOOST_CHECK_EQUAL(Total(ledger, T0 + DAY, T0, 100, 0), 0);
+
+    // stakes above the mature height are left out
+    BOOST_CHECK_EQUAL(Total(ledger, T0, T0 + 4 * DAY, 11, 2), 3 * COIN);
+    CStakeLedgerEntry latest;
+    BOOST_CHECK(ledger.GetLatest(100, latest));
+    BOOST_CHECK(latest.hash == uint256S("0x4"));
+    BOOST_CHECK(ledger.GetLatest(19, latest));
+    BOOST_CHECK(latest.hash == uint256S("0x3"));
+    BOOST_CHECK(!ledger.GetLatest(9, latest));
+
+    // adding the same stake again changes nothing, a new block moves it
+    setDays.clear();
+    ledger.Add(CStakeLedgerEntry(uint256S("0x3"), T0 + DAY, 12, 4 * COIN), setDays);
+    BOOST_CHECK(setDays.empty());
+    ledger.Add(CStakeLedgerEntry(uint256S("0x3"), T0 + 2 * DAY, 13, 4 * COIN), setDays);
+    BOOST_CHECK_EQUAL(setDays.size(), 2U);
+    BOOST_CHECK(!ledger.GetDayRecord(CStakeLedger::GetDay(T0 + DAY)));
+    BOOST_CHECK_EQUAL(ledger.size(), 4U);
+
+    setDays.clear();
+    ledger.Remove(uint256S("0x1"), setDays);
+    ledger.Remove(uint256S("0x5"), setDays);
+    BOOST_CHECK_EQUAL(setDays.size(), 1U);
+    BOOST_CHECK(!ledger.Contains(uint256S("0x1")));
+    BOOST_CHECK_EQUAL(Total(ledger, T0, T0 + 4 * DAY, 100, 3), 14 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(stakeledger_serialization)
+{
+    CStakeLedger ledger;
+    std::set<int64_t> setDays;
+    ledger.Add(CStakeLedgerEntry(uint256S("0x1"), T0 + 100, 10, 1 * COIN), setDays);
+    ledger.Add(CStakeLedgerEntry(uint256S("0x2"), T0 + 200, 30, 2 * COIN), setDays);
+
+    int64_t nDay = CStakeLedger::GetDay(T0);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << *ledger.GetDayRecord(nDay);
+    CStakeDay day;
+    ss >> day;
+    BOOST_CHECK_EQUAL(day.vEntries.size(), 2U);
+    BOOST_CHECK_EQUAL(day.nTotal, 3 * COIN);
+    BOOST_CHECK_EQUAL(day.nMaxHeight, 30);
+
+    CStakeLedger loaded;
+    loaded.LoadDay(nDay, day);
+    BOOST_CHECK(loaded.Contains(uint256S("0x2")));
+    BOOST_CHECK(*loaded.Find(uint256S("0x1")) == day.vEntries[0]);
+    int nCount;
+    BOOST_CHECK_EQUAL(loaded.GetTotal(T0, T0 + DAY - 1, 20, nCount), 1 * COIN);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
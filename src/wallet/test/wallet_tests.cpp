@@ -4,6 +4,10 @@
 
 #include "wallet/wallet.h"
 
+#include "chainparams.h"
+#include "main.h"
+#include "script/standard.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -42,7 +46,7 @@ static void add_coin(const CAmount& nValue, int nAge = 6*24, bool fIsFromMe = fa
         // so stop vin being empty, and cache a non-zero Debit to fake out IsFromMe()
         tx.vin.resize(1);
     }
-    CWalletTx* wtx = new CWalletTx(&wallet, tx);
+    CWalletTx* wtx = new CWalletTx(&wallet, CTransaction(tx));
     if (fIsFromMe)
     {
         wtx->fDebitCached = true;
@@ -59,6 +63,42 @@ static void empty_wallet(void)
     vCoins.clear();
 }
 
+// a new key of the wallet, and the script paying to it
+static CScript add_key(CWallet& wallet)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+    return GetScriptForDestination(key.GetPubKey().GetID());
+}
+
+// a transaction spending prevout to up to three outputs
+static CTransaction make_tx(const COutPoint& prevout, const CTxOut& out0, const CTxOut& out1 = CTxOut(), const CTxOut& out2 = CTxOut())
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.push_back(out0);
+    if (!out1.IsNull())
+        tx.vout.push_back(out1);
+    if (!out2.IsNull())
+        tx.vout.push_back(out2);
+    return CTransaction(tx);
+}
+
+// add tx to the wallet at position nIndex of the tip block, or unconfirmed if nIndex < 0;
+// without a walletdb it is added as loading the wallet would
+static CWalletTx add_tx(CWallet& wallet, CWalletDB* pwalletdb, const CTransaction& tx, int nIndex)
+{
+    CWalletTx wtx(&wallet, tx);
+    if (nIndex >= 0) {
+        wtx.hashBlock = chainActive.Tip()->GetBlockHash();
+        wtx.nIndex = nIndex;
+    }
+    BOOST_CHECK(wallet.AddToWallet(wtx, pwalletdb == NULL, pwalletdb));
+    return wtx;
+}
+
 static bool equal_sets(CoinSet a, CoinSet b)
 {
     pair<CoinSet::iterator, CoinSet::iterator> ret = mismatch(a.begin(), a.end(), b.begin());
@@ -351,4 +391,306 @@ BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
     BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
 }
 
+BOOST_AUTO_TEST_CASE(wallet_balances_follow_dirty_transactions)
+{
+    CWallet testWallet;
+    LOCK2(cs_main, testWallet.cs_wallet);
+    CScript scriptMine = add_key(testWallet);
+
+    // a confirmed payment of two outputs to us
+    CWalletTx wtxPay = add_tx(testWallet, NULL, make_tx(COutPoint(uint256S("0x1"), 0), CTxOut(5 * COIN, scriptMine), CTxOut(3 * COIN, scriptMine)), 0);
+    BOOST_CHECK_EQUAL(testWallet.GetBalance(), 8 * COIN);
+    BOOST_CHECK_EQUAL(testWallet.GetUnconfirmedBalance(), 0);
+
+    // a confirmed spend of the first output; the spent transaction is marked dirty as SyncTransaction does
+    add_tx(testWallet, NULL, make_tx(COutPoint(wtxPay.GetHash(), 0), CTxOut(4 * COIN, CScript() << OP_TRUE)), 1);
+    testWallet.mapWallet[wtxPay.GetHash()].MarkDirty();
+    BOOST_CHECK_EQUAL(testWallet.GetBalance(), 3 * COIN);
+
+    // the balances kept do not drift from a full recount
+    testWallet.MarkDirty();
+    BOOST_CHECK_EQUAL(testWallet.GetBalance(), 3 * COIN);
+    CWalletBalances balances = testWallet.GetBalances();
+    BOOST_CHECK_EQUAL(balances.nImmature, 0);
+    BOOST_CHECK_EQUAL(balances.nWatchTrusted, 0);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_balances_drop_zapped_transactions)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CScript scriptMine = add_key(*pwalletMain);
+
+    // a confirmed payment to us, as removeprunedfunds would zap it
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CWalletTx wtxPay = add_tx(*pwalletMain, &walletdb, make_tx(COutPoint(uint256S("0x1"), 0), CTxOut(5 * COIN, scriptMine)), 0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 5 * COIN);
+
+    std::vector<uint256> vHashIn(1, wtxPay.GetHash()), vHashOut;
+    BOOST_CHECK(pwalletMain->ZapSelectTx(vHashIn, vHashOut) == DB_LOAD_OK);
+    BOOST_CHECK_EQUAL(vHashOut.size(), 1U);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_stake_ledger_drops_zapped_coinstakes)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CScript scriptMine = add_key(*pwalletMain);
+
+    // a coinstake of ours in the tip
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CTransaction txStake = make_tx(COutPoint(uint256S("0x1"), 0), CTxOut(0, CScript()), CTxOut(5 * COIN, scriptMine));
+    BOOST_CHECK(txStake.IsCoinStake());
+    add_tx(*pwalletMain, &walletdb, txStake, 1);
+    BOOST_CHECK(pwalletMain->GetStakeLedger().Find(txStake.GetHash()) != NULL);
+
+    std::vector<uint256> vHashIn(1, txStake.GetHash()), vHashOut;
+    BOOST_CHECK(pwalletMain->ZapSelectTx(vHashIn, vHashOut) == DB_LOAD_OK);
+    BOOST_CHECK_EQUAL(vHashOut.size(), 1U);
+    BOOST_CHECK(pwalletMain->GetStakeLedger().Find(txStake.GetHash()) == NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeLedger().size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_outputs_follow_spends)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CScript scriptMine = add_key(*pwalletMain);
+    std::vector<COutput> vCoins;
+    pwalletMain->AvailableCoins(vCoins, true, NULL, false);
+    BOOST_CHECK(vCoins.empty());
+
+    // a payment of two outputs to us and one elsewhere, and a spend of the first
+    CTransaction txPay = make_tx(COutPoint(uint256S("0x1"), 0), CTxOut(5 * COIN, scriptMine), CTxOut(3 * COIN, scriptMine), CTxOut(1 * COIN, CScript() << OP_TRUE));
+    CTransaction txSpend = make_tx(COutPoint(txPay.GetHash(), 0), CTxOut(4 * COIN, CScript() << OP_TRUE));
+
+    // two blocks on top of the tip, the first with the payment and the second with the spend
+    CBlockIndex* pindexTip = chainActive.Tip();
+    CBlock block1, block2;
+    block1.hashPrevBlock = pindexTip->GetBlockHash();
+    block1.vtx.push_back(txPay);
+    uint256 hashBlock1 = block1.GetHash();
+    block2.hashPrevBlock = hashBlock1;
+    block2.vtx.push_back(txSpend);
+    uint256 hashBlock2 = block2.GetHash();
+    CBlockIndex index1, index2;
+    index1.phashBlock = &hashBlock1;
+    index1.pprev = pindexTip;
+    index1.nHeight = pindexTip->nHeight + 1;
+    index2.phashBlock = &hashBlock2;
+    index2.pprev = &index1;
+    index2.nHeight = index1.nHeight + 1;
+    mapBlockIndex[hashBlock1] = &index1;
+    mapBlockIndex[hashBlock2] = &index2;
+
+    // the outputs table follows each of these without being rebuilt
+    chainActive.SetTip(&index1);
+    pwalletMain->SyncTransaction(txPay, &index1, &block1);
+    pwalletMain->AvailableCoins(vCoins, true, NULL, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), 2U);
+    BOOST_CHECK(!pwalletMain->IsSpent(txPay.GetHash(), 0));
+
+    // the spend enters the mempool
+    pwalletMain->SyncTransaction(txSpend, NULL, NULL);
+    BOOST_CHECK(pwalletMain->IsSpent(txPay.GetHash(), 0));
+    pwalletMain->AvailableCoins(vCoins, true, NULL, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1U);
+    BOOST_CHECK_EQUAL(vCoins[0].i, 1);
+
+    // and is mined
+    chainActive.SetTip(&index2);
+    pwalletMain->SyncTransaction(txSpend, &index2, &block2);
+    BOOST_CHECK(pwalletMain->IsSpent(txPay.GetHash(), 0));
+    pwalletMain->AvailableCoins(vCoins, true, NULL, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1U);
+
+    // its block is disconnected, which leaves it unconfirmed, and then it is abandoned
+    chainActive.SetTip(&index1);
+    pwalletMain->SyncTransaction(txSpend, &index1, NULL, false);
+    BOOST_CHECK(pwalletMain->IsSpent(txPay.GetHash(), 0));
+    pwalletMain->AvailableCoins(vCoins, true, NULL, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1U);
+    BOOST_CHECK(pwalletMain->AbandonTransaction(txSpend.GetHash()));
+    BOOST_CHECK(!pwalletMain->IsSpent(txPay.GetHash(), 0));
+    pwalletMain->AvailableCoins(vCoins, true, NULL, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), 2U);
+
+    // the block of the payment is disconnected too
+    chainActive.SetTip(pindexTip);
+    pwalletMain->SyncTransaction(txPay, pindexTip, NULL, false);
+    pwalletMain->AvailableCoins(vCoins, true, NULL, false);
+    BOOST_CHECK(vCoins.empty());
+
+    // a rebuild of the table agrees
+    pwalletMain->MarkDirty();
+    BOOST_CHECK(!pwalletMain->IsSpent(txPay.GetHash(), 0));
+    pwalletMain->AvailableCoins(vCoins, true, NULL, false);
+    BOOST_CHECK(vCoins.empty());
+
+    mapBlockIndex.erase(hashBlock1);
+    mapBlockIndex.erase(hashBlock2);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_txs_since_height)
+{
+    CWallet testWallet;
+    LOCK2(cs_main, testWallet.cs_wallet);
+    CScript scriptMine = add_key(testWallet);
+
+    // one payment in the tip block, one not in a block yet
+    CWalletTx wtxConfirmed = add_tx(testWallet, NULL, make_tx(COutPoint(uint256S("0x1"), 0), CTxOut(5 * COIN, scriptMine)), 0);
+    CWalletTx wtxPending = add_tx(testWallet, NULL, make_tx(COutPoint(uint256S("0x2"), 0), CTxOut(3 * COIN, scriptMine)), -1);
+
+    int nTip = chainActive.Height();
+    std::vector<const CWalletTx*> vwtx;
+    testWallet.GetWalletTxsSince(nTip - 1, vwtx);
+    BOOST_CHECK_EQUAL(vwtx.size(), 2U);
+    BOOST_CHECK(vwtx[0]->GetHash() == wtxConfirmed.GetHash());
+    BOOST_CHECK(vwtx[1]->GetHash() == wtxPending.GetHash());
+
+    testWallet.GetWalletTxsSince(nTip, vwtx);
+    BOOST_CHECK_EQUAL(vwtx.size(), 1U);
+    BOOST_CHECK(vwtx[0]->GetHash() == wtxPending.GetHash());
+
+    // once it is in the tip block it is no longer after it
+    wtxPending.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtxPending.nIndex = 1;
+    BOOST_CHECK(testWallet.AddToWallet(wtxPending, true, NULL));
+    testWallet.GetWalletTxsSince(nTip, vwtx);
+    BOOST_CHECK(vwtx.empty());
+    testWallet.GetWalletTxsSince(nTip - 1, vwtx);
+    BOOST_CHECK_EQUAL(vwtx.size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_zapped_coins_do_not_stake)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CScript scriptMine = add_key(*pwalletMain);
+
+    // blocks on top of the tip, so that a payment in the tip is deep enough to stake
+    CBlockIndex* pindexTip = chainActive.Tip();
+    std::vector<uint256> vHashes(Params().GetConsensus().nCoinbaseMaturityV2);
+    std::vector<CBlockIndex> vBlocks(vHashes.size());
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        vHashes[i] = GetRandHash();
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : pindexTip;
+        vBlocks[i].nHeight = vBlocks[i].pprev->nHeight + 1;
+        mapBlockIndex[vHashes[i]] = &vBlocks[i];
+    }
+
+    // two payments to us in the tip, and a spend of the first that is not in a block
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CWalletTx wtxPay = add_tx(*pwalletMain, &walletdb, make_tx(COutPoint(uint256S("0x1"), 0), CTxOut(5 * COIN, scriptMine)), 0);
+    add_tx(*pwalletMain, &walletdb, make_tx(COutPoint(uint256S("0x2"), 0), CTxOut(3 * COIN, scriptMine)), 1);
+    CWalletTx wtxSpend = add_tx(*pwalletMain, &walletdb, make_tx(COutPoint(wtxPay.GetHash(), 0), CTxOut(4 * COIN, CScript() << OP_TRUE)), -1);
+
+    chainActive.SetTip(&vBlocks.back());
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeableCoinCount(), 1U);
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeWeight(), (uint64_t)(3 * COIN));
+
+    // zapping the spend lets the first payment stake again
+    std::vector<uint256> vHashIn(1, wtxSpend.GetHash()), vHashOut;
+    BOOST_CHECK(pwalletMain->ZapSelectTx(vHashIn, vHashOut) == DB_LOAD_OK);
+    BOOST_CHECK_EQUAL(vHashOut.size(), 1U);
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeableCoinCount(), 2U);
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeWeight(), (uint64_t)(8 * COIN));
+
+    // zapping the first payment takes it out of the stakeable coins
+    vHashIn.assign(1, wtxPay.GetHash());
+    vHashOut.clear();
+    BOOST_CHECK(pwalletMain->ZapSelectTx(vHashIn, vHashOut) == DB_LOAD_OK);
+    BOOST_CHECK_EQUAL(vHashOut.size(), 1U);
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeableCoinCount(), 1U);
+    BOOST_CHECK_EQUAL(pwalletMain->GetStakeWeight(), (uint64_t)(3 * COIN));
+
+    chainActive.SetTip(pindexTip);
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        mapBlockIndex.erase(hash);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_db_batches_nest)
+{
+    LOCK(pwalletMain->cs_wallet);
+    CWalletDBBatch batch(pwalletMain, false);
+    CWalletDB* pwalletdb = batch.get();
+    BOOST_CHECK(pwalletdb != NULL);
+    {
+        // writes made further down go through the outer batch
+        CWalletDBBatch inner(pwalletMain);
+        BOOST_CHECK(inner.get() == pwalletdb);
+        BOOST_CHECK(inner->WriteOrderPosNext(pwalletMain->nOrderPosNext));
+    }
+    BOOST_CHECK(batch.get() == pwalletdb);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_merkle_branch_finds_tx)
+{
+    LOCK(cs_main);
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(uint256S("0x1"), 0);
+    mtx.vout.push_back(CTxOut(5 * COIN, CScript() << OP_TRUE));
+    CTransaction tx(mtx);
+    mtx.vout[0].nValue = 4 * COIN;
+    CTransaction txOther(mtx);
+    mtx.vout[0].nValue = 3 * COIN;
+    CTransaction txMissing(mtx);
+
+    // a block on top of the tip, with the transaction second
+    CBlockIndex* pindexTip = chainActive.Tip();
+    CBlock block;
+    block.hashPrevBlock = pindexTip->GetBlockHash();
+    block.vtx.push_back(txOther);
+    block.vtx.push_back(tx);
+    uint256 hashBlock = block.GetHash();
+    CBlockIndex index;
+    index.phashBlock = &hashBlock;
+    index.pprev = pindexTip;
+    index.nHeight = pindexTip->nHeight + 1;
+    mapBlockIndex[hashBlock] = &index;
+    chainActive.SetTip(&index);
+
+    CMerkleTx merkleTx(tx);
+    BOOST_CHECK_EQUAL(merkleTx.SetMerkleBranch(block), 1);
+    BOOST_CHECK_EQUAL(merkleTx.nIndex, 1);
+    BOOST_CHECK(merkleTx.hashBlock == hashBlock);
+    BOOST_CHECK_EQUAL(merkleTx.GetDepthInMainChain(), 1);
+
+    CMerkleTx merkleMissing(txMissing);
+    BOOST_CHECK_EQUAL(merkleMissing.SetMerkleBranch(block), 0);
+    BOOST_CHECK_EQUAL(merkleMissing.nIndex, -1);
+
+    chainActive.SetTip(pindexTip);
+    mapBlockIndex.erase(hashBlock);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_repairs_txs_stored_as_conflicted)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    // the genesis coinbase, as older versions stored a transaction found in a block
+    CBlock genesis;
+    BOOST_CHECK(ReadBlockFromDisk(genesis, chainActive.Genesis(), Params().GetConsensus()));
+    CWalletTx wtxOld(pwalletMain, genesis.vtx[0]);
+    wtxOld.hashBlock = genesis.GetHash();
+    wtxOld.nIndex = -1;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxOld, true, NULL));
+
+    // and a transaction that really conflicts with that block
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(uint256S("0x1"), 0);
+    mtx.vout.push_back(CTxOut(5 * COIN, CScript() << OP_TRUE));
+    CWalletTx wtxConflicted(pwalletMain, CTransaction(mtx));
+    wtxConflicted.hashBlock = genesis.GetHash();
+    wtxConflicted.nIndex = -1;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxConflicted, true, NULL));
+    BOOST_CHECK(pwalletMain->mapWallet[wtxOld.GetHash()].GetDepthInMainChain() < 0);
+
+    pwalletMain->RepairConfirmedTransactions();
+    BOOST_CHECK_EQUAL(pwalletMain->mapWallet[wtxOld.GetHash()].nIndex, 0);
+    BOOST_CHECK_EQUAL(pwalletMain->mapWallet[wtxOld.GetHash()].GetDepthInMainChain(), 1);
+    BOOST_CHECK_EQUAL(pwalletMain->mapWallet[wtxConflicted.GetHash()].nIndex, -1);
+    BOOST_CHECK(pwalletMain->mapWallet[wtxConflicted.GetHash()].GetDepthInMainChain() < 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,7 +6,6 @@
 #include "wallet/wallet.h"
 
 #include "base58.h"
-#include "bignum.h"
 #include "checkpoints.h"
 #include "chain.h"
 #include "coincontrol.h"
@@ -150,7 +149,7 @@ CPubKey CWallet::GenerateNewKey()
         secret = childKey.key;
 
         // update the chain model in the database
-        if (!CWalletDB(strWalletFile).WriteHDChain(hdChain))
+        if (!CWalletDBBatch(this)->WriteHDChain(hdChain))
             throw std::runtime_error("CWallet::GenerateNewKey(): Writing HD chain model failed");
     } else {
         secret.MakeNewKey(fCompressed);
@@ -175,28 +174,12 @@ CPubKey CWallet::GenerateNewKey()
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin,ISMINE_SPENDABLE);
-    }
-    return nTotal;
+    return GetBalances().nStakeImmature;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin,ISMINE_SPENDABLE);
-    }
-    return nTotal;
+    return GetBalances().nMintImmature;
 }
 
 uint64_t CWallet::GetStakeWeight() const
@@ -207,61 +190,202 @@ uint64_t CWallet::GetStakeWeight() const
     if (nBalance <= nReserveBalance)
         return 0;
 
-    set<pair<const CWalletTx*, unsigned int> > vwtxPrev;
-
     set<pair<const CWalletTx*,unsigned int> > setCoins;
     int64_t nValueIn = 0;
 
     if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
         return 0;
 
-    if (setCoins.empty())
-        return 0;
+    // Selected coins are already at least nCoinbaseMaturityV2 deep
+    return nValueIn;
+}
 
-    uint64_t nWeight = 0;
+void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpendTime) const
+{
+    vCoins.clear();
 
-    LOCK2(cs_main, cs_wallet);
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    int nHeight;
     {
+        LOCK(cs_main);
+        nHeight = chainActive.Height();
+    }
+    const Consensus::Params& consensus = Params().GetConsensus();
+    int nBlocksToMaturity = (nHeight < consensus.nDigiShieldStartingHeight ? consensus.nCoinbaseMaturityV1 : consensus.nCoinbaseMaturityV2) + 20;
 
-        if (!mapWallet.count(pcoin.first->GetHash()))
-            continue;
+    // Coins spent by a transaction that is not in a block yet are checked again below
+    vector<COutPoint> vSpentUnconfirmed;
+    {
+        LOCK(cs_wallet);
+        vCoins.reserve(mapStakeableCoins.size());
+        for (map<COutPoint, CStakeableCoin>::const_iterator it = mapStakeableCoins.begin(); it != mapStakeableCoins.end(); ++it)
+        {
+            const CWalletTx* pcoin = it->second.tx;
+            int nDepth = nHeight - it->second.nHeight + 1;
+
+            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && nDepth < nBlocksToMaturity)
+                continue;
 
-        if (pcoin.first->GetDepthInMainChain() >= Params().GetConsensus().nCoinbaseMaturityV2)
-            nWeight += pcoin.first->vout[pcoin.second].nValue;
+            if (nDepth < consensus.nCoinbaseMaturityV2)
+                continue;
+
+            if (it->second.fSpentUnconfirmed)
+                vSpentUnconfirmed.push_back(it->first);
+            else
+                vCoins.push_back(COutput(pcoin, it->first.n, nDepth, true, it->second.fSpendable));
+        }
     }
 
-    return nWeight;
+    // IsSpent() needs cs_main to tell whether the spending transaction conflicts with the chain
+    if (vSpentUnconfirmed.empty())
+        return;
+
+    LOCK2(cs_main, cs_wallet);
+    BOOST_FOREACH(const COutPoint& outpoint, vSpentUnconfirmed)
+    {
+        map<COutPoint, CStakeableCoin>::const_iterator it = mapStakeableCoins.find(outpoint);
+        if (it == mapStakeableCoins.end() || IsSpent(outpoint.hash, outpoint.n))
+            continue;
+        vCoins.push_back(COutput(it->second.tx, outpoint.n, nHeight - it->second.nHeight + 1, true, it->second.fSpendable));
+    }
 }
 
-void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpendTime) const
+void CWallet::UpdateStakeableCoins(const uint256& hash)
 {
-    vCoins.clear();
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+    if (it == mapWallet.end())
+        return;
 
+    const CWalletTx* pcoin = &it->second;
+    int nDepth = pcoin->GetDepthInMainChain();
+    for (unsigned int i = 0; i < pcoin->vout.size(); i++)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            const uint256& wtxid = it->first;
+        COutPoint outpoint(hash, i);
+        isminetype mine = nDepth > 0 && pcoin->vout[i].nValue >= nMinimumInputValue ? IsMine(pcoin->vout[i]) : ISMINE_NO;
+        // Outputs spent in a block are left out, those spent otherwise are checked again when read
+        int nSpentHeight = mine != ISMINE_NO ? GetSpentHeight(outpoint) : CWalletOutputState::UNSPENT;
+        if (mine != ISMINE_NO && (nSpentHeight == CWalletOutputState::UNSPENT || nSpentHeight == CWalletOutputState::SPENT_UNCONFIRMED))
+            mapStakeableCoins[outpoint] = CStakeableCoin(pcoin, chainActive.Height() - nDepth + 1, (mine & ISMINE_SPENDABLE) != ISMINE_NO,
+                                                         nSpentHeight == CWalletOutputState::SPENT_UNCONFIRMED);
+        else
+            mapStakeableCoins.erase(outpoint);
+    }
+}
 
-            if (pcoin->GetBlocksToMaturity() > 0)
-                continue;
+void CWallet::UpdateStakeableCoins(const CTransaction& tx)
+{
+    UpdateStakeableCoins(tx.GetHash());
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        UpdateStakeableCoins(txin.prevout.hash);
+}
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 1)
-                continue;
+void CWallet::RebuildStakeableCoins()
+{
+    LOCK2(cs_main, cs_wallet);
+    mapStakeableCoins.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateStakeableCoins(it->first);
+}
 
-            if (nDepth < Params().GetConsensus().nCoinbaseMaturityV2)
-                continue;
+size_t CWallet::GetStakeableCoinCount() const
+{
+    LOCK2(cs_main, cs_wallet);
+    size_t nCount = 0;
+    for (map<COutPoint, CStakeableCoin>::const_iterator it = mapStakeableCoins.begin(); it != mapStakeableCoins.end(); ++it)
+        if (!it->second.fSpentUnconfirmed || !IsSpent(it->first.hash, it->first.n))
+            nCount++;
+    return nCount;
+}
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(IsSpent(wtxid,i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue){
-                    vCoins.push_back(COutput(pcoin, i, nDepth, true,
-                                           (IsMine(pcoin->vout[i]) & (ISMINE_SPENDABLE)) != ISMINE_NO));
-                }
+void CWallet::UpdateStakeLedger(const CWalletTx& wtx, CWalletDB* pwalletdb)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!wtx.IsCoinStake())
+        return;
+
+    std::set<int64_t> setDays;
+    int nDepth = wtx.GetDepthInMainChain();
+    if (nDepth > 0) {
+        // The credit of the transaction itself reads 0 until it matures
+        CAmount nAmount = GetCredit(wtx, ISMINE_SPENDABLE) - GetDebit(wtx, ISMINE_SPENDABLE);
+        stakeLedger.Add(CStakeLedgerEntry(wtx.GetHash(), wtx.nTime, chainActive.Height() - nDepth + 1, nAmount), setDays);
+    } else {
+        stakeLedger.Remove(wtx.GetHash(), setDays);
+    }
+    WriteStakeDays(setDays, pwalletdb);
+}
+
+void CWallet::WriteStakeDays(const std::set<int64_t>& setDays, CWalletDB* pwalletdb)
+{
+    if (!fFileBacked || setDays.empty())
+        return;
+
+    if (!pwalletdb) {
+        // Do not flush the wallet here for performance reasons
+        CWalletDB walletdb(strWalletFile, "r+", false);
+        WriteStakeDays(setDays, &walletdb);
+        return;
+    }
+
+    BOOST_FOREACH(int64_t nDay, setDays)
+    {
+        const CStakeDay* pday = stakeLedger.GetDayRecord(nDay);
+        if (pday)
+            pwalletdb->WriteStakeDay(nDay, *pday);
+        else
+            pwalletdb->EraseStakeDay(nDay);
+    }
+}
+
+void CWallet::SyncStakeLedger()
+{
+    LOCK2(cs_main, cs_wallet);
+
+    // Transactions may have been zapped, confirmed or reorganised while the
+    // ledger was not being kept, or the wallet may predate it
+    std::set<int64_t> setDays;
+    std::vector<uint256> vGone;
+    for (std::map<uint256, int64_t>::const_iterator it = stakeLedger.GetStakes().begin(); it != stakeLedger.GetStakes().end(); ++it)
+        if (!mapWallet.count(it->first))
+            vGone.push_back(it->first);
+    BOOST_FOREACH(const uint256& hash, vGone)
+        stakeLedger.Remove(hash, setDays);
+
+    unsigned int nAdded = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = it->second;
+        if (!wtx.IsCoinStake())
+            continue;
+        int nDepth = wtx.GetDepthInMainChain();
+        const CStakeLedgerEntry* pentry = stakeLedger.Find(it->first);
+        if (nDepth > 0) {
+            if (pentry && pentry->nHeight == chainActive.Height() - nDepth + 1)
+                continue;
+            CAmount nAmount = GetCredit(wtx, ISMINE_SPENDABLE) - GetDebit(wtx, ISMINE_SPENDABLE);
+            stakeLedger.Add(CStakeLedgerEntry(it->first, wtx.nTime, chainActive.Height() - nDepth + 1, nAmount), setDays);
+            nAdded++;
+        } else if (pentry) {
+            stakeLedger.Remove(it->first, setDays);
+            vGone.push_back(it->first);
         }
     }
+
+    WriteStakeDays(setDays, NULL);
+    LogPrintf("SyncStakeLedger: %u stakes recorded, %u added, %u removed\n", stakeLedger.size(), nAdded, vGone.size());
+}
+
+int CWallet::GetMatureStakeHeight() const
+{
+    LOCK(cs_main);
+    const Consensus::Params& consensus = Params().GetConsensus();
+    int nHeight = chainActive.Height();
+    int nMaturity = (nHeight < consensus.nDigiShieldStartingHeight ? consensus.nCoinbaseMaturityV1 : consensus.nCoinbaseMaturityV2) + 20;
+    return nHeight + 1 - nMaturity;
 }
 
 // Select some coins without random shuffle or best subset approximation
@@ -307,8 +431,6 @@ bool CWallet::SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTim
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CMutableTransaction& txNew, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBestHeader;
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
 
     txNew.vin.clear();
     txNew.vout.clear();
@@ -336,82 +458,85 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
+    // Kernel inputs are resolved once per tip; the coin x timestamp grid is then searched in parallel
+    vector<COutPoint> vPrevouts;
+    map<COutPoint, pair<const CWalletTx*, unsigned int> > mapStakeCoins;
+    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    {
+        COutPoint prevout(pcoin.first->GetHash(), pcoin.second);
+        vPrevouts.push_back(prevout);
+        mapStakeCoins.insert(make_pair(prevout, pcoin));
+    }
+    vector<CStakeCandidate> vCandidates;
+    stakeKernelSearch.Prepare(pindexPrev, vPrevouts, vCandidates);
+
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    static int nMaxStakeSearchInterval = 60;
+    unsigned int nInterval = max((int64_t)0, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval));
+
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    size_t nCandidate = 0;
+    unsigned int nTimeKernel = 0;
+    for (size_t nStart = 0; stakeKernelSearch.Search(vCandidates, nStart, txNew.nTime, nInterval, nCandidate, nTimeKernel) && pindexPrev == pindexBestHeader; nStart = nCandidate + 1)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBestHeader; n++)
+        boost::this_thread::interruption_point();
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = mapStakeCoins[vCandidates[nCandidate].prevout];
+
+        // Found a kernel
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<std::vector<unsigned char>> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<std::vector<unsigned char>> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    std::vector<unsigned char>& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.insert(make_pair(pcoin.first, pcoin.second));
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            std::vector<unsigned char>& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
 
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.insert(make_pair(pcoin.first, pcoin.second));
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -571,9 +696,9 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey,
-                                                 secret.GetPrivKey(),
-                                                 mapKeyMetadata[pubkey.GetID()]);
+        return CWalletDBBatch(this)->WriteKey(pubkey,
+                                              secret.GetPrivKey(),
+                                              mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
@@ -592,9 +717,9 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
                                                         vchCryptedSecret,
                                                         mapKeyMetadata[vchPubKey.GetID()]);
         else
-            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey,
-                                                            vchCryptedSecret,
-                                                            mapKeyMetadata[vchPubKey.GetID()]);
+            return CWalletDBBatch(this)->WriteCryptedKey(vchPubKey,
+                                                         vchCryptedSecret,
+                                                         mapKeyMetadata[vchPubKey.GetID()]);
     }
     return false;
 }
@@ -644,6 +769,7 @@ bool CWallet::AddWatchOnly(const CScript &dest)
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
+    fWalletOutputsStale = true;
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
@@ -655,10 +781,11 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    fWalletOutputsStale = true;
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseWatchOnly(dest))
+        if (!CWalletDBBatch(this)->EraseWatchOnly(dest))
             return false;
 
     return true;
@@ -756,13 +883,12 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
     if (nVersion > nWalletMaxVersion)
         nWalletMaxVersion = nVersion;
 
-    if (fFileBacked)
+    if (fFileBacked && nWalletVersion > 40000)
     {
-        CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : new CWalletDB(strWalletFile);
-        if (nWalletVersion > 40000)
-            pwalletdb->WriteMinVersion(nWalletVersion);
-        if (!pwalletdbIn)
-            delete pwalletdb;
+        if (pwalletdbIn)
+            pwalletdbIn->WriteMinVersion(nWalletVersion);
+        else
+            CWalletDBBatch(this)->WriteMinVersion(nWalletVersion);
     }
 
     return true;
@@ -907,6 +1033,21 @@ void CWallet::SyncMetaData(pair<TxSpends::iterator, TxSpends::iterator> range)
  */
 bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
 {
+    if (!fWalletOutputsStale) {
+        WalletOutputMap::const_iterator it = mapWalletOutputs.find(hash);
+        if (it != mapWalletOutputs.end()) {
+            BOOST_FOREACH(const CWalletOutputState& output, it->second.vOutputs) {
+                if (output.n != n)
+                    continue;
+                if (output.IsSpentInBlock())
+                    return true;
+                if (output.nSpentHeight == CWalletOutputState::UNSPENT)
+                    return false;
+                break;
+            }
+        }
+    }
+
     const COutPoint outpoint(hash, n);
     pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
     range = mapTxSpends.equal_range(outpoint);
@@ -924,6 +1065,121 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     return false;
 }
 
+int CWallet::GetSpentHeight(const COutPoint& outpoint) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(outpoint);
+    if (range.first == range.second)
+        return CWalletOutputState::UNSPENT;
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit == mapWallet.end())
+            continue;
+        int nDepth = mit->second.GetDepthInMainChain();
+        if (nDepth > 0)
+            return chainActive.Height() - nDepth + 1;
+    }
+    return CWalletOutputState::SPENT_UNCONFIRMED;
+}
+
+void CWallet::UpdateWalletOutputs(const uint256& hash) const
+{
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end()) {
+        mapWalletOutputs.erase(hash);
+        return;
+    }
+
+    const CWalletTx& wtx = mi->second;
+    CWalletTxOutputs outputs;
+    outputs.tx = &wtx;
+    bool fUnspent = false;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        isminetype mine = IsMine(wtx.vout[i]);
+        if (mine == ISMINE_NO)
+            continue;
+        int nSpentHeight = GetSpentHeight(COutPoint(hash, i));
+        outputs.vOutputs.push_back(CWalletOutputState(i, mine, nSpentHeight));
+        if (nSpentHeight < 0)
+            fUnspent = true;
+    }
+
+    if (fUnspent)
+        mapWalletOutputs[hash] = outputs;
+    else
+        mapWalletOutputs.erase(hash);
+}
+
+void CWallet::UpdateWalletOutputs(const CTransaction& tx) const
+{
+    if (fWalletOutputsStale)
+        return;
+    UpdateWalletOutputs(tx.GetHash());
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        UpdateWalletOutputs(txin.prevout.hash);
+}
+
+void CWallet::RebuildWalletOutputs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    mapWalletOutputs.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateWalletOutputs(it->first);
+    fWalletOutputsStale = false;
+}
+
+void CWallet::UpdateWalletTxHeight(const uint256& hash) const
+{
+    if (fWalletTxHeightsStale)
+        return;
+
+    map<uint256, int>::iterator mi = mapWalletTxHeight.find(hash);
+    if (mi != mapWalletTxHeight.end()) {
+        setWalletTxByHeight.erase(make_pair(mi->second, hash));
+        mapWalletTxHeight.erase(mi);
+    }
+
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+    if (it == mapWallet.end())
+        return;
+    const CBlockIndex* pindex = NULL;
+    int nHeight = it->second.GetDepthInMainChain(pindex) > 0 ? pindex->nHeight : TX_HEIGHT_UNCONFIRMED;
+    setWalletTxByHeight.insert(make_pair(nHeight, hash));
+    mapWalletTxHeight[hash] = nHeight;
+}
+
+void CWallet::RebuildWalletTxHeights() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    setWalletTxByHeight.clear();
+    mapWalletTxHeight.clear();
+    fWalletTxHeightsStale = false;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateWalletTxHeight(it->first);
+}
+
+void CWallet::GetWalletTxsSince(int nHeight, std::vector<const CWalletTx*>& vtxRet) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (fWalletTxHeightsStale)
+        RebuildWalletTxHeights();
+
+    vtxRet.clear();
+    std::set<std::pair<int, uint256> >::const_iterator it = setWalletTxByHeight.lower_bound(make_pair(nHeight + 1, uint256()));
+    for (; it != setWalletTxByHeight.end(); ++it)
+        vtxRet.push_back(&mapWallet.find(it->second)->second);
+}
+
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -1135,6 +1391,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // What is ours may have changed
+        fWalletOutputsStale = true;
     }
 }
 
@@ -1149,6 +1407,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        fWalletOutputsStale = true;
+        fWalletTxHeightsStale = true;
         BOOST_FOREACH(const CTxIn& txin, wtx.vin) {
             if (mapWallet.count(txin.prevout.hash)) {
                 CWalletTx& prevtx = mapWallet[txin.prevout.hash];
@@ -1256,6 +1516,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        UpdateWalletOutputs(wtx);
+        UpdateWalletTxHeight(wtx.GetHash());
+        UpdateStakeableCoins(wtx);
+        UpdateStakeLedger(wtx, pwalletdb);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -1308,9 +1572,9 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 
             // Do not flush the wallet here for performance reasons
             // this is safe, as in case of a crash, we rescan the necessary blocks on startup through our SetBestChain-mechanism
-            CWalletDB walletdb(strWalletFile, "r+", false);
+            CWalletDBBatch batch(this, false);
 
-            return AddToWallet(wtx, false, &walletdb);
+            return AddToWallet(wtx, false, batch.get());
         }
     }
     return false;
@@ -1321,7 +1585,8 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
     LOCK2(cs_main, cs_wallet);
 
     // Do not flush the wallet here for performance reasons
-    CWalletDB walletdb(strWalletFile, "r+", false);
+    CWalletDBBatch batch(this, false);
+    CWalletDB& walletdb = *batch.get();
 
     std::set<uint256> todo;
     std::set<uint256> done;
@@ -1353,6 +1618,10 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             wtx.setAbandoned();
             wtx.MarkDirty();
             walletdb.WriteTx(wtx);
+            UpdateWalletOutputs(wtx);
+            UpdateWalletTxHeight(wtx.GetHash());
+            UpdateStakeableCoins(wtx);
+            UpdateStakeLedger(wtx, &walletdb);
             NotifyTransactionChanged(this, wtx.GetHash(), CT_UPDATED);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them abandoned too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(hashTx, 0));
@@ -1394,7 +1663,8 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
         return;
 
     // Do not flush the wallet here for performance reasons
-    CWalletDB walletdb(strWalletFile, "r+", false);
+    CWalletDBBatch batch(this, false);
+    CWalletDB& walletdb = *batch.get();
 
     std::set<uint256> todo;
     std::set<uint256> done;
@@ -1415,6 +1685,10 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             wtx.hashBlock = hashBlock;
             wtx.MarkDirty();
             walletdb.WriteTx(wtx);
+            UpdateWalletOutputs(wtx);
+            UpdateWalletTxHeight(wtx.GetHash());
+            UpdateStakeableCoins(wtx);
+            UpdateStakeLedger(wtx, &walletdb);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them conflicted too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
             while (iter != mapTxSpends.end() && iter->first.hash == now) {
@@ -1434,10 +1708,64 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
     }
 }
 
+void CWallet::RepairConfirmedTransactions()
+{
+    LOCK2(cs_main, cs_wallet);
+
+    // SetMerkleBranch used to miss every transaction in its block, so they
+    // were written with the block hash and the nIndex of a conflict. Real
+    // conflicts name a block without the transaction.
+    std::map<uint256, std::vector<CWalletTx*> > mapByBlock;
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        CWalletTx& wtx = it->second;
+        if (wtx.nIndex == -1 && !wtx.hashUnset())
+            mapByBlock[wtx.hashBlock].push_back(&wtx);
+    }
+    if (mapByBlock.empty())
+        return;
+
+    CWalletDBBatch batch(this, false);
+    CWalletDB& walletdb = *batch.get();
+    unsigned int nRepaired = 0;
+    for (std::map<uint256, std::vector<CWalletTx*> >::const_iterator it = mapByBlock.begin(); it != mapByBlock.end(); ++it) {
+        BlockMap::const_iterator mi = mapBlockIndex.find(it->first);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA))
+            continue;
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second, Params().GetConsensus()))
+            continue;
+        BOOST_FOREACH(CWalletTx* pwtx, it->second) {
+            for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                if (block.vtx[i].GetHash() != pwtx->GetHash())
+                    continue;
+                pwtx->nIndex = i;
+                pwtx->MarkDirty();
+                walletdb.WriteTx(*pwtx);
+                UpdateWalletOutputs(*pwtx);
+                UpdateWalletTxHeight(pwtx->GetHash());
+                UpdateStakeableCoins(*pwtx);
+                UpdateStakeLedger(*pwtx, &walletdb);
+                BOOST_FOREACH(const CTxIn& txin, pwtx->vin) {
+                    if (mapWallet.count(txin.prevout.hash))
+                        mapWallet[txin.prevout.hash].MarkDirty();
+                }
+                nRepaired++;
+                break;
+            }
+        }
+    }
+    if (nRepaired)
+        LogPrintf("%s: %u transactions stored as conflicted are in their block\n", __func__, nRepaired);
+}
+
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, const CBlock* pblock, bool fConnect)
 {
     LOCK2(cs_main, cs_wallet);
 
+    // Everything this transaction changes in the wallet file is committed at once;
+    // it is not flushed, as on a crash the blocks are rescanned through SetBestChain
+    CWalletDBBatch batch(this, false);
+
     if (!fConnect)
     {
         // wallets need to refund inputs when disconnecting coinstake
@@ -1445,8 +1773,7 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
         {
             if (IsFromMe(tx))
             {
-                // Do not flush the wallet here for performance reasons
-                CWalletDB walletdb(strWalletFile, "r+", false);
+                CWalletDB& walletdb = *batch.get();
 
                 if (mapWallet.count(tx.hash))
                 {
@@ -1496,6 +1823,11 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
             mapTxSpends.erase(txin.prevout);
         }
     }
+
+    // Depth or spentness of the outputs involved may have changed
+    UpdateWalletOutputs(tx);
+    UpdateWalletTxHeight(tx.GetHash());
+    UpdateStakeableCoins(tx);
 }
 
 
@@ -1670,7 +2002,7 @@ bool CWallet::SetHDMasterKey(const CPubKey& pubkey)
 bool CWallet::SetHDChain(const CHDChain& chain, bool memonly)
 {
     LOCK(cs_wallet);
-    if (!memonly && !CWalletDB(strWalletFile).WriteHDChain(chain))
+    if (!memonly && !CWalletDBBatch(this)->WriteHDChain(chain))
         throw runtime_error("AddHDChain(): writing chain failed");
 
     hdChain = chain;
@@ -1923,6 +2255,20 @@ set<uint256> CWalletTx::GetConflicts() const
     return result;
 }
 
+void CWalletTx::MarkDirty()
+{
+    fCreditCached = false;
+    fAvailableCreditCached = false;
+    fWatchDebitCached = false;
+    fWatchCreditCached = false;
+    fAvailableWatchCreditCached = false;
+    fImmatureWatchCreditCached = false;
+    fDebitCached = false;
+    fChangeCached = false;
+    if (pwallet)
+        pwallet->MarkBalanceDirty(GetHash());
+}
+
 CAmount CWalletTx::GetDebit(const isminefilter& filter) const
 {
     if (vin.empty())
@@ -2190,94 +2536,116 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
  */
 
 
-CAmount CWallet::GetBalance() const
+void CWallet::MarkBalanceDirty(const uint256& hash) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+    LOCK(cs_balancedirty);
+    setBalanceDirty.insert(hash);
+}
+
+bool CWallet::GetBalanceParts(const CWalletTx& wtx, CWalletBalances& parts) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    int nDepth = wtx.GetDepthInMainChain();
+    if (wtx.IsTrusted()) {
+        parts.nTrusted = wtx.GetAvailableCredit();
+        parts.nWatchTrusted = wtx.GetAvailableWatchOnlyCredit();
+    } else if (nDepth == 0 && wtx.InMempool()) {
+        parts.nUntrustedPending = wtx.GetAvailableCredit();
+        parts.nWatchUntrustedPending = wtx.GetAvailableWatchOnlyCredit();
+    }
+
+    bool fImmature = (wtx.IsCoinBase() || wtx.IsCoinStake()) && nDepth > 0 && wtx.GetBlocksToMaturity() > 0;
+    if (fImmature) {
+        parts.nImmature = wtx.GetImmatureCredit();
+        parts.nWatchImmature = wtx.GetImmatureWatchOnlyCredit();
+        if (wtx.IsCoinStake())
+            parts.nStakeImmature = GetCredit(wtx, ISMINE_SPENDABLE);
+        else
+            parts.nMintImmature = GetCredit(wtx, ISMINE_SPENDABLE);
     }
 
-    return nTotal;
+    return fImmature || nDepth < 0 || (nDepth == 0 && !wtx.isAbandoned());
 }
 
-CAmount CWallet::GetUnconfirmedBalance() const
+CWalletBalances CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
+    LOCK2(cs_main, cs_wallet);
+
+    std::set<uint256> setDirty;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK(cs_balancedirty);
+        setDirty.swap(setBalanceDirty);
+    }
+
+    // Coinbases and coinstakes mature later once past nDigiShieldStartingHeight
+    const Consensus::Params& consensus = Params().GetConsensus();
+    int nMaturity = chainActive.Height() < consensus.nDigiShieldStartingHeight ? consensus.nCoinbaseMaturityV1 : consensus.nCoinbaseMaturityV2;
+    if (nMaturity != nBalanceMaturity) {
+        nBalanceMaturity = nMaturity;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit();
+            setDirty.insert(it->first);
+    }
+
+    setDirty.insert(setBalanceUnsettled.begin(), setBalanceUnsettled.end());
+    setBalanceUnsettled.clear();
+
+    CWalletBalances balances = balancesSettled;
+    BOOST_FOREACH(const uint256& hash, setDirty)
+    {
+        map<uint256, CWalletBalances>::iterator mi = mapBalanceParts.find(hash);
+        if (mi != mapBalanceParts.end()) {
+            balancesSettled -= mi->second;
+            balances -= mi->second;
+            mapBalanceParts.erase(mi);
         }
+
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            continue;
+
+        CWalletBalances parts;
+        if (GetBalanceParts(it->second, parts))
+            setBalanceUnsettled.insert(hash);
+        else if (!parts.IsNull()) {
+            mapBalanceParts[hash] = parts;
+            balancesSettled += parts;
+        }
+        balances += parts;
     }
-    return nTotal;
+
+    return balances;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nTrusted;
+}
+
+CAmount CWallet::GetUnconfirmedBalance() const
+{
+    return GetBalances().nUntrustedPending;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nWatchTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchUntrustedPending;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchImmature;
 }
 
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue) const
@@ -2286,10 +2654,12 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (fWalletOutputsStale)
+            RebuildWalletOutputs();
+        for (WalletOutputMap::const_iterator it = mapWalletOutputs.begin(); it != mapWalletOutputs.end(); ++it)
         {
             const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = it->second.tx;
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -2309,11 +2679,13 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             if (nDepth == 0 && !pcoin->InMempool())
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint((*it).first, i))))
+            BOOST_FOREACH(const CWalletOutputState& output, it->second.vOutputs) {
+                unsigned int i = output.n;
+                isminetype mine = output.mine;
+                if (output.IsSpentInBlock() || (output.nSpentHeight == CWalletOutputState::SPENT_UNCONFIRMED && IsSpent(wtxid, i)))
+                    continue;
+                if (!IsLockedCoin(wtxid, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint(wtxid, i))))
                         vCoins.push_back(COutput(pcoin, i, nDepth,
                                                  ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
                                                   (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO),
@@ -2903,10 +3275,9 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r+") : NULL;
+            // The spent key, the transaction and its order position are committed and flushed together
+            CWalletDBBatch batch(this);
+            CWalletDB* pwalletdb = fFileBacked ? batch.get() : NULL;
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -2923,9 +3294,6 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
-
-            if (fFileBacked)
-                delete pwalletdb;
         }
 
         // Track how many getdata requests our transaction gets
@@ -3018,6 +3386,18 @@ DBErrors CWallet::ZapSelectTx(vector<uint256>& vHashIn, vector<uint256>& vHashOu
     if (!fFileBacked)
         return DB_LOAD_OK;
     DBErrors nZapSelectTxRet = CWalletDB(strWalletFile,"cr+").ZapSelectTx(this, vHashIn, vHashOut);
+    // Stakeable coins point into mapWallet, and the outputs the zapped transactions spent are unspent again
+    RebuildStakeableCoins();
+    {
+        // The running balances and the stake ledger still hold the zapped transactions
+        LOCK(cs_wallet);
+        std::set<int64_t> setDays;
+        BOOST_FOREACH(const uint256& hash, vHashOut) {
+            MarkBalanceDirty(hash);
+            stakeLedger.Remove(hash, setDays);
+        }
+        WriteStakeDays(setDays, NULL);
+    }
     if (nZapSelectTxRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -3033,6 +3413,7 @@ DBErrors CWallet::ZapSelectTx(vector<uint256>& vHashIn, vector<uint256>& vHashOu
     if (nZapSelectTxRet != DB_LOAD_OK)
         return nZapSelectTxRet;
 
+    fWalletTxHeightsStale = true;
     MarkDirty();
 
     return DB_LOAD_OK;
@@ -3127,7 +3508,9 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
+        // The old pool is dropped and the new one written in one commit
+        CWalletDBBatch batch(this);
+        CWalletDB& walletdb = *batch.get();
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
         setKeyPool.clear();
@@ -3155,7 +3538,9 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
+        // The new keys and their pool entries are written in one commit
+        CWalletDBBatch batch(this);
+        CWalletDB& walletdb = *batch.get();
 
         // Top up key pool
         unsigned int nTargetSize;
@@ -3210,8 +3595,8 @@ void CWallet::KeepKey(int64_t nIndex)
     // Remove from key pool
     if (fFileBacked)
     {
-        CWalletDB walletdb(strWalletFile);
-        walletdb.ErasePool(nIndex);
+        LOCK(cs_wallet);
+        CWalletDBBatch(this)->ErasePool(nIndex);
     }
     LogPrintf("keypool keep %d\n", nIndex);
 }
@@ -3441,6 +3826,39 @@ std::set<CTxDestination> CWallet::GetAccountAddresses(const std::string& strAcco
     return result;
 }
 
+CWalletDBBatch::CWalletDBBatch(CWallet* pwalletIn, bool fFlushOnClose) : pwallet(pwalletIn)
+{
+    AssertLockHeld(pwallet->cs_wallet);
+    if (pwallet->nBatchDepth++ == 0)
+        pwallet->fBatchFlushOnClose = fFlushOnClose;
+    else if (fFlushOnClose)
+        pwallet->fBatchFlushOnClose = true;
+}
+
+CWalletDB* CWalletDBBatch::get() const
+{
+    if (!pwallet->pwalletdbBatch) {
+        // The batch is flushed, if at all, when it commits rather than whenever the handle closes
+        pwallet->pwalletdbBatch = new CWalletDB(pwallet->strWalletFile, "r+", false);
+        pwallet->fBatchTxn = pwallet->fFileBacked && pwallet->pwalletdbBatch->TxnBegin();
+    }
+    return pwallet->pwalletdbBatch;
+}
+
+CWalletDBBatch::~CWalletDBBatch()
+{
+    if (--pwallet->nBatchDepth > 0 || !pwallet->pwalletdbBatch)
+        return;
+
+    CWalletDB* pwalletdb = pwallet->pwalletdbBatch;
+    pwallet->pwalletdbBatch = NULL;
+    if (pwallet->fBatchTxn && !pwalletdb->TxnCommit())
+        LogPrintf("CWalletDBBatch: committing wallet batch to %s failed\n", pwallet->strWalletFile);
+    if (pwallet->fBatchFlushOnClose && pwallet->fFileBacked)
+        pwalletdb->Flush();
+    delete pwalletdb;
+}
+
 bool CReserveKey::GetReservedKey(CPubKey& pubkey)
 {
     if (nIndex == -1)
@@ -3711,6 +4129,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
 
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf("Flush wallet database activity from memory to disk log every <n> megabytes (default: %u)", DEFAULT_WALLET_DBLOGSIZE));
         strUsage += HelpMessageOpt("-flushwallet", strprintf("Run a thread to flush wallet periodically (default: %u)", DEFAULT_FLUSHWALLET));
+        strUsage += HelpMessageOpt("-walletflushdelay=<n>", strprintf("Write wallet changes that were not flushed as they were made to disk within <n> seconds (default: %u)", DEFAULT_WALLET_FLUSH_DELAY));
         strUsage += HelpMessageOpt("-privdb", strprintf("Sets the DB_PRIVATE flag in the wallet db environment (default: %u)", DEFAULT_WALLET_PRIVDB));
     }
 
@@ -3873,7 +4292,10 @@ bool CWallet::InitLoadWallet()
             }
         }
     }
+    walletInstance->RepairConfirmedTransactions();
     walletInstance->SetBroadcastTransactions(GetBoolArg("-walletbroadcast", DEFAULT_WALLETBROADCAST));
+    walletInstance->RebuildStakeableCoins();
+    walletInstance->SyncStakeLedger();
 
     pwalletMain = walletInstance;
     return true;
@@ -3926,6 +4348,8 @@ bool CWallet::ParameterInteraction()
                                        mapArgs["-maxtxfee"], ::minRelayTxFee.ToString()));
         }
     }
+    if (GetArg("-walletflushdelay", DEFAULT_WALLET_FLUSH_DELAY) <= 0)
+        return InitError(strprintf(_("Invalid -walletflushdelay=<n>: '%s' (must be at least 1)"), mapArgs["-walletflushdelay"]));
     nTxConfirmTarget = GetArg("-txconfirmtarget", DEFAULT_TX_CONFIRM_TARGET);
     bSpendZeroConfChange = GetBoolArg("-spendzeroconfchange", DEFAULT_SPEND_ZEROCONF_CHANGE);
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", DEFAULT_SEND_FREE_TRANSACTIONS);
@@ -4000,7 +4424,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock& block)
 
     // Locate the transaction
     for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
+        if (block.vtx[nIndex].GetHash() == GetHash())
             break;
     if (nIndex == (int)block.vtx.size())
     {
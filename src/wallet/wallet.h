@@ -7,6 +7,7 @@
 #define KEKCOIN_WALLET_WALLET_H
 
 #include "amount.h"
+#include "coins.h"
 #include "streams.h"
 #include "tinyformat.h"
 #include "ui_interface.h"
@@ -14,11 +15,13 @@
 #include "validationinterface.h"
 #include "script/ismine.h"
 #include "wallet/crypter.h"
+#include "wallet/stakeledger.h"
 #include "wallet/walletdb.h"
 #include "wallet/rpcwallet.h"
 #include "primitives/transaction.h"
 
 #include <algorithm>
+#include <limits>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -28,6 +31,7 @@
 #include <vector>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 extern CWallet* pwalletMain;
 
@@ -357,17 +361,8 @@ public:
     }
 
     //! make sure balances are recalculated
-    void MarkDirty()
-    {
-        fCreditCached = false;
-        fAvailableCreditCached = false;
-        fWatchDebitCached = false;
-        fWatchCreditCached = false;
-        fAvailableWatchCreditCached = false;
-        fImmatureWatchCreditCached = false;
-        fDebitCached = false;
-        fChangeCached = false;
-    }
+    //! make the amounts be computed again, and the wallet's balances with them
+    void MarkDirty();
 
     void BindWallet(CWallet *pwalletIn)
     {
@@ -494,6 +489,92 @@ public:
     std::string ToString() const;
 };
 
+/** What a transaction adds to each of the wallet's balances */
+struct CWalletBalances
+{
+    CAmount nTrusted;
+    CAmount nUntrustedPending;
+    CAmount nImmature;
+    CAmount nStakeImmature; //! coinstakes waiting to mature, see GetStake
+    CAmount nMintImmature; //! coinbases waiting to mature, see GetNewMint
+    CAmount nWatchTrusted;
+    CAmount nWatchUntrustedPending;
+    CAmount nWatchImmature;
+
+    CWalletBalances() : nTrusted(0), nUntrustedPending(0), nImmature(0), nStakeImmature(0), nMintImmature(0),
+                        nWatchTrusted(0), nWatchUntrustedPending(0), nWatchImmature(0) {}
+
+    bool IsNull() const
+    {
+        return !nTrusted && !nUntrustedPending && !nImmature && !nStakeImmature && !nMintImmature &&
+               !nWatchTrusted && !nWatchUntrustedPending && !nWatchImmature;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nTrusted += b.nTrusted;
+        nUntrustedPending += b.nUntrustedPending;
+        nImmature += b.nImmature;
+        nStakeImmature += b.nStakeImmature;
+        nMintImmature += b.nMintImmature;
+        nWatchTrusted += b.nWatchTrusted;
+        nWatchUntrustedPending += b.nWatchUntrustedPending;
+        nWatchImmature += b.nWatchImmature;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nTrusted -= b.nTrusted;
+        nUntrustedPending -= b.nUntrustedPending;
+        nImmature -= b.nImmature;
+        nStakeImmature -= b.nStakeImmature;
+        nMintImmature -= b.nMintImmature;
+        nWatchTrusted -= b.nWatchTrusted;
+        nWatchUntrustedPending -= b.nWatchUntrustedPending;
+        nWatchImmature -= b.nWatchImmature;
+        return *this;
+    }
+};
+
+/** An output of ours in the wallet's output table */
+struct CWalletOutputState
+{
+    static const int UNSPENT = -1;
+    static const int SPENT_UNCONFIRMED = -2;
+
+    unsigned int n;
+    isminetype mine;
+    //! height of the block of the transaction spending the output; UNSPENT if nothing
+    //! spends it, SPENT_UNCONFIRMED if only unconfirmed, conflicted or abandoned transactions do
+    int nSpentHeight;
+
+    bool IsSpentInBlock() const { return nSpentHeight >= 0; }
+
+    CWalletOutputState(unsigned int nIn, isminetype mineIn, int nSpentHeightIn) : n(nIn), mine(mineIn), nSpentHeight(nSpentHeightIn) {}
+};
+
+/** The outputs of ours in one wallet transaction, while any of them is not spent in a block */
+struct CWalletTxOutputs
+{
+    const CWalletTx* tx;
+    std::vector<CWalletOutputState> vOutputs;
+
+    CWalletTxOutputs() : tx(NULL) {}
+};
+
+/** A confirmed output of ours, not spent in a block, that can stake once it is deep enough */
+struct CStakeableCoin
+{
+    const CWalletTx* tx;
+    int nHeight; //! height of the block containing tx
+    bool fSpendable;
+    bool fSpentUnconfirmed; //! a transaction not in a block spends it, IsSpent decides when it is read
+
+    CStakeableCoin() : tx(NULL), nHeight(0), fSpendable(false), fSpentUnconfirmed(false) {}
+    CStakeableCoin(const CWalletTx* txIn, int nHeightIn, bool fSpendableIn, bool fSpentUnconfirmedIn) :
+        tx(txIn), nHeight(nHeightIn), fSpendable(fSpendableIn), fSpentUnconfirmed(fSpentUnconfirmedIn) {}
+};
 
 
 
@@ -623,6 +704,13 @@ private:
 
     CWalletDB *pwalletdbEncryption;
 
+    //! CWalletDBBatch scopes open, their handle once something is written, and how it is to be closed
+    int nBatchDepth;
+    CWalletDB *pwalletdbBatch;
+    bool fBatchTxn;
+    bool fBatchFlushOnClose;
+    friend class CWalletDBBatch;
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -648,6 +736,74 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Stakeable outputs keyed by outpoint, kept current as transactions are
+     * added, confirmed, disconnected, conflicted, abandoned or zapped so the
+     * staker does not walk mapWallet every round. Outputs spent by a
+     * transaction that is not in a block stay in, as that transaction can
+     * leave the mempool without the wallet hearing of it.
+     */
+    std::map<COutPoint, CStakeableCoin> mapStakeableCoins;
+    void UpdateStakeableCoins(const uint256& hash);
+    void UpdateStakeableCoins(const CTransaction& tx);
+
+    /**
+     * Rewards of the wallet's confirmed coinstakes by day, kept current from
+     * the same paths as mapStakeableCoins and stored in the wallet file so
+     * stake reports need not walk mapWallet.
+     */
+    CStakeLedger stakeLedger;
+    void UpdateStakeLedger(const CWalletTx& wtx, CWalletDB* pwalletdb);
+    void WriteStakeDays(const std::set<int64_t>& setDays, CWalletDB* pwalletdb);
+
+    /**
+     * Outputs of ours by transaction, with whether and where they are spent,
+     * so AvailableCoins and IsSpent need not probe mapTxSpends and the depth
+     * of every spender for every output the wallet ever had. Transactions
+     * whose outputs are all spent in blocks are dropped. Kept current from
+     * the same paths as mapStakeableCoins; rebuilt on first use after the
+     * wallet is loaded or what is ours changes.
+     */
+    typedef boost::unordered_map<uint256, CWalletTxOutputs, SaltedTxidHasher> WalletOutputMap;
+    mutable WalletOutputMap mapWalletOutputs;
+    mutable bool fWalletOutputsStale;
+    int GetSpentHeight(const COutPoint& outpoint) const;
+    void UpdateWalletOutputs(const uint256& hash) const;
+    void UpdateWalletOutputs(const CTransaction& tx) const;
+    void RebuildWalletOutputs() const;
+
+    /**
+     * Wallet transactions by the height of the main chain block holding
+     * them. Those in no main chain block (unconfirmed, conflicted or
+     * abandoned) sort after every block, so listsinceblock reads only what
+     * came after the block it is given. Kept current from the same paths as
+     * mapWalletOutputs, which includes every block disconnected in a reorg;
+     * rebuilt on first use after the wallet is loaded.
+     */
+    static const int TX_HEIGHT_UNCONFIRMED = std::numeric_limits<int>::max();
+    mutable std::set<std::pair<int, uint256> > setWalletTxByHeight;
+    mutable std::map<uint256, int> mapWalletTxHeight;
+    mutable bool fWalletTxHeightsStale;
+    void UpdateWalletTxHeight(const uint256& hash) const;
+    void RebuildWalletTxHeights() const;
+
+    /**
+     * Running balances. Transactions that are confirmed and mature, or
+     * abandoned, only change when they are marked dirty, so their share is
+     * kept in balancesSettled and mapBalanceParts. Unconfirmed, conflicted
+     * and immature ones depend on the mempool and the tip and are looked at
+     * again on every query; there are few of them.
+     */
+    mutable CWalletBalances balancesSettled;
+    mutable std::map<uint256, CWalletBalances> mapBalanceParts;
+    mutable std::set<uint256> setBalanceUnsettled;
+    mutable int nBalanceMaturity;
+    //! transactions marked dirty since the last query, guarded by cs_balancedirty
+    mutable std::set<uint256> setBalanceDirty;
+    mutable CCriticalSection cs_balancedirty;
+    //! what wtx adds to the balances; returns whether that can change without wtx being marked dirty
+    bool GetBalanceParts(const CWalletTx& wtx, CWalletBalances& parts) const;
+
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
@@ -697,11 +853,18 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        nBatchDepth = 0;
+        pwalletdbBatch = NULL;
+        fBatchTxn = false;
+        fBatchFlushOnClose = false;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        nBalanceMaturity = 0;
+        fWalletOutputsStale = true;
+        fWalletTxHeightsStale = true;
     }
 
     bool IsHDEnabled() const;
@@ -726,6 +889,8 @@ public:
     int64_t nTimeFirstKey;
 
     const CWalletTx* GetWalletTx(const uint256& hash) const;
+    //! Wallet transactions in main chain blocks above nHeight in block order, then those in no main chain block
+    void GetWalletTxsSince(int nHeight, std::vector<const CWalletTx*>& vtxRet) const;
 
     //! check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
@@ -751,6 +916,13 @@ public:
     void UnlockAllCoins();
     void ListLockedCoins(std::vector<COutPoint>& vOutpts);
     uint64_t GetStakeWeight() const;
+    void RebuildStakeableCoins();
+    size_t GetStakeableCoinCount() const;
+    //! Bring the stake ledger read from the wallet file in line with mapWallet
+    void SyncStakeLedger();
+    //! Highest block whose coinstakes are mature at the current tip
+    int GetMatureStakeHeight() const;
+    const CStakeLedger& GetStakeLedger() const { AssertLockHeld(cs_wallet); return stakeLedger; }
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CMutableTransaction& txNew, CKey& key);
     int64_t GetStake() const;
     int64_t GetNewMint() const;
@@ -782,6 +954,8 @@ public:
     bool EraseDestData(const CTxDestination &dest, const std::string &key);
     //! Adds a destination data tuple to the store, without saving it to disk
     bool LoadDestData(const CTxDestination &dest, const std::string &key, const std::string &value);
+    //! Adds a day of the stake ledger without saving it to disk
+    void LoadStakeDay(int64_t nDay, const CStakeDay& day) { AssertLockHeld(cs_wallet); stakeLedger.LoadDay(nDay, day); }
     //! Look up a destination data tuple in the store, return true if found false otherwise
     bool GetDestData(const CTxDestination &dest, const std::string &key, std::string *value) const;
 
@@ -819,6 +993,10 @@ public:
     CAmount GetWatchOnlyBalance() const;
     CAmount GetUnconfirmedWatchOnlyBalance() const;
     CAmount GetImmatureWatchOnlyBalance() const;
+    //! All of the above and GetStake/GetNewMint at once
+    CWalletBalances GetBalances() const;
+    //! Have the balances take the current state of this transaction into account
+    void MarkBalanceDirty(const uint256& hash) const;
 
     /**
      * Insert additional inputs into the transaction by
@@ -963,6 +1141,9 @@ public:
     /* Mark a transaction (and it in-wallet descendants) as abandoned so its inputs may be respent. */
     bool AbandonTransaction(const uint256& hashTx);
 
+    /* Confirm transactions that older versions stored as conflicted with the block they are in. */
+    void RepairConfirmedTransactions();
+
     /* Returns the wallets help message */
     static std::string GetWalletHelpString(bool showDebug);
 
@@ -985,6 +1166,35 @@ public:
     bool SetHDMasterKey(const CPubKey& key);
 };
 
+/**
+ * Groups the wallet database writes made while it is in scope into one
+ * Berkeley DB transaction. The first write in the outermost batch on a
+ * wallet opens a handle and begins the transaction; batches opened inside
+ * it write through the same handle, and the outermost one commits
+ * everything when it goes out of scope. Like CWalletDB, it checkpoints on
+ * close only if asked to, and once for the whole batch; otherwise the
+ * wallet flush thread writes the batch out within -walletflushdelay.
+ *
+ * cs_wallet must be held for as long as a batch is in scope, and every
+ * write to the wallet file in that time must go through the batch:
+ * another handle would wait for the locks of its open transaction.
+ */
+class CWalletDBBatch
+{
+private:
+    CWallet* pwallet;
+
+    CWalletDBBatch(const CWalletDBBatch&);
+    void operator=(const CWalletDBBatch&);
+
+public:
+    explicit CWalletDBBatch(CWallet* pwalletIn, bool fFlushOnClose = true);
+    ~CWalletDBBatch();
+
+    CWalletDB* get() const;
+    CWalletDB* operator->() const { return get(); }
+};
+
 /** A key allocated from the key pool. */
 class CReserveKey : public CReserveScript
 {
@@ -609,6 +609,14 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 return false;
             }
         }
+        else if (strType == "stakeday")
+        {
+            int64_t nDay;
+            CStakeDay day;
+            ssKey >> nDay;
+            ssValue >> day;
+            pwallet->LoadStakeDay(nDay, day);
+        }
     } catch (...)
     {
         return false;
@@ -863,9 +871,11 @@ void ThreadFlushWalletDB(const string& strFile)
     if (!GetBoolArg("-flushwallet", DEFAULT_FLUSHWALLET))
         return;
 
+    const int64_t nFlushDelay = GetArg("-walletflushdelay", DEFAULT_WALLET_FLUSH_DELAY);
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
     int64_t nLastWalletUpdate = GetTime();
+    int64_t nFirstUnflushedUpdate = 0;
     while (true)
     {
         MilliSleep(500);
@@ -874,9 +884,11 @@ void ThreadFlushWalletDB(const string& strFile)
         {
             nLastSeen = nWalletDBUpdated;
             nLastWalletUpdate = GetTime();
+            if (!nFirstUnflushedUpdate)
+                nFirstUnflushedUpdate = nLastWalletUpdate;
         }
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= nFlushDelay)
         {
             TRY_LOCK(bitdb.cs_db,lockDb);
             if (lockDb)
@@ -898,6 +910,7 @@ void ThreadFlushWalletDB(const string& strFile)
                     {
                         LogPrint("db", "Flushing %s\n", strFile);
                         nLastFlushed = nWalletDBUpdated;
+                        nFirstUnflushedUpdate = 0;
                         int64_t nStart = GetTimeMillis();
 
                         // Flush wallet file so it's self contained
@@ -910,6 +923,19 @@ void ThreadFlushWalletDB(const string& strFile)
                 }
             }
         }
+
+        // If the wallet is never quiet long enough to be closed, checkpoint it in place
+        // so that nothing written waits much longer than the delay. This does not count
+        // as a flush: the wallet is still closed and its log detached once it goes quiet.
+        if (nLastFlushed != nWalletDBUpdated && nFirstUnflushedUpdate && GetTime() - nFirstUnflushedUpdate >= nFlushDelay)
+        {
+            boost::this_thread::interruption_point();
+            LogPrint("db", "Checkpointing %s\n", strFile);
+            nFirstUnflushedUpdate = 0;
+            int64_t nStart = GetTimeMillis();
+            bitdb.dbenv->txn_checkpoint(0, 0, 0);
+            LogPrint("db", "Checkpointed %s %dms\n", strFile, GetTimeMillis() - nStart);
+        }
     }
 }
 
@@ -1020,3 +1046,15 @@ bool CWalletDB::WriteHDChain(const CHDChain& chain)
     nWalletDBUpdated++;
     return Write(std::string("hdchain"), chain);
 }
+
+bool CWalletDB::WriteStakeDay(int64_t nDay, const CStakeDay& day)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("stakeday"), nDay), day);
+}
+
+bool CWalletDB::EraseStakeDay(int64_t nDay)
+{
+    nWalletDBUpdated++;
+    return Erase(std::make_pair(std::string("stakeday"), nDay));
+}
@@ -18,6 +18,8 @@
 #include <vector>
 
 static const bool DEFAULT_FLUSHWALLET = true;
+//! Seconds that wallet writes not flushed as they are made may wait for the flush thread
+static const unsigned int DEFAULT_WALLET_FLUSH_DELAY = 2;
 
 class CAccount;
 class CAccountingEntry;
@@ -25,6 +27,7 @@ struct CBlockLocator;
 class CKeyPool;
 class CMasterKey;
 class CScript;
+class CStakeDay;
 class CWallet;
 class CWalletTx;
 class uint160;
@@ -178,6 +181,9 @@ public:
     //! write the hdchain model (external chain child index counter)
     bool WriteHDChain(const CHDChain& chain);
 
+    bool WriteStakeDay(int64_t nDay, const CStakeDay& day);
+    bool EraseStakeDay(int64_t nDay);
+
 private:
     CWalletDB(const CWalletDB&);
     void operator=(const CWalletDB&);